@@ -0,0 +1,126 @@
+//
+// Throughput of ConcurrentHashMap against a plain HashMap behind one global mutex, scaling from one thread
+// up to the number of online cores.
+//
+// Usage: concurrenthashmap_bench [max_threads] [ops_per_thread] [write_percent]
+//
+#include <concurrenthashmap.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define N_KEYS (1 << 20)
+
+typedef struct Worker {
+    pthread_t thread;
+    unsigned int seed;
+    size_t ops;
+    int write_percent;
+} Worker;
+
+static int keys[N_KEYS];
+static int values[N_KEYS];
+
+static ConcurrentHashMap *concurrent_map;
+static HashMap *locked_map;
+static pthread_mutex_t global_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t hash_int(const void *key) {
+    return (size_t) *(const int *) key;
+}
+
+static bool equals_int(const void *a, const void *b) {
+    return *(const int *) a == *(const int *) b;
+}
+
+static void free_entry_only(void *entry) {
+    // Keys and values live in static arrays
+    free(entry);
+}
+
+static inline unsigned int next_random(unsigned int *seed) {
+    *seed = *seed * 1103515245u + 12345u;
+    return *seed >> 8;
+}
+
+static void *run_concurrent(void *arg) {
+    Worker *worker = arg;
+    for (size_t i = 0; i < worker->ops; i++) {
+        const unsigned int r = next_random(&worker->seed);
+        int *key = &keys[r % N_KEYS];
+        if ((int) (r % 100) < worker->write_percent) {
+            ConcurrentHashMap_put(concurrent_map, key, &values[r % N_KEYS]);
+        } else {
+            ConcurrentHashMap_get(concurrent_map, key);
+        }
+    }
+    return NULL;
+}
+
+static void *run_locked(void *arg) {
+    Worker *worker = arg;
+    for (size_t i = 0; i < worker->ops; i++) {
+        const unsigned int r = next_random(&worker->seed);
+        int *key = &keys[r % N_KEYS];
+        pthread_mutex_lock(&global_lock);
+        if ((int) (r % 100) < worker->write_percent) {
+            HashMap_put(locked_map, key, &values[r % N_KEYS]);
+        } else {
+            HashMap_get(locked_map, key);
+        }
+        pthread_mutex_unlock(&global_lock);
+    }
+    return NULL;
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static double run(void *(*fn)(void *), const int n_threads, const size_t ops, const int write_percent) {
+    Worker workers[n_threads];
+    const double start = now_seconds();
+    for (int t = 0; t < n_threads; t++) {
+        workers[t] = (Worker) {.seed = (unsigned int) t * 7919u + 1u, .ops = ops, .write_percent = write_percent};
+        pthread_create(&workers[t].thread, NULL, fn, &workers[t]);
+    }
+    for (int t = 0; t < n_threads; t++) {
+        pthread_join(workers[t].thread, NULL);
+    }
+    const double elapsed = now_seconds() - start;
+    return (double) ops * n_threads / elapsed / 1e6;
+}
+
+int main(const int argc, char *argv[]) {
+    const long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    const int max_threads = argc > 1 ? atoi(argv[1]) : (int) (cores > 0 ? cores : 1);
+    const size_t ops = argc > 2 ? (size_t) atol(argv[2]) : 2000000;
+    const int write_percent = argc > 3 ? atoi(argv[3]) : 10;
+
+    concurrent_map = ConcurrentHashMap_create(0, HASHMAP_DEFAULT_CAPACITY, hash_int, equals_int, free_entry_only);
+    locked_map = HashMap_create(HASHMAP_DEFAULT_CAPACITY, hash_int, equals_int, free_entry_only);
+    for (int i = 0; i < N_KEYS; i++) {
+        keys[i] = i;
+        values[i] = i;
+        ConcurrentHashMap_put(concurrent_map, &keys[i], &values[i]);
+        HashMap_put(locked_map, &keys[i], &values[i]);
+    }
+
+    printf("%d keys, %zu ops per thread, %d%% writes\n", N_KEYS, ops, write_percent);
+    printf("%8s %22s %22s\n", "threads", "ConcurrentHashMap Mops", "HashMap+mutex Mops");
+    for (int n_threads = 1; n_threads <= max_threads; n_threads = n_threads * 2 > max_threads && n_threads < max_threads
+                                                                         ? max_threads
+                                                                         : n_threads * 2) {
+        const double concurrent = run(run_concurrent, n_threads, ops, write_percent);
+        const double locked = run(run_locked, n_threads, ops, write_percent);
+        printf("%8d %22.2f %22.2f\n", n_threads, concurrent, locked);
+    }
+
+    ConcurrentHashMap_destroy(concurrent_map);
+    HashMap_destroy(locked_map);
+    return 0;
+}
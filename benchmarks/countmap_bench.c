@@ -0,0 +1,170 @@
+//
+// Word counting with a CountMap against a HashMap of heap allocated int counters, the old way: find or
+// insert the counter with HashMap_get_or_insert_with, then bump it. Words are NUL terminated in one buffer
+// and both maps copy a word the first time they see it.
+//
+// The text is read from a file if one is given, otherwise a corpus of Zipf distributed words is generated.
+//
+// Usage: countmap_bench [text_file]
+//
+#include <commons.h>
+#include <countmap.h>
+#include <ctype.h>
+#include <hashmap.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define GENERATED_WORDS 20000000
+#define VOCABULARY 200000
+
+static bool equals_cstr(const void *a, const void *b) {
+    return strcmp(a, b) == 0;
+}
+
+static void *copy_cstr(const void *s) {
+    return strdup(s);
+}
+
+static void *new_counter(const void *key, void *ctx) {
+    (void) key;
+    (void) ctx;
+    return calloc(1, sizeof(int));
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static inline uint64_t next_random(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+/** Read a whole file, NULL if it can't be read */
+static char *read_file(const char *path, size_t *len) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    *len = (size_t) ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char *text = malloc(*len + 1);
+    if (text && fread(text, 1, *len, file) != *len) {
+        free(text);
+        text = NULL;
+    }
+    fclose(file);
+    return text;
+}
+
+/** Words drawn with probability about 1 / rank, the shape of word frequencies in natural text */
+static char *generate_text(size_t *len) {
+    double *cumulative = malloc(VOCABULARY * sizeof(double));
+    double sum = 0;
+    for (size_t r = 0; r < VOCABULARY; r++) {
+        sum += 1.0 / (double) (r + 1);
+        cumulative[r] = sum;
+    }
+    char *text = malloc((size_t) GENERATED_WORDS * 12);
+    size_t at = 0;
+    uint64_t state = 88172645463325252ULL;
+    for (size_t i = 0; i < GENERATED_WORDS; i++) {
+        const double x = (double) (next_random(&state) >> 11) / 9007199254740992.0 * sum;
+        size_t lo = 0;
+        size_t hi = VOCABULARY - 1;
+        while (lo < hi) {
+            const size_t mid = (lo + hi) / 2;
+            if (cumulative[mid] < x) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        at += (size_t) sprintf(text + at, "w%zx ", lo);
+    }
+    free(cumulative);
+    *len = at;
+    return text;
+}
+
+/** Cut text into words in place, lower cased and NUL terminated */
+static char **split_words(char *text, const size_t len, size_t *n) {
+    size_t capacity = 1024;
+    char **words = malloc(capacity * sizeof(char *));
+    *n = 0;
+    for (size_t i = 0; i < len;) {
+        while (i < len && !isalnum((unsigned char) text[i])) {
+            i++;
+        }
+        if (i == len) {
+            break;
+        }
+        if (*n == capacity) {
+            capacity *= 2;
+            words = realloc(words, capacity * sizeof(char *));
+        }
+        words[(*n)++] = text + i;
+        while (i < len && isalnum((unsigned char) text[i])) {
+            text[i] = (char) tolower((unsigned char) text[i]);
+            i++;
+        }
+        text[i++] = '\0';
+    }
+    return words;
+}
+
+int main(const int argc, char *argv[]) {
+    size_t len;
+    char *text = argc > 1 ? read_file(argv[1], &len) : generate_text(&len);
+    if (!text) {
+        fprintf(stderr, "Can't read %s\n", argv[1]);
+        return 1;
+    }
+    size_t n;
+    char **words = split_words(text, len, &n);
+
+    double start = now_seconds();
+    HashMap *hashmap = HashMap_create(HASHMAP_DEFAULT_CAPACITY, Commons_hash_fn_cstr, equals_cstr, NULL);
+    for (size_t i = 0; i < n; i++) {
+        int *count = HashMap_get_or_insert_with(hashmap, words[i], copy_cstr, new_counter, NULL);
+        (*count)++;
+    }
+    const double boxed = now_seconds() - start;
+
+    start = now_seconds();
+    CountMap *counts = CountMap_create(COUNTMAP_DEFAULT_CAPACITY, Commons_hash_fn_cstr, equals_cstr, copy_cstr, NULL);
+    for (size_t i = 0; i < n; i++) {
+        CountMap_increment(counts, words[i], 1);
+    }
+    const double inline_counts = now_seconds() - start;
+
+    start = now_seconds();
+    CountMap *batched = CountMap_create(COUNTMAP_DEFAULT_CAPACITY, Commons_hash_fn_cstr, equals_cstr, copy_cstr, NULL);
+    CountMap_increment_many(batched, (const void *const *) words, n);
+    const double batch_counts = now_seconds() - start;
+
+    printf("%zu words, %zu distinct\n", n, counts->size);
+    printf("%28s %10.1f ns/word\n", "HashMap with int values", boxed * 1e9 / n);
+    printf("%28s %10.1f ns/word\n", "CountMap_increment", inline_counts * 1e9 / n);
+    printf("%28s %10.1f ns/word\n", "CountMap_increment_many", batch_counts * 1e9 / n);
+
+    CountEntry top[5];
+    const size_t k = CountMap_top_k(counts, 5, top);
+    for (size_t i = 0; i < k; i++) {
+        printf("%16s %10lld\n", (const char *) top[i].key, (long long) top[i].count);
+    }
+
+    HashMap_destroy(hashmap);
+    CountMap_destroy(counts);
+    CountMap_destroy(batched);
+    free(words);
+    free(text);
+    return 0;
+}
@@ -0,0 +1,171 @@
+//
+// GROUP BY key with count, sum, min and max over an array of records: the usual loop into a HashMap of
+// heap allocated accumulators against GroupBy on one thread and on every CPU. Keys are drawn uniformly or
+// with probability about 1 / rank, the skewed case where a few hot keys get most of the records.
+//
+// Usage: groupby_bench [n_records] [n_keys]
+//
+#include <arraylist.h>
+#include <commons.h>
+#include <groupby.h>
+#include <hashmap.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct Record {
+    int64_t key;
+    int64_t value;
+} Record;
+
+typedef struct Accumulator {
+    int64_t count;
+    int64_t sum;
+    int64_t min;
+    int64_t max;
+} Accumulator;
+
+static size_t hash_int64(const void *key) {
+    return (size_t) *(const int64_t *) key;
+}
+
+static bool equals_int64(const void *a, const void *b) {
+    return *(const int64_t *) a == *(const int64_t *) b;
+}
+
+static const void *record_key(const void *record) {
+    return &((const Record *) record)->key;
+}
+
+static int64_t record_value(const void *record) {
+    return ((const Record *) record)->value;
+}
+
+static void *new_accumulator(const void *key, void *ctx) {
+    (void) key;
+    (void) ctx;
+    Accumulator *acc = malloc(sizeof(Accumulator));
+    *acc = (Accumulator) {.min = INT64_MAX, .max = INT64_MIN};
+    return acc;
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static inline uint64_t next_random(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static Record *generate(const size_t n, const size_t keys, const bool skewed) {
+    double *cumulative = malloc(keys * sizeof(double));
+    double sum = 0;
+    for (size_t r = 0; r < keys; r++) {
+        sum += 1.0 / (double) (r + 1);
+        cumulative[r] = sum;
+    }
+    Record *records = malloc(n * sizeof(Record));
+    uint64_t state = 88172645463325252ULL;
+    for (size_t i = 0; i < n; i++) {
+        size_t rank;
+        if (skewed) {
+            const double x = (double) (next_random(&state) >> 11) / 9007199254740992.0 * sum;
+            size_t lo = 0;
+            size_t hi = keys - 1;
+            while (lo < hi) {
+                const size_t mid = (lo + hi) / 2;
+                if (cumulative[mid] < x) {
+                    lo = mid + 1;
+                } else {
+                    hi = mid;
+                }
+            }
+            rank = lo;
+        } else {
+            rank = next_random(&state) % keys;
+        }
+        // Spread the ranks over the key space so hot keys don't sit next to each other
+        records[i] = (Record) {.key = (int64_t) (rank * 2654435761u), .value = (int64_t) (next_random(&state) % 1000)};
+    }
+    free(cumulative);
+    return records;
+}
+
+static double hashmap_loop(const Record *records, const size_t n, int64_t *check) {
+    const double start = now_seconds();
+    HashMap *map = HashMap_create(HASHMAP_DEFAULT_CAPACITY, hash_int64, equals_int64, NULL);
+    for (size_t i = 0; i < n; i++) {
+        Accumulator *acc = HashMap_get_or_insert_with(map, &records[i].key, (copy_fn) NULL, new_accumulator, NULL);
+        acc->count++;
+        acc->sum += records[i].value;
+        acc->min = records[i].value < acc->min ? records[i].value : acc->min;
+        acc->max = records[i].value > acc->max ? records[i].value : acc->max;
+    }
+    const double elapsed = now_seconds() - start;
+    *check = (int64_t) map->size;
+    // Keys point into the records, only the accumulators are the map's
+    HashMapIterator it;
+    HashMap_iter_init(map, &it);
+    for (MapEntry *entry = HashMap_iter_next(&it); entry; entry = HashMap_iter_next(&it)) {
+        free(entry->value);
+        entry->value = NULL;
+        entry->key = NULL;
+    }
+    HashMap_destroy(map);
+    return elapsed;
+}
+
+static double group_by(const Record *records, const size_t n, const size_t nthreads, int64_t *check) {
+    const GroupAggregate aggregates[] = {
+        GroupAggregate_count(), GroupAggregate_sum(record_value), GroupAggregate_min(record_value),
+        GroupAggregate_max(record_value)
+    };
+    const GroupBySpec spec = {
+        .key_fn = record_key, .hash_fn = hash_int64, .equals_fn = equals_int64, .aggregates = aggregates,
+        .aggregate_count = 4, .nthreads = nthreads
+    };
+    const double start = now_seconds();
+    ArrayList *result = GroupBy_array(records, n, sizeof(Record), &spec);
+    const double elapsed = now_seconds() - start;
+    *check = result ? (int64_t) ArrayList_size(result) : -1;
+    if (result) {
+        ArrayList_destroy(result);
+    }
+    return elapsed;
+}
+
+int main(const int argc, char *argv[]) {
+    const size_t n = argc > 1 ? (size_t) atol(argv[1]) : 10000000;
+    const size_t keys = argc > 2 ? (size_t) atol(argv[2]) : 100000;
+    printf("%zu records, %zu keys, ns per record\n", n, keys);
+    printf("%-10s %12s %12s %12s\n", "keys", "HashMap", "1 thread", "all CPUs");
+    for (int skewed = 0; skewed <= 1; skewed++) {
+        Record *records = generate(n, keys, skewed);
+        int64_t groups[3];
+        // Best of two, the first run of each also pays for faulting in fresh memory
+        double loop = 1e9, single = 1e9, parallel = 1e9;
+        for (int round = 0; round < 2; round++) {
+            const double t0 = hashmap_loop(records, n, &groups[0]);
+            const double t1 = group_by(records, n, 1, &groups[1]);
+            const double t2 = group_by(records, n, 0, &groups[2]);
+            loop = t0 < loop ? t0 : loop;
+            single = t1 < single ? t1 : single;
+            parallel = t2 < parallel ? t2 : parallel;
+        }
+        printf("%-10s %12.1f %12.1f %12.1f\n", skewed ? "zipf" : "uniform", loop * 1e9 / n, single * 1e9 / n,
+               parallel * 1e9 / n);
+        if (groups[0] != groups[1] || groups[0] != groups[2]) {
+            fprintf(stderr, "Group counts differ: %lld %lld %lld\n", (long long) groups[0], (long long) groups[1],
+                    (long long) groups[2]);
+            return 1;
+        }
+        free(records);
+    }
+    return 0;
+}
@@ -0,0 +1,181 @@
+//
+// Throughput and quality of the hash functions in commons.h, with the byte at a time 31 * hash + c loop and
+// the identity int hash as baselines.
+//
+// Usage: hash_bench [megabytes_per_size] [avalanche_samples]
+//
+#include <commons.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_INPUT 4096
+#define TABLE_BITS 16
+
+typedef uint64_t (*bytes_fn)(const void *data, size_t len);
+
+static volatile uint64_t sink;
+
+static uint64_t hash_wy(const void *data, const size_t len) {
+    return Commons_hash_bytes(data, len, 0);
+}
+
+static uint64_t hash_31(const void *data, const size_t len) {
+    const uint8_t *p = data;
+    uint64_t hash = 0;
+    for (size_t i = 0; i < len; i++) {
+        hash = 31 * hash + p[i];
+    }
+    return hash;
+}
+
+static uint64_t hash_u64(const void *data, const size_t len) {
+    (void) len;
+    uint64_t x;
+    memcpy(&x, data, sizeof(x));
+    return Commons_hash_u64(x);
+}
+
+static uint64_t hash_identity(const void *data, const size_t len) {
+    (void) len;
+    uint64_t x;
+    memcpy(&x, data, sizeof(x));
+    return x;
+}
+
+static inline uint64_t next_random(uint64_t *state) {
+    // splitmix64, independent from everything measured here
+    uint64_t z = *state += UINT64_C(0x9e3779b97f4a7c15);
+    z = (z ^ z >> 30) * UINT64_C(0xbf58476d1ce4e5b9);
+    z = (z ^ z >> 27) * UINT64_C(0x94d049bb133111eb);
+    return z ^ z >> 31;
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+/** @return GB/s hashing inputs of len bytes, total_bytes in all */
+static double throughput(const bytes_fn fn, const uint8_t *buffer, const size_t len, const size_t total_bytes) {
+    const size_t rounds = total_bytes / len;
+    uint64_t acc = 0;
+    const double start = now_seconds();
+    for (size_t i = 0; i < rounds; i++) {
+        // Feed the previous hash back in so calls can't be overlapped or hoisted
+        acc += fn(buffer + (acc & 63), len);
+    }
+    const double elapsed = now_seconds() - start;
+    sink = acc;
+    return (double) (rounds * len) / elapsed / 1e9;
+}
+
+/**
+ * Flip every input bit of random len byte inputs and record how often each output bit flips. An ideal hash
+ * flips every output bit with probability 0.5.
+ * @return the worst deviation from 0.5 over all (input bit, output bit) pairs
+ */
+static double avalanche(const bytes_fn fn, const size_t len, const size_t samples, double *mean_bias) {
+    const size_t in_bits = len * 8;
+    size_t *flips = calloc(in_bits * 64, sizeof(size_t));
+    uint8_t input[64];
+    uint64_t state = 42;
+    for (size_t s = 0; s < samples; s++) {
+        for (size_t i = 0; i < len; i += 8) {
+            const uint64_t r = next_random(&state);
+            memcpy(input + i, &r, len - i < 8 ? len - i : 8);
+        }
+        const uint64_t base = fn(input, len);
+        for (size_t bit = 0; bit < in_bits; bit++) {
+            input[bit / 8] ^= (uint8_t) (1u << bit % 8);
+            const uint64_t diff = base ^ fn(input, len);
+            input[bit / 8] ^= (uint8_t) (1u << bit % 8);
+            for (int out = 0; out < 64; out++) {
+                flips[bit * 64 + out] += diff >> out & 1;
+            }
+        }
+    }
+    double worst = 0, total = 0;
+    for (size_t i = 0; i < in_bits * 64; i++) {
+        double bias = (double) flips[i] / (double) samples - 0.5;
+        bias = bias < 0 ? -bias : bias;
+        worst = bias > worst ? bias : worst;
+        total += bias;
+    }
+    free(flips);
+    *mean_bias = total / (double) (in_bits * 64);
+    return worst;
+}
+
+/**
+ * Put sequential and strided int keys in a table of 2^TABLE_BITS buckets indexed by the low bits of the raw
+ * hash, the way a power of two table without any extra mixing would.
+ * @return the longest chain
+ */
+static size_t longest_chain(const bytes_fn fn, const uint64_t stride) {
+    static uint32_t buckets[1 << TABLE_BITS];
+    memset(buckets, 0, sizeof(buckets));
+    size_t longest = 0;
+    for (uint64_t i = 0; i < (1 << TABLE_BITS) * 3 / 4; i++) {
+        const uint64_t key = i * stride;
+        const size_t index = fn(&key, sizeof(key)) & ((1 << TABLE_BITS) - 1);
+        if (++buckets[index] > longest) {
+            longest = buckets[index];
+        }
+    }
+    return longest;
+}
+
+int main(const int argc, char *argv[]) {
+    const size_t megabytes = argc > 1 ? (size_t) atol(argv[1]) : 256;
+    const size_t samples = argc > 2 ? (size_t) atol(argv[2]) : 2000;
+    const size_t sizes[] = {4, 8, 16, 32, 64, 256, 1024, MAX_INPUT};
+
+    uint8_t *buffer = malloc(MAX_INPUT + 64);
+    uint64_t state = 1;
+    for (size_t i = 0; i < MAX_INPUT + 64; i++) {
+        buffer[i] = (uint8_t) next_random(&state);
+    }
+
+    printf("Throughput, %zu MB per input size\n", megabytes);
+    printf("%8s %18s %18s\n", "bytes", "hash_bytes GB/s", "31 * h + c GB/s");
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        printf("%8zu %18.2f %18.2f\n", sizes[i], throughput(hash_wy, buffer, sizes[i], megabytes << 20),
+               throughput(hash_31, buffer, sizes[i], megabytes << 20));
+    }
+    printf("%8s %18.2f %18s\n", "u64", throughput(hash_u64, buffer, 8, megabytes << 20), "");
+
+    printf("\nAvalanche, %zu samples, bias from 0.5 (0 is ideal)\n", samples);
+    printf("%-22s %10s %10s\n", "function", "worst", "mean");
+    const struct {
+        const char *name;
+        bytes_fn fn;
+        size_t len;
+    } cases[] = {
+        {"hash_bytes 8 bytes", hash_wy, 8},
+        {"hash_bytes 32 bytes", hash_wy, 32},
+        {"hash_u64", hash_u64, 8},
+        {"31 * h + c 8 bytes", hash_31, 8},
+        {"identity", hash_identity, 8},
+    };
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        double mean;
+        const double worst = avalanche(cases[i].fn, cases[i].len, samples, &mean);
+        printf("%-22s %10.4f %10.4f\n", cases[i].name, worst, mean);
+    }
+
+    printf("\nLongest chain, %d keys in %d buckets picked by the low hash bits\n", (1 << TABLE_BITS) * 3 / 4,
+           1 << TABLE_BITS);
+    printf("%-22s %10s %10s %10s\n", "function", "stride 1", "stride 64", "stride 2^16");
+    printf("%-22s %10zu %10zu %10zu\n", "hash_u64", longest_chain(hash_u64, 1), longest_chain(hash_u64, 64),
+           longest_chain(hash_u64, 1 << 16));
+    printf("%-22s %10zu %10zu %10zu\n", "hash_bytes", longest_chain(hash_wy, 1), longest_chain(hash_wy, 64),
+           longest_chain(hash_wy, 1 << 16));
+    printf("%-22s %10zu %10zu %10zu\n", "identity", longest_chain(hash_identity, 1),
+           longest_chain(hash_identity, 64), longest_chain(hash_identity, 1 << 16));
+
+    free(buffer);
+    return 0;
+}
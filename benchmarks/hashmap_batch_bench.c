@@ -0,0 +1,86 @@
+//
+// HashMap_get_many against a loop of HashMap_get on a map much larger than the cache, for the batch sizes
+// the network layer hands us.
+//
+// Usage: hashmap_batch_bench [n_keys] [lookups]
+//
+#include <commons.h>
+#include <hashmap.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static size_t hash_u64(const void *key) {
+    return (size_t) Commons_hash_u64(*(const uint64_t *) key);
+}
+
+static bool equals_u64(const void *a, const void *b) {
+    return *(const uint64_t *) a == *(const uint64_t *) b;
+}
+
+static void free_entry_only(void *entry) {
+    // Keys and values live in one array
+    free(entry);
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static inline uint64_t next_random(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+int main(const int argc, char *argv[]) {
+    const size_t n = argc > 1 ? (size_t) atol(argv[1]) : 4000000;
+    const size_t lookups = argc > 2 ? (size_t) atol(argv[2]) : 4000000;
+    const size_t batches[] = {1, 16, 64, 256, 1024};
+
+    uint64_t *keys = malloc(n * sizeof(uint64_t));
+    HashMap *map = HashMap_create(HASHMAP_DEFAULT_CAPACITY, hash_u64, equals_u64, free_entry_only);
+    for (size_t i = 0; i < n; i++) {
+        keys[i] = i;
+        HashMap_put(map, &keys[i], &keys[i]);
+    }
+
+    // Random keys in random order, so neither loop gets any help from locality
+    void **queries = malloc(lookups * sizeof(void *));
+    void **out = malloc(lookups * sizeof(void *));
+    uint64_t state = 88172645463325252ULL;
+    for (size_t i = 0; i < lookups; i++) {
+        queries[i] = &keys[next_random(&state) % n];
+    }
+
+    printf("%zu keys, %zu random lookups\n", n, lookups);
+    printf("%8s %16s %16s\n", "batch", "get ns/op", "get_many ns/op");
+    volatile size_t sink = 0;
+    for (size_t b = 0; b < sizeof(batches) / sizeof(batches[0]); b++) {
+        const size_t batch = batches[b];
+        double start = now_seconds();
+        for (size_t i = 0; i < lookups; i++) {
+            out[i] = HashMap_get(map, queries[i]);
+        }
+        const double single = now_seconds() - start;
+        sink += out[lookups - 1] != NULL;
+
+        start = now_seconds();
+        for (size_t i = 0; i < lookups; i += batch) {
+            const size_t count = lookups - i < batch ? lookups - i : batch;
+            sink += HashMap_get_many(map, queries + i, count, out + i);
+        }
+        const double many = now_seconds() - start;
+        printf("%8zu %16.1f %16.1f\n", batch, single * 1e9 / lookups, many * 1e9 / lookups);
+    }
+
+    HashMap_destroy(map);
+    free(queries);
+    free(out);
+    free(keys);
+    (void) sink;
+    return 0;
+}
@@ -0,0 +1,85 @@
+//
+// HashMap_build_parallel against HashMap_put_many and a loop of HashMap_put, loading a fresh map each run.
+//
+// Usage: hashmap_build_bench [n_keys] [threads]
+//
+#include <commons.h>
+#include <hashmap.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static size_t hash_u64(const void *key) {
+    return (size_t) Commons_hash_u64(*(const uint64_t *) key);
+}
+
+static bool equals_u64(const void *a, const void *b) {
+    return *(const uint64_t *) a == *(const uint64_t *) b;
+}
+
+static void free_entry_only(void *entry) {
+    // Keys and values live in one array
+    free(entry);
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static inline uint64_t next_random(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static HashMap *new_map(void) {
+    return HashMap_create(HASHMAP_DEFAULT_CAPACITY, hash_u64, equals_u64, free_entry_only);
+}
+
+int main(const int argc, char *argv[]) {
+    const size_t n = argc > 1 ? (size_t) atol(argv[1]) : 4000000;
+    const size_t threads = argc > 2 ? (size_t) atol(argv[2]) : 0;
+
+    uint64_t *data = malloc(n * sizeof(uint64_t));
+    void **keys = malloc(n * sizeof(void *));
+    void **old_values = malloc(n * sizeof(void *));
+    uint64_t state = 88172645463325252ULL;
+    for (size_t i = 0; i < n; i++) {
+        data[i] = next_random(&state);
+        keys[i] = &data[i];
+    }
+
+    printf("%zu random keys, %zu threads (0 is one per cpu)\n", n, threads);
+    printf("%16s %12s\n", "load", "ns/key");
+
+    HashMap *map = new_map();
+    double start = now_seconds();
+    for (size_t i = 0; i < n; i++) {
+        HashMap_put(map, keys[i], keys[i]);
+    }
+    printf("%16s %12.1f\n", "put loop", (now_seconds() - start) * 1e9 / n);
+    HashMap_destroy(map);
+
+    map = new_map();
+    start = now_seconds();
+    HashMap_put_many(map, keys, keys, n, old_values);
+    printf("%16s %12.1f\n", "put_many", (now_seconds() - start) * 1e9 / n);
+    HashMap_destroy(map);
+
+    map = new_map();
+    start = now_seconds();
+    if (!HashMap_build_parallel(map, keys, keys, n, threads, old_values)) {
+        fprintf(stderr, "build failed\n");
+        return 1;
+    }
+    printf("%16s %12.1f\n", "build_parallel", (now_seconds() - start) * 1e9 / n);
+    HashMap_destroy(map);
+
+    free(old_values);
+    free(keys);
+    free(data);
+    return 0;
+}
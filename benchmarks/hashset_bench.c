@@ -0,0 +1,74 @@
+//
+// Deduplicating ids with a HashSet against the old way of putting every id in a HashMap with a dummy value.
+// Half of the ids are repeats. The ids live in one array so that both sides chase the same key pointers.
+//
+// Usage: hashset_bench [n_ids]
+//
+#include <commons.h>
+#include <hashmap.h>
+#include <hashset.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static size_t hash_id(const void *key) {
+    return (size_t) Commons_hash_u64(*(const uint64_t *) key);
+}
+
+static bool eq_id(const void *a, const void *b) {
+    return *(const uint64_t *) a == *(const uint64_t *) b;
+}
+
+static void release_dummy(void *value) {
+    MapEntry *entry = value;
+    free(entry->value);
+    free(entry);
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static inline uint64_t id_at(const size_t i) {
+    return (uint64_t) (i / 2) * UINT64_C(0x9e3779b97f4a7c15);
+}
+
+int main(const int argc, char *argv[]) {
+    const size_t n = argc > 1 ? (size_t) atol(argv[1]) : 4000000;
+    uint64_t *ids = malloc(n * sizeof(uint64_t));
+    for (size_t i = 0; i < n; i++) {
+        ids[i] = id_at(i);
+    }
+
+    // At this size whatever runs second pays for the heap the first one left behind, so the set runs first
+    double start = now_seconds();
+    HashSet *set = HashSet_create(HASHSET_DEFAULT_CAPACITY, hash_id, eq_id, NOOP);
+    for (size_t i = 0; i < n; i++) {
+        HashSet_add(set, &ids[i]);
+    }
+    const double set_time = now_seconds() - start;
+    const size_t set_bytes = set->capacity * (sizeof(HashSetSlot) + 1);
+    HashSet_destroy(set);
+
+    start = now_seconds();
+    HashMap *map = HashMap_create(HASHMAP_DEFAULT_CAPACITY, hash_id, eq_id, release_dummy);
+    for (size_t i = 0; i < n; i++) {
+        if (!HashMap_contains_key(map, &ids[i])) {
+            HashMap_put(map, &ids[i], malloc(1));
+        }
+    }
+    const double map_time = now_seconds() - start;
+    // Counting the entry and the dummy value as the 32 and 16 bytes malloc hands out for them
+    const size_t map_bytes = map->capacity * (sizeof(MapEntry *) + 1) + map->size * (32 + 16);
+    const size_t unique = map->size;
+    HashMap_destroy(map);
+    free(ids);
+
+    printf("%zu ids, %zu unique\n", n, unique);
+    printf("%-24s %14s %14s\n", "", "ns/id", "approx MB");
+    printf("%-24s %14.1f %14.1f\n", "HashMap + dummy values", map_time * 1e9 / n, map_bytes / 1e6);
+    printf("%-24s %14.1f %14.1f\n", "HashSet", set_time * 1e9 / n, set_bytes / 1e6);
+    return 0;
+}
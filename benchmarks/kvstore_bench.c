@@ -0,0 +1,118 @@
+//
+// KVStore throughput against a temp directory: puts, random gets, reopening by scanning the data files,
+// merging, and reopening from the hint files the merge wrote.
+//
+// Usage: kvstore_bench [n_keys] [value_size] [parent_dir]
+//
+#include <bstrlib.h>
+#include <dirent.h>
+#include <kvstore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+/** 16 bytes for any i below 10^12 */
+static void make_key(char key[32], const size_t i) {
+    snprintf(key, 32, "key-%012zu", i);
+}
+
+static void remove_dir(const char *dir) {
+    DIR *d = opendir(dir);
+    struct dirent *dirent;
+    char path[4096];
+    while (d && (dirent = readdir(d))) {
+        if (dirent->d_name[0] != '.') {
+            snprintf(path, sizeof(path), "%s/%s", dir, dirent->d_name);
+            unlink(path);
+        }
+    }
+    if (d) {
+        closedir(d);
+    }
+    rmdir(dir);
+}
+
+static double reopen(KVStore **store, const char *dir) {
+    KVStore_close(*store);
+    const double start = now_seconds();
+    *store = KVStore_open(dir, 0);
+    return now_seconds() - start;
+}
+
+int main(const int argc, char *argv[]) {
+    const size_t n = argc > 1 ? (size_t) atol(argv[1]) : 1000000;
+    const size_t value_size = argc > 2 ? (size_t) atol(argv[2]) : 100;
+    char dir[4096];
+    snprintf(dir, sizeof(dir), "%s/kvstore_bench.XXXXXX", argc > 3 ? argv[3] : "/tmp");
+    if (!mkdtemp(dir)) {
+        fprintf(stderr, "Failed to create a directory in %s\n", argc > 3 ? argv[3] : "/tmp");
+        return 1;
+    }
+    KVStore *store = KVStore_open(dir, 0);
+    if (!store) {
+        remove_dir(dir);
+        return 1;
+    }
+
+    char key[32];
+    char *value = malloc(value_size);
+    memset(value, 'v', value_size);
+    double start = now_seconds();
+    for (size_t i = 0; i < n; i++) {
+        make_key(key, i);
+        memcpy(value, &i, value_size < sizeof(i) ? value_size : sizeof(i));
+        KVStore_put(store, key, 16, value, value_size);
+    }
+    KVStore_sync(store);
+    const double put_time = now_seconds() - start;
+
+    // Half of the keys written again, so the merge has garbage to drop
+    start = now_seconds();
+    for (size_t i = 0; i < n; i += 2) {
+        make_key(key, i);
+        KVStore_put(store, key, 16, value, value_size);
+    }
+    KVStore_sync(store);
+    const double overwrite_time = now_seconds() - start;
+
+    size_t found = 0;
+    start = now_seconds();
+    for (size_t i = 0; i < n; i++) {
+        make_key(key, (i * 7919) % n);
+        bstring stored = KVStore_get(store, key, 16);
+        found += stored != NULL;
+        bdestroy(stored);
+    }
+    const double get_time = now_seconds() - start;
+
+    const double scan_open_time = reopen(&store, dir);
+    start = now_seconds();
+    KVStore_merge(store);
+    const double merge_time = now_seconds() - start;
+    const double hint_open_time = reopen(&store, dir);
+
+    const double mb = (double) n * (double) (16 + value_size) / 1e6;
+    printf("%zu keys, 16 byte keys, %zu byte values, %s\n", n, value_size, dir);
+    printf("put             %10.1f ns/op %10.1f MB/s\n", put_time * 1e9 / n, mb / put_time);
+    printf("overwrite half  %10.1f ns/op\n", overwrite_time * 1e9 / (n / 2));
+    printf("get             %10.1f ns/op %10.1f MB/s (page cache warm)\n", get_time * 1e9 / n, mb / get_time);
+    printf("open by scan    %10.3f s\n", scan_open_time);
+    printf("merge           %10.3f s\n", merge_time);
+    printf("open from hints %10.3f s\n", hint_open_time);
+
+    const int status = found == n && store && KVStore_size(store) == n ? 0 : 1;
+    if (store) {
+        KVStore_close(store);
+    }
+    free(value);
+    remove_dir(dir);
+    return status;
+}
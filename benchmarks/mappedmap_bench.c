@@ -0,0 +1,83 @@
+//
+// Startup cost of rebuilding a string keyed HashMap against mapping a saved one, plus lookup speed on both.
+//
+// Usage: mappedmap_bench [n_keys] [path]
+//
+#include <mappedmap.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static bool equals_cstr(const void *a, const void *b) {
+    return strcmp(a, b) == 0;
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static HashMap *build(const size_t n) {
+    HashMap *map = HashMap_create(HASHMAP_DEFAULT_CAPACITY, Commons_hash_fn_cstr, equals_cstr, NULL);
+    char key[32];
+    for (size_t i = 0; i < n; i++) {
+        snprintf(key, sizeof(key), "key-%zu", i);
+        int64_t *value = malloc(sizeof(int64_t));
+        *value = (int64_t) i;
+        HashMap_put(map, strdup(key), value);
+    }
+    return map;
+}
+
+int main(const int argc, char *argv[]) {
+    const size_t n = argc > 1 ? (size_t) atol(argv[1]) : 2000000;
+    const char *path = argc > 2 ? argv[2] : "/tmp/mappedmap_bench.map";
+
+    double start = now_seconds();
+    HashMap *map = build(n);
+    const double build_time = now_seconds() - start;
+
+    start = now_seconds();
+    if (!HashMap_save(map, path, &MapCodec_cstr, &MapCodec_int64)) {
+        fprintf(stderr, "Failed to save %s\n", path);
+        return 1;
+    }
+    const double save_time = now_seconds() - start;
+
+    start = now_seconds();
+    MappedMap *mapped = HashMap_open_mapped(path);
+    const double open_time = now_seconds() - start;
+    if (!mapped) {
+        return 1;
+    }
+
+    char key[32];
+    int64_t sum = 0;
+    start = now_seconds();
+    for (size_t i = 0; i < n; i++) {
+        snprintf(key, sizeof(key), "key-%zu", (i * 7919) % n);
+        sum += *(int64_t *) HashMap_get(map, key);
+    }
+    const double heap_get = now_seconds() - start;
+    start = now_seconds();
+    for (size_t i = 0; i < n; i++) {
+        snprintf(key, sizeof(key), "key-%zu", (i * 7919) % n);
+        sum -= *(const int64_t *) MappedMap_get(mapped, key, strlen(key) + 1, NULL);
+    }
+    const double mapped_get = now_seconds() - start;
+
+    printf("%zu string keys\n", n);
+    printf("build HashMap   %10.3f s\n", build_time);
+    printf("save            %10.3f s\n", save_time);
+    printf("open mapped     %10.6f s\n", open_time);
+    printf("get ns/op       %10.1f heap %10.1f mapped (first touch included)\n", heap_get * 1e9 / n,
+           mapped_get * 1e9 / n);
+
+    MappedMap_close(mapped);
+    HashMap_destroy(map);
+    unlink(path);
+    return sum != 0;
+}
@@ -0,0 +1,95 @@
+//
+// Full iteration and random lookups of an OrderedMap against a HashMap holding the same keys.
+//
+// Usage: orderedmap_bench [n_keys] [lookups]
+//
+#include <commons.h>
+#include <hashmap.h>
+#include <orderedmap.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static size_t hash_u64(const void *key) {
+    return (size_t) Commons_hash_u64(*(const uint64_t *) key);
+}
+
+static bool equals_u64(const void *a, const void *b) {
+    return *(const uint64_t *) a == *(const uint64_t *) b;
+}
+
+static void free_entry_only(void *entry) {
+    // Keys and values live in one array
+    free(entry);
+}
+
+static bool sum_keys(void *key, void *value, void *ctx) {
+    (void) value;
+    *(uint64_t *) ctx += *(const uint64_t *) key;
+    return true;
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static inline uint64_t next_random(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+int main(const int argc, char *argv[]) {
+    const size_t n = argc > 1 ? (size_t) atol(argv[1]) : 1000000;
+    const size_t lookups = argc > 2 ? (size_t) atol(argv[2]) : 4000000;
+
+    uint64_t *keys = malloc(n * sizeof(uint64_t));
+    HashMap *hashmap = HashMap_create(HASHMAP_DEFAULT_CAPACITY, hash_u64, equals_u64, free_entry_only);
+    OrderedMap *ordered = OrderedMap_create(ORDEREDMAP_DEFAULT_CAPACITY, hash_u64, equals_u64, NOOP);
+    uint64_t state = 88172645463325252ULL;
+    for (size_t i = 0; i < n; i++) {
+        keys[i] = next_random(&state);
+        HashMap_put(hashmap, &keys[i], &keys[i]);
+        OrderedMap_put(ordered, &keys[i], &keys[i]);
+    }
+
+    printf("%zu keys, %zu random lookups\n", n, lookups);
+    printf("%12s %16s %16s\n", "", "HashMap", "OrderedMap");
+    uint64_t sum = 0;
+    const int passes = 10;
+    double start = now_seconds();
+    for (int p = 0; p < passes; p++) {
+        HashMap_for_each(hashmap, sum_keys, &sum);
+    }
+    const double hash_iter = now_seconds() - start;
+    start = now_seconds();
+    for (int p = 0; p < passes; p++) {
+        OrderedMap_for_each(ordered, sum_keys, &sum);
+    }
+    const double ordered_iter = now_seconds() - start;
+    printf("%12s %13.1f ns %13.1f ns\n", "iterate/key", hash_iter * 1e9 / (n * passes),
+           ordered_iter * 1e9 / (n * passes));
+
+    volatile size_t sink = 0;
+    start = now_seconds();
+    for (size_t i = 0; i < lookups; i++) {
+        sink += HashMap_get(hashmap, &keys[next_random(&state) % n]) != NULL;
+    }
+    const double hash_get = now_seconds() - start;
+    start = now_seconds();
+    for (size_t i = 0; i < lookups; i++) {
+        sink += OrderedMap_get(ordered, &keys[next_random(&state) % n]) != NULL;
+    }
+    const double ordered_get = now_seconds() - start;
+    printf("%12s %13.1f ns %13.1f ns\n", "get", hash_get * 1e9 / lookups, ordered_get * 1e9 / lookups);
+
+    HashMap_destroy(hashmap);
+    OrderedMap_destroy(ordered);
+    free(keys);
+    sink += sum;
+    (void) sink;
+    return 0;
+}
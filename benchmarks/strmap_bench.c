@@ -0,0 +1,86 @@
+//
+// Lookups of string keys in a StrMap against a HashMap of bstring keys. The HashMap side has to wrap each
+// lookup key in a bstring, which is done with a tagbstring on the stack so it pays no allocation either.
+//
+// Usage: strmap_bench [n_keys] [lookups]
+//
+#include <bstrlib.h>
+#include <commons.h>
+#include <hashmap.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <strmap.h>
+#include <time.h>
+
+static bool equals_bstring(const void *a, const void *b) {
+    return biseq((const_bstring) a, (const_bstring) b) == 1;
+}
+
+static void release_entry(void *map_entry) {
+    MapEntry *entry = map_entry;
+    bdestroy(entry->key);
+    free(entry);
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static inline uint64_t next_random(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+int main(const int argc, char *argv[]) {
+    const size_t n = argc > 1 ? (size_t) atol(argv[1]) : 1000000;
+    const size_t lookups = argc > 2 ? (size_t) atol(argv[2]) : 4000000;
+    // Identifier sized keys and url sized keys
+    const char *formats[] = {"user:%zu", "/api/v2/accounts/%zu/settings/notifications"};
+
+    printf("%zu keys, %zu random lookups\n", n, lookups);
+    printf("%12s %18s %18s\n", "key length", "HashMap ns/op", "StrMap ns/op");
+    for (size_t f = 0; f < 2; f++) {
+        char (*keys)[64] = malloc(n * sizeof(*keys));
+        size_t *lengths = malloc(n * sizeof(size_t));
+        HashMap *hashmap = HashMap_create(HASHMAP_DEFAULT_CAPACITY, Commons_hash_fn_bstring, equals_bstring, release_entry);
+        StrMap *strmap = StrMap_create(STRMAP_DEFAULT_CAPACITY, NOOP);
+        for (size_t i = 0; i < n; i++) {
+            lengths[i] = (size_t) snprintf(keys[i], sizeof(keys[i]), formats[f], i);
+            HashMap_put(hashmap, blk2bstr(keys[i], (int) lengths[i]), keys[i]);
+            StrMap_put(strmap, keys[i], lengths[i], keys[i]);
+        }
+        size_t *queries = malloc(lookups * sizeof(size_t));
+        uint64_t state = 88172645463325252ULL;
+        for (size_t i = 0; i < lookups; i++) {
+            queries[i] = next_random(&state) % n;
+        }
+
+        volatile size_t sink = 0;
+        double start = now_seconds();
+        for (size_t i = 0; i < lookups; i++) {
+            struct tagbstring key;
+            btfromblk(key, keys[queries[i]], lengths[queries[i]]);
+            sink += HashMap_get(hashmap, &key) != NULL;
+        }
+        const double boxed = now_seconds() - start;
+
+        start = now_seconds();
+        for (size_t i = 0; i < lookups; i++) {
+            sink += StrMap_get(strmap, keys[queries[i]], lengths[queries[i]]) != NULL;
+        }
+        const double flat = now_seconds() - start;
+        printf("%12zu %18.1f %18.1f\n", lengths[n - 1], boxed * 1e9 / lookups, flat * 1e9 / lookups);
+
+        HashMap_destroy(hashmap);
+        StrMap_destroy(strmap);
+        free(queries);
+        free(lengths);
+        free(keys);
+        (void) sink;
+    }
+    return 0;
+}
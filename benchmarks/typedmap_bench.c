@@ -0,0 +1,90 @@
+//
+// A HASHMAP_DECLARE generated integer map against HashMap with heap allocated int keys and values, the way
+// integer keyed maps had to be built before.
+//
+// Usage: typedmap_bench [n_keys]
+//
+#include <commons.h>
+#include <hashmap.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <typedmap.h>
+
+static inline size_t hash_u64(const uint64_t key) {
+    return (size_t) Commons_hash_u64(key);
+}
+
+static inline bool eq_u64(const uint64_t a, const uint64_t b) {
+    return a == b;
+}
+
+HASHMAP_DECLARE(IntMap, uint64_t, uint32_t, hash_u64, eq_u64)
+
+static size_t hash_boxed(const void *key) {
+    return (size_t) Commons_hash_u64(*(const uint64_t *) key);
+}
+
+static bool eq_boxed(const void *a, const void *b) {
+    return *(const uint64_t *) a == *(const uint64_t *) b;
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static inline uint64_t key_at(const size_t i) {
+    // Spread out keys so neither map gets help from sequential input
+    return (uint64_t) i * UINT64_C(0x9e3779b97f4a7c15);
+}
+
+int main(const int argc, char *argv[]) {
+    const size_t n = argc > 1 ? (size_t) atol(argv[1]) : 1000000;
+    volatile uint64_t sink = 0;
+
+    double start = now_seconds();
+    HashMap *boxed = HashMap_create(HASHMAP_DEFAULT_CAPACITY, hash_boxed, eq_boxed, NULL);
+    for (size_t i = 0; i < n; i++) {
+        uint64_t *key = malloc(sizeof(uint64_t));
+        uint32_t *value = malloc(sizeof(uint32_t));
+        *key = key_at(i);
+        *value = (uint32_t) i;
+        HashMap_put(boxed, key, value);
+    }
+    const double boxed_put = now_seconds() - start;
+    start = now_seconds();
+    for (size_t i = 0; i < n; i++) {
+        uint64_t key = key_at(i);
+        sink += *(uint32_t *) HashMap_get(boxed, &key);
+    }
+    const double boxed_get = now_seconds() - start;
+    const size_t boxed_bytes = boxed->capacity * (sizeof(MapEntry *) + 1) + n * (sizeof(MapEntry) + 2 * 16);
+
+    start = now_seconds();
+    IntMap *typed = IntMap_create(0);
+    for (size_t i = 0; i < n; i++) {
+        IntMap_put(typed, key_at(i), (uint32_t) i);
+    }
+    const double typed_put = now_seconds() - start;
+    start = now_seconds();
+    for (size_t i = 0; i < n; i++) {
+        sink += *IntMap_get(typed, key_at(i));
+    }
+    const double typed_get = now_seconds() - start;
+    const size_t typed_bytes = typed->capacity * (sizeof(IntMapSlot) + 1);
+
+    printf("%zu uint64_t -> uint32_t entries\n", n);
+    printf("%-10s %14s %14s %14s\n", "", "put ns/op", "get ns/op", "approx MB");
+    printf("%-10s %14.1f %14.1f %14.1f\n", "HashMap", boxed_put * 1e9 / n, boxed_get * 1e9 / n,
+           boxed_bytes / 1048576.0);
+    printf("%-10s %14.1f %14.1f %14.1f\n", "IntMap", typed_put * 1e9 / n, typed_get * 1e9 / n,
+           typed_bytes / 1048576.0);
+    printf("(HashMap memory counts 16 bytes of malloc overhead per key and value allocation)\n");
+
+    HashMap_destroy(boxed);
+    IntMap_destroy(typed);
+    (void) sink;
+    return 0;
+}
@@ -0,0 +1,56 @@
+//
+// Chunked bump allocator
+//
+#ifndef libfaafo_ARENA_H
+#define libfaafo_ARENA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define ARENA_DEFAULT_CHUNK_SIZE (64 * 1024)
+#define ARENA_ALIGNMENT 16
+
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t capacity;
+    size_t used;
+    unsigned char data[];
+} ArenaChunk;
+
+/**
+ * Memory is handed out from large chunks by bumping an offset. Single allocations can not be freed,
+ * everything is released at once with Arena_reset or Arena_destroy, which cost one free per chunk no
+ * matter how many allocations were made.
+ */
+typedef struct Arena {
+    ArenaChunk *head;   /**< The chunk currently allocated from, older chunks follow via next */
+    size_t chunk_size;  /**< Size of the data area in each regular chunk */
+    size_t allocated;   /**< Bytes handed out since creation or the last reset */
+} Arena;
+
+/**
+ * Allocate a new arena
+ * @param chunk_size size of each chunk in bytes. 0 means ARENA_DEFAULT_CHUNK_SIZE
+ * @return a new arena or NULL if out of memory
+ */
+Arena *Arena_create(size_t chunk_size);
+
+/**
+ * Allocate size bytes aligned to ARENA_ALIGNMENT. Requests larger than the chunk size get a chunk of their own.
+ * @return uninitialized memory owned by the arena or NULL if out of memory
+ */
+void *Arena_alloc(Arena *arena, size_t size) __nonnull((1));
+
+/** Same as Arena_alloc but the memory is zeroed */
+void *Arena_calloc(Arena *arena, size_t size) __nonnull((1));
+
+/**
+ * Release every allocation at once. The first chunk is kept and rewound so a reused arena does not go
+ * back to malloc for its first chunk_size bytes.
+ */
+bool Arena_reset(Arena *arena) __nonnull((1));
+
+bool Arena_destroy(Arena *arena) __nonnull((1));
+
+#endif //libfaafo_ARENA_H
@@ -0,0 +1,140 @@
+//
+// Bounded cache on top of HashMap
+//
+#ifndef libfaafo_CACHE_H
+#define libfaafo_CACHE_H
+
+#include <commons.h>
+#include <hashmap.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CACHE_WINDOW_PERCENT 1
+#define CACHE_PROTECTED_PERCENT 80
+#define CACHE_SKETCH_DEPTH 4
+
+/** Weight of an entry in whatever unit the capacity is in, e.g. bytes */
+typedef size_t (*weigh_fn)(const void *key, const void *value);
+
+typedef enum CachePolicy {
+    CACHE_LRU,          /**< Evict the least recently used entry */
+    /**
+     * W-TinyLFU: new entries go through a small LRU window, and get into the main cache only if they are
+     * estimated to be used more often than the entry they would push out. One scan over cold keys can't
+     * flush the entries that are actually popular.
+     */
+    CACHE_TINYLFU
+} CachePolicy;
+
+/** Where a node sits, also the list it is linked into */
+typedef enum CacheSegment {
+    CACHE_WINDOW,
+    CACHE_PROBATION,
+    CACHE_PROTECTED
+} CacheSegment;
+
+/**
+ * One cached entry. The MapEntry comes first, it is what the HashMap stores, so a lookup lands on the node
+ * itself and moving it in its recency list is a couple of pointer writes.
+ */
+typedef struct CacheNode {
+    MapEntry entry;
+    struct CacheNode *prev;
+    struct CacheNode *next;
+    size_t weight;
+    CacheSegment segment;
+} CacheNode;
+
+/** Circular doubly linked list around a sentinel, most recently used first */
+typedef struct CacheList {
+    CacheNode head;
+    size_t weight;
+} CacheList;
+
+/**
+ * Count-min sketch of how often keys were seen, 4 bit counters packed 16 to a word. All counters are
+ * halved once sample_size increments have been made, so the estimates follow changes in popularity.
+ */
+typedef struct FrequencySketch {
+    uint64_t *table;    /**< CACHE_SKETCH_DEPTH rows of words_per_row words */
+    size_t words_per_row;
+    size_t additions;
+    size_t sample_size;
+} FrequencySketch;
+
+typedef struct CacheStats {
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+} CacheStats;
+
+/**
+ * A HashMap holding at most capacity worth of entries, evicting by policy to stay under it. Every
+ * operation is O(1). Not thread safe.
+ */
+typedef struct Cache {
+    HashMap *map;
+    CachePolicy policy;
+    size_t capacity;
+    size_t weight;              /**< Sum of the weights of all entries */
+    size_t window_capacity;     /**< CACHE_TINYLFU only, share of capacity for the window */
+    size_t protected_capacity;  /**< CACHE_TINYLFU only, share of the main cache for protected entries */
+    weigh_fn weigh_fn;
+    destructor_fn df;
+    CacheList lists[3];         /**< Indexed by CacheSegment, CACHE_LRU only uses CACHE_PROBATION */
+    FrequencySketch sketch;
+    CacheStats stats;
+} Cache;
+
+/**
+ * Allocate a new cache
+ * @param capacity the most the entries may weigh in total, must be > 0
+ * @param weigh_fn weight of an entry, NULL counts every entry as 1 so that capacity is a number of entries
+ * @param df called on the MapEntry of every entry that leaves the cache (evicted, removed, replaced or
+ * cleared) to release its key and value. It must not free the MapEntry, which is part of a CacheNode.
+ * NULL frees the key and the value.
+ * @return A new cache on the heap or NULL if errors.
+ */
+Cache *Cache_create(size_t capacity, CachePolicy policy, hash_fn hash_fn, equals_fn equals_fn, weigh_fn weigh_fn,
+                    destructor_fn df) __nonnull((3, 4));
+
+bool Cache_destroy(Cache *cache) __nonnull((1));
+
+/** Release every entry, statistics are kept */
+bool Cache_clear(Cache *cache) __nonnull((1));
+
+/**
+ * Value for key, which counts as a use of the entry. Hits and misses are counted in stats.
+ * @return the value or NULL if key is not cached
+ */
+void *Cache_get(Cache *cache, const void *key) __nonnull((1, 2));
+
+/** Value for key without counting it as a use or in the statistics */
+void *Cache_peek(const Cache *cache, const void *key) __nonnull((1, 2));
+
+/**
+ * Mark key as used, like Cache_get without the statistics
+ * @return true if key is cached
+ */
+bool Cache_touch(Cache *cache, const void *key) __nonnull((1, 2));
+
+/**
+ * Cache value for key, which may evict other entries or, under CACHE_TINYLFU, be rejected by the admission
+ * policy right away (it is then released through df like any evicted entry). An entry already cached for
+ * key is released through df and replaced. The replaced entry's key or value is set to NULL before df sees it
+ * when it is the very pointer being put again, so a df that dereferences them must check for NULL.
+ * @return false on errors, including an entry heavier than the whole capacity. key and value stay with the
+ * caller then.
+ */
+bool Cache_put(Cache *cache, void *key, void *value) __nonnull((1, 2, 3));
+
+/** @return true if an entry for key was removed and released */
+bool Cache_remove(Cache *cache, const void *key) __nonnull((1, 2));
+
+size_t Cache_size(const Cache *cache) __nonnull((1));
+
+/** @return hits / (hits + misses), 0 before the first Cache_get */
+double Cache_hit_rate(const Cache *cache) __nonnull((1));
+
+#endif //libfaafo_CACHE_H
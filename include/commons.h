@@ -5,6 +5,8 @@
 #define COMMONS_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #define NOOP Commons_noop
 
@@ -35,6 +37,11 @@ static inline bool Commons_will_overflow(size_t a, size_t b, size_t *result) {
 
 typedef void (*destructor_fn)(void *);
 typedef bool (*equals_fn)(const void *a, const void *b);
+typedef size_t (*hash_fn)(const void *key);
+/** Negative, zero or positive as a orders before, equal to or after b */
+typedef int (*compare_fn)(const void *a, const void *b);
+/** Copy of item on the heap, NULL if out of memory */
+typedef void *(*copy_fn)(const void *item);
 
 void Commons_bstring_destroy(void *b_string);
 
@@ -47,4 +54,81 @@ void Commons_noop(void *ptr);
  */
 void Commons_map_entry_destroy(void *map_entry);
 
+/*
+ * Hash functions. Commons_hash_bytes is wyhash (final version 4) for byte blobs of any length, the
+ * integer hashes are full avalanche mixers that cost a couple of multiplies. All of them spread every
+ * input bit over the whole output word, so they are safe to use with power of two tables that mask off
+ * the low bits. The unseeded versions use seed 0 and are stable for the life of the process and between
+ * runs on the same architecture, the seeded ones should be fed Commons_hash_random_seed() when keys
+ * come from an untrusted source.
+ */
+
+#define COMMONS_HASH_P0 UINT64_C(0x2d358dccaa6c78a5)
+#define COMMONS_HASH_P1 UINT64_C(0x8bb84b93962eacc9)
+
+/** Multiply to 128 bits and fold the halves together */
+static inline uint64_t Commons_hash_mix(const uint64_t a, const uint64_t b) {
+#if defined(__SIZEOF_INT128__)
+	const __uint128_t r = (__uint128_t) a * b;
+	return (uint64_t) r ^ (uint64_t) (r >> 64);
+#else
+	const uint64_t a_lo = (uint32_t) a, a_hi = a >> 32, b_lo = (uint32_t) b, b_hi = b >> 32;
+	const uint64_t lo_lo = a_lo * b_lo, hi_lo = a_hi * b_lo, lo_hi = a_lo * b_hi, hi_hi = a_hi * b_hi;
+	const uint64_t cross = (lo_lo >> 32) + (uint32_t) hi_lo + lo_hi;
+	const uint64_t hi = hi_hi + (hi_lo >> 32) + (cross >> 32);
+	return ((cross << 32) | (uint32_t) lo_lo) ^ hi;
+#endif
+}
+
+/**
+ * Hash a 64 bit integer. This is a bijection (rrmxmx by Pelle Evensen), so distinct keys never collide
+ * on the full word.
+ */
+static inline uint64_t Commons_hash_u64(uint64_t x) {
+	x ^= (x >> 49 | x << 15) ^ (x >> 24 | x << 40);
+	x *= UINT64_C(0x9fb21c651e98df25);
+	x ^= x >> 28;
+	x *= UINT64_C(0x9fb21c651e98df25);
+	return x ^ x >> 28;
+}
+
+static inline uint64_t Commons_hash_u32(const uint32_t x) {
+	return Commons_hash_u64(x);
+}
+
+static inline uint64_t Commons_hash_u64_seeded(const uint64_t x, const uint64_t seed) {
+	return Commons_hash_mix(x ^ COMMONS_HASH_P0, seed ^ COMMONS_HASH_P1);
+}
+
+/**
+ * Hash len bytes starting at data
+ * @param data bytes to hash, may be NULL if len is 0
+ * @param len number of bytes
+ * @param seed any value, different seeds give unrelated hash functions
+ * @return the 64 bit hash
+ */
+uint64_t Commons_hash_bytes(const void *data, size_t len, uint64_t seed);
+
+/** A seed that is hard to guess from outside the process, read from the OS random source when there is one */
+uint64_t Commons_hash_random_seed(void);
+
+/** hash_fn for int keys */
+size_t Commons_hash_fn_int(const void *key);
+
+/** hash_fn for int64_t keys */
+size_t Commons_hash_fn_int64(const void *key);
+
+/** hash_fn for NUL terminated strings */
+size_t Commons_hash_fn_cstr(const void *key);
+
+/** hash_fn for bstring keys, hashes the same as Commons_hash_bytes over the string data */
+size_t Commons_hash_fn_bstring(const void *key);
+
+/**
+ * CRC-32C (Castagnoli) of len bytes, for checksums of data on disk. Uses the SSE4.2 crc32 instruction when
+ * the target has it and a lookup table otherwise, both give the same result.
+ * @param crc 0 to start, or the result for the bytes before data to continue a running checksum
+ */
+uint32_t Commons_crc32c(uint32_t crc, const void *data, size_t len);
+
 #endif //COMMONS_H
@@ -0,0 +1,80 @@
+//
+// Sharded thread safe HashMap
+//
+#ifndef libfaafo_CONCURRENTHASHMAP_H
+#define libfaafo_CONCURRENTHASHMAP_H
+
+#include <hashmap.h>
+#include <pthread.h>
+#include <stdbool.h>
+
+#define CONCURRENTHASHMAP_DEFAULT_SHARDS 64
+#define CONCURRENTHASHMAP_CACHE_LINE 64
+
+/**
+ * One independently locked HashMap. Padded to whole cache lines so that threads working on neighbouring
+ * shards never write to the same line.
+ */
+typedef struct ConcurrentShard {
+    pthread_rwlock_t lock;
+    HashMap *map;
+    size_t size;        /**< Mirrors map->size, written under the lock and read atomically without it */
+} __attribute__((aligned(CONCURRENTHASHMAP_CACHE_LINE))) ConcurrentShard;
+
+/**
+ * Keys are partitioned into shards by high bits of their hash (just below the bits the shard maps use for
+ * their control tags), and each shard has its own reader-writer lock and grows on its own. Threads only
+ * contend when they touch the same shard.
+ */
+typedef struct ConcurrentHashMap {
+    ConcurrentShard *shards;
+    size_t n_shards;
+    unsigned int shard_shift;
+    hash_fn hash_fn;
+    equals_fn equals_fn;
+    destructor_fn df;
+} ConcurrentHashMap;
+
+/**
+ * Allocate a new concurrent hashmap
+ * @param n_shards number of shards, must be a power of 2. 0 means CONCURRENTHASHMAP_DEFAULT_SHARDS
+ * @param shard_capacity initial capacity of each shard, same rules as for HashMap_create
+ * @param hash_fn the hashing function to apply for the MapEntry value types. Cannot be NULL
+ * @param equals_fn the equals function to use when comparing MapEntry values to find a match. Must not be null
+ * @param map_entry_df the destroy function to apply to the MapEntries in the map, see HashMap_create
+ * @return A new map on the heap or NULL if errors.
+ */
+ConcurrentHashMap *ConcurrentHashMap_create(size_t n_shards, size_t shard_capacity, hash_fn hash_fn,
+                                            equals_fn equals_fn, destructor_fn map_entry_df) __nonnull((3, 4));
+
+/**
+ * Associate value with key, same contract as HashMap_put
+ * @return the previous value for key, to be released by the caller, or NULL
+ */
+void *ConcurrentHashMap_put(ConcurrentHashMap *map, void *key, void *value) __nonnull((1, 2, 3));
+
+/**
+ * Get the value for key. The value stays valid only as long as no other thread removes or replaces it,
+ * use ConcurrentHashMap_read when that can't be ruled out.
+ */
+void *ConcurrentHashMap_get(ConcurrentHashMap *map, const void *key) __nonnull((1, 2));
+
+/**
+ * Call fn with the value for key (NULL if absent) while holding the shard's read lock
+ * @return whatever fn returned
+ */
+bool ConcurrentHashMap_read(ConcurrentHashMap *map, const void *key, bool (*fn)(const void *value, void *ctx),
+                            void *ctx) __nonnull((1, 2, 3));
+
+bool ConcurrentHashMap_contains_key(ConcurrentHashMap *map, const void *key) __nonnull((1, 2));
+
+bool ConcurrentHashMap_remove(ConcurrentHashMap *map, const void *key) __nonnull((1, 2));
+
+/** Sum of the shard sizes. Exact when no writers are running, a snapshot-ish estimate otherwise */
+size_t ConcurrentHashMap_size(const ConcurrentHashMap *map) __nonnull((1));
+
+bool ConcurrentHashMap_clear(ConcurrentHashMap *map) __nonnull((1));
+
+bool ConcurrentHashMap_destroy(ConcurrentHashMap *map) __nonnull((1));
+
+#endif //libfaafo_CONCURRENTHASHMAP_H
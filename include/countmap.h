@@ -0,0 +1,114 @@
+//
+// Open addressing hash map from keys to 64 bit counters
+//
+#ifndef libfaafo_COUNTMAP_H
+#define libfaafo_COUNTMAP_H
+
+#include <commons.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define COUNTMAP_DEFAULT_CAPACITY 16
+
+#define CountMap_is_empty(map) ((map) ? (map)->size == 0 : 0)
+
+/** A key, its hash and its counter, stored right in the slot array */
+typedef struct CountMapSlot {
+    void *key;
+    size_t hash;
+    int64_t count;
+} CountMapSlot;
+
+/** A key and its count as handed out by CountMap_top_k */
+typedef struct CountEntry {
+    void *key;
+    int64_t count;
+} CountEntry;
+
+/**
+ * Hash map from keys to counters laid out like HashSet, the counter sits in the slot next to the key and
+ * its cached hash. Counting a key is one probe that either bumps the counter in place or fills an empty
+ * slot, no value is ever allocated. Keys are looked up as given and only copied with key_copy the first
+ * time they are counted, so a word counter can count straight out of a scratch buffer.
+ *
+ * A key stays in the map when its count goes to 0 or below, remove it explicitly to drop it.
+ */
+typedef struct CountMap {
+    CountMapSlot *slots;
+    uint8_t *ctrl;      /**< control bytes, one per slot plus a mirrored tail for wrap free group loads */
+    size_t capacity;
+    size_t size;
+    size_t threshold;
+    size_t shrink_threshold;
+    size_t min_capacity;
+    hash_fn hash_fn;
+    equals_fn equals_fn;
+    copy_fn key_copy;
+    destructor_fn key_df;
+    uint64_t seed;
+} CountMap;
+
+/**
+ * Allocate a new map
+ * @param capacity the initial capacity, same rules as for HashMap_create
+ * @param key_copy copies a key the first time it is counted, NULL stores the key given (which then has to
+ * live as long as the map holds it)
+ * @param key_df called on every key the map releases. NULL means free, NOOP for keys owned elsewhere
+ * @return A new map on the heap or NULL if errors.
+ */
+CountMap *CountMap_create(size_t capacity, hash_fn hash_fn, equals_fn equals_fn, copy_fn key_copy,
+                          destructor_fn key_df) __nonnull((2, 3));
+
+bool CountMap_destroy(CountMap *map) __nonnull((1));
+
+/** Remove and release every key, swapping a grown table for one of min_capacity */
+bool CountMap_clear(CountMap *map) __nonnull((1));
+
+/**
+ * Add delta to the count of key, a key that is not in the map starts at 0
+ * @return false if out of memory
+ */
+bool CountMap_increment(CountMap *map, const void *key, int64_t delta) __nonnull((1, 2));
+
+/**
+ * Count each of n keys once, HASHMAP_BATCH at a time: the home slots of a batch are prefetched while its
+ * keys are hashed, so the cache misses of the batch overlap.
+ * @return the number of keys counted, less than n only if out of memory
+ */
+size_t CountMap_increment_many(CountMap *map, const void *const *keys, size_t n) __nonnull((1, 2));
+
+/** @return the count of key, 0 if it is not in the map */
+int64_t CountMap_get(const CountMap *map, const void *key) __nonnull((1, 2));
+
+bool CountMap_contains(const CountMap *map, const void *key) __nonnull((1, 2));
+
+/** @return true if key was in the map, it is then released */
+bool CountMap_remove(CountMap *map, const void *key) __nonnull((1, 2));
+
+/**
+ * The k keys with the highest counts, highest first, ties in no particular order. Runs in O(size log k)
+ * with a heap of k entries. The keys still belong to the map.
+ * @param out room for k entries
+ * @return the number of entries written, min(k, size)
+ */
+size_t CountMap_top_k(const CountMap *map, size_t k, CountEntry *out) __nonnull((1, 3));
+
+/**
+ * Add every count of other to map, keys new to map are copied with its key_copy. Both maps must use the
+ * same notion of equality, other's keys are hashed again since every map has a seed of its own.
+ * A map without key_copy shares other's keys instead, so it must have been created with NOOP as key_df
+ * (at most one of the maps may release them) and can't use them once other released them.
+ * @return false if out of memory or map would release keys it shares, map then holds whatever was merged
+ * up to that point
+ */
+bool CountMap_merge(CountMap *map, const CountMap *other) __nonnull((1, 2));
+
+/**
+ * Step through the entries, starting with *cursor = 0. Incrementing keys that are already in the map is
+ * fine, anything that adds or removes keys invalidates the cursor.
+ * @return false once every entry has been returned
+ */
+bool CountMap_next(const CountMap *map, size_t *cursor, void **key, int64_t *count) __nonnull((1, 2));
+
+#endif //libfaafo_COUNTMAP_H
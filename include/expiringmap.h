@@ -0,0 +1,115 @@
+//
+// HashMap with a time to live per entry
+//
+#ifndef libfaafo_EXPIRINGMAP_H
+#define libfaafo_EXPIRINGMAP_H
+
+#include <commons.h>
+#include <hashmap.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define EXPIRINGMAP_WHEEL_BITS 6
+#define EXPIRINGMAP_WHEEL_SLOTS (1 << EXPIRINGMAP_WHEEL_BITS)
+#define EXPIRINGMAP_WHEEL_LEVELS 4
+/** Ticks covered by the wheel, deadlines past the current span wait in an overflow list until it is reached */
+#define EXPIRINGMAP_WHEEL_SPAN (UINT64_C(1) << (EXPIRINGMAP_WHEEL_BITS * EXPIRINGMAP_WHEEL_LEVELS))
+
+/** Current time in ticks, the unit of every ttl. It must never go backwards. */
+typedef uint64_t (*clock_fn)(void);
+
+/**
+ * One entry. The MapEntry comes first, it is what the HashMap stores, the rest links the node into the
+ * timer wheel slot its deadline falls in.
+ */
+typedef struct ExpiringNode {
+    MapEntry entry;
+    struct ExpiringNode *next;
+    struct ExpiringNode **pprev;    /**< The pointer that points at this node, the slot head or prev->next */
+    uint64_t deadline;              /**< Tick at which the entry expires */
+    uint8_t level;                  /**< Wheel level, EXPIRINGMAP_WHEEL_LEVELS for the overflow list */
+    uint8_t slot;
+} ExpiringNode;
+
+/**
+ * Hierarchical timer wheel. Level l has EXPIRINGMAP_WHEEL_SLOTS slots of 64^l ticks each, a deadline goes
+ * on the lowest level where it shares all higher bits with the current tick. Advancing the clock empties
+ * the slots it passes: level 0 slots expire their nodes, higher ones hand them down to the level that now
+ * fits them. Occupancy bitmaps find the next non empty slot in a couple of instructions, so an advance
+ * costs O(levels + expired) however far the clock moves.
+ */
+typedef struct TimerWheel {
+    ExpiringNode *slots[EXPIRINGMAP_WHEEL_LEVELS][EXPIRINGMAP_WHEEL_SLOTS];
+    uint64_t occupied[EXPIRINGMAP_WHEEL_LEVELS];    /**< Bit s set when slots[l][s] is not empty */
+    ExpiringNode *overflow;                         /**< Deadlines past the span the wheel currently covers */
+    uint64_t overflow_min;                          /**< No deadline in overflow is earlier than this */
+    uint64_t now;                                   /**< Tick the wheel has been advanced to */
+} TimerWheel;
+
+/**
+ * A HashMap whose entries expire a time to live after they were put. Expired entries are released by
+ * ExpiringMap_advance, whose cost depends on the number of entries that expired and not on the size of
+ * the map, and lazily by the lookups that run into them before that. Not thread safe.
+ */
+typedef struct ExpiringMap {
+    HashMap *map;
+    TimerWheel wheel;
+    clock_fn clock;
+    destructor_fn df;
+    size_t expired;     /**< Entries released because they expired, lazily or by ExpiringMap_advance */
+} ExpiringMap;
+
+/**
+ * Allocate a new map
+ * @param clock time source for ttls and lazy expiry, NULL is CLOCK_MONOTONIC in milliseconds
+ * @param df called on the MapEntry of every entry that leaves the map (expired, removed, replaced or
+ * cleared) to release its key and value. It must not free the MapEntry, which is part of an ExpiringNode.
+ * NULL frees the key and the value.
+ * @return A new map on the heap or NULL if errors.
+ */
+ExpiringMap *ExpiringMap_create(hash_fn hash_fn, equals_fn equals_fn, clock_fn clock, destructor_fn df)
+__nonnull((1, 2));
+
+bool ExpiringMap_destroy(ExpiringMap *map) __nonnull((1));
+
+/** Release every entry */
+bool ExpiringMap_clear(ExpiringMap *map) __nonnull((1));
+
+/**
+ * Put value for key, expiring ttl ticks from now. An entry already in the map for key is released
+ * through df and replaced, with the new deadline. If key or value is the same pointer as the one in the
+ * map, it stays in the map and df gets NULL in its place, so a df that dereferences them must check for NULL.
+ * @return false on errors, key and value stay with the caller then
+ */
+bool ExpiringMap_put(ExpiringMap *map, void *key, void *value, uint64_t ttl) __nonnull((1, 2, 3));
+
+/**
+ * Value for key. An entry found past its deadline is released on the spot.
+ * @return the value or NULL if key is not in the map or has expired
+ */
+void *ExpiringMap_get(ExpiringMap *map, const void *key) __nonnull((1, 2));
+
+/**
+ * Give the entry for key a new deadline, ttl ticks from now
+ * @return false if key is not in the map or has expired
+ */
+bool ExpiringMap_touch(ExpiringMap *map, const void *key, uint64_t ttl) __nonnull((1, 2));
+
+/** @return true if an entry for key was removed and released, expired or not */
+bool ExpiringMap_remove(ExpiringMap *map, const void *key) __nonnull((1, 2));
+
+/**
+ * Move the wheel to now and release every entry whose deadline is at or before it
+ * @param now a tick from the map's clock, earlier than the last one passed does nothing
+ * @return number of entries released
+ */
+size_t ExpiringMap_advance(ExpiringMap *map, uint64_t now) __nonnull((1));
+
+/** ExpiringMap_advance to the clock's current time */
+size_t ExpiringMap_expire(ExpiringMap *map) __nonnull((1));
+
+/** Number of entries, including expired ones that have not been released yet */
+size_t ExpiringMap_size(const ExpiringMap *map) __nonnull((1));
+
+#endif //libfaafo_EXPIRINGMAP_H
@@ -0,0 +1,93 @@
+//
+// Parallel hash aggregation over arrays of records, GROUP BY for data in memory
+//
+#ifndef libfaafo_GROUPBY_H
+#define libfaafo_GROUPBY_H
+
+#include <arraylist.h>
+#include <commons.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** The group of a record, usually a pointer to one of its fields. NULL leaves the record out. */
+typedef const void *(*group_key_fn)(const void *record);
+/** The value of a record that a SUM, MIN or MAX aggregates */
+typedef int64_t (*group_value_fn)(const void *record);
+
+typedef enum GroupAggregateKind {
+    GROUP_COUNT,
+    GROUP_SUM,
+    GROUP_MIN,
+    GROUP_MAX,
+    GROUP_CUSTOM
+} GroupAggregateKind;
+
+/**
+ * One aggregate computed for every group. COUNT, SUM, MIN and MAX keep an int64_t, sums wrap around on
+ * overflow. A CUSTOM aggregate keeps state_size bytes of state per group, 8 byte aligned, which must not own
+ * memory: states are copied and dropped without any destructor.
+ */
+typedef struct GroupAggregate {
+    GroupAggregateKind kind;
+    group_value_fn value_fn;
+    size_t state_size;
+    void (*init)(void *state);
+    void (*update)(void *state, const void *record);
+    /** Fold the state other, built from other records of the same group, into state */
+    void (*merge)(void *state, const void *other);
+} GroupAggregate;
+
+#define GroupAggregate_count() ((GroupAggregate) {.kind = GROUP_COUNT})
+#define GroupAggregate_sum(fn) ((GroupAggregate) {.kind = GROUP_SUM, .value_fn = (fn)})
+#define GroupAggregate_min(fn) ((GroupAggregate) {.kind = GROUP_MIN, .value_fn = (fn)})
+#define GroupAggregate_max(fn) ((GroupAggregate) {.kind = GROUP_MAX, .value_fn = (fn)})
+#define GroupAggregate_custom(size, init_fn, update_fn, merge_fn) ((GroupAggregate) { \
+    .kind = GROUP_CUSTOM, .state_size = (size), .init = (init_fn), .update = (update_fn), .merge = (merge_fn)})
+
+/** What to group by and what to compute for every group */
+typedef struct GroupBySpec {
+    group_key_fn key_fn;
+    hash_fn hash_fn;            /**< Of the keys key_fn returns */
+    equals_fn equals_fn;
+    const GroupAggregate *aggregates;
+    size_t aggregate_count;
+    size_t nthreads;            /**< 0 uses one thread per online CPU. Small inputs run on the calling thread. */
+} GroupBySpec;
+
+/**
+ * One group of the result. key is the key of one of its records, it points into the input like key_fn's
+ * results do. The aggregates follow in spec order, read them with GroupRow_value and GroupRow_state.
+ */
+typedef struct GroupRow {
+    const void *key;
+    int64_t values[];
+} GroupRow;
+
+/**
+ * Group the elements of list, which are pointers to records.
+ *
+ * Threads take the input in chunks of consecutive records and aggregate them into tables of their own,
+ * each split into partitions by hash. Partitions are then merged across threads, every partition by one
+ * thread, and the rows of all partitions make up the result. Records are dealt out by position and a
+ * thread's table holds every key at most once, so a hot key or a skewed distribution costs no thread more
+ * than its share of the input: no record or group ever moves between threads before the merge, and the
+ * merge only moves groups.
+ * Rows are kept inline in open addressing tables, there is no allocation per group until the result is
+ * built.
+ *
+ * @return a list of GroupRows in no particular order, which frees them when destroyed, or NULL on errors
+ */
+ArrayList *GroupBy_list(const ArrayList *list, const GroupBySpec *spec) __nonnull((1, 2));
+
+/** Same as GroupBy_list for n records of record_size bytes each stored one after the other */
+ArrayList *GroupBy_array(const void *records, size_t n, size_t record_size, const GroupBySpec *spec)
+__nonnull((4));
+
+/** @return aggregate i of a row, which must be a COUNT, SUM, MIN or MAX */
+int64_t GroupRow_value(const GroupBySpec *spec, const GroupRow *row, size_t i) __nonnull((1, 2));
+
+/** @return the state of aggregate i of a row */
+const void *GroupRow_state(const GroupBySpec *spec, const GroupRow *row, size_t i) __nonnull((1, 2));
+
+#endif //libfaafo_GROUPBY_H
@@ -4,49 +4,289 @@
 
 #ifndef libfaafo_HASHMAP_H
 #define libfaafo_HASHMAP_H
+#include <arena.h>
 #include <commons.h>
 #include <stdbool.h>
-#include "linkedlist.h"
+#include <stddef.h>
+#include <stdint.h>
 
 #define HASHMAP_DEFAULT_CAPACITY 16
+#define HASHMAP_MIN_CAPACITY 16
 #define HASHMAP_LOAD_FACTOR 0.75f
+#define HASHMAP_SHRINK_LOAD_FACTOR 0.125f
+#define HASHMAP_BATCH 16
+#define HASHMAP_TREEIFY_THRESHOLD 8
+#define HASHMAP_UNTREEIFY_THRESHOLD 6
+/** Control bytes of the embedded table, HASHMAP_MIN_CAPACITY plus room for the mirrored tail */
+#define HASHMAP_SMALL_CTRL_BYTES (2 * HASHMAP_MIN_CAPACITY)
+/** Entries embedded in the map, as many as a HASHMAP_MIN_CAPACITY table holds before it grows */
+#define HASHMAP_SMALL_ENTRIES 12
 
 #define HashMap_is_empty(map) ((map) ? (map)->size == 0 : 0)
 
-typedef size_t (*hash_fn)(const void *key);
-
 typedef struct MapEntry {
     void *key;
     void *value;
     size_t hash;
 } MapEntry;
 
+/**
+ * The table being moved away from during an incremental resize. Its slots are migrated in order,
+ * starting right after an empty slot, a few at a time by every put and remove.
+ */
+typedef struct HashMapMigration {
+    MapEntry **slots;   /**< NULL when no migration is running */
+    uint8_t *ctrl;
+    size_t capacity;
+    size_t start;       /**< First slot migrated */
+    size_t done;        /**< Number of slots migrated so far, counting from start */
+} HashMapMigration;
+
+/**
+ * Open addressing hash map. Entries live in a flat array of slots next to an array of one byte control
+ * tags (empty, or full plus 7 bits of the hash) that are probed a group at a time. Collisions are resolved
+ * with linear probing and removals shift the following entries back, so there are no tombstones.
+ *
+ * Every map mixes hash_fn output with its own random seed, so the table layout can't be predicted from
+ * outside the process. Keys that collide on hash_fn itself are not helped by that, given a comparator the
+ * map keeps them in a balanced tree (a tree bin) once HASHMAP_TREEIFY_THRESHOLD of them share a hash.
+ */
 typedef struct HashMap {
-    LinkedList **buckets;
+    MapEntry **slots;   /**< capacity entry pointers, NULL where the slot is empty */
+    uint8_t *ctrl;      /**< control bytes, one per slot plus a mirrored tail for wrap free group loads */
     size_t capacity;
     size_t size;
     size_t threshold;
+    size_t shrink_threshold;    /**< Removals that take size below this shrink the table */
+    size_t min_capacity;        /**< Floor for shrinking, the capacity the map was created with or reserved */
     hash_fn hash_fn;
     equals_fn equals_fn;
     destructor_fn df;
+    Arena *arena;               /**< Entry storage in arena mode, NULL when entries are malloc'ed one by one */
+    MapEntry *free_entries;     /**< Removed arena entries kept for reuse, chained through their value */
+    HashMapMigration old;       /**< Previous table while an incremental resize is in progress */
+    size_t migrate_step;        /**< Old slots migrated per put/remove, 0 means resize all at once */
+    uint64_t seed;              /**< Mixed into every hash, random per map */
+    compare_fn compare_fn;      /**< Orders colliding keys in tree bins, NULL keeps them in plain slots */
+    size_t tree_bins;           /**< Number of tree bins in the tables */
+    /*
+     * Table for a map at HASHMAP_MIN_CAPACITY, slots and ctrl point here whenever the map is at that capacity.
+     * Creating a small map is then a single allocation, and a lookup in it is one group compare.
+     */
+    MapEntry *small_slots[HASHMAP_MIN_CAPACITY];
+    uint8_t small_ctrl[HASHMAP_SMALL_CTRL_BYTES];
+    /*
+     * Entries of a map created with the default destructor, which owns its MapEntries and never hands them
+     * out. The first HASHMAP_SMALL_ENTRIES puts of such a map take an entry from here instead of malloc, so a
+     * small map holds its entries without any allocation beyond the map itself.
+     */
+    MapEntry small_entries[HASHMAP_SMALL_ENTRIES];
+    uint32_t small_entries_used;    /**< One bit per entry of small_entries that is in the table */
 } HashMap;
 
+/** Called for every entry by HashMap_for_each, return false to stop the walk */
+typedef bool (*map_visit_fn)(void *key, void *value, void *ctx);
+
+/** Value for a key that is about to be inserted, NULL to insert nothing */
+typedef void *(*supplier_fn)(const void *key, void *ctx);
+
+/** New value for key from its current value (NULL if absent), NULL to remove the entry */
+typedef void *(*compute_fn)(const void *key, void *value, void *ctx);
+
+/** Value for a key that has both old_value in the map and value being merged in, NULL to remove the entry */
+typedef void *(*merge_fn)(void *old_value, void *value, void *ctx);
+
+/**
+ * Iterator over the entries of a map in table order, set up with HashMap_iter_init. It walks the control
+ * bytes a group at a time, so empty stretches of the table are skipped 16 slots per step. Any put, remove
+ * or clear on the map invalidates it.
+ */
+typedef struct HashMapIterator {
+    const HashMap *map;
+    MapEntry *const *slots;     /**< Table being walked, the old table of a running migration comes last */
+    const uint8_t *ctrl;
+    size_t capacity;
+    size_t group;               /**< First slot of the group that pending belongs to */
+    uint32_t pending;           /**< Full slots of that group not returned yet, one bit per slot */
+    const struct TreeNode *node; /**< Next entry of the tree bin being walked, NULL outside of one */
+} HashMapIterator;
+
+/**
+ * Zero allocation view of the keys or the values of a map, backed by the map itself. Iterate it with
+ * HashMapView_next, it is invalidated like a HashMapIterator.
+ */
+typedef struct HashMapView {
+    HashMapIterator it;
+    bool values;
+} HashMapView;
+
 /**
  * Allocate a new hashmap
- * @param capacity the initial capacity. Must be > 0 AND powers of 2. Recommended: HASHMAP_DEFAULT_CAPACITY
+ * @param capacity the initial capacity. Must be > 0 AND powers of 2. Recommended: HASHMAP_DEFAULT_CAPACITY.
+ * Capacities below HASHMAP_MIN_CAPACITY are rounded up to it.
  * @param hash_fn the hashing function to apply for the MapEntry value types. Cannot be NULL
  * @param equals_fn the equals function to use when comparing MapEntry values to find a match. Must not be nulkl
  * @param map_entry_df the destroy function to apply to the MapEntries in the map. Defaults to using free on MapEntry key,value and the entry itself
  * @return A new hashmap on the heap of NULL if errors.
  */
 HashMap *HashMap_create(size_t capacity, hash_fn hash_fn, equals_fn equals_fn, destructor_fn map_entry_df) __nonnull((2, 3));
+/**
+ * Allocate a new hashmap in arena mode. MapEntries are carved out of large chunks instead of being
+ * allocated one by one, and no destructor is ever run on them. Keys and values are expected to be owned
+ * elsewhere, typically allocated with HashMap_arena_alloc, which makes HashMap_clear and HashMap_destroy
+ * a release of a few chunks however many entries the map holds.
+ * @param capacity the initial capacity, same rules as HashMap_create
+ * @param hash_fn the hashing function to apply for the MapEntry value types. Cannot be NULL
+ * @param equals_fn the equals function to use when comparing MapEntry values to find a match. Must not be null
+ * @param chunk_size size of each arena chunk in bytes. 0 means ARENA_DEFAULT_CHUNK_SIZE
+ * @return A new hashmap on the heap of NULL if errors.
+ */
+HashMap *HashMap_create_arena(size_t capacity, hash_fn hash_fn, equals_fn equals_fn, size_t chunk_size) __nonnull((2, 3));
+
+/**
+ * Allocate memory from the map's arena, e.g. for keys and values that should live exactly as long as the
+ * map's content. The memory is released by the next HashMap_clear or by HashMap_destroy.
+ * @return size bytes of uninitialized memory or NULL if the map is not in arena mode or out of memory
+ */
+void *HashMap_arena_alloc(HashMap *map, size_t size) __nonnull((1));
+
+/**
+ * Switch incremental resizing on or off. When on, growing the map allocates the new table but leaves the
+ * entries where they are, and each following put and remove moves migrate_step slots of the old table over.
+ * Lookups consult both tables until the migration is done, so no single put pays for rehashing the whole map.
+ * @param migrate_step old slots migrated per put/remove. 0 turns incremental resizing off, finishing any
+ * running migration right away
+ * @return true on success, false if map is NULL
+ */
+bool HashMap_set_incremental_resize(HashMap *map, size_t migrate_step) __nonnull((1));
+
+/**
+ * Migrate up to n_slots slots of a running incremental resize, e.g. from an idle loop. HashMap_get never
+ * migrates since it only reads the map.
+ * @return true if the migration is still in progress afterwards
+ */
+bool HashMap_rehash_step(HashMap *map, size_t n_slots) __nonnull((1));
+
+/**
+ * Protect the map against keys that collide on hash_fn, e.g. crafted by whoever sends them. With a
+ * comparator, entries that share a hash are moved into a balanced tree as soon as there are
+ * HASHMAP_TREEIFY_THRESHOLD of them and back into plain slots when fewer than HASHMAP_UNTREEIFY_THRESHOLD
+ * remain, so lookups stay O(log n) however many keys collide.
+ * @param compare_fn total order on keys that is 0 exactly when equals_fn is true, NULL turns tree bins off
+ * @return true on success, false if map is NULL or already has tree bins ordered by another comparator
+ */
+bool HashMap_set_compare(HashMap *map, compare_fn compare_fn) __nonnull((1));
+
 void *HashMap_put(HashMap *map, void *key, void *value) __nonnull((1, 2, 3));
 void *HashMap_get(const HashMap *map, void *key) __nonnull((1, 2));
 bool HashMap_remove(HashMap *map, void *key) __nonnull((1, 2));
 bool HashMap_destroy(HashMap *map) __nonnull((1));
+
+/** Remove every entry, swapping a table that grew past min_capacity for a fresh one of min_capacity */
 bool HashMap_clear(HashMap *map) __nonnull((1));
-// bool HashMap_contains_key(const HashMap *map, void *key);
-// HashSet *HashMap_keyset(const HashMap *map);
+
+/*
+ * Sizing. The table doubles when an insert takes it past HASHMAP_LOAD_FACTOR and shrinks, down to
+ * min_capacity, when a removal takes it below HASHMAP_SHRINK_LOAD_FACTOR. A shrunk table is half full at
+ * most, so a map hovering around one size doesn't keep resizing back and forth.
+ */
+
+/**
+ * Make room for n entries in total, so that putting them causes no resize on the way. The capacity
+ * reached also becomes the map's min_capacity.
+ * @return true on success, false if out of memory
+ */
+bool HashMap_reserve(HashMap *map, size_t n) __nonnull((1));
+
+/**
+ * Rehash into the smallest table that holds the current entries, finishing a running migration first.
+ * This goes below min_capacity if the map is small enough, which lowers min_capacity along with it.
+ * @return true on success, false if out of memory (the map is then left as it was)
+ */
+bool HashMap_compact(HashMap *map) __nonnull((1));
+
+/*
+ * Entry API. Each of these hashes the key once and probes the table once, whether the key turns out to be
+ * there or not. key is only used for the lookup, a new entry stores key_copy(key) so callers can look up
+ * with a key on the stack and only pay for a heap copy when it is actually inserted. A NULL key_copy stores
+ * key itself, which then has to live as long as the entry. A copied key is released with free() if the
+ * insert is abandoned. The callbacks must not modify the map.
+ */
+
+/**
+ * Value for key, inserting supplier(key, ctx) first if key is not in the map
+ * @return the value in the map or NULL on errors, including a supplier returning NULL
+ */
+void *HashMap_get_or_insert_with(HashMap *map, const void *key, copy_fn key_copy, supplier_fn supplier, void *ctx)
+__nonnull((1, 2, 4));
+
+/**
+ * Replace the value for key with fn(key, value, ctx), where value is NULL if key is not in the map. When
+ * fn returns NULL the entry is removed and released by the map's destructor, value included. Otherwise
+ * the old value is handed to fn, which must release it if the new value is a different one.
+ * @return the new value, NULL if the entry was removed, never inserted or on errors
+ */
+void *HashMap_compute(HashMap *map, const void *key, copy_fn key_copy, compute_fn fn, void *ctx) __nonnull((1, 2, 4));
+
+/**
+ * Insert value for key if absent, otherwise replace the value with fn(old_value, value, ctx). fn owns value
+ * and old_value and must release whichever of them it does not return. A NULL result removes the entry,
+ * the map's destructor then releases old_value with it and fn only releases value.
+ * @return the value now in the map, NULL if the entry was removed or on errors (value stays with the caller)
+ */
+void *HashMap_merge(HashMap *map, const void *key, copy_fn key_copy, void *value, merge_fn fn, void *ctx)
+__nonnull((1, 2, 4, 5));
+
+/**
+ * Look up n keys at once. Keys are handled HASHMAP_BATCH at a time: all of them are hashed and their
+ * control bytes and slots prefetched, then the entries of matching slots are prefetched, and only then are
+ * the keys compared. The cache misses of a whole batch overlap instead of being paid one after the other.
+ * @param out_values n values, NULL for keys that are not in the map
+ * @return number of keys found
+ */
+size_t HashMap_get_many(const HashMap *map, void *const *keys, size_t n, void **out_values) __nonnull((1, 2, 4));
+
+/**
+ * Put n key/value pairs, prefetching the home slots of each batch of HASHMAP_BATCH keys before inserting it.
+ * Same ownership rules as HashMap_put.
+ * @param out_old_values n replaced values, NULL for keys that were inserted. The map doesn't keep replaced
+ * values, releasing them is up to the caller.
+ * @return true if every pair was put
+ */
+bool HashMap_put_many(HashMap *map, void *const *keys, void *const *values, size_t n, void **out_old_values)
+__nonnull((1, 2, 3, 5));
+
+/**
+ * Fill an empty map with n key/value pairs using nthreads threads. The table is sized for n up front, the
+ * keys are hashed in parallel and partitioned by the region of the table their home slot is in, then every
+ * thread fills whole regions on its own. The result, duplicate keys included, is the same as that of
+ * HashMap_put_many over the pairs in order: the first key stays, the last value wins and out_old_values gets
+ * the values each later pair replaced.
+ * @param nthreads 0 uses one thread per online CPU. Small inputs are put on the calling thread alone.
+ * @return true if every pair was put. The map can't be in arena mode.
+ */
+bool HashMap_build_parallel(HashMap *map, void *const *keys, void *const *values, size_t n, size_t nthreads,
+                            void **out_old_values) __nonnull((1, 2, 3, 6));
+
+bool HashMap_contains_key(const HashMap *map, const void *key) __nonnull((1, 2));
+
+void HashMap_iter_init(const HashMap *map, HashMapIterator *it) __nonnull((1, 2));
+
+/** @return the next entry or NULL when all entries have been returned */
+MapEntry *HashMap_iter_next(HashMapIterator *it) __nonnull((1));
+
+/**
+ * Call fn for every entry, prefetching the entries of the next control group while the current one is
+ * visited. fn must not modify the map.
+ * @return true if every entry was visited, false if fn stopped the walk or map is NULL
+ */
+bool HashMap_for_each(const HashMap *map, map_visit_fn fn, void *ctx) __nonnull((1, 2));
+
+HashMapView HashMap_keyset(const HashMap *map) __nonnull((1));
+HashMapView HashMap_values(const HashMap *map) __nonnull((1));
+
+/** @return the next key or value of the view, NULL when done */
+void *HashMapView_next(HashMapView *view) __nonnull((1));
 
 
 #endif //libfaafo_HASHMAP_H
@@ -0,0 +1,106 @@
+//
+// Hash map from keys to lists of values
+//
+#ifndef libfaafo_HASHMULTIMAP_H
+#define libfaafo_HASHMULTIMAP_H
+
+#include <arena.h>
+#include <commons.h>
+#include <hashmap.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** Spill blocks hold 2 << class values, up to 2^31 values for one key */
+#define HASHMULTIMAP_BLOCK_CLASSES 31
+
+/** Called with the values of one key, in the order they were put */
+typedef bool (*multimap_visit_fn)(void *key, void *const *values, size_t count, void *ctx);
+
+/**
+ * The values of one key. The MapEntry comes first, it is what the HashMap stores (its value points back at
+ * the node). A single value lives in the node, values points at it. A second value moves both into a
+ * spill block from the map's arena, which doubles as needed, so the values of a key are always contiguous.
+ */
+typedef struct MultiMapNode {
+    MapEntry entry;
+    void **values;
+    uint32_t count;
+    uint32_t capacity;  /**< 1 while the value is inline, else the size of the spill block */
+    void *first;
+} MultiMapNode;
+
+/**
+ * Map from a key to any number of values, for one to many relations without a list allocation per key.
+ * Nodes and spill blocks come from one arena. Blocks a key grew out of, and nodes of removed keys, go on
+ * free lists for reuse and the arena itself is only given back on clear and destroy.
+ * Not thread safe.
+ */
+typedef struct HashMultiMap {
+    HashMap *map;
+    Arena *arena;
+    MultiMapNode *free_nodes;                           /**< Chained through entry.value */
+    void **free_blocks[HASHMULTIMAP_BLOCK_CLASSES];     /**< Per size class, chained through their first slot */
+    size_t size;                                        /**< Values over all keys */
+    equals_fn value_equals_fn;
+    destructor_fn key_df;
+    destructor_fn value_df;
+} HashMultiMap;
+
+/**
+ * Allocate a new multimap
+ * @param value_equals_fn how remove_value matches values, NULL compares the pointers
+ * @param key_df called on every key the map releases. NULL means free, NOOP for keys owned elsewhere
+ * @param value_df same for values
+ * @return A new multimap on the heap or NULL if errors.
+ */
+HashMultiMap *HashMultiMap_create(hash_fn key_hash_fn, equals_fn key_equals_fn, equals_fn value_equals_fn,
+                                  destructor_fn key_df, destructor_fn value_df) __nonnull((1, 2));
+
+bool HashMultiMap_destroy(HashMultiMap *multimap) __nonnull((1));
+
+/** Remove and release every key and value, the arena is rewound for reuse */
+bool HashMultiMap_clear(HashMultiMap *multimap) __nonnull((1));
+
+/**
+ * Add value to the values of key, after the ones it already has. Like the HashMap entry API, key is only
+ * used for the lookup and a key new to the map is stored as key_copy(key), so an inverted index can look
+ * up with a word on the stack and only copy the words it has not seen. A NULL key_copy stores key itself,
+ * which then belongs to the map.
+ * @return false on errors, value then stays with the caller
+ */
+bool HashMultiMap_put(HashMultiMap *multimap, const void *key, copy_fn key_copy, void *value) __nonnull((1, 2, 4));
+
+/**
+ * The values of key in the order they were put, valid until the next put or remove
+ * @param count set to the number of values, 0 if key is not in the map
+ * @return the values or NULL if key is not in the map
+ */
+void *const *HashMultiMap_get_all(const HashMultiMap *multimap, const void *key, size_t *count)
+__nonnull((1, 2, 3));
+
+/** @return the number of values of key */
+size_t HashMultiMap_count(const HashMultiMap *multimap, const void *key) __nonnull((1, 2));
+
+/**
+ * Remove and release the first value of key that matches value. A key left without values is removed.
+ * @return true if a value was removed
+ */
+bool HashMultiMap_remove_value(HashMultiMap *multimap, const void *key, const void *value) __nonnull((1, 2, 3));
+
+/**
+ * Remove key and release it with all its values
+ * @return the number of values removed
+ */
+size_t HashMultiMap_remove(HashMultiMap *multimap, const void *key) __nonnull((1, 2));
+
+/** @return the number of distinct keys */
+size_t HashMultiMap_key_count(const HashMultiMap *multimap) __nonnull((1));
+
+/**
+ * Call fn for every key with its values, keys in no particular order
+ * @return false if fn stopped the walk
+ */
+bool HashMultiMap_for_each(const HashMultiMap *multimap, multimap_visit_fn fn, void *ctx) __nonnull((1, 2));
+
+#endif //libfaafo_HASHMULTIMAP_H
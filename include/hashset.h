@@ -0,0 +1,110 @@
+//
+// Open addressing hash set
+//
+#ifndef libfaafo_HASHSET_H
+#define libfaafo_HASHSET_H
+
+#include <commons.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define HASHSET_DEFAULT_CAPACITY 16
+
+#define HashSet_is_empty(set) ((set) ? (set)->size == 0 : 0)
+
+/** A member and its hash, stored right in the slot array */
+typedef struct HashSetSlot {
+    void *key;
+    size_t hash;
+} HashSetSlot;
+
+/**
+ * Hash set laid out like a HashMap minus the values: the slots hold the keys and their cached hashes
+ * inline, so a member costs 16 bytes plus a control byte and no allocation of its own. Probing, seeding,
+ * growing and shrinking follow HashMap (same load factors and control bytes), without incremental resizing,
+ * arena mode or tree bins.
+ */
+typedef struct HashSet {
+    HashSetSlot *slots;
+    uint8_t *ctrl;      /**< control bytes, one per slot plus a mirrored tail for wrap free group loads */
+    size_t capacity;
+    size_t size;
+    size_t threshold;
+    size_t shrink_threshold;
+    size_t min_capacity;
+    hash_fn hash_fn;
+    equals_fn equals_fn;
+    destructor_fn df;
+    uint64_t seed;
+} HashSet;
+
+/**
+ * Iterator over the members of a set, set up with HashSet_iter_init. Any add, remove or clear on the set
+ * invalidates it.
+ */
+typedef struct HashSetIterator {
+    const HashSet *set;
+    size_t group;       /**< First slot of the group that pending belongs to */
+    uint32_t pending;   /**< Full slots of that group not returned yet, one bit per slot */
+} HashSetIterator;
+
+/**
+ * Allocate a new set
+ * @param capacity the initial capacity, same rules as for HashMap_create
+ * @param key_df called on every key the set releases. NULL means free, NOOP for keys owned elsewhere
+ * @return A new set on the heap or NULL if errors.
+ */
+HashSet *HashSet_create(size_t capacity, hash_fn hash_fn, equals_fn equals_fn, destructor_fn key_df) __nonnull((2, 3));
+
+bool HashSet_destroy(HashSet *set) __nonnull((1));
+
+/** Remove and release every member, swapping a grown table for one of min_capacity */
+bool HashSet_clear(HashSet *set) __nonnull((1));
+
+/**
+ * Add key to the set, which then owns it
+ * @return true if key was added, false if an equal key is already a member (key stays with the caller)
+ * or on errors
+ */
+bool HashSet_add(HashSet *set, void *key) __nonnull((1, 2));
+
+bool HashSet_contains(const HashSet *set, const void *key) __nonnull((1, 2));
+
+/** @return the member equal to key, NULL if there is none */
+void *HashSet_get(const HashSet *set, const void *key) __nonnull((1, 2));
+
+/** @return true if a member equal to key was removed and released */
+bool HashSet_remove(HashSet *set, const void *key) __nonnull((1, 2));
+
+/*
+ * Bulk operations. set and other must use the same notion of equality, the keys of other are hashed again
+ * with hash_fn of set since every set mixes its hashes with a seed of its own. other is never modified.
+ */
+
+/**
+ * Union, adds every member of other that set does not have
+ * @param key_copy copies the keys of other that are added, NULL shares them (at most one of the sets may
+ * then release them)
+ * @return false if out of memory, set then holds whatever was added up to that point
+ */
+bool HashSet_add_all(HashSet *set, const HashSet *other, copy_fn key_copy) __nonnull((1, 2));
+
+/**
+ * Intersection, removes and releases every member that is not in other
+ * @return number of members removed
+ */
+size_t HashSet_retain_all(HashSet *set, const HashSet *other) __nonnull((1, 2));
+
+/**
+ * Difference, removes and releases every member that is in other. Walks whichever of the two sets is smaller.
+ * @return number of members removed
+ */
+size_t HashSet_remove_all(HashSet *set, const HashSet *other) __nonnull((1, 2));
+
+void HashSet_iter_init(const HashSet *set, HashSetIterator *it) __nonnull((1, 2));
+
+/** @return the next member or NULL when all members have been returned */
+void *HashSet_iter_next(HashSetIterator *it) __nonnull((1));
+
+#endif //libfaafo_HASHSET_H
@@ -0,0 +1,137 @@
+//
+// Append only log structured key-value store on disk, Bitcask style
+//
+#ifndef libfaafo_KVSTORE_H
+#define libfaafo_KVSTORE_H
+
+#include <bstrlib.h>
+#include <hashmap.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define KVSTORE_DEFAULT_SEGMENT_SIZE ((uint64_t) 64 << 20)
+
+/** crc | key_len | value_len | seq, the fixed part in front of every record of a data file */
+#define KVSTORE_HEADER_SIZE 20
+/** seq | offset | key_len | value_len, the fixed part in front of every record of a hint file */
+#define KVSTORE_HINT_HEADER_SIZE 24
+/** value_len of a record that deletes its key */
+#define KVSTORE_TOMBSTONE UINT32_MAX
+
+/** One data file of the store, "<id>.data" in the store's directory with the id zero padded to 10 digits */
+typedef struct KVSegment {
+    uint32_t id;
+    int fd;
+    uint64_t size;      /**< Bytes of whole records, appends go here */
+} KVSegment;
+
+/**
+ * Where the latest value of a key lives. The MapEntry comes first, it is what the keydir stores (its key
+ * points at the key below, its value back at the entry), and the key bytes follow the entry in the same
+ * allocation.
+ */
+typedef struct KVEntry {
+    MapEntry entry;
+    KVSegment *segment;
+    uint64_t offset;        /**< Of the record in the segment */
+    uint64_t seq;
+    uint32_t value_len;     /**< KVSTORE_TOMBSTONE only while the store is being opened */
+    struct tagbstring key;
+    unsigned char key_data[];
+} KVEntry;
+
+/**
+ * Records are appended to the active segment, a new one is started once it reaches max_segment_size. Every
+ * record is
+ *   crc32c | key_len | value_len | seq | key | value
+ * in native byte order, the CRC-32C covers everything after itself. A remove appends a tombstone, a record
+ * without value. The sequence number grows with every write, so the newest record of a key wins however
+ * its segments got reordered by merges.
+ *
+ * The keydir, a HashMap of every live key, says where the newest record of each key is. A get is one
+ * lookup and one pread of the whole record, a put one write of the whole record. Opening a store rebuilds
+ * the keydir by scanning the data files, or from the hint file next to a data file if there is one. Hint
+ * files hold the keys and record positions without the values and are written for the output of merges.
+ *
+ * KVStore_merge rewrites every segment but the active one, dropping overwritten records and tombstones.
+ * It can run on a thread of its own while the store is in use, gets and writes are only held up while the
+ * keydir is pointed at the new segments at the end.
+ *
+ * Safe for concurrent use from any number of threads within one process. Nothing stops two processes from
+ * opening the same directory, which corrupts the store.
+ */
+typedef struct KVStore {
+    HashMap *keydir;
+    KVSegment **segments;       /**< Sorted by id, the active segment is not always the last one */
+    size_t segment_count;
+    size_t segment_capacity;
+    KVSegment *active;
+    bstring dir;
+    uint64_t max_segment_size;
+    uint64_t seq;               /**< Sequence number of the next write */
+    uint32_t next_id;
+    pthread_rwlock_t lock;      /**< Read for gets, write for anything that changes the keydir or segments */
+    pthread_mutex_t merge_lock;
+} KVStore;
+
+/**
+ * Open the store in dir, creating the directory if needed. Any number of data files left by an earlier
+ * run are loaded, records after the first one that fails its CRC check in a file are ignored with a
+ * warning, as a write torn by a crash leaves them. Writes always go to a new segment.
+ * @param max_segment_size size at which the active segment is rolled over, 0 means
+ * KVSTORE_DEFAULT_SEGMENT_SIZE. A record bigger than that gets a segment to itself.
+ * @return the store or NULL if dir can't be created or read
+ */
+KVStore *KVStore_open(const char *dir, uint64_t max_segment_size) __nonnull((1));
+
+/**
+ * Sync and close the store, removing the active segment if nothing was written to it. No other thread may
+ * be using the store, a running merge included.
+ */
+bool KVStore_close(KVStore *store) __nonnull((1));
+
+/**
+ * Set key to value. The record is written with one write call, but only reaches the disk when the
+ * operating system gets to it or on the next KVStore_sync.
+ * @return false on errors, the store is then unchanged
+ */
+bool KVStore_put(KVStore *store, const void *key, size_t key_len, const void *value, size_t value_len)
+__nonnull((1, 2));
+
+/**
+ * Read the value of key with one pread, checking the CRC of its record
+ * @return a new bstring the caller frees with bdestroy, NULL if key is not in the store or its record is
+ * damaged
+ */
+bstring KVStore_get(KVStore *store, const void *key, size_t key_len) __nonnull((1, 2));
+
+bool KVStore_contains(KVStore *store, const void *key, size_t key_len) __nonnull((1, 2));
+
+/**
+ * Remove key by appending a tombstone
+ * @return true if key was in the store and the tombstone was written
+ */
+bool KVStore_remove(KVStore *store, const void *key, size_t key_len) __nonnull((1, 2));
+
+/** fsync the active segment, every put and remove before this call survives a crash after it */
+bool KVStore_sync(KVStore *store) __nonnull((1));
+
+/** @return the number of keys in the store */
+size_t KVStore_size(KVStore *store) __nonnull((1));
+
+/**
+ * Copy the live records of every segment but the active one to new segments, write a hint file for each
+ * and delete the old segments. Merges are serialized, a second call waits for the first to finish.
+ * The new segments are synced before the old ones are removed, a crash at any point loses nothing.
+ * @return false on errors, the old segments are then left as they were
+ */
+bool KVStore_merge(KVStore *store) __nonnull((1));
+
+#define KVStore_put_bstring(store, key, value) \
+    KVStore_put(store, (key)->data, (size_t) (key)->slen, (value)->data, (size_t) (value)->slen)
+#define KVStore_get_bstring(store, key) KVStore_get(store, (key)->data, (size_t) (key)->slen)
+#define KVStore_remove_bstring(store, key) KVStore_remove(store, (key)->data, (size_t) (key)->slen)
+
+#endif //libfaafo_KVSTORE_H
@@ -0,0 +1,96 @@
+//
+// Read only HashMap snapshots saved to disk and memory mapped back in
+//
+#ifndef libfaafo_MAPPEDMAP_H
+#define libfaafo_MAPPEDMAP_H
+
+#include <hashmap.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define MAPPEDMAP_MAGIC "FAAFOMAP"
+#define MAPPEDMAP_VERSION 1
+
+/** Turns keys or values into bytes for HashMap_save */
+typedef struct MapCodec {
+    size_t (*encoded_size)(const void *item);
+    /** Write exactly encoded_size(item) bytes to out */
+    void (*encode)(const void *item, void *out);
+} MapCodec;
+
+/** NUL terminated strings, the terminator is stored too so mapped values can be used as C strings */
+extern const MapCodec MapCodec_cstr;
+/** bstrings, the string data without terminator */
+extern const MapCodec MapCodec_bstring;
+/** Native int */
+extern const MapCodec MapCodec_int;
+/** Native int64_t */
+extern const MapCodec MapCodec_int64;
+
+/**
+ * File layout, everything in native byte order and position independent:
+ *   header    MappedMapHeader
+ *   slots     capacity MappedMapSlot, linear probing on hash & (capacity - 1), offset 0 marks an empty slot
+ *   records   one per entry at an 8 byte aligned offset: uint32_t key_len, uint32_t value_len, value, key
+ * Values come right after the 8 byte record header so fixed size values can be read in place.
+ */
+typedef struct MappedMapHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t capacity;
+    uint64_t size;
+    uint64_t slots_offset;
+    uint64_t records_offset;
+    uint64_t file_size;
+    uint64_t reserved;
+} MappedMapHeader;
+
+typedef struct MappedMapSlot {
+    uint64_t hash;      /**< Commons_hash_bytes of the encoded key, seed 0 */
+    uint64_t offset;    /**< Offset of the record from the start of the file */
+} MappedMapSlot;
+
+/** A saved map mapped into memory. Lookups run against the mapping, pages are shared between processes */
+typedef struct MappedMap {
+    const uint8_t *base;
+    size_t length;
+    const MappedMapSlot *slots;
+    size_t capacity;
+    size_t size;
+} MappedMap;
+
+/**
+ * Write every entry of map to path in the mapped layout. The file is written next to path and renamed
+ * over it, so readers never see a half written file.
+ * Lookups in the saved file hash the encoded key bytes, so they work in any process, whatever hash_fn the
+ * map was built with.
+ * @return true on success
+ */
+bool HashMap_save(const HashMap *map, const char *path, const MapCodec *key_codec, const MapCodec *value_codec)
+__nonnull((1, 2, 3, 4));
+
+/**
+ * Map a file written by HashMap_save. Nothing is read or decoded up front, pages are loaded on first use.
+ * @return the mapped map or NULL if the file can't be mapped or is not a valid map file
+ */
+MappedMap *HashMap_open_mapped(const char *path) __nonnull((1));
+
+/**
+ * Look up an encoded key
+ * @param value_len set to the length of the value if found, may be NULL
+ * @return pointer to the value inside the mapping, 8 byte aligned, or NULL if key is not in the map
+ */
+const void *MappedMap_get(const MappedMap *map, const void *key, size_t key_len, size_t *value_len)
+__nonnull((1, 2));
+
+/** Encode key with codec and look it up, see MappedMap_get */
+const void *MappedMap_get_with(const MappedMap *map, const void *key, const MapCodec *codec, size_t *value_len)
+__nonnull((1, 2, 3));
+
+size_t MappedMap_size(const MappedMap *map) __nonnull((1));
+
+bool MappedMap_close(MappedMap *map) __nonnull((1));
+
+#endif //libfaafo_MAPPEDMAP_H
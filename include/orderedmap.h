@@ -0,0 +1,82 @@
+//
+// Insertion ordered hash map, a dense entry array indexed by a sparse table of small offsets
+//
+#ifndef libfaafo_ORDEREDMAP_H
+#define libfaafo_ORDEREDMAP_H
+
+#include <commons.h>
+#include <hashmap.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define ORDEREDMAP_DEFAULT_CAPACITY 16
+
+#define OrderedMap_is_empty(map) ((map) ? (map)->size == 0 : 0)
+
+/**
+ * Hash map that remembers the order keys were first put in. The entries sit in one array in that order
+ * and the hash table only holds offsets into it, each 1, 2, 4 or 8 bytes wide depending on how many
+ * entries the array has room for. A small map costs 24 bytes per entry plus a byte or two per index slot,
+ * and iterating is a linear scan that gives the same order however the table was resized.
+ *
+ * Removing a key leaves a hole in the array that iteration skips. Holes are squeezed out whenever the
+ * table is rebuilt, which happens when the array runs out of room or the map shrinks. Putting a new value
+ * for a key that is already in the map keeps its position.
+ */
+typedef struct OrderedMap {
+    MapEntry *entries;  /**< In insertion order, a removed entry has a NULL key */
+    size_t used;        /**< Entries taken in the array, holes included */
+    size_t size;
+    void *index;        /**< capacity offsets, 0 for an empty slot and i + 1 for entries[i] */
+    uint8_t index_width;
+    size_t capacity;    /**< Slots in the index, the array has room for capacity * HASHMAP_LOAD_FACTOR entries */
+    size_t min_capacity;
+    hash_fn hash_fn;
+    equals_fn equals_fn;
+    destructor_fn df;
+    uint64_t seed;
+} OrderedMap;
+
+/**
+ * Allocate a new map
+ * @param capacity the initial capacity, same rules as for HashMap_create
+ * @param df called on the MapEntry of every entry the map releases, to release its key and value. It must
+ * not free the MapEntry, which lives in the map's array. NULL frees the key and the value, NOOP leaves them alone.
+ * @return A new map on the heap or NULL if errors.
+ */
+OrderedMap *OrderedMap_create(size_t capacity, hash_fn hash_fn, equals_fn equals_fn, destructor_fn df)
+__nonnull((2, 3));
+
+bool OrderedMap_destroy(OrderedMap *map) __nonnull((1));
+
+/** Remove and release every entry, swapping a grown table for one of min_capacity */
+bool OrderedMap_clear(OrderedMap *map) __nonnull((1));
+
+/**
+ * Same ownership rules as HashMap_put. A new key goes after every key already in the map.
+ * @return the value key had before, now the caller's, NULL if key is new or on errors
+ */
+void *OrderedMap_put(OrderedMap *map, void *key, void *value) __nonnull((1, 2, 3));
+
+void *OrderedMap_get(const OrderedMap *map, const void *key) __nonnull((1, 2));
+
+bool OrderedMap_contains(const OrderedMap *map, const void *key) __nonnull((1, 2));
+
+/** @return true if key was in the map, its entry is then released */
+bool OrderedMap_remove(OrderedMap *map, const void *key) __nonnull((1, 2));
+
+/**
+ * Call fn for every entry in insertion order
+ * @return false if fn stopped the walk
+ */
+bool OrderedMap_for_each(const OrderedMap *map, map_visit_fn fn, void *ctx) __nonnull((1, 2));
+
+/**
+ * Step through the entries in insertion order, starting with *cursor = 0. Any put of a new key, remove or
+ * clear invalidates the cursor.
+ * @return false once every entry has been returned
+ */
+bool OrderedMap_next(const OrderedMap *map, size_t *cursor, void **key, void **value) __nonnull((1, 2));
+
+#endif //libfaafo_ORDEREDMAP_H
@@ -0,0 +1,105 @@
+//
+// Persistent hash map, a hash array mapped trie whose versions share their unchanged nodes
+//
+#ifndef libfaafo_PERSISTENTMAP_H
+#define libfaafo_PERSISTENTMAP_H
+
+#include <commons.h>
+#include <hashmap.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define PERSISTENTMAP_BITS 5
+#define PERSISTENTMAP_FANOUT (1 << PERSISTENTMAP_BITS)
+
+typedef enum PersistentNodeKind {
+    PERSISTENT_BRANCH,
+    PERSISTENT_LEAF,
+    PERSISTENT_COLLISION    /**< Leaves whose 64 bit hashes are all equal */
+} PersistentNodeKind;
+
+/** Header shared by every node. Nodes never change once built and are freed when refs drops to 0. */
+typedef struct PersistentNode {
+    size_t refs;        /**< Versions and parent nodes pointing at the node, updated atomically */
+    uint32_t bitmap;    /**< Branch only, bit i set when the child for hash digit i is present */
+    uint8_t kind;
+    uint16_t count;     /**< Children of a branch, leaves of a collision node */
+} PersistentNode;
+
+/**
+ * Branch and collision node. A branch only stores the children that exist, child for digit i is at index
+ * popcount(bitmap & ((1 << i) - 1)), so a sparse branch costs a word per child rather than FANOUT words.
+ */
+typedef struct PersistentBranch {
+    PersistentNode node;
+    PersistentNode *children[];
+} PersistentBranch;
+
+typedef struct PersistentLeaf {
+    PersistentNode node;
+    MapEntry entry;
+} PersistentLeaf;
+
+/**
+ * One version of a persistent map. Versions are immutable: PersistentMap_assoc and PersistentMap_dissoc
+ * return a new version that shares every node off the path to the changed key with the version it was
+ * made from, so an update copies O(log32 n) nodes and keeping an old version around costs nothing.
+ *
+ * Nodes and versions are reference counted with atomic operations, any thread may read or release a
+ * version while other threads derive new ones from it.
+ */
+typedef struct PersistentMap {
+    size_t refs;
+    PersistentNode *root;   /**< NULL for the empty map */
+    size_t size;
+    hash_fn hash_fn;
+    equals_fn equals_fn;
+    destructor_fn df;
+    uint64_t seed;          /**< Mixed into every hash, shared by all versions derived from one empty map */
+} PersistentMap;
+
+/**
+ * Allocate a new empty map
+ * @param df called on the MapEntry of a leaf once no version uses it any more, to release its key and
+ * value. It must not free the MapEntry. NULL frees the key and the value, NOOP leaves them alone.
+ * @return A new version on the heap or NULL if errors.
+ */
+PersistentMap *PersistentMap_create(hash_fn hash_fn, equals_fn equals_fn, destructor_fn df) __nonnull((1, 2));
+
+/** Take another reference to map, an O(1) snapshot. @return map */
+PersistentMap *PersistentMap_retain(PersistentMap *map) __nonnull((1));
+
+/** Drop a reference to map, freeing it and every node no other version uses once it was the last one */
+bool PersistentMap_release(PersistentMap *map) __nonnull((1));
+
+/** @return the value for key or NULL if there is none */
+void *PersistentMap_get(const PersistentMap *map, const void *key) __nonnull((1, 2));
+
+bool PersistentMap_contains(const PersistentMap *map, const void *key) __nonnull((1, 2));
+
+/**
+ * A new version with value for key, map itself is unchanged. key and value belong to the new leaf and are
+ * released through df with it, so with a df that frees they must not be pointers some other leaf holds,
+ * even when replacing the value of a key that is already in the map.
+ * @return the new version, to be released by the caller, or NULL if out of memory (key and value then
+ * stay with the caller)
+ */
+PersistentMap *PersistentMap_assoc(PersistentMap *map, void *key, void *value) __nonnull((1, 2, 3));
+
+/**
+ * A new version without key, map itself is unchanged
+ * @return the new version, or map retained again if key is not in it, to be released by the caller. NULL
+ * if out of memory.
+ */
+PersistentMap *PersistentMap_dissoc(PersistentMap *map, const void *key) __nonnull((1, 2));
+
+size_t PersistentMap_size(const PersistentMap *map) __nonnull((1));
+
+/**
+ * Call fn for every entry, in no particular order
+ * @return false if fn stopped the walk
+ */
+bool PersistentMap_for_each(const PersistentMap *map, map_visit_fn fn, void *ctx) __nonnull((1, 2));
+
+#endif //libfaafo_PERSISTENTMAP_H
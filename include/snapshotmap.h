@@ -0,0 +1,90 @@
+//
+// Read mostly HashMap with lock free readers
+//
+#ifndef libfaafo_SNAPSHOTMAP_H
+#define libfaafo_SNAPSHOTMAP_H
+
+#include <hashmap.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define SNAPSHOTMAP_CACHE_LINE 64
+
+/**
+ * Per thread reader registration. A reader only ever writes its own slot, which sits on a cache line of
+ * its own, so readers never bounce a line between cores.
+ */
+typedef struct SnapshotReader {
+    uint64_t epoch;     /**< Global epoch seen when the read section was entered, 0 outside of one */
+    bool in_use;
+} __attribute__((aligned(SNAPSHOTMAP_CACHE_LINE))) SnapshotReader;
+
+/** A table version or entry replaced by a writer, freed once no reader can still be looking at it */
+typedef struct SnapshotRetired {
+    struct SnapshotRetired *next;
+    HashMap *table;     /**< Old version of the table, entries shared with newer versions are not freed */
+    MapEntry *entry;    /**< Entry that was replaced or removed, NULL if none */
+    uint64_t epoch;     /**< Safe to free once every active reader entered at or after this epoch */
+} SnapshotRetired;
+
+/**
+ * Readers look up keys in an immutable published table without taking any lock. Writers serialize on a
+ * mutex, copy the table, apply their change to the copy and publish it with one atomic store. Old tables
+ * and replaced entries are reclaimed with epoch based reclamation, entries through the map's destructor.
+ * Every write copies the table, so this is meant for maps that are read far more often than written.
+ */
+typedef struct SnapshotMap {
+    HashMap *current;           /**< The published table */
+    uint64_t epoch;             /**< Bumped by every publish */
+    SnapshotReader *readers;
+    size_t max_readers;
+    SnapshotRetired *retired;
+    pthread_mutex_t write_lock;
+    destructor_fn df;
+} SnapshotMap;
+
+/**
+ * Allocate a new snapshot map
+ * @param capacity the initial capacity, same rules as HashMap_create
+ * @param max_readers number of reader threads that can be registered at the same time
+ * @param hash_fn the hashing function to apply for the MapEntry value types. Cannot be NULL
+ * @param equals_fn the equals function to use when comparing MapEntry values to find a match. Must not be null
+ * @param map_entry_df the destroy function to apply to the MapEntries in the map, see HashMap_create
+ * @return A new map on the heap or NULL if errors.
+ */
+SnapshotMap *SnapshotMap_create(size_t capacity, size_t max_readers, hash_fn hash_fn, equals_fn equals_fn,
+                                destructor_fn map_entry_df) __nonnull((3, 4));
+
+/** Claim a reader slot for the calling thread, NULL if all max_readers slots are taken */
+SnapshotReader *SnapshotMap_register_reader(SnapshotMap *map) __nonnull((1));
+
+void SnapshotMap_unregister_reader(SnapshotMap *map, SnapshotReader *reader) __nonnull((1, 2));
+
+/** Start a read section. Values returned by SnapshotMap_get stay valid until SnapshotMap_exit */
+void SnapshotMap_enter(SnapshotMap *map, SnapshotReader *reader) __nonnull((1, 2));
+
+void SnapshotMap_exit(SnapshotReader *reader) __nonnull((1));
+
+/** Lock free lookup, must be called inside a read section */
+void *SnapshotMap_get(const SnapshotMap *map, const void *key) __nonnull((1, 2));
+
+/**
+ * Publish a new version with key associated with value. A replaced entry is destroyed with the map's
+ * destructor once no reader can see it anymore, key and value are owned by the map from here on.
+ * @return true on success
+ */
+bool SnapshotMap_put(SnapshotMap *map, void *key, void *value) __nonnull((1, 2, 3));
+
+/** Publish a new version without key. @return true if key was in the map */
+bool SnapshotMap_remove(SnapshotMap *map, const void *key) __nonnull((1, 2));
+
+size_t SnapshotMap_size(const SnapshotMap *map) __nonnull((1));
+
+/** Free whatever retired versions no reader can see anymore. Writers do this on every publish */
+void SnapshotMap_reclaim(SnapshotMap *map) __nonnull((1));
+
+/** Destroy the map, no reader may be inside a read section */
+bool SnapshotMap_destroy(SnapshotMap *map) __nonnull((1));
+
+#endif //libfaafo_SNAPSHOTMAP_H
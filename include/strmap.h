@@ -0,0 +1,99 @@
+//
+// Open addressing hash map specialized for string keys
+//
+#ifndef libfaafo_STRMAP_H
+#define libfaafo_STRMAP_H
+
+#include <arena.h>
+#include <bstrlib.h>
+#include <commons.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define STRMAP_DEFAULT_CAPACITY 16
+/** Keys up to this many bytes are stored in the slot itself */
+#define STRMAP_INLINE_KEY 24
+
+#define StrMap_is_empty(map) ((map) ? (map)->size == 0 : 0)
+
+/* bstring versions of the lookups, the map never keeps a reference to b */
+#define StrMap_get_bstring(map, b) StrMap_get((map), (const char *) (b)->data, (size_t) blength(b))
+#define StrMap_contains_bstring(map, b) StrMap_contains((map), (const char *) (b)->data, (size_t) blength(b))
+#define StrMap_put_bstring(map, b, value) StrMap_put((map), (const char *) (b)->data, (size_t) blength(b), (value))
+#define StrMap_remove_bstring(map, b) StrMap_remove((map), (const char *) (b)->data, (size_t) blength(b))
+
+/** Short keys are zero padded to the full width, so two of them compare equal exactly when all bytes do */
+typedef union StrMapKey {
+    char bytes[STRMAP_INLINE_KEY];
+    char *data;     /**< Keys longer than STRMAP_INLINE_KEY, copied into the map's arena */
+} StrMapKey;
+
+/** 48 bytes, a probe that matches the tag finds hash, length and a short key on the same cache line */
+typedef struct StrMapSlot {
+    size_t hash;
+    uint32_t len;
+    StrMapKey key;
+    void *value;
+} StrMapSlot;
+
+/**
+ * Hash map from byte strings to values, laid out like HashSet: slots inline in one array next to the
+ * control bytes, linear probing by groups and backward shift deletion, with the same load factors.
+ *
+ * The map owns copies of its keys. Short keys live in the slot, so a lookup that hits compares the cached
+ * hash, the length and the padded key without following a single pointer. Longer keys are copied into an
+ * arena, the space of removed ones is given back once more than half of the arena is dead, and on clear.
+ * Lookups take a pointer and a length, no bstring or NUL terminator needed.
+ */
+typedef struct StrMap {
+    StrMapSlot *slots;
+    uint8_t *ctrl;          /**< control bytes, one per slot plus a mirrored tail for wrap free group loads */
+    size_t capacity;
+    size_t size;
+    size_t threshold;
+    size_t shrink_threshold;
+    size_t min_capacity;
+    Arena *keys;            /**< Long keys, created on first use */
+    size_t dead_key_bytes;  /**< Bytes in keys taken by long keys that were removed */
+    destructor_fn df;
+    uint64_t seed;
+} StrMap;
+
+/** Called with each entry, key is not NUL terminated and only valid until the map is modified */
+typedef bool (*strmap_visit_fn)(const char *key, size_t len, void *value, void *ctx);
+
+/**
+ * Allocate a new map
+ * @param capacity the initial capacity, same rules as for HashMap_create
+ * @param value_df called on every value the map releases. NULL means free, NOOP for values owned elsewhere
+ * @return A new map on the heap or NULL if errors.
+ */
+StrMap *StrMap_create(size_t capacity, destructor_fn value_df);
+
+bool StrMap_destroy(StrMap *map) __nonnull((1));
+
+/** Remove every entry and release the values, swapping a grown table for one of min_capacity */
+bool StrMap_clear(StrMap *map) __nonnull((1));
+
+/**
+ * Map the len bytes at key to value. The key is copied, value belongs to the map.
+ * @return the value key had before, now the caller's, NULL if key is new or on errors
+ */
+void *StrMap_put(StrMap *map, const char *key, size_t len, void *value) __nonnull((1, 4));
+
+/** @return the value for the len bytes at key, NULL if there is none */
+void *StrMap_get(const StrMap *map, const char *key, size_t len) __nonnull((1));
+
+bool StrMap_contains(const StrMap *map, const char *key, size_t len) __nonnull((1));
+
+/** @return true if key was in the map, its value is then released */
+bool StrMap_remove(StrMap *map, const char *key, size_t len) __nonnull((1));
+
+/**
+ * Call fn for every entry, in no particular order
+ * @return false if fn stopped the walk
+ */
+bool StrMap_for_each(const StrMap *map, strmap_visit_fn fn, void *ctx) __nonnull((1, 2));
+
+#endif //libfaafo_STRMAP_H
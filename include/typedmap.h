@@ -0,0 +1,241 @@
+//
+// Type specialized hash maps generated at compile time.
+//
+// HASHMAP_DECLARE(Name, K, V, hash, eq) emits a map type Name with keys and values stored inline in the table
+// and the hash and equality functions called directly, so the compiler can inline them into every probe.
+// There is no void *, no allocation per entry and no function pointer call. K and V can be any type that
+// can be copied with assignment.
+//
+// The layout follows HashMap: a flat array of slots next to one control byte per slot (empty, or full plus
+// 7 bits of the hash), linear probing and backward shift deletion. hash is used as is, the low bits pick the
+// home slot and the top bits become the control tag, so it must spread its input over the whole word, e.g.
+// Commons_hash_u64 or Commons_hash_bytes.
+//
+// Example:
+//     static inline size_t hash_u64(const uint64_t key) { return Commons_hash_u64(key); }
+//     static inline bool eq_u64(const uint64_t a, const uint64_t b) { return a == b; }
+//     HASHMAP_DECLARE(IntMap, uint64_t, uint32_t, hash_u64, eq_u64)
+//
+//     IntMap *map = IntMap_create(0);
+//     IntMap_put(map, 42, 7);
+//     uint32_t *value = IntMap_get(map, 42);
+//
+#ifndef libfaafo_TYPEDMAP_H
+#define libfaafo_TYPEDMAP_H
+
+#include <commons.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TYPEDMAP_MIN_CAPACITY 16
+#define TYPEDMAP_CTRL_EMPTY ((uint8_t) 0x00)
+
+/** Full control byte for a hash, the top 7 bits of the hash with the full bit set */
+#define TypedMap_tag(hash) ((uint8_t) (0x80 | ((size_t) (hash) >> (sizeof(size_t) * 8 - 7))))
+
+/** Grow once more than 3/4 of the slots are in use, same as HASHMAP_LOAD_FACTOR */
+#define TypedMap_threshold(capacity) ((capacity) - (capacity) / 4)
+
+/*
+ * Functions:
+ *   Name *Name_create(size_t capacity)                   capacity rounded up to a power of 2, 0 for the default
+ *   void Name_destroy(Name *map)
+ *   void Name_clear(Name *map)                           keeps the capacity
+ *   size_t Name_size(const Name *map)
+ *   V *Name_get(const Name *map, K key)                  NULL if absent, valid until the next put or remove
+ *   bool Name_contains(const Name *map, K key)
+ *   V *Name_entry(Name *map, K key, bool *inserted)      slot for key, inserted zeroed if absent, NULL if out of memory
+ *   bool Name_put(Name *map, K key, V value)             insert or replace, false if out of memory
+ *   bool Name_remove(Name *map, K key, V *out_value)     out_value may be NULL
+ *   bool Name_next(const Name *map, size_t *cursor, K *key, V *value)
+ *                                                        iterate from *cursor = 0 until it returns false
+ */
+#define HASHMAP_DECLARE(Name, K, V, hash, eq)                                                                          \
+typedef struct Name##Slot {                                                                                            \
+    K key;                                                                                                             \
+    V value;                                                                                                           \
+} Name##Slot;                                                                                                          \
+                                                                                                                       \
+typedef struct Name {                                                                                                  \
+    Name##Slot *slots;                                                                                                 \
+    uint8_t *ctrl;          /* shares the allocation with slots */                                                     \
+    size_t capacity;                                                                                                   \
+    size_t size;                                                                                                       \
+    size_t threshold;                                                                                                  \
+} Name;                                                                                                                \
+                                                                                                                       \
+static inline bool Name##_allocate_table_(Name *map, const size_t capacity) {                                          \
+    if (capacity > SIZE_MAX / (sizeof(Name##Slot) + 1)) {                                                              \
+        return false;                                                                                                  \
+    }                                                                                                                  \
+    /* Slots first so they get malloc's alignment, control bytes right behind them */                                  \
+    Name##Slot *slots = calloc(1, capacity * sizeof(Name##Slot) + capacity);                                           \
+    if (!slots) {                                                                                                      \
+        return false;                                                                                                  \
+    }                                                                                                                  \
+    map->slots = slots;                                                                                                \
+    map->ctrl = (uint8_t *) (slots + capacity);                                                                        \
+    map->capacity = capacity;                                                                                          \
+    map->threshold = TypedMap_threshold(capacity);                                                                     \
+    return true;                                                                                                       \
+}                                                                                                                      \
+                                                                                                                       \
+static inline Name *Name##_create(size_t capacity) {                                                                   \
+    size_t rounded = TYPEDMAP_MIN_CAPACITY;                                                                            \
+    while (rounded < capacity) {                                                                                       \
+        if (Commons_will_overflow(rounded, 2, &rounded)) {                                                             \
+            return NULL;                                                                                               \
+        }                                                                                                              \
+    }                                                                                                                  \
+    Name *map = calloc(1, sizeof(Name));                                                                               \
+    if (map && !Name##_allocate_table_(map, rounded)) {                                                                \
+        free(map);                                                                                                     \
+        return NULL;                                                                                                   \
+    }                                                                                                                  \
+    return map;                                                                                                        \
+}                                                                                                                      \
+                                                                                                                       \
+static inline void Name##_destroy(Name *map) {                                                                         \
+    if (map) {                                                                                                         \
+        free(map->slots);                                                                                              \
+        free(map);                                                                                                     \
+    }                                                                                                                  \
+}                                                                                                                      \
+                                                                                                                       \
+static inline void Name##_clear(Name *const map) {                                                                     \
+    memset(map->ctrl, TYPEDMAP_CTRL_EMPTY, map->capacity);                                                             \
+    map->size = 0;                                                                                                     \
+}                                                                                                                      \
+                                                                                                                       \
+static inline size_t Name##_size(const Name *const map) {                                                              \
+    return map->size;                                                                                                  \
+}                                                                                                                      \
+                                                                                                                       \
+/* Index of key, or of the empty slot that ends its probe run when it is absent */                                     \
+static inline size_t Name##_find_(const Name *const map, const K key, const size_t h, bool *found) {                   \
+    const size_t mask = map->capacity - 1;                                                                             \
+    const uint8_t tag = TypedMap_tag(h);                                                                               \
+    for (size_t i = h & mask;; i = (i + 1) & mask) {                                                                   \
+        const uint8_t ctrl = map->ctrl[i];                                                                             \
+        if (ctrl == TYPEDMAP_CTRL_EMPTY) {                                                                             \
+            *found = false;                                                                                            \
+            return i;                                                                                                  \
+        }                                                                                                              \
+        if (ctrl == tag && eq(map->slots[i].key, key)) {                                                               \
+            *found = true;                                                                                             \
+            return i;                                                                                                  \
+        }                                                                                                              \
+    }                                                                                                                  \
+}                                                                                                                      \
+                                                                                                                       \
+static inline V *Name##_get(const Name *const map, const K key) {                                                      \
+    bool found;                                                                                                        \
+    const size_t i = Name##_find_(map, key, (size_t) hash(key), &found);                                               \
+    return found ? &map->slots[i].value : NULL;                                                                        \
+}                                                                                                                      \
+                                                                                                                       \
+static inline bool Name##_contains(const Name *const map, const K key) {                                               \
+    return Name##_get(map, key) != NULL;                                                                               \
+}                                                                                                                      \
+                                                                                                                       \
+static inline bool Name##_grow_(Name *const map) {                                                                     \
+    Name old = *map;                                                                                                   \
+    size_t new_capacity;                                                                                               \
+    if (Commons_will_overflow(old.capacity, 2, &new_capacity) || !Name##_allocate_table_(map, new_capacity)) {         \
+        *map = old;                                                                                                    \
+        return false;                                                                                                  \
+    }                                                                                                                  \
+    const size_t mask = map->capacity - 1;                                                                             \
+    for (size_t j = 0; j < old.capacity; j++) {                                                                        \
+        if (old.ctrl[j] == TYPEDMAP_CTRL_EMPTY) {                                                                      \
+            continue;                                                                                                  \
+        }                                                                                                              \
+        const size_t h = (size_t) hash(old.slots[j].key);                                                              \
+        size_t i = h & mask;                                                                                           \
+        while (map->ctrl[i] != TYPEDMAP_CTRL_EMPTY) {                                                                  \
+            i = (i + 1) & mask;                                                                                        \
+        }                                                                                                              \
+        map->ctrl[i] = old.ctrl[j];                                                                                    \
+        map->slots[i] = old.slots[j];                                                                                  \
+    }                                                                                                                  \
+    free(old.slots);                                                                                                   \
+    return true;                                                                                                       \
+}                                                                                                                      \
+                                                                                                                       \
+static inline V *Name##_entry(Name *const map, const K key, bool *const inserted) {                                    \
+    const size_t h = (size_t) hash(key);                                                                               \
+    bool found;                                                                                                        \
+    size_t i = Name##_find_(map, key, h, &found);                                                                      \
+    if (found) {                                                                                                       \
+        *inserted = false;                                                                                             \
+        return &map->slots[i].value;                                                                                   \
+    }                                                                                                                  \
+    if (map->size >= map->threshold) {                                                                                 \
+        if (!Name##_grow_(map)) {                                                                                      \
+            return NULL;                                                                                               \
+        }                                                                                                              \
+        i = Name##_find_(map, key, h, &found);                                                                         \
+    }                                                                                                                  \
+    map->ctrl[i] = TypedMap_tag(h);                                                                                    \
+    map->slots[i].key = key;                                                                                           \
+    memset(&map->slots[i].value, 0, sizeof(V));                                                                        \
+    map->size++;                                                                                                       \
+    *inserted = true;                                                                                                  \
+    return &map->slots[i].value;                                                                                       \
+}                                                                                                                      \
+                                                                                                                       \
+static inline bool Name##_put(Name *const map, const K key, const V value) {                                           \
+    bool inserted;                                                                                                     \
+    V *slot = Name##_entry(map, key, &inserted);                                                                       \
+    if (!slot) {                                                                                                       \
+        return false;                                                                                                  \
+    }                                                                                                                  \
+    *slot = value;                                                                                                     \
+    return true;                                                                                                       \
+}                                                                                                                      \
+                                                                                                                       \
+static inline bool Name##_remove(Name *const map, const K key, V *const out_value) {                                   \
+    bool found;                                                                                                        \
+    size_t hole = Name##_find_(map, key, (size_t) hash(key), &found);                                                  \
+    if (!found) {                                                                                                      \
+        return false;                                                                                                  \
+    }                                                                                                                  \
+    if (out_value) {                                                                                                   \
+        *out_value = map->slots[hole].value;                                                                           \
+    }                                                                                                                  \
+    /* Backward shift: pull later entries of the run into the hole unless that moves them before their home */         \
+    const size_t mask = map->capacity - 1;                                                                             \
+    for (size_t i = (hole + 1) & mask; map->ctrl[i] != TYPEDMAP_CTRL_EMPTY; i = (i + 1) & mask) {                      \
+        const size_t home = (size_t) hash(map->slots[i].key) & mask;                                                   \
+        if (((i - home) & mask) >= ((i - hole) & mask)) {                                                              \
+            map->slots[hole] = map->slots[i];                                                                          \
+            map->ctrl[hole] = map->ctrl[i];                                                                            \
+            hole = i;                                                                                                  \
+        }                                                                                                              \
+    }                                                                                                                  \
+    map->ctrl[hole] = TYPEDMAP_CTRL_EMPTY;                                                                             \
+    map->size--;                                                                                                       \
+    return true;                                                                                                       \
+}                                                                                                                      \
+                                                                                                                       \
+static inline bool Name##_next(const Name *const map, size_t *const cursor, K *const key, V *const value) {            \
+    for (size_t i = *cursor; i < map->capacity; i++) {                                                                 \
+        if (map->ctrl[i] != TYPEDMAP_CTRL_EMPTY) {                                                                     \
+            if (key) {                                                                                                 \
+                *key = map->slots[i].key;                                                                              \
+            }                                                                                                          \
+            if (value) {                                                                                               \
+                *value = map->slots[i].value;                                                                          \
+            }                                                                                                          \
+            *cursor = i + 1;                                                                                           \
+            return true;                                                                                               \
+        }                                                                                                              \
+    }                                                                                                                  \
+    *cursor = map->capacity;                                                                                           \
+    return false;                                                                                                      \
+}
+
+#endif //libfaafo_TYPEDMAP_H
@@ -0,0 +1,124 @@
+//
+// Chunked bump allocator
+//
+#include "arena.h"
+
+#include <dbg.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define align_up(n) (((n) + (ARENA_ALIGNMENT - 1)) & ~((size_t) ARENA_ALIGNMENT - 1))
+
+static ArenaChunk *create_chunk(size_t capacity);
+
+static void free_chunks(ArenaChunk *chunk);
+
+Arena *Arena_create(const size_t chunk_size) {
+	Arena *arena = calloc(1, sizeof(Arena));
+	check_mem_return(arena, NULL);
+	arena->chunk_size = chunk_size > 0 ? align_up(chunk_size) : ARENA_DEFAULT_CHUNK_SIZE;
+	// Chunks are created lazily so an unused arena costs nothing but the struct
+	arena->head = NULL;
+	arena->allocated = 0;
+	return arena;
+}
+
+void *Arena_alloc(Arena *const arena, const size_t size) {
+	check_return(arena, "Arena is null", NULL);
+	check_return(size > 0, "Size must be > 0", NULL);
+	check_return(size <= SIZE_MAX - ARENA_ALIGNMENT, "Size %zu too large", NULL, size);
+
+	ArenaChunk *chunk = arena->head;
+	if (chunk) {
+		// data[] is not necessarily aligned itself, so align the address rather than the offset
+		const uintptr_t start = (uintptr_t) (chunk->data + chunk->used);
+		const size_t padding = align_up(start) - start;
+		if (padding + size <= chunk->capacity - chunk->used) {
+			void *ptr = chunk->data + chunk->used + padding;
+			chunk->used += padding + size;
+			arena->allocated += size;
+			return ptr;
+		}
+	}
+
+	// Out of room, oversized requests get a dedicated chunk to avoid wasting the rest of a regular one
+	const size_t capacity = size + ARENA_ALIGNMENT > arena->chunk_size ? size + ARENA_ALIGNMENT : arena->chunk_size;
+	ArenaChunk *new_chunk = create_chunk(capacity);
+	check_mem_return(new_chunk, NULL);
+
+	const uintptr_t start = (uintptr_t) new_chunk->data;
+	const size_t padding = align_up(start) - start;
+	if (chunk && capacity > arena->chunk_size) {
+		// Slot the dedicated chunk in behind the head so the head keeps serving small requests
+		new_chunk->next = chunk->next;
+		chunk->next = new_chunk;
+	} else {
+		new_chunk->next = chunk;
+		arena->head = new_chunk;
+	}
+	new_chunk->used = padding + size;
+	arena->allocated += size;
+	return new_chunk->data + padding;
+}
+
+void *Arena_calloc(Arena *const arena, const size_t size) {
+	void *ptr = Arena_alloc(arena, size);
+	if (ptr) {
+		memset(ptr, 0, size);
+	}
+	return ptr;
+}
+
+bool Arena_reset(Arena *const arena) {
+	check_return(arena, "Arena is null", false);
+	ArenaChunk *chunk = arena->head;
+	if (!chunk) {
+		return true;
+	}
+
+	// Hang on to one regular sized chunk, dedicated oversized ones go back to malloc
+	ArenaChunk *keep = NULL;
+	ArenaChunk *next;
+	for (; chunk; chunk = next) {
+		next = chunk->next;
+		if (!keep && chunk->capacity == arena->chunk_size) {
+			keep = chunk;
+			continue;
+		}
+		free(chunk);
+	}
+	if (keep) {
+		keep->next = NULL;
+		keep->used = 0;
+	}
+	arena->head = keep;
+	arena->allocated = 0;
+	return true;
+}
+
+bool Arena_destroy(Arena *arena) {
+	check_return(arena, "Arena is null", false);
+	free_chunks(arena->head);
+	free(arena);
+	return true;
+}
+
+
+// Private helper functions
+
+static ArenaChunk *create_chunk(const size_t capacity) {
+	ArenaChunk *chunk = malloc(sizeof(ArenaChunk) + capacity);
+	check_mem_return(chunk, NULL);
+	chunk->next = NULL;
+	chunk->capacity = capacity;
+	chunk->used = 0;
+	return chunk;
+}
+
+static void free_chunks(ArenaChunk *chunk) {
+	while (chunk) {
+		ArenaChunk *next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+}
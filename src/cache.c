@@ -0,0 +1,390 @@
+//
+// Bounded cache with LRU or W-TinyLFU eviction
+//
+#include "cache.h"
+
+#include <dbg.h>
+#include <stdlib.h>
+
+#include "hashmap_internal.h"
+
+// Counters of a fresh sketch, it doubles along with the number of entries
+#define SKETCH_MIN_WIDTH 64
+#define SKETCH_RESET_MASK UINT64_C(0x7777777777777777)
+
+static void default_df(void *map_entry);
+
+static void list_init(CacheList *list);
+
+static void list_push_front(CacheList *list, CacheNode *node);
+
+static void list_unlink(CacheList *list, CacheNode *node);
+
+static CacheNode *list_back(const CacheList *list);
+
+static void move_to(Cache *cache, CacheNode *node, CacheSegment segment);
+
+static void on_access(Cache *cache, CacheNode *node);
+
+static void evict(Cache *cache);
+
+static void release_node(Cache *cache, CacheNode *node);
+
+static void evict_node(Cache *cache, CacheNode *node);
+
+static bool sketch_ensure(FrequencySketch *sketch, size_t n);
+
+static void sketch_increment(FrequencySketch *sketch, size_t hash);
+
+static unsigned sketch_frequency(const FrequencySketch *sketch, size_t hash);
+
+Cache *Cache_create(const size_t capacity, const CachePolicy policy, const hash_fn hash_fn, const equals_fn equals_fn,
+					const weigh_fn weigh_fn, const destructor_fn df) {
+	check_return(capacity > 0, "Capacity must be > 0", NULL);
+	check_return(policy == CACHE_LRU || policy == CACHE_TINYLFU, "Unknown cache policy", NULL);
+
+	Cache *cache = calloc(1, sizeof(Cache));
+	check_mem_return(cache, NULL);
+	// Nodes are released by the cache, the map only indexes them
+	cache->map = HashMap_create(HASHMAP_DEFAULT_CAPACITY, hash_fn, equals_fn, NOOP);
+	check(cache->map, "Failed to create map", goto catch);
+	if (policy == CACHE_TINYLFU) {
+		check_mem(sketch_ensure(&cache->sketch, SKETCH_MIN_WIDTH), goto catch);
+	}
+
+	cache->policy = policy;
+	cache->capacity = capacity;
+	cache->weight = 0;
+	cache->window_capacity = capacity * CACHE_WINDOW_PERCENT / 100;
+	if (cache->window_capacity == 0) {
+		cache->window_capacity = 1;
+	}
+	cache->protected_capacity = (capacity - cache->window_capacity) * CACHE_PROTECTED_PERCENT / 100;
+	cache->weigh_fn = weigh_fn;
+	cache->df = df ? df : default_df;
+	for (size_t i = 0; i < sizeof(cache->lists) / sizeof(cache->lists[0]); i++) {
+		list_init(&cache->lists[i]);
+	}
+	return cache;
+catch:
+	if (cache->map) {
+		HashMap_destroy(cache->map);
+	}
+	free(cache);
+	return NULL;
+}
+
+bool Cache_destroy(Cache *cache) {
+	check_return(cache, "Cache is null", false);
+	Cache_clear(cache);
+	HashMap_destroy(cache->map);
+	free(cache->sketch.table);
+	free(cache);
+	return true;
+}
+
+bool Cache_clear(Cache *cache) {
+	check_return(cache, "Cache is null", false);
+	// The map goes first, clearing it still looks at the entries
+	check_return(HashMap_clear(cache->map), "Failed to clear map", false);
+	for (size_t i = 0; i < sizeof(cache->lists) / sizeof(cache->lists[0]); i++) {
+		CacheList *list = &cache->lists[i];
+		for (CacheNode *node = list->head.next, *next; node != &list->head; node = next) {
+			next = node->next;
+			cache->df(&node->entry);
+			free(node);
+		}
+		list_init(list);
+	}
+	cache->weight = 0;
+	return true;
+}
+
+void *Cache_get(Cache *const cache, const void *const key) {
+	check_return(cache, "Cache is null", NULL);
+	check_return(key, "Key is null", NULL);
+
+	const size_t hash = HashMap_hash(cache->map, key);
+	if (cache->policy == CACHE_TINYLFU) {
+		// Misses count too, a key that keeps being asked for earns its way into the main cache
+		sketch_increment(&cache->sketch, hash);
+	}
+	MapEntry *entry = HashMap_find_hashed(cache->map, key, hash);
+	if (!entry) {
+		cache->stats.misses++;
+		return NULL;
+	}
+	cache->stats.hits++;
+	on_access(cache, (CacheNode *) entry);
+	return entry->value;
+}
+
+void *Cache_peek(const Cache *const cache, const void *const key) {
+	check_return(cache, "Cache is null", NULL);
+	check_return(key, "Key is null", NULL);
+	const MapEntry *entry = HashMap_find_hashed(cache->map, key, HashMap_hash(cache->map, key));
+	return entry ? entry->value : NULL;
+}
+
+bool Cache_touch(Cache *const cache, const void *const key) {
+	check_return(cache, "Cache is null", false);
+	check_return(key, "Key is null", false);
+	const size_t hash = HashMap_hash(cache->map, key);
+	if (cache->policy == CACHE_TINYLFU) {
+		sketch_increment(&cache->sketch, hash);
+	}
+	MapEntry *entry = HashMap_find_hashed(cache->map, key, hash);
+	if (!entry) {
+		return false;
+	}
+	on_access(cache, (CacheNode *) entry);
+	return true;
+}
+
+bool Cache_put(Cache *const cache, void *const key, void *const value) {
+	check_return(cache, "Cache is null", false);
+	check_return(key, "Key is null", false);
+	check_return(value, "Value is null", false);
+
+	const size_t weight = cache->weigh_fn ? cache->weigh_fn(key, value) : 1;
+	check_return(weight <= cache->capacity, "Entry of weight %zu is heavier than the whole cache", false, weight);
+	const size_t hash = HashMap_hash(cache->map, key);
+	if (cache->policy == CACHE_TINYLFU) {
+		sketch_increment(&cache->sketch, hash);
+	}
+
+	MapEntry *entry = HashMap_find_hashed(cache->map, key, hash);
+	if (entry) {
+		CacheNode *node = (CacheNode *) entry;
+		// Whatever the caller put again as the very same pointer stays, df gets NULL for it
+		MapEntry replaced = *entry;
+		replaced.key = replaced.key != key ? replaced.key : NULL;
+		replaced.value = replaced.value != value ? replaced.value : NULL;
+		cache->df(&replaced);
+		entry->key = key;
+		entry->value = value;
+		cache->lists[node->segment].weight += weight - node->weight;
+		cache->weight += weight - node->weight;
+		node->weight = weight;
+		on_access(cache, node);
+		evict(cache);
+		return true;
+	}
+
+	CacheNode *node = malloc(sizeof(CacheNode));
+	check_mem_return(node, false);
+	node->entry = (MapEntry) {.key = key, .value = value, .hash = hash};
+	node->weight = weight;
+	if (!HashMap_attach_hashed(cache->map, &node->entry)) {
+		free(node);
+		return false;
+	}
+	node->segment = cache->policy == CACHE_LRU ? CACHE_PROBATION : CACHE_WINDOW;
+	list_push_front(&cache->lists[node->segment], node);
+	cache->weight += weight;
+	if (cache->policy == CACHE_TINYLFU) {
+		// Out of memory only makes the estimates coarser
+		sketch_ensure(&cache->sketch, cache->map->size);
+	}
+	evict(cache);
+	return true;
+}
+
+bool Cache_remove(Cache *const cache, const void *const key) {
+	check_return(cache, "Cache is null", false);
+	check_return(key, "Key is null", false);
+	MapEntry *entry = HashMap_find_hashed(cache->map, key, HashMap_hash(cache->map, key));
+	if (!entry) {
+		return false;
+	}
+	release_node(cache, (CacheNode *) entry);
+	return true;
+}
+
+size_t Cache_size(const Cache *const cache) {
+	check_return(cache, "Cache is null", 0);
+	return cache->map->size;
+}
+
+double Cache_hit_rate(const Cache *const cache) {
+	check_return(cache, "Cache is null", 0);
+	const size_t lookups = cache->stats.hits + cache->stats.misses;
+	return lookups > 0 ? (double) cache->stats.hits / (double) lookups : 0;
+}
+
+
+// Private helper functions
+
+static void default_df(void *map_entry) {
+	MapEntry *entry = map_entry;
+	free(entry->key);
+	free(entry->value);
+}
+
+static inline void list_init(CacheList *const list) {
+	list->head.prev = &list->head;
+	list->head.next = &list->head;
+	list->weight = 0;
+}
+
+static inline void list_push_front(CacheList *const list, CacheNode *const node) {
+	node->prev = &list->head;
+	node->next = list->head.next;
+	list->head.next->prev = node;
+	list->head.next = node;
+	list->weight += node->weight;
+}
+
+static inline void list_unlink(CacheList *const list, CacheNode *const node) {
+	node->prev->next = node->next;
+	node->next->prev = node->prev;
+	list->weight -= node->weight;
+}
+
+/** @return the least recently used node of list, NULL if it is empty */
+static inline CacheNode *list_back(const CacheList *const list) {
+	return list->head.prev != &list->head ? list->head.prev : NULL;
+}
+
+/** Make node the most recently used one of segment, which may be the segment it is in */
+static inline void move_to(Cache *const cache, CacheNode *const node, const CacheSegment segment) {
+	list_unlink(&cache->lists[node->segment], node);
+	node->segment = segment;
+	list_push_front(&cache->lists[segment], node);
+}
+
+static void on_access(Cache *const cache, CacheNode *const node) {
+	if (cache->policy == CACHE_LRU || node->segment != CACHE_PROBATION) {
+		move_to(cache, node, node->segment);
+		return;
+	}
+	// A second use in the main cache makes the entry protected, pushing the oldest protected one back
+	move_to(cache, node, CACHE_PROTECTED);
+	CacheList *protected = &cache->lists[CACHE_PROTECTED];
+	while (protected->weight > cache->protected_capacity) {
+		move_to(cache, list_back(protected), CACHE_PROBATION);
+	}
+}
+
+static void evict(Cache *const cache) {
+	if (cache->policy == CACHE_LRU) {
+		while (cache->weight > cache->capacity) {
+			evict_node(cache, list_back(&cache->lists[CACHE_PROBATION]));
+		}
+		return;
+	}
+
+	CacheList *window = &cache->lists[CACHE_WINDOW];
+	CacheList *probation = &cache->lists[CACHE_PROBATION];
+	CacheList *protected = &cache->lists[CACHE_PROTECTED];
+	while (window->weight > cache->window_capacity) {
+		// The oldest window entry becomes a candidate for the main cache, probation is where it would go
+		CacheNode *candidate = list_back(window);
+		move_to(cache, candidate, CACHE_PROBATION);
+		while (cache->weight > cache->capacity) {
+			CacheNode *victim = list_back(probation);
+			if (victim == candidate) {
+				victim = list_back(protected);
+			}
+			// The candidate only gets in if it has been seen more often than the entry it pushes out
+			if (victim && sketch_frequency(&cache->sketch, candidate->entry.hash) >
+						  sketch_frequency(&cache->sketch, victim->entry.hash)) {
+				evict_node(cache, victim);
+			} else {
+				evict_node(cache, candidate);
+				break;
+			}
+		}
+	}
+	// A replaced value that got heavier can overflow the cache without overflowing the window
+	while (cache->weight > cache->capacity) {
+		CacheNode *victim = list_back(probation);
+		if (!victim) {
+			victim = list_back(protected) ? list_back(protected) : list_back(window);
+		}
+		evict_node(cache, victim);
+	}
+}
+
+/** Take node out of its list and the map, then release it */
+static void release_node(Cache *const cache, CacheNode *const node) {
+	list_unlink(&cache->lists[node->segment], node);
+	cache->weight -= node->weight;
+	HashMap_detach_hashed(cache->map, node->entry.key, node->entry.hash);
+	cache->df(&node->entry);
+	free(node);
+}
+
+static inline void evict_node(Cache *const cache, CacheNode *const node) {
+	cache->stats.evictions++;
+	release_node(cache, node);
+}
+
+/**
+ * Make the sketch at least n counters wide, which keeps its error rate down as the cache fills up. A
+ * resized sketch starts counting from scratch.
+ * @return false if out of memory, the sketch is then left as it was
+ */
+static bool sketch_ensure(FrequencySketch *const sketch, const size_t n) {
+	size_t width = sketch->words_per_row * 16;
+	if (width >= n) {
+		return true;
+	}
+	if (width < SKETCH_MIN_WIDTH) {
+		width = SKETCH_MIN_WIDTH;
+	}
+	while (width < n) {
+		width *= 2;
+	}
+	uint64_t *table = calloc(CACHE_SKETCH_DEPTH * (width / 16), sizeof(uint64_t));
+	if (!table) {
+		return false;
+	}
+	free(sketch->table);
+	sketch->table = table;
+	sketch->words_per_row = width / 16;
+	sketch->additions = 0;
+	sketch->sample_size = 10 * width;
+	return true;
+}
+
+/*
+ * Each row picks its counter with double hashing, h1 + row * h2, from the already mixed 64 bit hash.
+ * The counter's word is picked first, its nibble within the word second.
+ */
+#define sketch_counter(sketch, hash, row) \
+	(((hash) + (row) * (((hash) >> 32) | 1)) & ((sketch)->words_per_row * 16 - 1))
+
+static void sketch_increment(FrequencySketch *const sketch, const size_t hash) {
+	bool added = false;
+	for (size_t row = 0; row < CACHE_SKETCH_DEPTH; row++) {
+		const size_t counter = sketch_counter(sketch, hash, row);
+		uint64_t *word = &sketch->table[row * sketch->words_per_row + counter / 16];
+		const unsigned shift = (counter % 16) * 4;
+		if (((*word >> shift) & 0xf) < 0xf) {
+			*word += UINT64_C(1) << shift;
+			added = true;
+		}
+	}
+	if (added && ++sketch->additions >= sketch->sample_size) {
+		// Age everything at once: halve every counter, the shift moves each nibble's low bit out
+		const size_t words = CACHE_SKETCH_DEPTH * sketch->words_per_row;
+		for (size_t i = 0; i < words; i++) {
+			sketch->table[i] = (sketch->table[i] >> 1) & SKETCH_RESET_MASK;
+		}
+		sketch->additions /= 2;
+	}
+}
+
+static unsigned sketch_frequency(const FrequencySketch *const sketch, const size_t hash) {
+	unsigned frequency = 0xf;
+	for (size_t row = 0; row < CACHE_SKETCH_DEPTH; row++) {
+		const size_t counter = sketch_counter(sketch, hash, row);
+		const uint64_t word = sketch->table[row * sketch->words_per_row + counter / 16];
+		const unsigned count = (unsigned) (word >> (counter % 16) * 4) & 0xf;
+		if (count < frequency) {
+			frequency = count;
+		}
+	}
+	return frequency;
+}
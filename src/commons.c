@@ -5,9 +5,34 @@
 
 #include <assert.h>
 #include <hashmap.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <bstrlib.h>
 
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#endif
+
+/** wyhash's default secret, odd 64 bit constants with 32 bits set */
+static const uint64_t wyp[4] = {
+	COMMONS_HASH_P0, COMMONS_HASH_P1, UINT64_C(0x4b33a62ed433d4a3), UINT64_C(0x4d5a2da51de1aa47)
+};
+
+static inline uint64_t read_u64(const uint8_t *p);
+
+static inline uint64_t read_u32(const uint8_t *p);
+
+static inline void mum(uint64_t *a, uint64_t *b);
+
+#if !defined(__SSE4_2__)
+/** CRC-32C of every byte value, filled in before main runs */
+static uint32_t crc32c_table[256];
+
+static void crc32c_init(void) __attribute__((constructor));
+#endif
+
 
 inline void Commons_noop(void *ptr) {
 	// Does nothing
@@ -24,3 +49,143 @@ void Commons_map_entry_destroy(void *map_entry) {
 	free(entry->value);
 	free(entry);
 }
+
+uint64_t Commons_hash_bytes(const void *const data, const size_t len, uint64_t seed) {
+	const uint8_t *p = data;
+	seed ^= Commons_hash_mix(seed ^ wyp[0], wyp[1]);
+	uint64_t a, b;
+	if (len <= 16) {
+		if (len >= 4) {
+			a = read_u32(p) << 32 | read_u32(p + (len >> 3 << 2));
+			b = read_u32(p + len - 4) << 32 | read_u32(p + len - 4 - (len >> 3 << 2));
+		} else if (len > 0) {
+			// First, middle and last byte cover every length from 1 to 3
+			a = (uint64_t) p[0] << 16 | (uint64_t) p[len >> 1] << 8 | p[len - 1];
+			b = 0;
+		} else {
+			a = b = 0;
+		}
+	} else {
+		size_t i = len;
+		if (i >= 48) {
+			// Three independent lanes keep the multipliers busy on long inputs
+			uint64_t see1 = seed, see2 = seed;
+			do {
+				seed = Commons_hash_mix(read_u64(p) ^ wyp[1], read_u64(p + 8) ^ seed);
+				see1 = Commons_hash_mix(read_u64(p + 16) ^ wyp[2], read_u64(p + 24) ^ see1);
+				see2 = Commons_hash_mix(read_u64(p + 32) ^ wyp[3], read_u64(p + 40) ^ see2);
+				p += 48;
+				i -= 48;
+			} while (i >= 48);
+			seed ^= see1 ^ see2;
+		}
+		while (i > 16) {
+			seed = Commons_hash_mix(read_u64(p) ^ wyp[1], read_u64(p + 8) ^ seed);
+			i -= 16;
+			p += 16;
+		}
+		// The last 16 bytes, overlapping what was already consumed when needed
+		a = read_u64(p + i - 16);
+		b = read_u64(p + i - 8);
+	}
+	a ^= wyp[1];
+	b ^= seed;
+	mum(&a, &b);
+	return Commons_hash_mix(a ^ wyp[0] ^ len, b ^ wyp[1]);
+}
+
+uint64_t Commons_hash_random_seed(void) {
+	uint64_t seed = 0;
+	FILE *urandom = fopen("/dev/urandom", "rb");
+	if (urandom) {
+		const size_t read = fread(&seed, sizeof(seed), 1, urandom);
+		fclose(urandom);
+		if (read == 1) {
+			return seed;
+		}
+	}
+	// No OS random source, fall back to things that at least differ between runs
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	seed = Commons_hash_mix((uint64_t) now.tv_sec ^ COMMONS_HASH_P0, (uint64_t) now.tv_nsec ^ COMMONS_HASH_P1);
+	return Commons_hash_mix(seed ^ (uint64_t) (uintptr_t) &now, (uint64_t) clock() ^ COMMONS_HASH_P1);
+}
+
+size_t Commons_hash_fn_int(const void *const key) {
+	return key ? (size_t) Commons_hash_u32((uint32_t) *(const int *) key) : 0;
+}
+
+size_t Commons_hash_fn_int64(const void *const key) {
+	return key ? (size_t) Commons_hash_u64((uint64_t) *(const int64_t *) key) : 0;
+}
+
+size_t Commons_hash_fn_cstr(const void *const key) {
+	return key ? (size_t) Commons_hash_bytes(key, strlen(key), 0) : 0;
+}
+
+size_t Commons_hash_fn_bstring(const void *const key) {
+	const_bstring str = key;
+	if (!str || !str->data || str->slen < 0) {
+		return 0;
+	}
+	return (size_t) Commons_hash_bytes(str->data, (size_t) str->slen, 0);
+}
+
+uint32_t Commons_crc32c(uint32_t crc, const void *const data, size_t len) {
+	const uint8_t *p = data;
+	crc = ~crc;
+#if defined(__SSE4_2__)
+	for (; len >= 8; len -= 8, p += 8) {
+		crc = (uint32_t) _mm_crc32_u64(crc, read_u64(p));
+	}
+	for (; len > 0; len--, p++) {
+		crc = _mm_crc32_u8(crc, *p);
+	}
+#else
+	for (; len > 0; len--, p++) {
+		crc = crc32c_table[(crc ^ *p) & 0xff] ^ (crc >> 8);
+	}
+#endif
+	return ~crc;
+}
+
+
+// Private helper functions
+
+static inline uint64_t read_u64(const uint8_t *const p) {
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t read_u32(const uint8_t *const p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline void mum(uint64_t *const a, uint64_t *const b) {
+#if defined(__SIZEOF_INT128__)
+	const __uint128_t r = (__uint128_t) *a * *b;
+	*a = (uint64_t) r;
+	*b = (uint64_t) (r >> 64);
+#else
+	const uint64_t folded = Commons_hash_mix(*a, *b);
+	const uint64_t lo = *a * *b;
+	*a = lo;
+	*b = folded ^ lo;
+#endif
+}
+
+#if !defined(__SSE4_2__)
+static void crc32c_init(void) {
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t crc = i;
+		for (int bit = 0; bit < 8; bit++) {
+			// 0x82f63b78 is the Castagnoli polynomial, bit reversed
+			crc = crc & 1 ? (crc >> 1) ^ UINT32_C(0x82f63b78) : crc >> 1;
+		}
+		crc32c_table[i] = crc;
+	}
+}
+#endif
@@ -0,0 +1,169 @@
+//
+// Sharded thread safe HashMap
+//
+#include "concurrenthashmap.h"
+
+#include <dbg.h>
+#include <stdlib.h>
+
+#include "hashmap_internal.h"
+
+// The top 7 bits become control tags inside the shard maps, pick the shard from the bits right below
+#define TAG_BITS 7
+
+static ConcurrentShard *shard_for(const ConcurrentHashMap *map, size_t hash);
+
+static size_t hash_key(const ConcurrentHashMap *map, const void *key);
+
+ConcurrentHashMap *ConcurrentHashMap_create(size_t n_shards, const size_t shard_capacity, const hash_fn hash_fn,
+											const equals_fn equals_fn, const destructor_fn map_entry_df) {
+	if (n_shards == 0) {
+		n_shards = CONCURRENTHASHMAP_DEFAULT_SHARDS;
+	}
+	check_return((n_shards & (n_shards - 1)) == 0, "Number of shards must be a power of 2", NULL);
+	check_return(hash_fn, "Hash function must not be null", NULL);
+	check_return(equals_fn, "Equals function must not be null", NULL);
+	size_t shards_size;
+	check_return(!Commons_will_overflow(n_shards, sizeof(ConcurrentShard), &shards_size), "Too many shards: %zu", NULL,
+				 n_shards);
+
+	ConcurrentHashMap *map = calloc(1, sizeof(ConcurrentHashMap));
+	check_mem_return(map, NULL);
+
+	void *shards = NULL;
+	check_mem(posix_memalign(&shards, CONCURRENTHASHMAP_CACHE_LINE, shards_size) == 0, goto catch);
+	memset(shards, 0, shards_size);
+	map->shards = shards;
+
+	unsigned int shard_bits = 0;
+	while (((size_t) 1 << shard_bits) < n_shards) {
+		shard_bits++;
+	}
+	map->shard_shift = (unsigned int) (sizeof(size_t) * 8) - TAG_BITS - shard_bits;
+	map->hash_fn = hash_fn;
+	map->equals_fn = equals_fn;
+	map->df = map_entry_df;
+
+	for (size_t i = 0; i < n_shards; i++) {
+		ConcurrentShard *shard = &map->shards[i];
+		shard->map = HashMap_create(shard_capacity, hash_fn, equals_fn, map_entry_df);
+		check(shard->map, "Failed to create shard %zu", goto catch, i);
+		check(pthread_rwlock_init(&shard->lock, NULL) == 0, "Failed to init lock for shard %zu", {
+			  HashMap_destroy(shard->map);
+			  goto catch;
+			  }, i);
+		map->n_shards++;
+	}
+	return map;
+catch:
+	if (map->shards) {
+		ConcurrentHashMap_destroy(map);
+	} else {
+		free(map);
+	}
+	return NULL;
+}
+
+void *ConcurrentHashMap_put(ConcurrentHashMap *const map, void *const key, void *const value) {
+	check_return(map, "Map is null", NULL);
+	check_return(key, "Key is null", NULL);
+	check_return(value, "Value is null", NULL);
+
+	const size_t hash = hash_key(map, key);
+	ConcurrentShard *shard = shard_for(map, hash);
+	pthread_rwlock_wrlock(&shard->lock);
+	void *old_value = HashMap_put_hashed(shard->map, key, value, hash);
+	__atomic_store_n(&shard->size, shard->map->size, __ATOMIC_RELAXED);
+	pthread_rwlock_unlock(&shard->lock);
+	return old_value;
+}
+
+void *ConcurrentHashMap_get(ConcurrentHashMap *const map, const void *const key) {
+	check_return(map, "Map is null", NULL);
+	check_return(key, "Key is null", NULL);
+
+	const size_t hash = hash_key(map, key);
+	ConcurrentShard *shard = shard_for(map, hash);
+	pthread_rwlock_rdlock(&shard->lock);
+	const MapEntry *entry = HashMap_find_hashed(shard->map, key, hash);
+	void *value = entry ? entry->value : NULL;
+	pthread_rwlock_unlock(&shard->lock);
+	return value;
+}
+
+bool ConcurrentHashMap_read(ConcurrentHashMap *const map, const void *const key,
+							bool (*fn)(const void *value, void *ctx), void *ctx) {
+	check_return(map, "Map is null", false);
+	check_return(key, "Key is null", false);
+	check_return(fn, "Read function is null", false);
+
+	const size_t hash = hash_key(map, key);
+	ConcurrentShard *shard = shard_for(map, hash);
+	pthread_rwlock_rdlock(&shard->lock);
+	const MapEntry *entry = HashMap_find_hashed(shard->map, key, hash);
+	const bool result = fn(entry ? entry->value : NULL, ctx);
+	pthread_rwlock_unlock(&shard->lock);
+	return result;
+}
+
+bool ConcurrentHashMap_contains_key(ConcurrentHashMap *const map, const void *const key) {
+	return ConcurrentHashMap_get(map, key) != NULL;
+}
+
+bool ConcurrentHashMap_remove(ConcurrentHashMap *const map, const void *const key) {
+	check_return(map, "Map is null", false);
+	check_return(key, "Key is null", false);
+
+	const size_t hash = hash_key(map, key);
+	ConcurrentShard *shard = shard_for(map, hash);
+	pthread_rwlock_wrlock(&shard->lock);
+	const bool removed = HashMap_remove_hashed(shard->map, key, hash);
+	__atomic_store_n(&shard->size, shard->map->size, __ATOMIC_RELAXED);
+	pthread_rwlock_unlock(&shard->lock);
+	return removed;
+}
+
+size_t ConcurrentHashMap_size(const ConcurrentHashMap *const map) {
+	check_return(map, "Map is null", 0);
+	size_t size = 0;
+	for (size_t i = 0; i < map->n_shards; i++) {
+		size += __atomic_load_n(&map->shards[i].size, __ATOMIC_RELAXED);
+	}
+	return size;
+}
+
+bool ConcurrentHashMap_clear(ConcurrentHashMap *const map) {
+	check_return(map, "Map is null", false);
+	// One shard at a time, a concurrent writer may refill an already cleared shard
+	for (size_t i = 0; i < map->n_shards; i++) {
+		ConcurrentShard *shard = &map->shards[i];
+		pthread_rwlock_wrlock(&shard->lock);
+		HashMap_clear(shard->map);
+		__atomic_store_n(&shard->size, 0, __ATOMIC_RELAXED);
+		pthread_rwlock_unlock(&shard->lock);
+	}
+	return true;
+}
+
+bool ConcurrentHashMap_destroy(ConcurrentHashMap *map) {
+	check_return(map, "Map is null", false);
+	for (size_t i = 0; i < map->n_shards; i++) {
+		HashMap_destroy(map->shards[i].map);
+		pthread_rwlock_destroy(&map->shards[i].lock);
+	}
+	free(map->shards);
+	free(map);
+	return true;
+}
+
+
+// Private helper functions
+
+static inline size_t hash_key(const ConcurrentHashMap *const map, const void *const key) {
+	// Shards only ever see hashes computed here, so the seed of shard 0 is the seed of all of them
+	return HashMap_hash(map->shards[0].map, key);
+}
+
+static inline ConcurrentShard *shard_for(const ConcurrentHashMap *const map, const size_t hash) {
+	return &map->shards[(hash >> map->shard_shift) & (map->n_shards - 1)];
+}
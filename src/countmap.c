@@ -0,0 +1,305 @@
+//
+// Open addressing hash map from keys to counters, counters inline in the slots
+//
+#include "countmap.h"
+
+#include <dbg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashmap_internal.h"
+#include "slottable.h"
+
+#define SLOT_LAYOUT SlotTable_layout(CountMapSlot)
+
+// Returned by find_index when the key is not in the map
+#define NOT_FOUND SIZE_MAX
+
+static void default_key_df(void *key);
+
+static size_t generate_hash(const CountMap *map, const void *key);
+
+static size_t find_index(const CountMap *map, const void *key, size_t hash, size_t *insert_index);
+
+static bool increment_hashed(CountMap *map, const void *key, size_t hash, int64_t delta);
+
+static void erase_index(CountMap *map, size_t index);
+
+static bool resize(CountMap *map, size_t new_capacity);
+
+static void shrink_if_sparse(CountMap *map);
+
+static void sift_down(CountEntry *heap, size_t n, size_t i);
+
+CountMap *CountMap_create(size_t capacity, const hash_fn hash_fn, const equals_fn equals_fn, const copy_fn key_copy,
+						  const destructor_fn key_df) {
+	check_return(capacity > 0, "Capacity must be > 0", NULL);
+	check_return((capacity & (capacity - 1)) == 0, "Capacity must be a power of 2", NULL);
+	check_return(hash_fn, "Hash function must not be null", NULL);
+	check_return(equals_fn, "Equals function must not be null", NULL);
+
+	if (capacity < HASHMAP_MIN_CAPACITY) {
+		capacity = HASHMAP_MIN_CAPACITY;
+	}
+
+	CountMap *map = calloc(1, sizeof(CountMap));
+	check_mem_return(map, NULL);
+	map->slots = SlotTable_allocate(capacity, &map->ctrl, sizeof(CountMapSlot));
+	check_mem(map->slots, goto catch);
+
+	map->size = 0;
+	map->capacity = capacity;
+	map->min_capacity = capacity;
+	map->hash_fn = hash_fn;
+	map->equals_fn = equals_fn;
+	map->key_copy = key_copy;
+	map->key_df = key_df ? key_df : default_key_df;
+	map->seed = HashMap_new_seed();
+	SlotTable_set_thresholds(map);
+	return map;
+catch:
+	free(map);
+	return NULL;
+}
+
+bool CountMap_destroy(CountMap *map) {
+	check_return(map, "Map is null", false);
+	SlotTable_release(map->slots, map->ctrl, map->capacity, map->size, sizeof(CountMapSlot), offsetof(CountMapSlot, key),
+					  map->key_df);
+	free(map->slots); // ctrl bytes share the allocation
+	free(map);
+	return true;
+}
+
+bool CountMap_clear(CountMap *map) {
+	check_return(map, "Map is null", false);
+	SlotTable_release(map->slots, map->ctrl, map->capacity, map->size, sizeof(CountMapSlot), offsetof(CountMapSlot, key),
+					  map->key_df);
+	map->slots = SlotTable_clear(map->slots, &map->ctrl, &map->capacity, map->min_capacity, map->size,
+								 sizeof(CountMapSlot));
+	SlotTable_set_thresholds(map);
+	map->size = 0;
+	return true;
+}
+
+bool CountMap_increment(CountMap *const map, const void *const key, const int64_t delta) {
+	check_return(map, "Map is null", false);
+	check_return(key, "Key is null", false);
+	return increment_hashed(map, key, generate_hash(map, key), delta);
+}
+
+size_t CountMap_increment_many(CountMap *const map, const void *const *keys, const size_t n) {
+	check_return(map, "Map is null", 0);
+	check_return(keys, "Keys are null", 0);
+
+	size_t hashes[HASHMAP_BATCH];
+	for (size_t base = 0; base < n; base += HASHMAP_BATCH) {
+		const size_t batch = n - base < HASHMAP_BATCH ? n - base : HASHMAP_BATCH;
+		for (size_t i = 0; i < batch; i++) {
+			check_return(keys[base + i], "Key is null", base);
+			hashes[i] = generate_hash(map, keys[base + i]);
+			const size_t index = hashes[i] & (map->capacity - 1);
+			__builtin_prefetch(map->ctrl + index);
+			__builtin_prefetch(map->slots + index, 1);
+		}
+		for (size_t i = 0; i < batch; i++) {
+			check_return(increment_hashed(map, keys[base + i], hashes[i], 1), "Failed to count key", base + i);
+		}
+	}
+	return n;
+}
+
+int64_t CountMap_get(const CountMap *const map, const void *const key) {
+	check_return(map, "Map is null", 0);
+	check_return(key, "Key is null", 0);
+	const size_t index = find_index(map, key, generate_hash(map, key), NULL);
+	return index != NOT_FOUND ? map->slots[index].count : 0;
+}
+
+bool CountMap_contains(const CountMap *const map, const void *const key) {
+	check_return(map, "Map is null", false);
+	check_return(key, "Key is null", false);
+	return find_index(map, key, generate_hash(map, key), NULL) != NOT_FOUND;
+}
+
+bool CountMap_remove(CountMap *const map, const void *const key) {
+	check_return(map, "Map is null", false);
+	check_return(key, "Key is null", false);
+	const size_t index = find_index(map, key, generate_hash(map, key), NULL);
+	if (index == NOT_FOUND) {
+		return false;
+	}
+	void *stored = map->slots[index].key;
+	erase_index(map, index);
+	map->key_df(stored);
+	shrink_if_sparse(map);
+	return true;
+}
+
+size_t CountMap_top_k(const CountMap *const map, const size_t k, CountEntry *const out) {
+	check_return(map && out, "Map or output is null", 0);
+	if (k == 0) {
+		return 0;
+	}
+	// out is a min heap of the best k so far, its root is the one the next better count replaces
+	size_t n = 0;
+	for (size_t i = 0; i < map->capacity; i++) {
+		if (map->ctrl[i] == CTRL_EMPTY) {
+			continue;
+		}
+		const CountEntry entry = {.key = map->slots[i].key, .count = map->slots[i].count};
+		if (n < k) {
+			size_t child = n++;
+			while (child > 0 && out[(child - 1) / 2].count > entry.count) {
+				out[child] = out[(child - 1) / 2];
+				child = (child - 1) / 2;
+			}
+			out[child] = entry;
+		} else if (entry.count > out[0].count) {
+			out[0] = entry;
+			sift_down(out, n, 0);
+		}
+	}
+	// Heap sort in place, popping the smallest to the back leaves the highest count first
+	for (size_t end = n; end > 1; end--) {
+		const CountEntry smallest = out[0];
+		out[0] = out[end - 1];
+		out[end - 1] = smallest;
+		sift_down(out, end - 1, 0);
+	}
+	return n;
+}
+
+bool CountMap_merge(CountMap *const map, const CountMap *const other) {
+	check_return(map && other, "Map is null", false);
+	check_return(map->key_copy || map->key_df == NOOP, "A map without key_copy must not release merged keys",
+				 false);
+	for (size_t i = 0; i < other->capacity; i++) {
+		if (other->ctrl[i] == CTRL_EMPTY) {
+			continue;
+		}
+		const CountMapSlot *slot = &other->slots[i];
+		check_return(increment_hashed(map, slot->key, generate_hash(map, slot->key), slot->count),
+					 "Failed to merge key", false);
+	}
+	return true;
+}
+
+bool CountMap_next(const CountMap *const map, size_t *const cursor, void **const key, int64_t *const count) {
+	check_return(map && cursor, "Map or cursor is null", false);
+	while (*cursor < map->capacity) {
+		const size_t index = (*cursor)++;
+		if (map->ctrl[index] != CTRL_EMPTY) {
+			if (key) {
+				*key = map->slots[index].key;
+			}
+			if (count) {
+				*count = map->slots[index].count;
+			}
+			return true;
+		}
+	}
+	return false;
+}
+
+
+// Private helper functions
+
+static void default_key_df(void *key) {
+	free(key);
+}
+
+static inline size_t generate_hash(const CountMap *map, const void *key) {
+	// Same mix as HashMap, see generate_hash there
+	return (size_t) Commons_hash_u64_seeded(map->hash_fn(key), map->seed);
+}
+
+/**
+ * @param insert_index if not NULL and key is not in the map, set to the slot a new entry for key goes in
+ * @return the slot of key or NOT_FOUND
+ */
+static size_t find_index(const CountMap *const map, const void *const key, const size_t hash,
+						 size_t *const insert_index) {
+	const size_t mask = map->capacity - 1;
+	const uint8_t tag = HashGroup_tag(hash);
+	for (size_t pos = hash & mask;; pos = (pos + HASHGROUP_WIDTH) & mask) {
+		const uint8_t *group = map->ctrl + pos;
+		for (GroupMask match = HashGroup_match(group, tag); match; match &= match - 1) {
+			const size_t index = (pos + HashGroup_lowest(match)) & mask;
+			if (map->slots[index].hash == hash && map->equals_fn(map->slots[index].key, key)) {
+				return index;
+			}
+		}
+		const GroupMask empty = HashGroup_match_empty(group);
+		if (empty) {
+			if (insert_index) {
+				*insert_index = (pos + HashGroup_lowest(empty)) & mask;
+			}
+			return NOT_FOUND;
+		}
+	}
+}
+
+/** The one probe behind every increment: bump the counter where key is, or start it where the probe ended */
+static bool increment_hashed(CountMap *const map, const void *const key, const size_t hash, const int64_t delta) {
+	size_t insert_index;
+	const size_t index = find_index(map, key, hash, &insert_index);
+	if (index != NOT_FOUND) {
+		map->slots[index].count += delta;
+		return true;
+	}
+	if (map->size >= map->threshold) {
+		size_t new_cap;
+		if (!SlotTable_grow_capacity(map->capacity, &new_cap, sizeof(CountMapSlot))) {
+			log_warn("Max capacity reached for map, further attempts to expand will cause failure");
+			return false;
+		}
+		check_return(resize(map, new_cap), "Failed to resize map", false);
+		find_index(map, key, hash, &insert_index);
+	}
+	void *stored = map->key_copy ? map->key_copy(key) : (void *) key;
+	check_mem_return(stored, false);
+	map->slots[insert_index] = (CountMapSlot) {.key = stored, .hash = hash, .count = delta};
+	HashGroup_set_ctrl(map->ctrl, map->capacity, insert_index, HashGroup_tag(hash));
+	map->size++;
+	return true;
+}
+
+/** The caller releases the key */
+static inline void erase_index(CountMap *const map, const size_t index) {
+	SlotTable_erase(map->slots, map->ctrl, map->capacity, index, SLOT_LAYOUT);
+	map->size--;
+}
+
+static bool resize(CountMap *const map, const size_t new_capacity) {
+	CountMapSlot *slots = SlotTable_resize(map->slots, &map->ctrl, &map->capacity, new_capacity, SLOT_LAYOUT);
+	check_mem_return(slots, false);
+	map->slots = slots;
+	SlotTable_set_thresholds(map);
+	return true;
+}
+
+static void shrink_if_sparse(CountMap *const map) {
+	const size_t new_cap = SlotTable_shrink_capacity(map->size, map->shrink_threshold, map->capacity,
+													 map->min_capacity, sizeof(CountMapSlot));
+	if (new_cap) {
+		resize(map, new_cap);
+	}
+}
+
+/** Restore the min heap order below i in the first n entries of heap */
+static void sift_down(CountEntry *const heap, const size_t n, size_t i) {
+	const CountEntry entry = heap[i];
+	for (size_t child = 2 * i + 1; child < n; child = 2 * i + 1) {
+		if (child + 1 < n && heap[child + 1].count < heap[child].count) {
+			child++;
+		}
+		if (heap[child].count >= entry.count) {
+			break;
+		}
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = entry;
+}
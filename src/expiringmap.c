@@ -0,0 +1,309 @@
+//
+// HashMap with a time to live per entry
+//
+#include "expiringmap.h"
+
+#include <dbg.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "hashmap_internal.h"
+
+static uint64_t monotonic_ms(void);
+
+static void default_df(void *map_entry);
+
+static uint64_t deadline_after(uint64_t now, uint64_t ttl);
+
+static void wheel_schedule(TimerWheel *wheel, ExpiringNode *node);
+
+static void wheel_unlink(TimerWheel *wheel, ExpiringNode *node);
+
+static ExpiringNode *wheel_take_slot(TimerWheel *wheel, size_t level, size_t slot);
+
+static bool wheel_next(const TimerWheel *wheel, size_t *level, size_t *slot, uint64_t *start);
+
+static void release_node(ExpiringMap *map, ExpiringNode *node);
+
+static void free_list(ExpiringMap *map, ExpiringNode *node);
+
+static MapEntry *find_live(ExpiringMap *map, const void *key);
+
+ExpiringMap *ExpiringMap_create(const hash_fn hash_fn, const equals_fn equals_fn, const clock_fn clock,
+								const destructor_fn df) {
+	ExpiringMap *map = calloc(1, sizeof(ExpiringMap));
+	check_mem_return(map, NULL);
+	// Nodes are released by the expiring map, the HashMap only indexes them
+	map->map = HashMap_create(HASHMAP_DEFAULT_CAPACITY, hash_fn, equals_fn, NOOP);
+	check(map->map, "Failed to create map", free(map); return NULL);
+	map->clock = clock ? clock : monotonic_ms;
+	map->df = df ? df : default_df;
+	map->wheel.now = map->clock();
+	map->wheel.overflow_min = UINT64_MAX;
+	return map;
+}
+
+bool ExpiringMap_destroy(ExpiringMap *map) {
+	check_return(map, "Map is null", false);
+	ExpiringMap_clear(map);
+	HashMap_destroy(map->map);
+	free(map);
+	return true;
+}
+
+bool ExpiringMap_clear(ExpiringMap *map) {
+	check_return(map, "Map is null", false);
+	// The HashMap goes first, clearing it still looks at the entries
+	check_return(HashMap_clear(map->map), "Failed to clear map", false);
+	TimerWheel *wheel = &map->wheel;
+	for (size_t level = 0; level < EXPIRINGMAP_WHEEL_LEVELS; level++) {
+		while (wheel->occupied[level]) {
+			free_list(map, wheel_take_slot(wheel, level, __builtin_ctzll(wheel->occupied[level])));
+		}
+	}
+	free_list(map, wheel->overflow);
+	wheel->overflow = NULL;
+	wheel->overflow_min = UINT64_MAX;
+	return true;
+}
+
+bool ExpiringMap_put(ExpiringMap *const map, void *const key, void *const value, const uint64_t ttl) {
+	check_return(map, "Map is null", false);
+	check_return(key, "Key is null", false);
+	check_return(value, "Value is null", false);
+
+	const uint64_t deadline = deadline_after(map->clock(), ttl);
+	const size_t hash = HashMap_hash(map->map, key);
+	MapEntry *entry = HashMap_find_hashed(map->map, key, hash);
+	if (entry) {
+		ExpiringNode *node = (ExpiringNode *) entry;
+		// A key or value put again as the same pointer is kept, so it is hidden from df, see ExpiringMap_put
+		MapEntry replaced = *entry;
+		replaced.key = replaced.key != key ? replaced.key : NULL;
+		replaced.value = replaced.value != value ? replaced.value : NULL;
+		map->df(&replaced);
+		entry->key = key;
+		entry->value = value;
+		wheel_unlink(&map->wheel, node);
+		node->deadline = deadline;
+		wheel_schedule(&map->wheel, node);
+		return true;
+	}
+
+	ExpiringNode *node = malloc(sizeof(ExpiringNode));
+	check_mem_return(node, false);
+	node->entry = (MapEntry) {.key = key, .value = value, .hash = hash};
+	node->deadline = deadline;
+	if (!HashMap_attach_hashed(map->map, &node->entry)) {
+		free(node);
+		return false;
+	}
+	wheel_schedule(&map->wheel, node);
+	return true;
+}
+
+void *ExpiringMap_get(ExpiringMap *const map, const void *const key) {
+	check_return(map, "Map is null", NULL);
+	check_return(key, "Key is null", NULL);
+	const MapEntry *entry = find_live(map, key);
+	return entry ? entry->value : NULL;
+}
+
+bool ExpiringMap_touch(ExpiringMap *const map, const void *const key, const uint64_t ttl) {
+	check_return(map, "Map is null", false);
+	check_return(key, "Key is null", false);
+	ExpiringNode *node = (ExpiringNode *) find_live(map, key);
+	if (!node) {
+		return false;
+	}
+	wheel_unlink(&map->wheel, node);
+	node->deadline = deadline_after(map->clock(), ttl);
+	wheel_schedule(&map->wheel, node);
+	return true;
+}
+
+bool ExpiringMap_remove(ExpiringMap *const map, const void *const key) {
+	check_return(map, "Map is null", false);
+	check_return(key, "Key is null", false);
+	MapEntry *entry = HashMap_find_hashed(map->map, key, HashMap_hash(map->map, key));
+	if (!entry) {
+		return false;
+	}
+	release_node(map, (ExpiringNode *) entry);
+	return true;
+}
+
+size_t ExpiringMap_advance(ExpiringMap *const map, const uint64_t now) {
+	check_return(map, "Map is null", 0);
+	TimerWheel *wheel = &map->wheel;
+	size_t released = 0;
+	size_t level, slot;
+	uint64_t start;
+	// Slots are emptied earliest first, every node handed down lands in a slot that comes up later in this loop
+	while (wheel_next(wheel, &level, &slot, &start) && start <= now) {
+		if (start > wheel->now) {
+			wheel->now = start;
+		}
+		ExpiringNode *node = level < EXPIRINGMAP_WHEEL_LEVELS ? wheel_take_slot(wheel, level, slot) : wheel->overflow;
+		if (level == EXPIRINGMAP_WHEEL_LEVELS) {
+			wheel->overflow = NULL;
+			wheel->overflow_min = UINT64_MAX;
+		}
+		while (node) {
+			ExpiringNode *next = node->next;
+			if (level == 0) {
+				// Taken off the wheel already, only the map still has it
+				HashMap_detach_hashed(map->map, node->entry.key, node->entry.hash);
+				map->df(&node->entry);
+				free(node);
+				released++;
+			} else {
+				wheel_schedule(wheel, node);
+			}
+			node = next;
+		}
+	}
+	if (now > wheel->now) {
+		wheel->now = now;
+	}
+	map->expired += released;
+	return released;
+}
+
+size_t ExpiringMap_expire(ExpiringMap *const map) {
+	check_return(map, "Map is null", 0);
+	return ExpiringMap_advance(map, map->clock());
+}
+
+size_t ExpiringMap_size(const ExpiringMap *const map) {
+	check_return(map, "Map is null", 0);
+	return map->map->size;
+}
+
+
+// Private helper functions
+
+static uint64_t monotonic_ms(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000 + (uint64_t) now.tv_nsec / 1000000;
+}
+
+static void default_df(void *map_entry) {
+	MapEntry *entry = map_entry;
+	free(entry->key);
+	free(entry->value);
+}
+
+static inline uint64_t deadline_after(const uint64_t now, const uint64_t ttl) {
+	return ttl > UINT64_MAX - now ? UINT64_MAX : now + ttl;
+}
+
+/**
+ * Link node into the slot its deadline falls in: the lowest level where the deadline and the current tick
+ * only differ in that level's bits or below. Deadlines already passed go in the current level 0 slot, which
+ * the next advance empties.
+ */
+static void wheel_schedule(TimerWheel *const wheel, ExpiringNode *const node) {
+	ExpiringNode **head;
+	if (node->deadline <= wheel->now) {
+		node->level = 0;
+		node->slot = wheel->now % EXPIRINGMAP_WHEEL_SLOTS;
+	} else {
+		const unsigned highest_bit = 63 - __builtin_clzll(node->deadline ^ wheel->now);
+		node->level = highest_bit / EXPIRINGMAP_WHEEL_BITS;
+		node->slot = (node->deadline >> node->level * EXPIRINGMAP_WHEEL_BITS) % EXPIRINGMAP_WHEEL_SLOTS;
+	}
+	if (node->level < EXPIRINGMAP_WHEEL_LEVELS) {
+		head = &wheel->slots[node->level][node->slot];
+		wheel->occupied[node->level] |= UINT64_C(1) << node->slot;
+	} else {
+		node->level = EXPIRINGMAP_WHEEL_LEVELS;
+		head = &wheel->overflow;
+		if (node->deadline < wheel->overflow_min) {
+			wheel->overflow_min = node->deadline;
+		}
+	}
+	node->next = *head;
+	if (node->next) {
+		node->next->pprev = &node->next;
+	}
+	node->pprev = head;
+	*head = node;
+}
+
+static inline void wheel_unlink(TimerWheel *const wheel, ExpiringNode *const node) {
+	*node->pprev = node->next;
+	if (node->next) {
+		node->next->pprev = node->pprev;
+	}
+	if (node->level < EXPIRINGMAP_WHEEL_LEVELS && !wheel->slots[node->level][node->slot]) {
+		wheel->occupied[node->level] &= ~(UINT64_C(1) << node->slot);
+	}
+}
+
+/** @return the nodes of a slot, which is left empty */
+static inline ExpiringNode *wheel_take_slot(TimerWheel *const wheel, const size_t level, const size_t slot) {
+	ExpiringNode *nodes = wheel->slots[level][slot];
+	wheel->slots[level][slot] = NULL;
+	wheel->occupied[level] &= ~(UINT64_C(1) << slot);
+	return nodes;
+}
+
+/**
+ * Find the slot to empty next, the occupied one whose range of ticks starts first. All nodes of a level come
+ * before those of the level above, so that is the first occupied slot of the lowest occupied level.
+ * @param level set to EXPIRINGMAP_WHEEL_LEVELS for the overflow list
+ * @param start first tick of the slot, when it is due
+ * @return false if the wheel is empty
+ */
+static bool wheel_next(const TimerWheel *const wheel, size_t *const level, size_t *const slot, uint64_t *const start) {
+	for (size_t l = 0; l < EXPIRINGMAP_WHEEL_LEVELS; l++) {
+		const unsigned shift = l * EXPIRINGMAP_WHEEL_BITS;
+		const uint64_t pending = wheel->occupied[l] & (UINT64_MAX << (wheel->now >> shift) % EXPIRINGMAP_WHEEL_SLOTS);
+		if (pending) {
+			*level = l;
+			*slot = __builtin_ctzll(pending);
+			*start = (wheel->now & ~((UINT64_C(1) << (shift + EXPIRINGMAP_WHEEL_BITS)) - 1)) | (uint64_t) *slot << shift;
+			return true;
+		}
+	}
+	if (!wheel->overflow) {
+		return false;
+	}
+	// Due at the next span, or the one holding the earliest deadline if that is further out
+	const uint64_t next_span = (wheel->now | (EXPIRINGMAP_WHEEL_SPAN - 1)) + 1;
+	const uint64_t earliest_span = wheel->overflow_min & ~(EXPIRINGMAP_WHEEL_SPAN - 1);
+	*level = EXPIRINGMAP_WHEEL_LEVELS;
+	*slot = 0;
+	*start = earliest_span > next_span ? earliest_span : next_span;
+	return true;
+}
+
+/** Take node off the wheel and out of the map, then release it */
+static void release_node(ExpiringMap *const map, ExpiringNode *const node) {
+	wheel_unlink(&map->wheel, node);
+	HashMap_detach_hashed(map->map, node->entry.key, node->entry.hash);
+	map->df(&node->entry);
+	free(node);
+}
+
+static void free_list(ExpiringMap *const map, ExpiringNode *node) {
+	while (node) {
+		ExpiringNode *next = node->next;
+		map->df(&node->entry);
+		free(node);
+		node = next;
+	}
+}
+
+/** @return the entry for key, NULL if there is none or it has expired, in which case it is released */
+static MapEntry *find_live(ExpiringMap *const map, const void *const key) {
+	MapEntry *entry = HashMap_find_hashed(map->map, key, HashMap_hash(map->map, key));
+	if (entry && ((ExpiringNode *) entry)->deadline <= map->clock()) {
+		release_node(map, (ExpiringNode *) entry);
+		map->expired++;
+		return NULL;
+	}
+	return entry;
+}
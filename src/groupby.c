@@ -0,0 +1,460 @@
+//
+// Parallel hash aggregation over arrays of records, GROUP BY for data in memory
+//
+#include "groupby.h"
+
+#include <dbg.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashmap_internal.h"
+
+// Below this many records threads cost more than they save
+#define GROUPBY_PARALLEL_MIN 16384
+// Records a thread takes at a time, enough to make the atomic counter cheap, few enough to even out the end
+#define GROUPBY_CHUNK 4096
+// Partitions per thread, so that a thread that drew big partitions doesn't hold up the merge
+#define GROUPBY_PARTITIONS_PER_THREAD 8
+#define TABLE_MIN_CAPACITY 16
+
+/** The fixed part of a table row, the states of the aggregates follow. An empty row has a NULL key. */
+typedef struct TableRow {
+	const void *key;
+	size_t hash;
+} TableRow;
+
+/** Open addressing table of rows stored inline, linear probing, at most 3/4 full */
+typedef struct GroupTable {
+	unsigned char *rows;
+	size_t capacity;
+	size_t size;
+} GroupTable;
+
+typedef struct GroupRun GroupRun;
+
+/** A thread and its tables, one per partition */
+typedef struct GroupWorker {
+	GroupRun *run;
+	GroupTable *tables;
+} GroupWorker;
+
+struct GroupRun {
+	const GroupBySpec *spec;
+	const ArrayList *list;          /**< The input, either list or records */
+	const unsigned char *records;
+	size_t record_size;
+	size_t n;
+	size_t states_size;             /**< Bytes of aggregate state per row */
+	size_t stride;                  /**< Bytes per table row */
+	uint64_t seed;
+	size_t partitions;
+	unsigned partition_bits;
+	GroupWorker *workers;
+	size_t nthreads;
+	GroupRow **rows;                /**< Result rows of every partition, rows_start[p] is where they go */
+	size_t *rows_start;
+	size_t next_chunk;              /**< Handed out atomically */
+	size_t next_partition;
+	bool failed;
+};
+
+static ArrayList *group_by(GroupRun *run);
+
+static void *aggregate_chunks(void *arg);
+
+static void *merge_partitions(void *arg);
+
+static bool merge_partition(GroupRun *run, size_t partition);
+
+static TableRow *find_or_add(const GroupRun *run, GroupTable *table, const void *key, size_t hash, bool *added);
+
+static bool grow_table(const GroupRun *run, GroupTable *table);
+
+static size_t slots_of(const GroupAggregate *aggregate);
+
+static void init_states(const GroupBySpec *spec, int64_t *states);
+
+static void update_states(const GroupBySpec *spec, int64_t *states, const void *record);
+
+static void merge_states(const GroupBySpec *spec, int64_t *states, const int64_t *other);
+
+static bool valid_spec(const GroupBySpec *spec);
+
+ArrayList *GroupBy_list(const ArrayList *const list, const GroupBySpec *const spec) {
+	check_return(list && spec, "List or spec is null", NULL);
+	check_return(valid_spec(spec), "Invalid spec", NULL);
+	GroupRun run = {.spec = spec, .list = list, .n = ArrayList_size(list)};
+	return group_by(&run);
+}
+
+ArrayList *GroupBy_array(const void *const records, const size_t n, const size_t record_size,
+						 const GroupBySpec *const spec) {
+	check_return(spec, "Spec is null", NULL);
+	check_return(records || n == 0, "Records are null", NULL);
+	check_return(record_size > 0, "Record size must be > 0", NULL);
+	check_return(valid_spec(spec), "Invalid spec", NULL);
+	GroupRun run = {.spec = spec, .records = records, .record_size = record_size, .n = n};
+	return group_by(&run);
+}
+
+int64_t GroupRow_value(const GroupBySpec *const spec, const GroupRow *const row, const size_t i) {
+	check_return(spec && row, "Spec or row is null", 0);
+	check_return(i < spec->aggregate_count && spec->aggregates[i].kind != GROUP_CUSTOM,
+				 "Aggregate %zu has no value", 0, i);
+	return *(const int64_t *) GroupRow_state(spec, row, i);
+}
+
+const void *GroupRow_state(const GroupBySpec *const spec, const GroupRow *const row, const size_t i) {
+	check_return(spec && row, "Spec or row is null", NULL);
+	check_return(i < spec->aggregate_count, "No aggregate %zu", NULL, i);
+	size_t slot = 0;
+	for (size_t j = 0; j < i; j++) {
+		slot += slots_of(&spec->aggregates[j]);
+	}
+	return &row->values[slot];
+}
+
+
+// Private helper functions
+
+static ArrayList *group_by(GroupRun *const run) {
+	const GroupBySpec *spec = run->spec;
+	for (size_t i = 0; i < spec->aggregate_count; i++) {
+		run->states_size += slots_of(&spec->aggregates[i]) * sizeof(int64_t);
+	}
+	run->stride = sizeof(TableRow) + run->states_size;
+	run->seed = HashMap_new_seed();
+	run->nthreads = spec->nthreads ? spec->nthreads : HashMap_online_cpus();
+	if (run->n < GROUPBY_PARALLEL_MIN) {
+		run->nthreads = 1;
+	} else if (run->nthreads > run->n / GROUPBY_CHUNK) {
+		run->nthreads = run->n / GROUPBY_CHUNK;
+	}
+	// Power of two partitions picked by the top bits of the hash, the tables index by the low bits
+	run->partitions = 1;
+	run->partition_bits = 0;
+	while (run->nthreads > 1 && run->partitions < run->nthreads * GROUPBY_PARTITIONS_PER_THREAD) {
+		run->partitions *= 2;
+		run->partition_bits++;
+	}
+
+	ArrayList *result = NULL;
+	GroupTable *tables = calloc(run->nthreads * run->partitions, sizeof(GroupTable));
+	run->workers = calloc(run->nthreads, sizeof(GroupWorker));
+	run->rows_start = calloc(run->partitions + 1, sizeof(size_t));
+	check_mem(tables && run->workers && run->rows_start, goto done);
+	for (size_t t = 0; t < run->nthreads; t++) {
+		run->workers[t] = (GroupWorker) {.run = run, .tables = tables + t * run->partitions};
+	}
+
+	check(HashMap_run_parallel(run->workers, sizeof(GroupWorker), run->nthreads, aggregate_chunks) && !run->failed,
+		  "Failed to aggregate", goto done);
+	// Room for the rows of every partition as if no key were shared between threads, merging only ever
+	// leaves fewer
+	size_t offset = 0;
+	for (size_t p = 0; p < run->partitions; p++) {
+		run->rows_start[p] = offset;
+		for (size_t t = 0; t < run->nthreads; t++) {
+			offset += run->workers[t].tables[p].size;
+		}
+	}
+	run->rows_start[run->partitions] = offset;
+	run->rows = calloc(offset > 0 ? offset : 1, sizeof(GroupRow *));
+	check_mem(run->rows, goto done);
+	bool merged = HashMap_run_parallel(run->workers, sizeof(GroupWorker), run->nthreads, merge_partitions) &&
+				  !run->failed;
+
+	size_t total = 0;
+	for (size_t p = 0; p < run->partitions; p++) {
+		total += run->workers[0].tables[p].size;
+	}
+	check(total <= UINT_MAX, "Too many groups for a list", merged = false);
+	result = merged ? ArrayList_create(total > 0 ? (unsigned int) total : ARRAYLIST_DEFAULT_CAPACITY, free) : NULL;
+	// Whatever happened, every row made it into rows and goes to the list or is freed here
+	for (size_t p = 0; p < run->partitions; p++) {
+		for (size_t i = run->rows_start[p]; i < run->rows_start[p + 1] && run->rows[i]; i++) {
+			if (!result || !ArrayList_add(result, run->rows[i])) {
+				free(run->rows[i]);
+				merged = false;
+			}
+		}
+	}
+	if (!merged && result) {
+		ArrayList_destroy(result);
+		result = NULL;
+	}
+	check(result, "Failed to merge groups", goto done);
+done:
+	for (size_t i = 0; tables && i < run->nthreads * run->partitions; i++) {
+		free(tables[i].rows);
+	}
+	free(tables);
+	free(run->workers);
+	free(run->rows);
+	free(run->rows_start);
+	return result;
+}
+
+/** Aggregate chunks of the input into the worker's own tables until the input runs out */
+static void *aggregate_chunks(void *arg) {
+	GroupWorker *worker = arg;
+	GroupRun *run = worker->run;
+	const GroupBySpec *spec = run->spec;
+	for (;;) {
+		const size_t from = __atomic_fetch_add(&run->next_chunk, GROUPBY_CHUNK, __ATOMIC_RELAXED);
+		if (from >= run->n || __atomic_load_n(&run->failed, __ATOMIC_RELAXED)) {
+			return NULL;
+		}
+		const size_t to = run->n - from > GROUPBY_CHUNK ? from + GROUPBY_CHUNK : run->n;
+		for (size_t i = from; i < to; i++) {
+			const void *record = run->list
+				? ArrayList_get(run->list, (unsigned int) i)
+				: run->records + i * run->record_size;
+			const void *key = spec->key_fn(record);
+			if (!key) {
+				continue;
+			}
+			const size_t hash = (size_t) Commons_hash_u64_seeded(spec->hash_fn(key), run->seed);
+			GroupTable *table = &worker->tables[run->partition_bits ? hash >> (sizeof(size_t) * 8 - run->partition_bits) : 0];
+			bool added;
+			TableRow *row = find_or_add(run, table, key, hash, &added);
+			if (!row) {
+				__atomic_store_n(&run->failed, true, __ATOMIC_RELAXED);
+				return NULL;
+			}
+			int64_t *states = (int64_t *) (row + 1);
+			if (added) {
+				init_states(spec, states);
+			}
+			update_states(spec, states, record);
+		}
+	}
+}
+
+static void *merge_partitions(void *arg) {
+	GroupRun *run = ((GroupWorker *) arg)->run;
+	for (;;) {
+		const size_t p = __atomic_fetch_add(&run->next_partition, 1, __ATOMIC_RELAXED);
+		if (p >= run->partitions) {
+			return NULL;
+		}
+		// Carries on after a failure, every partition has to hand out its rows for them to be freed
+		if (!merge_partition(run, p)) {
+			__atomic_store_n(&run->failed, true, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+/**
+ * Merge partition p of every thread into the biggest one, which saves reinserting its rows, and move the
+ * result out as GroupRows. The merged table ends up in the tables of the first worker.
+ * @return false if out of memory
+ */
+static bool merge_partition(GroupRun *const run, const size_t partition) {
+	size_t largest = 0;
+	for (size_t t = 1; t < run->nthreads; t++) {
+		if (run->workers[t].tables[partition].size > run->workers[largest].tables[partition].size) {
+			largest = t;
+		}
+	}
+	GroupTable target = run->workers[largest].tables[partition];
+	run->workers[largest].tables[partition] = run->workers[0].tables[partition];
+	run->workers[0].tables[partition] = target;
+	GroupTable *merged = &run->workers[0].tables[partition];
+
+	bool ok = true;
+	for (size_t t = 1; t < run->nthreads && ok; t++) {
+		const GroupTable *source = &run->workers[t].tables[partition];
+		for (size_t i = 0; i < source->capacity && ok; i++) {
+			const TableRow *row = (const TableRow *) (source->rows + i * run->stride);
+			if (!row->key) {
+				continue;
+			}
+			bool added;
+			TableRow *into = find_or_add(run, merged, row->key, row->hash, &added);
+			ok = into != NULL;
+			if (ok && added) {
+				memcpy(into + 1, row + 1, run->states_size);
+			} else if (ok) {
+				merge_states(run->spec, (int64_t *) (into + 1), (const int64_t *) (row + 1));
+			}
+		}
+	}
+
+	GroupRow **out = run->rows + run->rows_start[partition];
+	GroupRow **end = run->rows + run->rows_start[partition + 1];
+	for (size_t i = 0; i < merged->capacity && ok; i++) {
+		const TableRow *row = (const TableRow *) (merged->rows + i * run->stride);
+		if (!row->key) {
+			continue;
+		}
+		GroupRow *group = malloc(sizeof(GroupRow) + run->states_size);
+		ok = group != NULL;
+		if (ok) {
+			group->key = row->key;
+			memcpy(group->values, row + 1, run->states_size);
+			*out++ = group;
+		}
+	}
+	if (out < end) {
+		*out = NULL;
+	}
+	return ok;
+}
+
+/**
+ * The row of key, added with uninitialized states if key is not in the table yet
+ * @return NULL if the table had to grow and could not
+ */
+static TableRow *find_or_add(const GroupRun *const run, GroupTable *const table, const void *const key,
+							 const size_t hash, bool *const added) {
+	if ((table->size + 1) * 4 > table->capacity * 3 && !grow_table(run, table)) {
+		return NULL;
+	}
+	const size_t mask = table->capacity - 1;
+	for (size_t index = hash & mask;; index = (index + 1) & mask) {
+		TableRow *row = (TableRow *) (table->rows + index * run->stride);
+		if (!row->key) {
+			row->key = key;
+			row->hash = hash;
+			table->size++;
+			*added = true;
+			return row;
+		}
+		if (row->hash == hash && (row->key == key || run->spec->equals_fn(row->key, key))) {
+			*added = false;
+			return row;
+		}
+	}
+}
+
+static bool grow_table(const GroupRun *const run, GroupTable *const table) {
+	const size_t capacity = table->capacity ? table->capacity * 2 : TABLE_MIN_CAPACITY;
+	unsigned char *rows = calloc(capacity, run->stride);
+	check_mem_return(rows, false);
+	const size_t mask = capacity - 1;
+	for (size_t i = 0; i < table->capacity; i++) {
+		const TableRow *row = (const TableRow *) (table->rows + i * run->stride);
+		if (!row->key) {
+			continue;
+		}
+		size_t index = row->hash & mask;
+		while (((const TableRow *) (rows + index * run->stride))->key) {
+			index = (index + 1) & mask;
+		}
+		memcpy(rows + index * run->stride, row, run->stride);
+	}
+	free(table->rows);
+	table->rows = rows;
+	table->capacity = capacity;
+	return true;
+}
+
+/** int64_t slots an aggregate takes in a row */
+static size_t slots_of(const GroupAggregate *const aggregate) {
+	if (aggregate->kind != GROUP_CUSTOM) {
+		return 1;
+	}
+	return (aggregate->state_size + sizeof(int64_t) - 1) / sizeof(int64_t);
+}
+
+static void init_states(const GroupBySpec *const spec, int64_t *states) {
+	for (size_t i = 0; i < spec->aggregate_count; i++) {
+		const GroupAggregate *aggregate = &spec->aggregates[i];
+		switch (aggregate->kind) {
+			case GROUP_MIN:
+				*states = INT64_MAX;
+				break;
+			case GROUP_MAX:
+				*states = INT64_MIN;
+				break;
+			case GROUP_CUSTOM:
+				aggregate->init(states);
+				break;
+			default:
+				*states = 0;
+				break;
+		}
+		states += slots_of(aggregate);
+	}
+}
+
+static void update_states(const GroupBySpec *const spec, int64_t *states, const void *const record) {
+	for (size_t i = 0; i < spec->aggregate_count; i++) {
+		const GroupAggregate *aggregate = &spec->aggregates[i];
+		switch (aggregate->kind) {
+			case GROUP_COUNT:
+				(*states)++;
+				break;
+			case GROUP_SUM:
+				*states = (int64_t) ((uint64_t) *states + (uint64_t) aggregate->value_fn(record));
+				break;
+			case GROUP_MIN: {
+				const int64_t value = aggregate->value_fn(record);
+				*states = value < *states ? value : *states;
+				break;
+			}
+			case GROUP_MAX: {
+				const int64_t value = aggregate->value_fn(record);
+				*states = value > *states ? value : *states;
+				break;
+			}
+			case GROUP_CUSTOM:
+				aggregate->update(states, record);
+				break;
+		}
+		states += slots_of(aggregate);
+	}
+}
+
+static void merge_states(const GroupBySpec *const spec, int64_t *states, const int64_t *other) {
+	for (size_t i = 0; i < spec->aggregate_count; i++) {
+		const GroupAggregate *aggregate = &spec->aggregates[i];
+		switch (aggregate->kind) {
+			case GROUP_COUNT:
+			case GROUP_SUM:
+				*states = (int64_t) ((uint64_t) *states + (uint64_t) *other);
+				break;
+			case GROUP_MIN:
+				*states = *other < *states ? *other : *states;
+				break;
+			case GROUP_MAX:
+				*states = *other > *states ? *other : *states;
+				break;
+			case GROUP_CUSTOM:
+				aggregate->merge(states, other);
+				break;
+		}
+		states += slots_of(aggregate);
+		other += slots_of(aggregate);
+	}
+}
+
+static bool valid_spec(const GroupBySpec *const spec) {
+	if (!spec->key_fn || !spec->hash_fn || !spec->equals_fn || (spec->aggregate_count > 0 && !spec->aggregates)) {
+		return false;
+	}
+	for (size_t i = 0; i < spec->aggregate_count; i++) {
+		const GroupAggregate *aggregate = &spec->aggregates[i];
+		switch (aggregate->kind) {
+			case GROUP_COUNT:
+				break;
+			case GROUP_SUM:
+			case GROUP_MIN:
+			case GROUP_MAX:
+				if (!aggregate->value_fn) {
+					return false;
+				}
+				break;
+			case GROUP_CUSTOM:
+				if (!aggregate->init || !aggregate->update || !aggregate->merge || aggregate->state_size == 0) {
+					return false;
+				}
+				break;
+			default:
+				return false;
+		}
+	}
+	return true;
+}
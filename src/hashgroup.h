@@ -0,0 +1,76 @@
+//
+// Control byte groups shared by the open addressing tables.
+//
+// Every slot in a table has one control byte. An empty slot is 0x00, a full slot is 0x80 | a 7 bit tag taken
+// from the top of the hash. Groups of HASHGROUP_WIDTH control bytes are matched at once, with SSE2 when the
+// target has it and with a plain loop (that compilers happily vectorize) when it does not.
+//
+#ifndef libfaafo_HASHGROUP_H
+#define libfaafo_HASHGROUP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define HASHGROUP_WIDTH 16
+#define CTRL_EMPTY ((uint8_t) 0x00)
+#define CTRL_FULL_BIT ((uint8_t) 0x80)
+
+/** One bit per control byte in a group, bit 0 is the first byte */
+typedef uint32_t GroupMask;
+
+/** Number of control bytes to allocate for a table of capacity slots (the tail mirrors the head) */
+#define HashGroup_ctrl_bytes(capacity) ((capacity) + HASHGROUP_WIDTH - 1)
+
+/** Offset of the lowest set bit in a non-empty mask */
+#define HashGroup_lowest(mask) ((size_t) __builtin_ctz(mask))
+
+static inline uint8_t HashGroup_tag(const size_t hash) {
+	return (uint8_t) (CTRL_FULL_BIT | (hash >> (sizeof(size_t) * 8 - 7)));
+}
+
+static inline GroupMask HashGroup_match(const uint8_t *group, const uint8_t tag) {
+#if defined(__SSE2__)
+	const __m128i ctrl = _mm_loadu_si128((const __m128i *) group);
+	return (GroupMask) _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char) tag)));
+#else
+	GroupMask mask = 0;
+	for (unsigned i = 0; i < HASHGROUP_WIDTH; i++) {
+		mask |= (GroupMask) (group[i] == tag) << i;
+	}
+	return mask;
+#endif
+}
+
+static inline GroupMask HashGroup_match_empty(const uint8_t *group) {
+	return HashGroup_match(group, CTRL_EMPTY);
+}
+
+/** Full slots are the only control bytes with the top bit set */
+static inline GroupMask HashGroup_match_full(const uint8_t *group) {
+#if defined(__SSE2__)
+	return (GroupMask) _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) group));
+#else
+	GroupMask mask = 0;
+	for (unsigned i = 0; i < HASHGROUP_WIDTH; i++) {
+		mask |= (GroupMask) (group[i] >> 7) << i;
+	}
+	return mask;
+#endif
+}
+
+/**
+ * Set the control byte for a slot, keeping the mirrored tail in sync so that a group load starting
+ * anywhere in the table never has to wrap around.
+ */
+static inline void HashGroup_set_ctrl(uint8_t *ctrl, const size_t capacity, const size_t index, const uint8_t value) {
+	ctrl[index] = value;
+	if (index < HASHGROUP_WIDTH - 1) {
+		ctrl[capacity + index] = value;
+	}
+}
+
+#endif //libfaafo_HASHGROUP_H
@@ -7,114 +7,285 @@
 #include <stdint.h>
 #include <stdlib.h>
 
-#define set_threshold(map) ((map)->threshold = (size_t)((map)->capacity * HASHMAP_LOAD_FACTOR))
+#include "hashgroup.h"
+#include "hashmap_internal.h"
+#include "treebin.h"
 
-struct ListNodePair {
-	LinkedList *list;
-	Node *node;
-};
+#define set_threshold(map) ((map)->threshold = (size_t)((map)->capacity * HASHMAP_LOAD_FACTOR), \
+	(map)->shrink_threshold = (size_t)((map)->capacity * HASHMAP_SHRINK_LOAD_FACTOR))
+
+#define is_migrating(map) ((map)->old.slots != NULL)
+
+#if HashGroup_ctrl_bytes(HASHMAP_MIN_CAPACITY) > HASHMAP_SMALL_CTRL_BYTES
+#error "The embedded table has no room for the control bytes of a HASHMAP_MIN_CAPACITY table"
+#endif
+
+#if HASHMAP_SMALL_ENTRIES > 32
+#error "small_entries_used has one bit per embedded entry"
+#endif
+
+// small_entries_used with every embedded entry taken
+#define SMALL_ENTRIES_ALL ((uint32_t) ((1ull << HASHMAP_SMALL_ENTRIES) - 1))
+
+// Returned by find_index when the key is not in the map
+#define NOT_FOUND SIZE_MAX
+
+/** Where a key is in the map, or where it goes */
+typedef struct Location {
+	MapEntry **table;   /**< Table holding the slot at index, NULL if key has no entry and no bin */
+	size_t index;       /**< Slot of the entry or bin for key, otherwise the slot a new entry goes in */
+	MapEntry *entry;    /**< Entry for key, NULL if key is not in the map */
+	TreeBin *bin;       /**< Bin that holds the entries with the hash of key, NULL if there is none */
+	size_t same_hash;   /**< Entries probed past that share the hash of key, when there is no bin */
+} Location;
 
 static void default_map_entry_df(void *value);
 
 static size_t generate_hash(const HashMap *map, const void *key);
 
-static MapEntry *create_entry(void *key, void *value, size_t hash);
+static MapEntry *create_entry(HashMap *map, void *key, void *value, size_t hash);
+
+static void release_entry(HashMap *map, MapEntry *entry);
+
+static bool is_small_entry(const HashMap *map, const MapEntry *entry);
+
+static void free_entry(HashMap *map, MapEntry *entry);
+
+static bool allocate_table(HashMap *map, size_t capacity, MapEntry ***out_slots, uint8_t **out_ctrl);
+
+static void free_table(HashMap *map, MapEntry **slots);
+
+static size_t probe(const HashMap *map, MapEntry *const *slots, const uint8_t *ctrl, size_t mask, size_t pos,
+					const void *key, size_t hash, size_t *insert_index, size_t *same_hash);
+
+static size_t find_index(const HashMap *map, const void *key, size_t hash);
+
+static size_t find_old_index(const HashMap *map, const void *key, size_t hash);
+
+static bool locate(HashMap *map, const void *key, size_t hash, Location *loc);
+
+static void find_location(const HashMap *map, const void *key, size_t hash, Location *loc);
+
+static void place_entry(HashMap *map, const Location *loc, MapEntry *entry);
+
+static MapEntry *new_entry(HashMap *map, const void *key, copy_fn key_copy, size_t hash);
+
+static void discard_entry(HashMap *map, MapEntry *entry, const void *key);
+
+static MapEntry *detach_at(HashMap *map, const Location *loc);
+
+static void remove_at(HashMap *map, const Location *loc);
 
-static void add_new_entry(HashMap *map, size_t index, void *key, void *value, size_t hash);
+static bool treeify(HashMap *map, MapEntry *entry);
 
-static void *handle_existing(HashMap *map, LinkedList *bucket, size_t hash, void *key, void *new_value);
+static void untreeify(HashMap *map, const Location *loc);
+
+static void insert_entry(MapEntry **slots, uint8_t *ctrl, size_t capacity, MapEntry *entry);
+
+static void erase_index(MapEntry **slots, uint8_t *ctrl, size_t capacity, size_t index);
+
+static void erase_slot(HashMap *map, MapEntry **table, size_t index);
+
+static void release_entries(HashMap *map);
+
+static void destroy_entries(HashMap *map, MapEntry **slots, const uint8_t *ctrl, size_t capacity, bool release);
 
 static bool expand(HashMap *map);
 
+static size_t capacity_for(size_t n);
+
+static void shrink(HashMap *map);
+
 static bool resize(HashMap *map, size_t new_capacity);
 
-static void rehash_old_buckets(const HashMap *map, size_t old_cap);
+static bool start_migration(HashMap *map, size_t new_capacity);
+
+static void finish_migration(HashMap *map);
+
+static void prefetch_home(const HashMap *map, size_t hash);
+
+static void prefetch_match(const HashMap *map, size_t hash);
+
+static void iter_start(HashMapIterator *it, MapEntry *const *slots, const uint8_t *ctrl, size_t capacity);
 
-static void find_node(const HashMap *map, const void *key, size_t hash, struct ListNodePair *out_pair);
+static bool for_each_table(MapEntry *const *slots, const uint8_t *ctrl, size_t capacity, map_visit_fn fn, void *ctx);
 
-HashMap *HashMap_create(const size_t capacity, const hash_fn hash_fn, const equals_fn equals_fn, const destructor_fn map_entry_df) {
+HashMap *HashMap_create(size_t capacity, const hash_fn hash_fn, const equals_fn equals_fn, const destructor_fn map_entry_df) {
 	check_return(capacity > 0, "Capacity must be > 0", NULL);
 	check_return((capacity & (capacity - 1)) == 0, "Capacity must be a power of 2", NULL);
 	check_return(hash_fn, "Hash function must not be null", NULL);
 	check_return(equals_fn, "Equals function must not be null", NULL);
 
+	// Groups are loaded HASHGROUP_WIDTH control bytes at a time, smaller tables would wrap onto themselves
+	if (capacity < HASHMAP_MIN_CAPACITY) {
+		capacity = HASHMAP_MIN_CAPACITY;
+	}
+
 	HashMap *map = calloc(1, sizeof(HashMap));
 	check_mem_return(map, NULL);
 
-	LinkedList **buckets = calloc(capacity, sizeof(LinkedList *));
-	check_mem(buckets, goto catch);
+	check_mem(allocate_table(map, capacity, &map->slots, &map->ctrl), goto catch);
 
-	map->buckets = buckets;
 	map->size = 0;
 	map->capacity = capacity;
+	map->min_capacity = capacity;
 	map->hash_fn = hash_fn;
 	map->equals_fn = equals_fn;
 	map->df = map_entry_df ? map_entry_df : default_map_entry_df;
+	map->seed = HashMap_new_seed();
 	set_threshold(map);
 	return map;
 catch:
-	// Doing simple free instead of HashMap_destroy since buckets will have no values to clear here
-	free(map->buckets);
 	free(map);
 	return NULL;
 }
 
-void *HashMap_put(HashMap *const map, void *key, void *const value) {
+HashMap *HashMap_create_arena(const size_t capacity, const hash_fn hash_fn, const equals_fn equals_fn,
+							  const size_t chunk_size) {
+	Arena *arena = Arena_create(chunk_size);
+	check_mem_return(arena, NULL);
+
+	// Entries are never destroyed one by one in arena mode, so the destructor is never called
+	HashMap *map = HashMap_create(capacity, hash_fn, equals_fn, NOOP);
+	check(map, "Failed to create map", goto catch);
+	map->arena = arena;
+	map->free_entries = NULL;
+	return map;
+catch:
+	Arena_destroy(arena);
+	return NULL;
+}
+
+void *HashMap_arena_alloc(HashMap *const map, const size_t size) {
 	check_return(map, "Map is null", NULL);
-	check_return(key, "Key is null", NULL);
-	check_return(value, "Value is null", NULL);
+	check_return(map->arena, "Map is not in arena mode", NULL);
+	return Arena_alloc(map->arena, size);
+}
 
-	const bool is_time_to_expand = map->size >= map->threshold;
-	if (is_time_to_expand) {
-		const bool is_expanded = expand(map);
-		check_return(is_expanded, "Failed to expand map", NULL);
+bool HashMap_set_incremental_resize(HashMap *const map, const size_t migrate_step) {
+	check_return(map, "Map is null", false);
+	if (migrate_step == 0) {
+		// Turning it off mid migration, finish the job right away
+		finish_migration(map);
 	}
-	const size_t hash = generate_hash(map, key);
-	const size_t index = hash & (map->capacity - 1); // Java style but will break if cap not powers of 2
-	LinkedList *bucket = map->buckets[index];
-	if (bucket) {
-		return handle_existing(map, bucket, hash, key, value);
+	map->migrate_step = migrate_step;
+	return true;
+}
+
+bool HashMap_set_compare(HashMap *const map, const compare_fn compare_fn) {
+	check_return(map, "Map is null", false);
+	check_return(map->tree_bins == 0 || compare_fn == map->compare_fn,
+				 "Map has tree bins ordered by another comparator", false);
+	map->compare_fn = compare_fn;
+	return true;
+}
+
+bool HashMap_rehash_step(HashMap *const map, size_t n_slots) {
+	check_return(map, "Map is null", false);
+	if (!is_migrating(map)) {
+		return false;
 	}
-	add_new_entry(map, index, key, value, hash);
-	return NULL; // No previous entry to return
+
+	HashMapMigration *old = &map->old;
+	const size_t mask = old->capacity - 1;
+	for (; n_slots > 0 && old->done < old->capacity; n_slots--, old->done++) {
+		/*
+		 * Slots are moved in order starting right after an empty one, so no probe run in the old table ever
+		 * straddles the migrated region and find_old_index can resume probing where the migration is at.
+		 */
+		const size_t index = (old->start + old->done) & mask;
+		if (old->ctrl[index] != CTRL_EMPTY) {
+			insert_entry(map->slots, map->ctrl, map->capacity, old->slots[index]);
+			old->slots[index] = NULL;
+			HashGroup_set_ctrl(old->ctrl, old->capacity, index, CTRL_EMPTY);
+		}
+	}
+	if (old->done < old->capacity) {
+		return true;
+	}
+	free_table(map, old->slots);
+	map->old = (HashMapMigration) {0};
+	return false;
+}
+
+void *HashMap_put(HashMap *const map, void *key, void *const value) {
+	check_return(map, "Map is null", NULL);
+	check_return(key, "Key is null", NULL);
+	check_return(value, "Value is null", NULL);
+	return HashMap_put_hashed(map, key, value, generate_hash(map, key));
 }
 
 void *HashMap_get(const HashMap *map, void *key) {
 	check_return(map, "Map is null", NULL);
 	check_return(key, "Key is null", NULL);
 
-	struct ListNodePair pair = {0};
-	find_node(map, key, generate_hash(map, key), &pair);
-	Node *node = pair.node;
-	check_return(node, "No entry found", NULL);
-	const MapEntry *entry = (MapEntry *) node->value;
+	MapEntry *entry = HashMap_find_hashed(map, key, generate_hash(map, key));
+	check_return(entry, "No entry found", NULL);
 	return entry->value;
 }
 
 bool HashMap_destroy(HashMap *map) {
 	check_return(map, "Map is null", false);
-	const bool cleared = HashMap_clear(map);
-	check_return(cleared, "Could not clear map", false);
-	free(map->buckets);
+	// No clear, it would swap a grown table for a fresh one only to free that right away
+	release_entries(map);
+	if (map->arena) {
+		Arena_destroy(map->arena);
+	}
+	free_table(map, map->slots);
 	free(map);
 	return true;
 }
 
 bool HashMap_clear(HashMap *map) {
 	check_return(map, "Map is null", false);
-	for (size_t i = 0; i < map->capacity; i++) {
-		LinkedList *bucket = map->buckets[i];
-		if (bucket) {
-			/*
-			 * Since we only initialize a bucket when needing to put data at that index, NULL buckets are likely
-			 * to exist, and we don't want to break out if we hit one.
-			 */
-			LinkedList_destroy(bucket, true);
-			map->buckets[i] = NULL;
-		}
+	release_entries(map);
+	if (map->arena) {
+		// Entries, and whatever keys and values came from HashMap_arena_alloc, go with the chunks
+		Arena_reset(map->arena);
+		map->free_entries = NULL;
+	}
+	MapEntry **slots;
+	uint8_t *ctrl;
+	if (map->capacity > map->min_capacity && allocate_table(map, map->min_capacity, &slots, &ctrl)) {
+		// Don't hold on to what an earlier burst of inserts grew the table to
+		free_table(map, map->slots);
+		map->slots = slots;
+		map->ctrl = ctrl;
+		map->capacity = map->min_capacity;
+		set_threshold(map);
+	} else if (map->size > 0) {
+		memset(map->slots, 0, map->capacity * sizeof(MapEntry *));
+		memset(map->ctrl, CTRL_EMPTY, HashGroup_ctrl_bytes(map->capacity));
 	}
-	// Reset size, keep capacity
 	map->size = 0;
+	map->tree_bins = 0;
+	return true;
+}
+
+bool HashMap_reserve(HashMap *const map, const size_t n) {
+	check_return(map, "Map is null", false);
+	const size_t capacity = capacity_for(n);
+	check_return(capacity > 0, "Can't make room for %zu entries", false, n);
+	if (capacity > map->capacity) {
+		finish_migration(map);
+		check_return(resize(map, capacity), "Failed to resize map", false);
+	}
+	if (capacity > map->min_capacity) {
+		map->min_capacity = capacity;
+	}
+	return true;
+}
+
+bool HashMap_compact(HashMap *const map) {
+	check_return(map, "Map is null", false);
+	finish_migration(map);
+	const size_t capacity = capacity_for(map->size);
+	if (capacity < map->capacity) {
+		check_return(resize(map, capacity), "Failed to resize map", false);
+	}
+	if (capacity < map->min_capacity) {
+		map->min_capacity = capacity;
+	}
 	return true;
 }
 
@@ -122,14 +293,327 @@ bool HashMap_remove(HashMap *const map, void *key) {
 	check_return(map, "Map is null", false);
 	check_return(key, "Key is null", false);
 
-	struct ListNodePair pair = {0};
-	find_node(map, key, generate_hash(map, key), &pair);
-	check_return(pair.node && pair.list, "Node or list not found for key", false);
-	LinkedList_remove(pair.list, pair.node);
-	map->size--;
+	const bool removed = HashMap_remove_hashed(map, key, generate_hash(map, key));
+	check_return(removed, "Node or list not found for key", false);
+	return true;
+}
+
+void *HashMap_get_or_insert_with(HashMap *const map, const void *const key, const copy_fn key_copy,
+								 const supplier_fn supplier, void *const ctx) {
+	check_return(map, "Map is null", NULL);
+	check_return(key, "Key is null", NULL);
+	check_return(supplier, "Supplier is null", NULL);
+
+	const size_t hash = generate_hash(map, key);
+	Location loc;
+	check_return(locate(map, key, hash, &loc), "Failed to expand map", NULL);
+	if (loc.entry) {
+		return loc.entry->value;
+	}
+	// Only now that the key is known to be new do the key and the value get materialized
+	MapEntry *entry = new_entry(map, key, key_copy, hash);
+	check_return(entry, "Failed to create entry", NULL);
+	entry->value = supplier(key, ctx);
+	if (!entry->value) {
+		log_err("Supplier returned no value");
+		discard_entry(map, entry, key);
+		return NULL;
+	}
+	place_entry(map, &loc, entry);
+	return entry->value;
+}
+
+void *HashMap_compute(HashMap *const map, const void *const key, const copy_fn key_copy, const compute_fn fn,
+					  void *const ctx) {
+	check_return(map, "Map is null", NULL);
+	check_return(key, "Key is null", NULL);
+	check_return(fn, "Compute function is null", NULL);
+
+	const size_t hash = generate_hash(map, key);
+	Location loc;
+	check_return(locate(map, key, hash, &loc), "Failed to expand map", NULL);
+	if (loc.entry) {
+		void *value = fn(key, loc.entry->value, ctx);
+		if (value) {
+			loc.entry->value = value;
+		} else {
+			remove_at(map, &loc);
+		}
+		return value;
+	}
+
+	MapEntry *entry = new_entry(map, key, key_copy, hash);
+	check_return(entry, "Failed to create entry", NULL);
+	entry->value = fn(key, NULL, ctx);
+	if (!entry->value) {
+		// Nothing to insert, which is not an error
+		discard_entry(map, entry, key);
+		return NULL;
+	}
+	place_entry(map, &loc, entry);
+	return entry->value;
+}
+
+void *HashMap_merge(HashMap *const map, const void *const key, const copy_fn key_copy, void *const value,
+					const merge_fn fn, void *const ctx) {
+	check_return(map, "Map is null", NULL);
+	check_return(key, "Key is null", NULL);
+	check_return(value, "Value is null", NULL);
+	check_return(fn, "Merge function is null", NULL);
+
+	const size_t hash = generate_hash(map, key);
+	Location loc;
+	check_return(locate(map, key, hash, &loc), "Failed to expand map", NULL);
+	if (loc.entry) {
+		void *merged = fn(loc.entry->value, value, ctx);
+		if (merged) {
+			loc.entry->value = merged;
+		} else {
+			remove_at(map, &loc);
+		}
+		return merged;
+	}
+
+	MapEntry *entry = new_entry(map, key, key_copy, hash);
+	check_return(entry, "Failed to create entry", NULL);
+	entry->value = value;
+	place_entry(map, &loc, entry);
+	return value;
+}
+
+size_t HashMap_get_many(const HashMap *const map, void *const *keys, const size_t n, void **out_values) {
+	check_return(map, "Map is null", 0);
+	check_return(keys && out_values, "Keys or values are null", 0);
+
+	size_t found = 0;
+	size_t hashes[HASHMAP_BATCH];
+	for (size_t base = 0; base < n; base += HASHMAP_BATCH) {
+		const size_t batch = n - base < HASHMAP_BATCH ? n - base : HASHMAP_BATCH;
+		// Stage one: hash everything, the control bytes and slots of every home slot start loading
+		for (size_t i = 0; i < batch; i++) {
+			hashes[i] = generate_hash(map, keys[base + i]);
+			prefetch_home(map, hashes[i]);
+		}
+		// Stage two: by now the control bytes are in, start loading the entries behind matching tags
+		for (size_t i = 0; i < batch; i++) {
+			prefetch_match(map, hashes[i]);
+		}
+		// Stage three: compare keys, mostly against entries that are already in the cache
+		for (size_t i = 0; i < batch; i++) {
+			const MapEntry *entry = HashMap_find_hashed(map, keys[base + i], hashes[i]);
+			out_values[base + i] = entry ? entry->value : NULL;
+			found += entry != NULL;
+		}
+	}
+	return found;
+}
+
+bool HashMap_put_many(HashMap *const map, void *const *keys, void *const *values, const size_t n,
+					  void **out_old_values) {
+	check_return(map, "Map is null", false);
+	check_return(keys && values && out_old_values, "Keys, values or old values are null", false);
+
+	size_t hashes[HASHMAP_BATCH];
+	for (size_t base = 0; base < n; base += HASHMAP_BATCH) {
+		const size_t batch = n - base < HASHMAP_BATCH ? n - base : HASHMAP_BATCH;
+		for (size_t i = 0; i < batch; i++) {
+			check_return(keys[base + i] && values[base + i], "Key or value is null", false);
+			hashes[i] = generate_hash(map, keys[base + i]);
+			prefetch_home(map, hashes[i]);
+		}
+		for (size_t i = 0; i < batch; i++) {
+			prefetch_match(map, hashes[i]);
+		}
+		for (size_t i = 0; i < batch; i++) {
+			const size_t size = map->size;
+			void *old_value = HashMap_put_hashed(map, keys[base + i], values[base + i], hashes[i]);
+			// NULL from put_hashed is either a fresh insert or a failure, only the size tells them apart
+			check_return(old_value || map->size > size, "Failed to put key", false);
+			out_old_values[base + i] = old_value;
+		}
+	}
+	return true;
+}
+
+bool HashMap_contains_key(const HashMap *const map, const void *const key) {
+	check_return(map, "Map is null", false);
+	check_return(key, "Key is null", false);
+	return HashMap_find_hashed(map, key, generate_hash(map, key)) != NULL;
+}
+
+void HashMap_iter_init(const HashMap *const map, HashMapIterator *const it) {
+	check(map && it, "Map or iterator is null", return);
+	it->map = map;
+	iter_start(it, map->slots, map->ctrl, map->capacity);
+}
+
+MapEntry *HashMap_iter_next(HashMapIterator *const it) {
+	check_return(it, "Iterator is null", NULL);
+	if (it->node) {
+		// Finish the tree bin before moving on to the next slot
+		MapEntry *entry = it->node->entry;
+		it->node = TreeBin_next(it->node);
+		return entry;
+	}
+	while (!it->pending) {
+		it->group += HASHGROUP_WIDTH;
+		if (it->group < it->capacity) {
+			it->pending = HashGroup_match_full(it->ctrl + it->group);
+		} else if (is_migrating(it->map) && it->slots == it->map->slots) {
+			iter_start(it, it->map->old.slots, it->map->old.ctrl, it->map->old.capacity);
+		} else {
+			it->group = it->capacity;
+			return NULL;
+		}
+	}
+	const size_t index = it->group + HashGroup_lowest(it->pending);
+	it->pending &= it->pending - 1;
+	if (it->pending) {
+		// Entries are scattered over the heap, start loading the next one while the caller works on this one
+		__builtin_prefetch(it->slots[it->group + HashGroup_lowest(it->pending)]);
+	}
+	MapEntry *entry = it->slots[index];
+	if (TreeBin_is_bin(entry)) {
+		const TreeNode *first = TreeBin_first(TreeBin_of(entry));
+		it->node = TreeBin_next(first);
+		return first->entry;
+	}
+	return entry;
+}
+
+bool HashMap_for_each(const HashMap *const map, const map_visit_fn fn, void *const ctx) {
+	check_return(map, "Map is null", false);
+	check_return(fn, "Visit function is null", false);
+	if (!for_each_table(map->slots, map->ctrl, map->capacity, fn, ctx)) {
+		return false;
+	}
+	return !is_migrating(map) || for_each_table(map->old.slots, map->old.ctrl, map->old.capacity, fn, ctx);
+}
+
+HashMapView HashMap_keyset(const HashMap *const map) {
+	HashMapView view = {.values = false};
+	HashMap_iter_init(map, &view.it);
+	return view;
+}
+
+HashMapView HashMap_values(const HashMap *const map) {
+	HashMapView view = {.values = true};
+	HashMap_iter_init(map, &view.it);
+	return view;
+}
+
+void *HashMapView_next(HashMapView *const view) {
+	check_return(view, "View is null", NULL);
+	const MapEntry *entry = HashMap_iter_next(&view->it);
+	if (!entry) {
+		return NULL;
+	}
+	return view->values ? entry->value : entry->key;
+}
+
+
+// Functions shared with the other containers through hashmap_internal.h
+
+uint64_t HashMap_new_seed(void) {
+	static uint64_t secret;
+	static uint64_t maps;
+	uint64_t base = __atomic_load_n(&secret, __ATOMIC_RELAXED);
+	if (!base) {
+		// Threads racing here may each read a secret, any of them will do
+		base = Commons_hash_random_seed() | 1;
+		__atomic_store_n(&secret, base, __ATOMIC_RELAXED);
+	}
+	return Commons_hash_u64_seeded(__atomic_fetch_add(&maps, 1, __ATOMIC_RELAXED), base);
+}
+
+size_t HashMap_hash(const HashMap *const map, const void *const key) {
+	return generate_hash(map, key);
+}
+
+void *HashMap_put_hashed(HashMap *const map, void *const key, void *const value, const size_t hash) {
+	Location loc;
+	check_return(locate(map, key, hash, &loc), "Failed to expand map", NULL);
+	if (loc.entry) {
+		// Replace the value of the existing entry and hand the old one back to the caller
+		void *old_value = loc.entry->value;
+		loc.entry->value = value;
+		return old_value;
+	}
+	MapEntry *entry = create_entry(map, key, value, hash);
+	check_mem_return(entry, NULL);
+	place_entry(map, &loc, entry);
+	return NULL; // No previous entry to return
+}
+
+MapEntry *HashMap_find_hashed(const HashMap *const map, const void *const key, const size_t hash) {
+	MapEntry *entry;
+	size_t index = find_old_index(map, key, hash);
+	if (index != NOT_FOUND) {
+		entry = map->old.slots[index];
+	} else {
+		index = find_index(map, key, hash);
+		if (index == NOT_FOUND) {
+			return NULL;
+		}
+		entry = map->slots[index];
+	}
+	return TreeBin_is_bin(entry) ? TreeBin_find(TreeBin_of(entry), key) : entry;
+}
+
+bool HashMap_remove_hashed(HashMap *const map, const void *const key, const size_t hash) {
+	MapEntry *entry = HashMap_detach_hashed(map, key, hash);
+	if (!entry) {
+		return false;
+	}
+	release_entry(map, entry);
+	return true;
+}
+
+MapEntry *HashMap_detach_hashed(HashMap *const map, const void *const key, const size_t hash) {
+	HashMap_rehash_step(map, map->migrate_step);
+	Location loc;
+	find_location(map, key, hash, &loc);
+	return loc.entry ? detach_at(map, &loc) : NULL;
+}
+
+bool HashMap_attach_hashed(HashMap *const map, MapEntry *const entry) {
+	Location loc;
+	check_return(locate(map, entry->key, entry->hash, &loc), "Failed to expand map", false);
+	check_return(!loc.entry, "Key is already in the map", false);
+	place_entry(map, &loc, entry);
 	return true;
 }
 
+bool HashMap_presize(HashMap *const map, const size_t n) {
+	check_return(map->size == 0 && !is_migrating(map), "Map is not empty", false);
+	const size_t capacity = capacity_for(n);
+	check_return(capacity > 0, "Can't make room for %zu entries", false, n);
+	return capacity <= map->capacity || resize(map, capacity);
+}
+
+HashMap *HashMap_clone_table(const HashMap *const map) {
+	check_return(!is_migrating(map), "Can't clone a map in the middle of a resize", NULL);
+	check_return(map->tree_bins == 0, "Can't clone a map with tree bins", NULL);
+	HashMap *clone = malloc(sizeof(HashMap));
+	check_mem_return(clone, NULL);
+	*clone = *map;
+	check_mem(allocate_table(clone, map->capacity, &clone->slots, &clone->ctrl), {
+			  free(clone);
+			  return NULL;
+			  });
+	memcpy(clone->slots, map->slots, map->capacity * sizeof(MapEntry *));
+	memcpy(clone->ctrl, map->ctrl, HashGroup_ctrl_bytes(map->capacity));
+	return clone;
+}
+
+void HashMap_free_table(HashMap *map) {
+	if (is_migrating(map)) {
+		free_table(map, map->old.slots);
+	}
+	free_table(map, map->slots);
+	free(map);
+}
+
 
 // Private helper functions
 
@@ -141,13 +625,30 @@ static void default_map_entry_df(void *value) {
 }
 
 static inline size_t generate_hash(const HashMap *map, const void *key) {
-	size_t hash = map->hash_fn(key);
-	hash ^= (hash >> 16);
-	return hash;
+	/*
+	 * The low bits pick the home slot and the top 7 bits become the control tag, so both ends need entropy
+	 * even when the hash function is something weak like the identity of an int. The seeded mix spreads every
+	 * input bit over the whole word, and since the seed is secret, keys that pile up in one probe run of this
+	 * map can't be worked out in advance.
+	 */
+	return (size_t) Commons_hash_u64_seeded(map->hash_fn(key), map->seed);
 }
 
-static MapEntry *create_entry(void *const key, void *const value, const size_t hash) {
-	MapEntry *entry = calloc(1, sizeof(MapEntry));
+static MapEntry *create_entry(HashMap *const map, void *const key, void *const value, const size_t hash) {
+	MapEntry *entry;
+	if (map->free_entries) {
+		entry = map->free_entries;
+		map->free_entries = entry->value;
+	} else if (map->arena) {
+		entry = Arena_alloc(map->arena, sizeof(MapEntry));
+	} else if (map->df == default_map_entry_df && map->small_entries_used != SMALL_ENTRIES_ALL) {
+		// Entries of the default destructor never leave the map, so they can live in it
+		const unsigned int i = (unsigned int) __builtin_ctz(~map->small_entries_used);
+		map->small_entries_used |= (uint32_t) 1 << i;
+		entry = &map->small_entries[i];
+	} else {
+		entry = malloc(sizeof(MapEntry));
+	}
 	check_mem_return(entry, NULL);
 
 	entry->key = key;
@@ -156,134 +657,518 @@ static MapEntry *create_entry(void *const key, void *const value, const size_t h
 	return entry;
 }
 
-static void add_new_entry(HashMap *const map, const size_t index, void *const key, void *const value,
-						  const size_t hash) {
-	LinkedList *bucket = LinkedList_create(map->df);
-	check(bucket, "Failed to create bucket", return);
-
-	MapEntry *entry = create_entry(key, value, hash);
-	if (!entry) {
-		LinkedList_destroy(bucket, true);
+static inline void release_entry(HashMap *const map, MapEntry *const entry) {
+	if (map->arena) {
+		// Arena memory can't be freed on its own, keep the entry around for the next put instead
+		entry->value = map->free_entries;
+		map->free_entries = entry;
 		return;
 	}
-	LinkedList_push(bucket, entry);
-	map->buckets[index] = bucket;
-	map->size++;
+	if (is_small_entry(map, entry)) {
+		// What default_map_entry_df does, minus freeing the entry
+		free(entry->key);
+		free(entry->value);
+		free_entry(map, entry);
+		return;
+	}
+	map->df(entry);
+}
+
+static inline bool is_small_entry(const HashMap *const map, const MapEntry *const entry) {
+	return (uintptr_t) entry - (uintptr_t) map->small_entries < sizeof(map->small_entries);
 }
 
-static void *handle_existing(HashMap *const map, LinkedList *const bucket, const size_t hash, void *const key, void *const new_value) {
-	// Look for an existing entry (same key+value) in the buckets list, replace existing
-	for (const Node *curr = bucket->first; curr != NULL; curr = curr->next) {
-		MapEntry *entry = curr->value;
+/** Give back the memory of an entry from create_entry outside arena mode, nothing it points to */
+static inline void free_entry(HashMap *const map, MapEntry *const entry) {
+	if (is_small_entry(map, entry)) {
+		map->small_entries_used &= ~((uint32_t) 1 << (entry - map->small_entries));
+	} else {
+		free(entry);
+	}
+}
 
-		if (entry->hash == hash && map->equals_fn(entry->key, key)) {
-			void *old_value = entry->value;
-			entry->value = new_value;
-			return old_value;
+/**
+ * Empty table of capacity slots. A map at HASHMAP_MIN_CAPACITY uses the table embedded in its struct, so
+ * small maps never allocate one, unless that table is still in use by the map (a resize allocates the new
+ * table before it lets go of the old one).
+ */
+static bool allocate_table(HashMap *const map, const size_t capacity, MapEntry ***out_slots, uint8_t **out_ctrl) {
+	if (capacity == HASHMAP_MIN_CAPACITY && map->slots != map->small_slots && map->old.slots != map->small_slots) {
+		memset(map->small_slots, 0, sizeof(map->small_slots));
+		memset(map->small_ctrl, CTRL_EMPTY, sizeof(map->small_ctrl));
+		*out_slots = map->small_slots;
+		*out_ctrl = map->small_ctrl;
+		return true;
+	}
+	// One allocation for both arrays, slots first to keep the pointers aligned
+	const size_t slot_bytes = capacity * sizeof(MapEntry *);
+	void *table = calloc(1, slot_bytes + HashGroup_ctrl_bytes(capacity));
+	if (!table) {
+		return false;
+	}
+	*out_slots = table;
+	*out_ctrl = (uint8_t *) table + slot_bytes;
+	return true;
+}
+
+/** Free a table from allocate_table, ctrl bytes share its allocation */
+static inline void free_table(HashMap *const map, MapEntry **const slots) {
+	if (slots != map->small_slots) {
+		free(slots);
+	}
+}
+
+static size_t probe(const HashMap *const map, MapEntry *const *slots, const uint8_t *ctrl, const size_t mask,
+					size_t pos, const void *const key, const size_t hash, size_t *const insert_index,
+					size_t *const same_hash) {
+	const uint8_t tag = HashGroup_tag(hash);
+	for (;; pos = (pos + HASHGROUP_WIDTH) & mask) {
+		const uint8_t *group = ctrl + pos;
+		for (GroupMask match = HashGroup_match(group, tag); match; match &= match - 1) {
+			const size_t index = (pos + HashGroup_lowest(match)) & mask;
+			const MapEntry *entry = slots[index];
+			if (entry->hash != hash) {
+				continue;
+			}
+			// A tree bin holds every entry with its hash, whether key is among them is up to the caller
+			if (TreeBin_is_bin(entry) || map->equals_fn(entry->key, key)) {
+				return index;
+			}
+			if (same_hash) {
+				(*same_hash)++;
+			}
+		}
+		// Linear probing never skips an empty slot, so the key can not be any further away
+		const GroupMask empty = HashGroup_match_empty(group);
+		if (empty) {
+			if (insert_index) {
+				// The same slot insert_entry would pick, so an insert needs no second probe
+				*insert_index = (pos + HashGroup_lowest(empty)) & mask;
+			}
+			return NOT_FOUND;
 		}
 	}
+}
 
-	MapEntry *entry = create_entry(key, new_value, hash);
-	check_mem_return(entry, NULL);
-	LinkedList_push(bucket, entry);
+static inline size_t find_index(const HashMap *const map, const void *const key, const size_t hash) {
+	const size_t mask = map->capacity - 1; // Java style but will break if cap not powers of 2
+	return probe(map, map->slots, map->ctrl, mask, hash & mask, key, hash, NULL, NULL);
+}
+
+static inline size_t find_old_index(const HashMap *const map, const void *const key, const size_t hash) {
+	if (!is_migrating(map)) {
+		return NOT_FOUND;
+	}
+	const HashMapMigration *old = &map->old;
+	const size_t mask = old->capacity - 1;
+	size_t pos = hash & mask;
+	if (((pos - old->start) & mask) < old->done) {
+		// The home slot was already migrated, whatever is left of its run continues at the migration cursor
+		pos = (old->start + old->done) & mask;
+	}
+	return probe(map, old->slots, old->ctrl, mask, pos, key, hash, NULL, NULL);
+}
+
+/**
+ * One probe for everything an update needs. Runs the migration step and grows the table up front, so the
+ * slot found for a new entry is still the right one when the entry is placed.
+ * @return false if the table had to grow and could not
+ */
+static bool locate(HashMap *const map, const void *const key, const size_t hash, Location *const loc) {
+	HashMap_rehash_step(map, map->migrate_step);
+	if (map->size >= map->threshold && !expand(map)) {
+		return false;
+	}
+	find_location(map, key, hash, loc);
+	return true;
+}
+
+static void find_location(const HashMap *const map, const void *const key, const size_t hash,
+						  Location *const loc) {
+	loc->entry = NULL;
+	loc->bin = NULL;
+	loc->same_hash = 0;
+	loc->index = find_old_index(map, key, hash);
+	if (loc->index != NOT_FOUND) {
+		loc->table = map->old.slots;
+	} else {
+		const size_t mask = map->capacity - 1;
+		size_t insert_index = NOT_FOUND;
+		loc->index = probe(map, map->slots, map->ctrl, mask, hash & mask, key, hash, &insert_index, &loc->same_hash);
+		if (loc->index == NOT_FOUND) {
+			// New entries always go to the new table, the old one only ever shrinks
+			loc->table = NULL;
+			loc->index = insert_index;
+			return;
+		}
+		loc->table = map->slots;
+	}
+	MapEntry *entry = loc->table[loc->index];
+	if (TreeBin_is_bin(entry)) {
+		loc->bin = TreeBin_of(entry);
+		loc->entry = TreeBin_find(loc->bin, key);
+	} else {
+		loc->entry = entry;
+	}
+}
+
+/**
+ * Add an entry for a key that locate did not find: to the tree bin for its hash, to the empty slot locate
+ * picked, or together with the entries it collides with to a new tree bin. Running out of memory for the
+ * tree only costs the protection, never the insert.
+ */
+static void place_entry(HashMap *const map, const Location *const loc, MapEntry *const entry) {
+	if (loc->bin) {
+		if (!TreeBin_insert(loc->bin, entry)) {
+			untreeify(map, loc);
+			insert_entry(map->slots, map->ctrl, map->capacity, entry);
+		}
+	} else if (map->compare_fn && loc->same_hash + 1 >= HASHMAP_TREEIFY_THRESHOLD) {
+		if (!treeify(map, entry)) {
+			// treeify may have finished a migration and moved the slot locate picked
+			insert_entry(map->slots, map->ctrl, map->capacity, entry);
+		}
+	} else {
+		map->slots[loc->index] = entry;
+		HashGroup_set_ctrl(map->ctrl, map->capacity, loc->index, HashGroup_tag(entry->hash));
+	}
 	map->size++;
-	return NULL;
+}
+
+/**
+ * Entry for a key that is not in the map yet, without a value. The entry is allocated before the key is
+ * copied, so running out of memory never leaves a copied key or a supplied value behind.
+ * @return the entry or NULL if out of memory or key_copy failed
+ */
+static MapEntry *new_entry(HashMap *const map, const void *const key, const copy_fn key_copy, const size_t hash) {
+	MapEntry *entry = create_entry(map, NULL, NULL, hash);
+	check_mem_return(entry, NULL);
+	entry->key = key_copy ? key_copy(key) : (void *) key;
+	if (!entry->key) {
+		discard_entry(map, entry, key);
+		return NULL;
+	}
+	return entry;
+}
+
+/** Give back an entry from new_entry that never made it into the table, freeing its copied key */
+static void discard_entry(HashMap *const map, MapEntry *const entry, const void *const key) {
+	if (entry->key != key) {
+		free(entry->key);
+	}
+	if (map->arena) {
+		entry->value = map->free_entries;
+		map->free_entries = entry;
+	} else {
+		free_entry(map, entry);
+	}
+}
+
+/** Take the entry found at loc out of the map, without releasing it */
+static MapEntry *detach_at(HashMap *const map, const Location *const loc) {
+	MapEntry *entry = loc->entry;
+	if (loc->bin) {
+		TreeBin_remove(loc->bin, entry->key);
+		if (loc->bin->count < HASHMAP_UNTREEIFY_THRESHOLD) {
+			untreeify(map, loc);
+		}
+	} else {
+		erase_slot(map, loc->table, loc->index);
+	}
+	map->size--;
+	if (map->size < map->shrink_threshold && map->capacity > map->min_capacity) {
+		shrink(map);
+	}
+	return entry;
+}
+
+/** Remove and release the entry found at loc */
+static void remove_at(HashMap *const map, const Location *const loc) {
+	release_entry(map, detach_at(map, loc));
+}
+
+/**
+ * Move entry and every entry in the map with the same hash to a new tree bin. A running migration is
+ * finished first so that they are all in the new table.
+ * @return false if out of memory, the table is then left as it was apart from the finished migration
+ */
+static bool treeify(HashMap *const map, MapEntry *const entry) {
+	finish_migration(map);
+	TreeBin *bin = TreeBin_create(entry->hash, map->compare_fn);
+	check_mem_return(bin, false);
+
+	// Entries with the same hash share a home slot and are never past the first empty slot that follows it
+	const size_t mask = map->capacity - 1;
+	for (size_t i = entry->hash & mask; map->ctrl[i] != CTRL_EMPTY; i = (i + 1) & mask) {
+		if (map->slots[i]->hash == entry->hash && !TreeBin_insert(bin, map->slots[i])) {
+			goto catch;
+		}
+	}
+	if (!TreeBin_insert(bin, entry)) {
+		goto catch;
+	}
+	// Nothing can fail from here on, take the entries out of the table. Backward shift never moves an entry
+	// in front of the slot being erased, so one pass finds them all.
+	for (size_t i = entry->hash & mask; map->ctrl[i] != CTRL_EMPTY;) {
+		if (map->slots[i]->hash == entry->hash) {
+			erase_index(map->slots, map->ctrl, map->capacity, i);
+		} else {
+			i = (i + 1) & mask;
+		}
+	}
+	insert_entry(map->slots, map->ctrl, map->capacity, &bin->entry);
+	map->tree_bins++;
+	return true;
+catch:
+	TreeBin_destroy(bin, NULL);
+	return false;
+}
+
+/** Replace the tree bin at loc with plain slots in the new table for its entries */
+static void untreeify(HashMap *const map, const Location *const loc) {
+	erase_slot(map, loc->table, loc->index);
+	for (const TreeNode *node = TreeBin_first(loc->bin); node; node = TreeBin_next(node)) {
+		insert_entry(map->slots, map->ctrl, map->capacity, node->entry);
+	}
+	TreeBin_destroy(loc->bin, NULL);
+	map->tree_bins--;
+}
+
+static void insert_entry(MapEntry **slots, uint8_t *ctrl, const size_t capacity, MapEntry *const entry) {
+	const size_t mask = capacity - 1;
+	// Always terminates since the load factor keeps at least a quarter of the slots empty
+	for (size_t pos = entry->hash & mask;; pos = (pos + HASHGROUP_WIDTH) & mask) {
+		const GroupMask empty = HashGroup_match_empty(ctrl + pos);
+		if (empty) {
+			const size_t index = (pos + HashGroup_lowest(empty)) & mask;
+			slots[index] = entry;
+			HashGroup_set_ctrl(ctrl, capacity, index, HashGroup_tag(entry->hash));
+			return;
+		}
+	}
+}
+
+static void erase_index(MapEntry **slots, uint8_t *ctrl, const size_t capacity, const size_t index) {
+	/*
+	 * Backward shift deletion: walk the run following the removed slot and pull back every entry whose
+	 * probe path passes through the hole. This keeps lookups correct without leaving tombstones behind.
+	 */
+	const size_t mask = capacity - 1;
+	size_t hole = index;
+	for (size_t next = (hole + 1) & mask; ctrl[next] != CTRL_EMPTY; next = (next + 1) & mask) {
+		const size_t home = slots[next]->hash & mask;
+		if (((next - home) & mask) >= ((next - hole) & mask)) {
+			slots[hole] = slots[next];
+			HashGroup_set_ctrl(ctrl, capacity, hole, ctrl[next]);
+			hole = next;
+		}
+	}
+	slots[hole] = NULL;
+	HashGroup_set_ctrl(ctrl, capacity, hole, CTRL_EMPTY);
+}
+
+/** Erase a slot of either table, table being the slots of the one the slot is in */
+static inline void erase_slot(HashMap *const map, MapEntry **table, const size_t index) {
+	if (table == map->old.slots) {
+		erase_index(map->old.slots, map->old.ctrl, map->old.capacity, index);
+	} else {
+		erase_index(map->slots, map->ctrl, map->capacity, index);
+	}
+}
+
+/** Release every entry and drop the old table of a running migration, the current table stays as it is */
+static void release_entries(HashMap *const map) {
+	if (map->arena) {
+		if (map->tree_bins > 0) {
+			// Tree bins are malloc'ed, only the entries in them live in the arena
+			destroy_entries(map, map->slots, map->ctrl, map->capacity, false);
+			if (is_migrating(map)) {
+				destroy_entries(map, map->old.slots, map->old.ctrl, map->old.capacity, false);
+			}
+		}
+	} else if (map->size > 0) {
+		destroy_entries(map, map->slots, map->ctrl, map->capacity, true);
+		if (is_migrating(map)) {
+			destroy_entries(map, map->old.slots, map->old.ctrl, map->old.capacity, true);
+		}
+	}
+	if (is_migrating(map)) {
+		free_table(map, map->old.slots);
+		map->old = (HashMapMigration) {0};
+	}
+}
+
+/** Free the tree bins of a table and, if release is set, release every entry */
+static void destroy_entries(HashMap *const map, MapEntry **slots, const uint8_t *ctrl, const size_t capacity,
+							const bool release) {
+	for (size_t i = 0; i < capacity; i++) {
+		if (ctrl[i] == CTRL_EMPTY) {
+			continue;
+		}
+		if (!TreeBin_is_bin(slots[i])) {
+			if (release) {
+				release_entry(map, slots[i]);
+			}
+			continue;
+		}
+		TreeBin *bin = TreeBin_of(slots[i]);
+		// The walk only follows the nodes, never the entries they point at
+		for (const TreeNode *node = TreeBin_first(bin); node && release; node = TreeBin_next(node)) {
+			release_entry(map, node->entry);
+		}
+		TreeBin_destroy(bin, NULL);
+	}
 }
 
 static bool expand(HashMap *const map) {
 	// Calculate new capacity with overflow check
 	size_t new_cap;
-	if (Commons_will_overflow(map->capacity, 2, &new_cap)) {
-		// If an overflow would occur then set to max
-		new_cap = SIZE_MAX;
-	}
-	if (new_cap <= map->capacity) {
+	if (Commons_will_overflow(map->capacity, 2, &new_cap) || new_cap > SIZE_MAX / sizeof(MapEntry *)) {
 		log_warn("Max capacity reached for map, further attempts to expand will cause failure");
 		return false;
 	}
 
-	const bool is_resized = resize(map, new_cap);
+	// A tiny migrate step may not have finished the previous migration yet, only one can run at a time
+	finish_migration(map);
+	const bool is_resized = map->migrate_step > 0 ? start_migration(map, new_cap) : resize(map, new_cap);
 	check_return(is_resized, "Failed to resize map", false);
 	return true;
 }
 
-static bool resize(HashMap *const map, const size_t new_capacity) {
-	// Keep a pointer to the old buckets in case realloc fails
-	LinkedList **old_buckets = map->buckets;
-	LinkedList **new_buckets = realloc(map->buckets, new_capacity * sizeof(LinkedList *));
-	if (!new_buckets) {
-		// Restore old state and return failure
-		map->buckets = old_buckets;
-		return false;
+/** @return the smallest capacity that holds n entries without growing, 0 if there is no such capacity */
+static size_t capacity_for(const size_t n) {
+	size_t capacity = HASHMAP_MIN_CAPACITY;
+	while ((size_t) (capacity * HASHMAP_LOAD_FACTOR) < n) {
+		if (Commons_will_overflow(capacity, 2, &capacity) || capacity > SIZE_MAX / sizeof(MapEntry *)) {
+			return 0;
+		}
+	}
+	return capacity;
+}
+
+/**
+ * Move to a table twice the size the remaining entries need. The same machinery as growing, so with
+ * incremental resizing on the entries move over a few at a time here too.
+ */
+static void shrink(HashMap *const map) {
+	size_t new_cap = capacity_for(map->size * 2);
+	if (new_cap < map->min_capacity) {
+		new_cap = map->min_capacity;
+	}
+	if (new_cap >= map->capacity) {
+		return;
+	}
+	finish_migration(map);
+	// A failed shrink costs nothing but memory, the map carries on with the table it has
+	if (map->migrate_step > 0) {
+		start_migration(map, new_cap);
+	} else {
+		resize(map, new_cap);
 	}
-	map->buckets = new_buckets;
+}
 
-	// Initialize the new bucket pointers to NULL
+static bool resize(HashMap *const map, const size_t new_capacity) {
+	MapEntry **old_slots = map->slots;
+	const uint8_t *old_ctrl = map->ctrl;
 	const size_t old_cap = map->capacity;
-	LinkedList **start = map->buckets + old_cap;
-	const size_t n_bytes_to_fill = (new_capacity - old_cap) * sizeof(LinkedList *);
-	memset(start, 0, n_bytes_to_fill);
 
-	// Rehash existing entries
-	rehash_old_buckets(map, old_cap);
+	// Allocate first so the map is left untouched if we are out of memory
+	check_mem_return(allocate_table(map, new_capacity, &map->slots, &map->ctrl), false);
 	map->capacity = new_capacity;
 	set_threshold(map);
+
+	// Rehash existing entries, the cached hash saves calling hash_fn again
+	for (size_t i = 0; i < old_cap; i++) {
+		if (old_ctrl[i] != CTRL_EMPTY) {
+			insert_entry(map->slots, map->ctrl, map->capacity, old_slots[i]);
+		}
+	}
+	free_table(map, old_slots);
 	return true;
 }
 
+static bool start_migration(HashMap *const map, const size_t new_capacity) {
+	MapEntry **new_slots;
+	uint8_t *new_ctrl;
+	check_mem_return(allocate_table(map, new_capacity, &new_slots, &new_ctrl), false);
 
-static inline void push_to_bucket(LinkedList **bucket, MapEntry *entry, const destructor_fn df) {
-	if (!*bucket) {
-		*bucket = LinkedList_create(df);
-		check(*bucket, "Failed to create bucket", return);
+	// The load factor guarantees an empty slot, migration starts right after the first one
+	size_t empty = 0;
+	while (map->ctrl[empty] != CTRL_EMPTY) {
+		empty++;
 	}
-	LinkedList_push(*bucket, entry);
+	map->old = (HashMapMigration) {
+		.slots = map->slots,
+		.ctrl = map->ctrl,
+		.capacity = map->capacity,
+		.start = (empty + 1) & (map->capacity - 1),
+		.done = 0
+	};
+	map->slots = new_slots;
+	map->ctrl = new_ctrl;
+	map->capacity = new_capacity;
+	set_threshold(map);
+	return true;
 }
 
-static void rehash_old_buckets(const HashMap *const map, const size_t old_cap) {
-	// Process each old bucket
-	for (size_t old_index = 0; old_index < old_cap; old_index++) {
-		LinkedList *old_bucket = map->buckets[old_index];
-		if (!old_bucket) {
-			continue;
-		}
-
-		// Java optimization: entries go either old_index or old_index + old_cap
-		LinkedList *low_bucket = NULL;
-		LinkedList *high_bucket = NULL;
+static inline void finish_migration(HashMap *const map) {
+	HashMap_rehash_step(map, SIZE_MAX);
+}
 
-		for (const Node *curr = old_bucket->first; curr != NULL; curr = curr->next) {
-			MapEntry *entry = curr->value;
+static inline void iter_start(HashMapIterator *const it, MapEntry *const *slots, const uint8_t *ctrl,
+							  const size_t capacity) {
+	it->slots = slots;
+	it->ctrl = ctrl;
+	it->capacity = capacity;
+	it->group = 0;
+	it->pending = HashGroup_match_full(ctrl);
+	it->node = NULL;
+}
 
-			// Works because capacity is always powers of 2
-			if (entry->hash & old_cap) {
-				push_to_bucket(&high_bucket, entry, map->df);
-			} else {
-				push_to_bucket(&low_bucket, entry, map->df);
+static bool for_each_table(MapEntry *const *slots, const uint8_t *ctrl, const size_t capacity, const map_visit_fn fn,
+						   void *const ctx) {
+	GroupMask mask = HashGroup_match_full(ctrl);
+	for (size_t group = 0; group < capacity; group += HASHGROUP_WIDTH) {
+		GroupMask next = 0;
+		if (group + HASHGROUP_WIDTH < capacity) {
+			/*
+			 * The slot array is read sequentially and the hardware prefetcher keeps up with it, but the entries
+			 * it points at are scattered over the heap. Ask for the next group's entries before visiting this one.
+			 */
+			next = HashGroup_match_full(ctrl + group + HASHGROUP_WIDTH);
+			for (GroupMask pending = next; pending; pending &= pending - 1) {
+				__builtin_prefetch(slots[group + HASHGROUP_WIDTH + HashGroup_lowest(pending)]);
 			}
 		}
-
-		// Assign buckets to their new positions
-		map->buckets[old_index] = low_bucket;
-		map->buckets[old_index + old_cap] = high_bucket;
-
-		// Destroy the old list but not its node_values that are now assigned to the new buckets
-		LinkedList_destroy(old_bucket, false);
+		for (; mask; mask &= mask - 1) {
+			MapEntry *entry = slots[group + HashGroup_lowest(mask)];
+			if (TreeBin_is_bin(entry)) {
+				for (const TreeNode *node = TreeBin_first(TreeBin_of(entry)); node; node = TreeBin_next(node)) {
+					if (!fn(node->entry->key, node->entry->value, ctx)) {
+						return false;
+					}
+				}
+			} else if (!fn(entry->key, entry->value, ctx)) {
+				return false;
+			}
+		}
+		mask = next;
 	}
+	return true;
 }
 
-static void find_node(const HashMap *const map, const void *const key, const size_t hash,
-					  struct ListNodePair *out_pair) {
-	const size_t index = hash & (map->capacity - 1); // Java style but will break if cap not powers of 2
-	LinkedList *bucket = map->buckets[index];
-	check(bucket, "No entry found", return);
+static inline void prefetch_home(const HashMap *const map, const size_t hash) {
+	const size_t index = hash & (map->capacity - 1);
+	__builtin_prefetch(map->ctrl + index);
+	__builtin_prefetch(map->slots + index);
+}
 
-	for (Node *curr = bucket->first; curr != NULL; curr = curr->next) {
-		const MapEntry *entry = curr->value;
-		if (entry->hash == hash && map->equals_fn(entry->key, key)) {
-			out_pair->list = bucket;
-			out_pair->node = curr;
-			return;
-		}
+/** Prefetch the entry behind the first tag match in the home group, usually the one being looked for */
+static inline void prefetch_match(const HashMap *const map, const size_t hash) {
+	const size_t mask = map->capacity - 1;
+	const size_t index = hash & mask;
+	const GroupMask match = HashGroup_match(map->ctrl + index, HashGroup_tag(hash));
+	if (match) {
+		__builtin_prefetch(map->slots[(index + HashGroup_lowest(match)) & mask]);
 	}
 }
@@ -0,0 +1,298 @@
+//
+// Parallel bulk construction of a HashMap
+//
+#include "hashmap.h"
+
+#include <dbg.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hashgroup.h"
+#include "hashmap_internal.h"
+
+// Below this many pairs threads cost more than they save
+#define BUILD_PARALLEL_MIN 16384
+// Smallest region of the table a partition gets, long enough that few probe runs hit its end
+#define BUILD_MIN_REGION 1024
+// Partitions per thread, so that a thread that drew dense partitions doesn't hold up the others
+#define BUILD_PARTITIONS_PER_THREAD 8
+
+/** Pair i of the input, with its hash, sorted by partition */
+typedef struct BuildItem {
+	size_t hash;
+	size_t index;
+} BuildItem;
+
+typedef struct Build Build;
+
+/** What one thread works on in each phase */
+typedef struct BuildWorker {
+	Build *build;
+	size_t id;
+	size_t from;        /**< Its share of the input pairs, [from, to) */
+	size_t to;
+	size_t *offsets;    /**< partitions counters: items of each partition in its share, then where they go */
+} BuildWorker;
+
+struct Build {
+	HashMap *map;
+	void *const *keys;
+	void *const *values;
+	void **out_old_values;
+	size_t *hashes;
+	BuildItem *items;
+	size_t *partition_start;    /**< partitions + 1 offsets into items */
+	size_t *overflow;           /**< Items of each partition left for the sequential pass, at its start */
+	size_t *inserted;           /**< New entries each partition put in its region */
+	size_t partitions;
+	unsigned region_shift;      /**< log2 of the slots in a region, home >> region_shift is the partition */
+	size_t next_partition;      /**< Handed out atomically in the fill phase */
+	bool failed;
+};
+
+static void *hash_share(void *arg);
+
+static void *scatter_share(void *arg);
+
+static void *fill_partitions(void *arg);
+
+static bool fill_region(Build *build, size_t partition);
+
+static void undo_fill(HashMap *map);
+
+bool HashMap_build_parallel(HashMap *const map, void *const *keys, void *const *values, const size_t n,
+							size_t nthreads, void **out_old_values) {
+	check_return(map, "Map is null", false);
+	check_return(keys && values && out_old_values, "Keys, values or old values are null", false);
+	check_return(map->size == 0, "Map must be empty", false);
+	check_return(!map->arena, "Arena maps can't be built in parallel", false);
+	for (size_t i = 0; i < n; i++) {
+		check_return(keys[i] && values[i], "Key or value is null", false);
+	}
+	check_return(HashMap_presize(map, n), "Failed to size table", false);
+	if (nthreads == 0) {
+		nthreads = HashMap_online_cpus();
+	}
+	if (n < BUILD_PARALLEL_MIN || nthreads < 2) {
+		return HashMap_put_many(map, keys, values, n, out_old_values);
+	}
+
+	Build build = {
+		.map = map, .keys = keys, .values = values, .out_old_values = out_old_values, .failed = false
+	};
+	// Power of two partitions, each owning a contiguous region of the table
+	build.partitions = 1;
+	while (build.partitions < nthreads * BUILD_PARTITIONS_PER_THREAD &&
+		   map->capacity / (build.partitions * 2) >= BUILD_MIN_REGION) {
+		build.partitions *= 2;
+	}
+	build.region_shift = (unsigned) __builtin_ctzll(map->capacity / build.partitions);
+
+	bool built = false;
+	BuildWorker *workers = calloc(nthreads, sizeof(BuildWorker));
+	size_t *counts = calloc(nthreads * build.partitions, sizeof(size_t));
+	build.hashes = malloc(n * sizeof(size_t));
+	build.items = malloc(n * sizeof(BuildItem));
+	build.partition_start = malloc((build.partitions + 1) * sizeof(size_t));
+	build.overflow = calloc(build.partitions, sizeof(size_t));
+	build.inserted = calloc(build.partitions, sizeof(size_t));
+	check_mem(workers && counts && build.hashes && build.items && build.partition_start && build.overflow &&
+			  build.inserted, goto done);
+	for (size_t t = 0; t < nthreads; t++) {
+		workers[t] = (BuildWorker) {
+			.build = &build, .id = t, .from = n * t / nthreads, .to = n * (t + 1) / nthreads,
+			.offsets = counts + t * build.partitions
+		};
+	}
+
+	// Hash and count the pairs of every partition, then lay the partitions out one after the other. Within
+	// a partition the items stay in input order, thread shares being in input order themselves.
+	check(HashMap_run_parallel(workers, sizeof(BuildWorker), nthreads, hash_share), "Failed to hash keys",
+		  goto done);
+	size_t offset = 0;
+	for (size_t p = 0; p < build.partitions; p++) {
+		build.partition_start[p] = offset;
+		for (size_t t = 0; t < nthreads; t++) {
+			const size_t count = workers[t].offsets[p];
+			workers[t].offsets[p] = offset;
+			offset += count;
+		}
+	}
+	build.partition_start[build.partitions] = offset;
+	check(HashMap_run_parallel(workers, sizeof(BuildWorker), nthreads, scatter_share), "Failed to partition keys",
+		  goto done);
+	check(HashMap_run_parallel(workers, sizeof(BuildWorker), nthreads, fill_partitions) && !build.failed,
+		  "Failed to fill table", {
+		  undo_fill(map);
+		  goto done;
+		  });
+
+	// The table is consistent now, what's left are the keys whose probe run reached the end of their region
+	for (size_t p = 0; p < build.partitions; p++) {
+		map->size += build.inserted[p];
+	}
+	for (size_t p = 0; p < build.partitions; p++) {
+		const BuildItem *item = build.items + build.partition_start[p];
+		for (const BuildItem *end = item + build.overflow[p]; item < end; item++) {
+			const size_t size = map->size;
+			void *old_value = HashMap_put_hashed(map, keys[item->index], values[item->index], item->hash);
+			check(old_value || map->size > size, "Failed to put key", goto done);
+			out_old_values[item->index] = old_value;
+		}
+	}
+	built = true;
+done:
+	free(workers);
+	free(counts);
+	free(build.hashes);
+	free(build.items);
+	free(build.partition_start);
+	free(build.overflow);
+	free(build.inserted);
+	return built;
+}
+
+
+// Functions shared with the other containers through hashmap_internal.h
+
+size_t HashMap_online_cpus(void) {
+	const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	return cpus > 0 ? (size_t) cpus : 1;
+}
+
+bool HashMap_run_parallel(void *const workers, const size_t worker_size, const size_t nthreads,
+						  void *(*const fn)(void *)) {
+	unsigned char *worker = workers;
+	pthread_t *threads = malloc(nthreads * sizeof(pthread_t));
+	check_mem_return(threads, false);
+	size_t started = 1;
+	while (started < nthreads &&
+		   pthread_create(&threads[started], NULL, fn, worker + started * worker_size) == 0) {
+		started++;
+	}
+	fn(worker);
+	for (size_t t = 1; t < started; t++) {
+		pthread_join(threads[t], NULL);
+	}
+	free(threads);
+	check_return(started == nthreads, "Failed to start thread %zu", false, started);
+	return true;
+}
+
+
+// Private helper functions
+
+static void *hash_share(void *arg) {
+	BuildWorker *worker = arg;
+	Build *build = worker->build;
+	const size_t mask = build->map->capacity - 1;
+	for (size_t i = worker->from; i < worker->to; i++) {
+		const size_t hash = HashMap_hash(build->map, build->keys[i]);
+		build->hashes[i] = hash;
+		worker->offsets[(hash & mask) >> build->region_shift]++;
+	}
+	return NULL;
+}
+
+static void *scatter_share(void *arg) {
+	BuildWorker *worker = arg;
+	Build *build = worker->build;
+	const size_t mask = build->map->capacity - 1;
+	for (size_t i = worker->from; i < worker->to; i++) {
+		const size_t hash = build->hashes[i];
+		build->items[worker->offsets[(hash & mask) >> build->region_shift]++] = (BuildItem) {hash, i};
+	}
+	return NULL;
+}
+
+static void *fill_partitions(void *arg) {
+	Build *build = ((BuildWorker *) arg)->build;
+	for (;;) {
+		const size_t p = __atomic_fetch_add(&build->next_partition, 1, __ATOMIC_RELAXED);
+		if (p >= build->partitions || __atomic_load_n(&build->failed, __ATOMIC_RELAXED)) {
+			return NULL;
+		}
+		if (!fill_region(build, p)) {
+			__atomic_store_n(&build->failed, true, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+/**
+ * Insert the items of a partition into its region of the table, in input order, the way HashMap_put would
+ * as long as a probe run stays inside the region. Items whose run reaches the end of the region are moved
+ * to the front of the partition for the sequential pass, the run of a duplicate key follows the same path
+ * so all its occurrences end up there together. So do new keys that would be the
+ * HASHMAP_TREEIFY_THRESHOLD-th with their hash when the map has a comparator, HashMap_put_hashed then
+ * moves them into a tree bin as it would have. Control bytes are checked one at a time, a group load
+ * could read into the next region while another thread writes it, and the mirrored tail is only written
+ * once all regions are done.
+ * @return false if out of memory
+ */
+static bool fill_region(Build *const build, const size_t partition) {
+	HashMap *map = build->map;
+	const size_t mask = map->capacity - 1;
+	const size_t region_end = (partition + 1) << build->region_shift;
+	BuildItem *items = build->items + build->partition_start[partition];
+	const size_t count = build->partition_start[partition + 1] - build->partition_start[partition];
+	size_t overflow = 0;
+	size_t inserted = 0;
+	for (size_t i = 0; i < count; i++) {
+		const BuildItem item = items[i];
+		void *key = build->keys[item.index];
+		const uint8_t tag = HashGroup_tag(item.hash);
+		size_t index = item.hash & mask;
+		size_t same_hash = 0;
+		for (; index < region_end && map->ctrl[index] != CTRL_EMPTY; index++) {
+			const MapEntry *entry = map->slots[index];
+			if (map->ctrl[index] == tag && entry->hash == item.hash) {
+				if (map->equals_fn(entry->key, key)) {
+					break;
+				}
+				same_hash++;
+			}
+		}
+		if (index == region_end || (map->compare_fn && map->ctrl[index] == CTRL_EMPTY &&
+									same_hash + 1 >= HASHMAP_TREEIFY_THRESHOLD)) {
+			items[overflow++] = item;
+			continue;
+		}
+		void *old_value = NULL;
+		if (map->ctrl[index] != CTRL_EMPTY) {
+			old_value = map->slots[index]->value;
+			map->slots[index]->value = build->values[item.index];
+		} else {
+			MapEntry *entry = malloc(sizeof(MapEntry));
+			if (!entry) {
+				build->inserted[partition] = inserted;
+				return false;
+			}
+			*entry = (MapEntry) {.key = key, .value = build->values[item.index], .hash = item.hash};
+			map->slots[index] = entry;
+			map->ctrl[index] = tag;
+			inserted++;
+		}
+		build->out_old_values[item.index] = old_value;
+	}
+	build->overflow[partition] = overflow;
+	build->inserted[partition] = inserted;
+	if (partition == 0) {
+		// Region 0 is the only one with slots in the mirrored tail, and only this thread writes it
+		memcpy(map->ctrl + map->capacity, map->ctrl, HASHGROUP_WIDTH - 1);
+	}
+	return true;
+}
+
+/** Free the entries a failed fill put in the table, leaving keys and values to the caller */
+static void undo_fill(HashMap *const map) {
+	for (size_t i = 0; i < map->capacity; i++) {
+		if (map->ctrl[i] != CTRL_EMPTY) {
+			free(map->slots[i]);
+			map->slots[i] = NULL;
+		}
+	}
+	memset(map->ctrl, CTRL_EMPTY, HashGroup_ctrl_bytes(map->capacity));
+	map->size = 0;
+}
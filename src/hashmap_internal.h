@@ -0,0 +1,71 @@
+//
+// HashMap functions for the containers built on top of it. They skip argument checks and take a hash
+// that was already computed with HashMap_hash, so a caller that needs the hash for its own purposes
+// (picking a shard, batching, ...) never hashes a key twice.
+//
+#ifndef libfaafo_HASHMAP_INTERNAL_H
+#define libfaafo_HASHMAP_INTERNAL_H
+
+#include <hashmap.h>
+
+/**
+ * Seed for a new table. The OS random source is only read for the first table of the process, the ones
+ * after it get that secret mixed with a counter, which is just as hard to guess from outside and needs no
+ * syscall.
+ */
+uint64_t HashMap_new_seed(void);
+
+/** The hash the map would compute for key, hash_fn output mixed with the map's seed */
+size_t HashMap_hash(const HashMap *map, const void *key);
+
+void *HashMap_put_hashed(HashMap *map, void *key, void *value, size_t hash);
+
+/** @return the entry for key or NULL, without logging on a miss */
+MapEntry *HashMap_find_hashed(const HashMap *map, const void *key, size_t hash);
+
+/** @return true if an entry was removed, without logging on a miss */
+bool HashMap_remove_hashed(HashMap *map, const void *key, size_t hash);
+
+/**
+ * Remove the entry for key from the table without releasing it. Only for maps with a destructor of their own,
+ * a map with the default one keeps some of its entries inside the HashMap struct.
+ * @return the detached entry, now owned by the caller, or NULL if key is not in the map
+ */
+MapEntry *HashMap_detach_hashed(HashMap *map, const void *key, size_t hash);
+
+/**
+ * Insert an entry the caller allocated, the counterpart of HashMap_detach_hashed. entry->hash must be set
+ * and entry->key must not be in the map yet. The map's destructor will be called on the entry like on any
+ * other, so containers that embed MapEntries in bigger nodes create the map with NOOP.
+ * @return false if the table had to grow and could not, or key is already in the map
+ */
+bool HashMap_attach_hashed(HashMap *map, MapEntry *entry);
+
+/**
+ * Grow the table of an empty map so that n entries fit without another resize. Unlike HashMap_reserve this
+ * leaves min_capacity alone, the map can still shrink later.
+ * @return false if out of memory or the map is not empty
+ */
+bool HashMap_presize(HashMap *map, size_t n);
+
+/**
+ * Copy the table of a map that is not in the middle of an incremental resize and has no tree bins. The copy
+ * points at the same MapEntries as the original and must be released with HashMap_free_table.
+ * @return the copy or NULL if out of memory
+ */
+HashMap *HashMap_clone_table(const HashMap *map);
+
+/** Free the map and its table but none of the entries */
+void HashMap_free_table(HashMap *map);
+
+/** @return the number of online CPUs, at least 1 */
+size_t HashMap_online_cpus(void);
+
+/**
+ * Run fn on each of nthreads workers of worker_size bytes stored one after the other, every worker on a thread
+ * of its own but the first, which runs on the calling thread. Used by the parallel bulk operations.
+ * @return false if a thread could not be started, after the ones that did have finished
+ */
+bool HashMap_run_parallel(void *workers, size_t worker_size, size_t nthreads, void *(*fn)(void *));
+
+#endif //libfaafo_HASHMAP_INTERNAL_H
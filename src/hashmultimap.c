@@ -0,0 +1,275 @@
+//
+// Hash map from keys to lists of values, on top of HashMap
+//
+#include "hashmultimap.h"
+
+#include <dbg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashmap_internal.h"
+
+#define MAX_VALUES_PER_KEY ((uint32_t) 1 << HASHMULTIMAP_BLOCK_CLASSES)
+
+/** Passed through HashMap_for_each to the caller's visitor */
+typedef struct VisitContext {
+	multimap_visit_fn fn;
+	void *ctx;
+} VisitContext;
+
+static void default_df(void *ptr);
+
+static bool release_visit(void *key, void *value, void *ctx);
+
+static bool forward_visit(void *key, void *value, void *ctx);
+
+static MultiMapNode *find_node(const HashMultiMap *multimap, const void *key);
+
+static MultiMapNode *alloc_node(HashMultiMap *multimap);
+
+static void free_node(HashMultiMap *multimap, MultiMapNode *node);
+
+static void **alloc_block(HashMultiMap *multimap, uint32_t capacity);
+
+static void free_block(HashMultiMap *multimap, void **block, uint32_t capacity);
+
+static bool append_value(HashMultiMap *multimap, MultiMapNode *node, void *value);
+
+static void remove_node(HashMultiMap *multimap, MultiMapNode *node);
+
+HashMultiMap *HashMultiMap_create(const hash_fn key_hash_fn, const equals_fn key_equals_fn,
+								  const equals_fn value_equals_fn, const destructor_fn key_df,
+								  const destructor_fn value_df) {
+	HashMultiMap *multimap = calloc(1, sizeof(HashMultiMap));
+	check_mem_return(multimap, NULL);
+	// Nodes live in the arena and are released by the multimap, the map only indexes them
+	multimap->map = HashMap_create(HASHMAP_DEFAULT_CAPACITY, key_hash_fn, key_equals_fn, NOOP);
+	check(multimap->map, "Failed to create map", goto catch);
+	multimap->arena = Arena_create(0);
+	check_mem(multimap->arena, goto catch);
+
+	multimap->size = 0;
+	multimap->value_equals_fn = value_equals_fn;
+	multimap->key_df = key_df ? key_df : default_df;
+	multimap->value_df = value_df ? value_df : default_df;
+	return multimap;
+catch:
+	if (multimap->map) {
+		HashMap_destroy(multimap->map);
+	}
+	free(multimap);
+	return NULL;
+}
+
+bool HashMultiMap_destroy(HashMultiMap *multimap) {
+	check_return(multimap, "Multimap is null", false);
+	HashMultiMap_clear(multimap);
+	HashMap_destroy(multimap->map);
+	Arena_destroy(multimap->arena);
+	free(multimap);
+	return true;
+}
+
+bool HashMultiMap_clear(HashMultiMap *multimap) {
+	check_return(multimap, "Multimap is null", false);
+	HashMap_for_each(multimap->map, release_visit, multimap);
+	check_return(HashMap_clear(multimap->map), "Failed to clear map", false);
+	Arena_reset(multimap->arena);
+	multimap->free_nodes = NULL;
+	memset(multimap->free_blocks, 0, sizeof(multimap->free_blocks));
+	multimap->size = 0;
+	return true;
+}
+
+bool HashMultiMap_put(HashMultiMap *const multimap, const void *const key, const copy_fn key_copy, void *const value) {
+	check_return(multimap, "Multimap is null", false);
+	check_return(key, "Key is null", false);
+	check_return(value, "Value is null", false);
+
+	const size_t hash = HashMap_hash(multimap->map, key);
+	const MapEntry *entry = HashMap_find_hashed(multimap->map, key, hash);
+	if (entry) {
+		return append_value(multimap, entry->value, value);
+	}
+	MultiMapNode *node = alloc_node(multimap);
+	check_mem_return(node, false);
+	void *stored = key_copy ? key_copy(key) : (void *) key;
+	check_mem(stored, goto catch);
+	*node = (MultiMapNode) {
+		.entry = {.key = stored, .value = node, .hash = hash}, .values = &node->first, .count = 1, .capacity = 1,
+		.first = value
+	};
+	check(HashMap_attach_hashed(multimap->map, &node->entry), "Failed to add key", goto catch);
+	multimap->size++;
+	return true;
+catch:
+	if (stored && stored != key) {
+		multimap->key_df(stored);
+	}
+	free_node(multimap, node);
+	return false;
+}
+
+void *const *HashMultiMap_get_all(const HashMultiMap *const multimap, const void *const key, size_t *const count) {
+	check_return(multimap && count, "Multimap or count is null", NULL);
+	check_return(key, "Key is null", NULL);
+	const MultiMapNode *node = find_node(multimap, key);
+	*count = node ? node->count : 0;
+	return node ? node->values : NULL;
+}
+
+size_t HashMultiMap_count(const HashMultiMap *const multimap, const void *const key) {
+	check_return(multimap, "Multimap is null", 0);
+	check_return(key, "Key is null", 0);
+	const MultiMapNode *node = find_node(multimap, key);
+	return node ? node->count : 0;
+}
+
+bool HashMultiMap_remove_value(HashMultiMap *const multimap, const void *const key, const void *const value) {
+	check_return(multimap, "Multimap is null", false);
+	check_return(key && value, "Key or value is null", false);
+	MultiMapNode *node = find_node(multimap, key);
+	if (!node) {
+		return false;
+	}
+	uint32_t i = 0;
+	while (i < node->count && node->values[i] != value &&
+		   !(multimap->value_equals_fn && multimap->value_equals_fn(node->values[i], value))) {
+		i++;
+	}
+	if (i == node->count) {
+		return false;
+	}
+	if (node->count == 1) {
+		remove_node(multimap, node);
+		return true;
+	}
+	multimap->value_df(node->values[i]);
+	memmove(node->values + i, node->values + i + 1, (node->count - i - 1) * sizeof(void *));
+	node->count--;
+	multimap->size--;
+	if (node->count == 1) {
+		// Back to a single value, it goes inline and the block is free for another key
+		node->first = node->values[0];
+		free_block(multimap, node->values, node->capacity);
+		node->values = &node->first;
+		node->capacity = 1;
+	}
+	return true;
+}
+
+size_t HashMultiMap_remove(HashMultiMap *const multimap, const void *const key) {
+	check_return(multimap, "Multimap is null", 0);
+	check_return(key, "Key is null", 0);
+	MultiMapNode *node = find_node(multimap, key);
+	if (!node) {
+		return 0;
+	}
+	const size_t count = node->count;
+	remove_node(multimap, node);
+	return count;
+}
+
+size_t HashMultiMap_key_count(const HashMultiMap *const multimap) {
+	check_return(multimap, "Multimap is null", 0);
+	return multimap->map->size;
+}
+
+bool HashMultiMap_for_each(const HashMultiMap *const multimap, const multimap_visit_fn fn, void *const ctx) {
+	check_return(multimap && fn, "Multimap or function is null", false);
+	VisitContext visit = {.fn = fn, .ctx = ctx};
+	return HashMap_for_each(multimap->map, forward_visit, &visit);
+}
+
+
+// Private helper functions
+
+static void default_df(void *ptr) {
+	free(ptr);
+}
+
+/** Release the key and values of a node, its memory goes with the arena */
+static bool release_visit(void *key, void *value, void *ctx) {
+	const HashMultiMap *multimap = ctx;
+	const MultiMapNode *node = value;
+	for (uint32_t i = 0; i < node->count; i++) {
+		multimap->value_df(node->values[i]);
+	}
+	multimap->key_df(key);
+	return true;
+}
+
+static bool forward_visit(void *key, void *value, void *ctx) {
+	const VisitContext *visit = ctx;
+	const MultiMapNode *node = value;
+	return visit->fn(key, node->values, node->count, visit->ctx);
+}
+
+static MultiMapNode *find_node(const HashMultiMap *const multimap, const void *const key) {
+	const MapEntry *entry = HashMap_find_hashed(multimap->map, key, HashMap_hash(multimap->map, key));
+	return entry ? entry->value : NULL;
+}
+
+static MultiMapNode *alloc_node(HashMultiMap *const multimap) {
+	MultiMapNode *node = multimap->free_nodes;
+	if (node) {
+		multimap->free_nodes = node->entry.value;
+		return node;
+	}
+	return Arena_alloc(multimap->arena, sizeof(MultiMapNode));
+}
+
+static void free_node(HashMultiMap *const multimap, MultiMapNode *const node) {
+	node->entry.value = multimap->free_nodes;
+	multimap->free_nodes = node;
+}
+
+/** Size class of a block, capacity is a power of 2 from 2 up */
+static inline unsigned block_class(const uint32_t capacity) {
+	return (unsigned) __builtin_ctz(capacity) - 1;
+}
+
+static void **alloc_block(HashMultiMap *const multimap, const uint32_t capacity) {
+	const unsigned class = block_class(capacity);
+	void **block = multimap->free_blocks[class];
+	if (block) {
+		multimap->free_blocks[class] = block[0];
+		return block;
+	}
+	return Arena_alloc(multimap->arena, capacity * sizeof(void *));
+}
+
+static void free_block(HashMultiMap *const multimap, void **const block, const uint32_t capacity) {
+	const unsigned class = block_class(capacity);
+	block[0] = multimap->free_blocks[class];
+	multimap->free_blocks[class] = block;
+}
+
+static bool append_value(HashMultiMap *const multimap, MultiMapNode *const node, void *const value) {
+	if (node->count == node->capacity) {
+		check_return(node->capacity < MAX_VALUES_PER_KEY, "Too many values for one key", false);
+		const uint32_t capacity = node->capacity * 2;
+		void **block = alloc_block(multimap, capacity);
+		check_mem_return(block, false);
+		memcpy(block, node->values, node->count * sizeof(void *));
+		if (node->capacity > 1) {
+			free_block(multimap, node->values, node->capacity);
+		}
+		node->values = block;
+		node->capacity = capacity;
+	}
+	node->values[node->count++] = value;
+	multimap->size++;
+	return true;
+}
+
+/** Take node out of the map and release its key and values */
+static void remove_node(HashMultiMap *const multimap, MultiMapNode *const node) {
+	HashMap_detach_hashed(multimap->map, node->entry.key, node->entry.hash);
+	multimap->size -= node->count;
+	release_visit(node->entry.key, node, multimap);
+	if (node->capacity > 1) {
+		free_block(multimap, node->values, node->capacity);
+	}
+	free_node(multimap, node);
+}
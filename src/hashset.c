@@ -0,0 +1,283 @@
+//
+// Open addressing hash set, keys and hashes inline in the slots
+//
+#include "hashset.h"
+
+#include <dbg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashmap_internal.h"
+#include "slottable.h"
+
+#define SLOT_LAYOUT SlotTable_layout(HashSetSlot)
+
+// Returned by find_index when the key is not in the set
+#define NOT_FOUND SIZE_MAX
+
+static void default_key_df(void *key);
+
+static size_t generate_hash(const HashSet *set, const void *key);
+
+static size_t find_index(const HashSet *set, const void *key, size_t hash, size_t *insert_index);
+
+static void erase_index(HashSet *set, size_t index);
+
+static bool resize(HashSet *set, size_t new_capacity);
+
+static void shrink_if_sparse(HashSet *set);
+
+HashSet *HashSet_create(size_t capacity, const hash_fn hash_fn, const equals_fn equals_fn, const destructor_fn key_df) {
+	check_return(capacity > 0, "Capacity must be > 0", NULL);
+	check_return((capacity & (capacity - 1)) == 0, "Capacity must be a power of 2", NULL);
+	check_return(hash_fn, "Hash function must not be null", NULL);
+	check_return(equals_fn, "Equals function must not be null", NULL);
+
+	if (capacity < HASHMAP_MIN_CAPACITY) {
+		capacity = HASHMAP_MIN_CAPACITY;
+	}
+
+	HashSet *set = calloc(1, sizeof(HashSet));
+	check_mem_return(set, NULL);
+	set->slots = SlotTable_allocate(capacity, &set->ctrl, sizeof(HashSetSlot));
+	check_mem(set->slots, goto catch);
+
+	set->size = 0;
+	set->capacity = capacity;
+	set->min_capacity = capacity;
+	set->hash_fn = hash_fn;
+	set->equals_fn = equals_fn;
+	set->df = key_df ? key_df : default_key_df;
+	set->seed = HashMap_new_seed();
+	SlotTable_set_thresholds(set);
+	return set;
+catch:
+	free(set);
+	return NULL;
+}
+
+bool HashSet_destroy(HashSet *set) {
+	check_return(set, "Set is null", false);
+	SlotTable_release(set->slots, set->ctrl, set->capacity, set->size, sizeof(HashSetSlot), offsetof(HashSetSlot, key),
+					  set->df);
+	free(set->slots); // ctrl bytes share the allocation
+	free(set);
+	return true;
+}
+
+bool HashSet_clear(HashSet *set) {
+	check_return(set, "Set is null", false);
+	SlotTable_release(set->slots, set->ctrl, set->capacity, set->size, sizeof(HashSetSlot), offsetof(HashSetSlot, key),
+					  set->df);
+	set->slots = SlotTable_clear(set->slots, &set->ctrl, &set->capacity, set->min_capacity, set->size,
+								 sizeof(HashSetSlot));
+	SlotTable_set_thresholds(set);
+	set->size = 0;
+	return true;
+}
+
+bool HashSet_add(HashSet *const set, void *const key) {
+	check_return(set, "Set is null", false);
+	check_return(key, "Key is null", false);
+
+	if (set->size >= set->threshold) {
+		size_t new_cap;
+		if (!SlotTable_grow_capacity(set->capacity, &new_cap, sizeof(HashSetSlot))) {
+			log_warn("Max capacity reached for set, further attempts to expand will cause failure");
+			return false;
+		}
+		check_return(resize(set, new_cap), "Failed to resize set", false);
+	}
+	const size_t hash = generate_hash(set, key);
+	size_t insert_index;
+	if (find_index(set, key, hash, &insert_index) != NOT_FOUND) {
+		return false;
+	}
+	set->slots[insert_index] = (HashSetSlot) {.key = key, .hash = hash};
+	HashGroup_set_ctrl(set->ctrl, set->capacity, insert_index, HashGroup_tag(hash));
+	set->size++;
+	return true;
+}
+
+bool HashSet_contains(const HashSet *const set, const void *const key) {
+	return HashSet_get(set, key) != NULL;
+}
+
+void *HashSet_get(const HashSet *const set, const void *const key) {
+	check_return(set, "Set is null", NULL);
+	check_return(key, "Key is null", NULL);
+	const size_t index = find_index(set, key, generate_hash(set, key), NULL);
+	return index != NOT_FOUND ? set->slots[index].key : NULL;
+}
+
+bool HashSet_remove(HashSet *const set, const void *const key) {
+	check_return(set, "Set is null", false);
+	check_return(key, "Key is null", false);
+	const size_t index = find_index(set, key, generate_hash(set, key), NULL);
+	if (index == NOT_FOUND) {
+		return false;
+	}
+	void *member = set->slots[index].key;
+	erase_index(set, index);
+	set->df(member);
+	shrink_if_sparse(set);
+	return true;
+}
+
+bool HashSet_add_all(HashSet *const set, const HashSet *const other, const copy_fn key_copy) {
+	check_return(set && other, "Set is null", false);
+	HashSetIterator it;
+	HashSet_iter_init(other, &it);
+	for (void *key = HashSet_iter_next(&it); key; key = HashSet_iter_next(&it)) {
+		if (HashSet_contains(set, key)) {
+			continue;
+		}
+		void *member = key_copy ? key_copy(key) : key;
+		check_mem_return(member, false);
+		if (!HashSet_add(set, member)) {
+			if (member != key) {
+				set->df(member);
+			}
+			return false;
+		}
+	}
+	return true;
+}
+
+size_t HashSet_retain_all(HashSet *const set, const HashSet *const other) {
+	check_return(set && other, "Set is null", 0);
+	size_t removed = 0;
+	for (size_t i = 0; i < set->capacity;) {
+		if (set->ctrl[i] == CTRL_EMPTY || HashSet_contains(other, set->slots[i].key)) {
+			i++;
+			continue;
+		}
+		/*
+		 * Backward shift only ever moves members into slots at or after i, so slot i is looked at again.
+		 * A run that wrapped around can bring an early member to the end of the table, it is then simply
+		 * checked a second time.
+		 */
+		void *member = set->slots[i].key;
+		erase_index(set, i);
+		set->df(member);
+		removed++;
+	}
+	shrink_if_sparse(set);
+	return removed;
+}
+
+size_t HashSet_remove_all(HashSet *const set, const HashSet *const other) {
+	check_return(set && other, "Set is null", 0);
+	size_t removed = 0;
+	if (other->size < set->size) {
+		HashSetIterator it;
+		HashSet_iter_init(other, &it);
+		for (void *key = HashSet_iter_next(&it); key; key = HashSet_iter_next(&it)) {
+			const size_t index = find_index(set, key, generate_hash(set, key), NULL);
+			if (index != NOT_FOUND) {
+				void *member = set->slots[index].key;
+				erase_index(set, index);
+				set->df(member);
+				removed++;
+			}
+		}
+	} else {
+		// Same walk as retain_all, with the test flipped
+		for (size_t i = 0; i < set->capacity;) {
+			if (set->ctrl[i] == CTRL_EMPTY || !HashSet_contains(other, set->slots[i].key)) {
+				i++;
+				continue;
+			}
+			void *member = set->slots[i].key;
+			erase_index(set, i);
+			set->df(member);
+			removed++;
+		}
+	}
+	shrink_if_sparse(set);
+	return removed;
+}
+
+void HashSet_iter_init(const HashSet *const set, HashSetIterator *const it) {
+	check(set && it, "Set or iterator is null", return);
+	it->set = set;
+	it->group = 0;
+	it->pending = HashGroup_match_full(set->ctrl);
+}
+
+void *HashSet_iter_next(HashSetIterator *const it) {
+	check_return(it, "Iterator is null", NULL);
+	while (!it->pending) {
+		it->group += HASHGROUP_WIDTH;
+		if (it->group >= it->set->capacity) {
+			it->group = it->set->capacity;
+			return NULL;
+		}
+		it->pending = HashGroup_match_full(it->set->ctrl + it->group);
+	}
+	const size_t index = it->group + HashGroup_lowest(it->pending);
+	it->pending &= it->pending - 1;
+	return it->set->slots[index].key;
+}
+
+
+// Private helper functions
+
+static void default_key_df(void *key) {
+	free(key);
+}
+
+static inline size_t generate_hash(const HashSet *set, const void *key) {
+	// Same mix as HashMap, see generate_hash there
+	return (size_t) Commons_hash_u64_seeded(set->hash_fn(key), set->seed);
+}
+
+/**
+ * @param insert_index if not NULL and key is not in the set, set to the slot a new member for key goes in
+ * @return the slot of key or NOT_FOUND
+ */
+static size_t find_index(const HashSet *const set, const void *const key, const size_t hash,
+						 size_t *const insert_index) {
+	const size_t mask = set->capacity - 1;
+	const uint8_t tag = HashGroup_tag(hash);
+	for (size_t pos = hash & mask;; pos = (pos + HASHGROUP_WIDTH) & mask) {
+		const uint8_t *group = set->ctrl + pos;
+		for (GroupMask match = HashGroup_match(group, tag); match; match &= match - 1) {
+			const size_t index = (pos + HashGroup_lowest(match)) & mask;
+			// The hash sits right next to the key, no pointer to chase before comparing it
+			if (set->slots[index].hash == hash && set->equals_fn(set->slots[index].key, key)) {
+				return index;
+			}
+		}
+		const GroupMask empty = HashGroup_match_empty(group);
+		if (empty) {
+			if (insert_index) {
+				*insert_index = (pos + HashGroup_lowest(empty)) & mask;
+			}
+			return NOT_FOUND;
+		}
+	}
+}
+
+/** The caller releases the key */
+static inline void erase_index(HashSet *const set, const size_t index) {
+	SlotTable_erase(set->slots, set->ctrl, set->capacity, index, SLOT_LAYOUT);
+	set->size--;
+}
+
+static bool resize(HashSet *const set, const size_t new_capacity) {
+	HashSetSlot *slots = SlotTable_resize(set->slots, &set->ctrl, &set->capacity, new_capacity, SLOT_LAYOUT);
+	check_mem_return(slots, false);
+	set->slots = slots;
+	SlotTable_set_thresholds(set);
+	return true;
+}
+
+static void shrink_if_sparse(HashSet *const set) {
+	const size_t new_cap = SlotTable_shrink_capacity(set->size, set->shrink_threshold, set->capacity,
+													 set->min_capacity, sizeof(HashSetSlot));
+	if (new_cap) {
+		resize(set, new_cap);
+	}
+}
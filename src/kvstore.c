@@ -0,0 +1,1005 @@
+//
+// Append only log structured key-value store on disk, Bitcask style
+//
+#include "kvstore.h"
+
+#include <arena.h>
+#include <dbg.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "hashmap_internal.h"
+
+#define DATA_SUFFIX ".data"
+#define HINT_SUFFIX ".hint"
+#define TMP_SUFFIX ".tmp"
+#define ID_DIGITS 10
+
+#define path_str(b) ((const char *) (b)->data)
+
+// Records up to this size are put together on the stack by KVStore_put
+#define STACK_RECORD_SIZE 1024
+// Merge output is written in chunks of this size
+#define MERGE_BUFFER_SIZE (1 << 20)
+
+#define is_tombstone(value_len) ((value_len) == KVSTORE_TOMBSTONE)
+/** Keeps a whole record, and a value read into a bstring, within INT_MAX bytes */
+#define MAX_BODY_LENGTH ((uint64_t) INT_MAX - KVSTORE_HEADER_SIZE - 1)
+#define body_length(key_len, value_len) ((uint64_t) (key_len) + (is_tombstone(value_len) ? 0 : (value_len)))
+
+/** The fixed part of a data file record, decoded */
+typedef struct RecordHeader {
+	uint32_t crc;
+	uint32_t key_len;
+	uint32_t value_len;
+	uint64_t seq;
+} RecordHeader;
+
+/** Called by scan_segment for every intact record, body is the key followed by the value */
+typedef bool (*record_fn)(void *ctx, KVSegment *segment, uint64_t offset, const RecordHeader *header,
+						  const unsigned char *body);
+
+/** A live record copied by a merge, applied to the keydir if the key was not written again meanwhile */
+typedef struct MergeMove {
+	const unsigned char *key;
+	uint32_t key_len;
+	KVSegment *from;
+	uint64_t from_offset;
+	KVSegment *to;
+	uint64_t to_offset;
+} MergeMove;
+
+/** A segment a merge reads, and what the merge found in it */
+typedef struct MergeInput {
+	KVSegment *segment;
+	uint64_t max_seq;       /**< Of all its records, tombstones included */
+	bool tombstones;
+} MergeInput;
+
+typedef struct MergeState {
+	KVStore *store;
+	MergeInput *input;      /**< The one being read */
+	KVSegment **outputs;
+	size_t output_count;
+	bstring buffer;         /**< Records not yet written to the last output */
+	bstring hints;          /**< Hint records of the last output */
+	MergeMove *moves;
+	size_t move_count;
+	size_t move_capacity;
+	Arena *keys;            /**< Key copies of the moves */
+} MergeState;
+
+static bool keys_equal(const void *a, const void *b);
+
+static int compare_ids(const void *a, const void *b);
+
+static int compare_max_seqs(const void *a, const void *b);
+
+static bstring segment_path(const KVStore *store, uint32_t id, const char *suffix);
+
+static KVSegment *open_segment(const KVStore *store, uint32_t id, bool create);
+
+static void close_segment(const KVStore *store, KVSegment *segment, bool unlink_files);
+
+static bool reserve_segments(KVStore *store, size_t n);
+
+static bool add_segment(KVStore *store, KVSegment *segment);
+
+static uint32_t take_id(KVStore *store);
+
+static bool roll_segment(KVStore *store);
+
+static bool list_segments(KVStore *store, uint32_t **ids, size_t *count);
+
+static bool load_segment(KVStore *store, KVSegment *segment);
+
+static bool load_hints(KVStore *store, KVSegment *segment);
+
+static bool load_record(void *ctx, KVSegment *segment, uint64_t offset, const RecordHeader *header,
+						const unsigned char *body);
+
+static bool apply_record(KVStore *store, KVSegment *segment, uint64_t offset, uint64_t seq, const void *key,
+						 uint32_t key_len, uint32_t value_len);
+
+static bool purge_tombstones(KVStore *store);
+
+static bool scan_segment(const KVStore *store, KVSegment *segment, record_fn fn, void *ctx);
+
+static void decode_header(const unsigned char *bytes, RecordHeader *header);
+
+static void encode_header(unsigned char *bytes, const RecordHeader *header);
+
+static uint32_t record_crc(const unsigned char *record, uint64_t body_len);
+
+static KVEntry *find_entry(const KVStore *store, const void *key, size_t key_len, size_t hash);
+
+static size_t key_hash(const KVStore *store, const void *key, size_t key_len);
+
+static KVEntry *new_entry(const void *key, uint32_t key_len, size_t hash);
+
+static bool write_record(KVStore *store, const void *key, size_t key_len, const void *value, uint32_t value_len);
+
+static bool append_record(KVStore *store, const unsigned char *record, size_t size, uint64_t *offset);
+
+static bool write_all(int fd, const void *data, size_t size);
+
+static bool sync_dir(const KVStore *store);
+
+static bool merge_record(void *ctx, KVSegment *segment, uint64_t offset, const RecordHeader *header,
+						 const unsigned char *body);
+
+static void remove_inputs(KVStore *store, MergeInput *inputs, size_t count);
+
+static bool start_output(MergeState *state);
+
+static bool finish_output(MergeState *state);
+
+static void free_store(KVStore *store);
+
+KVStore *KVStore_open(const char *const dir, const uint64_t max_segment_size) {
+	check_return(dir, "Directory is null", NULL);
+	check_return(mkdir(dir, 0755) == 0 || errno == EEXIST, "Failed to create %s", NULL, dir);
+	errno = 0;
+
+	KVStore *store = calloc(1, sizeof(KVStore));
+	check_mem_return(store, NULL);
+	uint32_t *ids = NULL;
+	size_t id_count = 0;
+	check(pthread_rwlock_init(&store->lock, NULL) == 0, "Failed to init lock", free(store); return NULL);
+	check(pthread_mutex_init(&store->merge_lock, NULL) == 0, "Failed to init merge lock", {
+		  pthread_rwlock_destroy(&store->lock);
+		  free(store);
+		  return NULL;
+		  });
+	store->max_segment_size = max_segment_size > 0 ? max_segment_size : KVSTORE_DEFAULT_SEGMENT_SIZE;
+	store->dir = bfromcstr(dir);
+	check_mem(store->dir, goto catch);
+	// Entries are allocated with their key and released with the entry itself
+	store->keydir = HashMap_create(HASHMAP_DEFAULT_CAPACITY, Commons_hash_fn_bstring, keys_equal, free);
+	check(store->keydir, "Failed to create keydir", goto catch);
+
+	check(list_segments(store, &ids, &id_count), "Failed to read %s", goto catch, dir);
+	for (size_t i = 0; i < id_count; i++) {
+		KVSegment *segment = open_segment(store, ids[i], false);
+		check(segment, "Failed to open segment %u", goto catch, ids[i]);
+		if (!add_segment(store, segment)) {
+			close_segment(store, segment, false);
+			goto catch;
+		}
+		check(load_segment(store, segment), "Failed to load segment %u", goto catch, ids[i]);
+		store->next_id = ids[i] + 1;
+	}
+	check(purge_tombstones(store), "Failed to purge removed keys", goto catch);
+	check(roll_segment(store), "Failed to create the active segment", goto catch);
+	free(ids);
+	return store;
+catch:
+	free(ids);
+	free_store(store);
+	return NULL;
+}
+
+bool KVStore_close(KVStore *store) {
+	check_return(store, "Store is null", false);
+	const bool synced = store->active->size == 0 || fsync(store->active->fd) == 0;
+	if (store->active->size == 0) {
+		// Every open starts a segment of its own, don't leave an empty one behind for each
+		size_t i = 0;
+		while (store->segments[i] != store->active) {
+			i++;
+		}
+		memmove(store->segments + i, store->segments + i + 1, (store->segment_count - i - 1) * sizeof(KVSegment *));
+		store->segment_count--;
+		close_segment(store, store->active, true);
+	}
+	free_store(store);
+	check_return(synced, "Failed to sync the active segment", false);
+	return true;
+}
+
+bool KVStore_put(KVStore *const store, const void *const key, const size_t key_len, const void *const value,
+				 const size_t value_len) {
+	check_return(store && key, "Store or key is null", false);
+	check_return(value || value_len == 0, "Value is null", false);
+	check_return(key_len <= MAX_BODY_LENGTH && value_len <= MAX_BODY_LENGTH - key_len, "Record too large", false);
+	return write_record(store, key, key_len, value, (uint32_t) value_len);
+}
+
+bstring KVStore_get(KVStore *const store, const void *const key, const size_t key_len) {
+	check_return(store && key, "Store or key is null", NULL);
+	if (key_len > INT_MAX) {
+		return NULL;
+	}
+	const size_t hash = key_hash(store, key, key_len);
+	pthread_rwlock_rdlock(&store->lock);
+	const KVEntry *entry = find_entry(store, key, key_len, hash);
+	if (!entry) {
+		pthread_rwlock_unlock(&store->lock);
+		return NULL;
+	}
+	// The whole record in one read, the value is moved to the front once the checksum is verified
+	const size_t size = KVSTORE_HEADER_SIZE + key_len + entry->value_len;
+	const uint32_t value_len = entry->value_len;
+	bstring record = bfromcstralloc((int) size + 1, "");
+	ssize_t read = -1;
+	if (record) {
+		read = pread(entry->segment->fd, record->data, size, (off_t) entry->offset);
+	}
+	pthread_rwlock_unlock(&store->lock);
+	check_mem_return(record, NULL);
+	check(read == (ssize_t) size, "Failed to read record", goto catch);
+
+	RecordHeader header;
+	decode_header(record->data, &header);
+	check(header.key_len == key_len && header.value_len == value_len &&
+		  header.crc == record_crc(record->data, size - KVSTORE_HEADER_SIZE) &&
+		  memcmp(record->data + KVSTORE_HEADER_SIZE, key, key_len) == 0, "Damaged record", goto catch);
+	memmove(record->data, record->data + KVSTORE_HEADER_SIZE + key_len, value_len);
+	record->slen = (int) value_len;
+	record->data[value_len] = '\0';
+	return record;
+catch:
+	bdestroy(record);
+	return NULL;
+}
+
+bool KVStore_contains(KVStore *const store, const void *const key, const size_t key_len) {
+	check_return(store && key, "Store or key is null", false);
+	if (key_len > INT_MAX) {
+		return false;
+	}
+	const size_t hash = key_hash(store, key, key_len);
+	pthread_rwlock_rdlock(&store->lock);
+	const bool found = find_entry(store, key, key_len, hash) != NULL;
+	pthread_rwlock_unlock(&store->lock);
+	return found;
+}
+
+bool KVStore_remove(KVStore *const store, const void *const key, const size_t key_len) {
+	check_return(store && key, "Store or key is null", false);
+	if (key_len > MAX_BODY_LENGTH) {
+		return false;
+	}
+	return write_record(store, key, key_len, NULL, KVSTORE_TOMBSTONE);
+}
+
+bool KVStore_sync(KVStore *const store) {
+	check_return(store, "Store is null", false);
+	pthread_rwlock_rdlock(&store->lock);
+	const int synced = fsync(store->active->fd);
+	pthread_rwlock_unlock(&store->lock);
+	check_return(synced == 0, "Failed to sync the active segment", false);
+	return true;
+}
+
+size_t KVStore_size(KVStore *const store) {
+	check_return(store, "Store is null", 0);
+	pthread_rwlock_rdlock(&store->lock);
+	const size_t size = store->keydir->size;
+	pthread_rwlock_unlock(&store->lock);
+	return size;
+}
+
+bool KVStore_merge(KVStore *const store) {
+	check_return(store, "Store is null", false);
+	pthread_mutex_lock(&store->merge_lock);
+
+	// Segments rolled while the merge runs are newer than anything merged, they are left alone
+	pthread_rwlock_rdlock(&store->lock);
+	const size_t input_count = store->segment_count - 1;
+	MergeInput *inputs = calloc(input_count > 0 ? input_count : 1, sizeof(MergeInput));
+	for (size_t i = 0, j = 0; inputs && i < store->segment_count; i++) {
+		if (store->segments[i] != store->active) {
+			inputs[j++].segment = store->segments[i];
+		}
+	}
+	pthread_rwlock_unlock(&store->lock);
+	if (!inputs) {
+		pthread_mutex_unlock(&store->merge_lock);
+		check_mem_return(inputs, false);
+	}
+	if (input_count == 0) {
+		free(inputs);
+		pthread_mutex_unlock(&store->merge_lock);
+		return true;
+	}
+
+	MergeState state = {
+		.store = store,
+		.buffer = bfromcstralloc(MERGE_BUFFER_SIZE, ""),
+		.hints = bfromcstralloc(4096, ""),
+		.keys = Arena_create(0)
+	};
+	bool ok = state.buffer && state.hints && state.keys;
+	check_mem(ok, goto done);
+	for (size_t i = 0; i < input_count; i++) {
+		state.input = &inputs[i];
+		ok = scan_segment(store, inputs[i].segment, merge_record, &state);
+		check(ok, "Failed to merge segment %u", goto done, inputs[i].segment->id);
+	}
+	ok = state.output_count == 0 || finish_output(&state);
+	check(ok, "Failed to finish merge output", goto done);
+	ok = sync_dir(store);
+	check(ok, "Failed to sync %s", goto done, path_str(store->dir));
+
+	// Everything is on disk, swap the segments. A key written since it was copied keeps its newer record.
+	pthread_rwlock_wrlock(&store->lock);
+	ok = reserve_segments(store, store->segment_count + state.output_count);
+	if (!ok) {
+		pthread_rwlock_unlock(&store->lock);
+		log_err("Out of memory.");
+		goto done;
+	}
+	size_t count = 0;
+	for (size_t i = 0; i < store->segment_count; i++) {
+		bool merged = false;
+		for (size_t j = 0; j < input_count && !merged; j++) {
+			merged = store->segments[i] == inputs[j].segment;
+		}
+		if (!merged) {
+			store->segments[count++] = store->segments[i];
+		}
+	}
+	store->segment_count = count;
+	for (size_t i = 0; i < state.output_count; i++) {
+		add_segment(store, state.outputs[i]);
+	}
+	for (size_t i = 0; i < state.move_count; i++) {
+		const MergeMove *move = &state.moves[i];
+		KVEntry *entry = find_entry(store, move->key, move->key_len, key_hash(store, move->key, move->key_len));
+		if (entry && entry->segment == move->from && entry->offset == move->from_offset) {
+			entry->segment = move->to;
+			entry->offset = move->to_offset;
+		}
+	}
+	pthread_rwlock_unlock(&store->lock);
+
+	// No get can be reading the old segments any more, they were only reachable through the keydir
+	remove_inputs(store, inputs, input_count);
+	state.output_count = 0;
+done:
+	for (size_t i = 0; i < state.output_count; i++) {
+		close_segment(store, state.outputs[i], true);
+	}
+	free(state.outputs);
+	free(state.moves);
+	bdestroy(state.buffer);
+	bdestroy(state.hints);
+	if (state.keys) {
+		Arena_destroy(state.keys);
+	}
+	free(inputs);
+	pthread_mutex_unlock(&store->merge_lock);
+	return ok;
+}
+
+
+// Private helper functions
+
+static bool keys_equal(const void *a, const void *b) {
+	return biseq(a, b) == 1;
+}
+
+static int compare_ids(const void *a, const void *b) {
+	const uint32_t x = *(const uint32_t *) a;
+	const uint32_t y = *(const uint32_t *) b;
+	return (x > y) - (x < y);
+}
+
+static int compare_max_seqs(const void *a, const void *b) {
+	const uint64_t x = ((const MergeInput *) a)->max_seq;
+	const uint64_t y = ((const MergeInput *) b)->max_seq;
+	return (x > y) - (x < y);
+}
+
+static bstring segment_path(const KVStore *const store, const uint32_t id, const char *const suffix) {
+	return bformat("%s/%0*u%s", path_str(store->dir), ID_DIGITS, id, suffix);
+}
+
+static KVSegment *open_segment(const KVStore *const store, const uint32_t id, const bool create) {
+	bstring path = segment_path(store, id, DATA_SUFFIX);
+	check_mem_return(path, NULL);
+	KVSegment *segment = malloc(sizeof(KVSegment));
+	check_mem(segment, goto catch);
+	segment->id = id;
+	// Only the active segment is ever written, old ones are read with pread alone
+	segment->fd = create
+		? open(path_str(path), O_RDWR | O_CREAT | O_EXCL | O_APPEND, 0644)
+		: open(path_str(path), O_RDONLY);
+	check(segment->fd >= 0, "Failed to open %s", goto catch, path_str(path));
+	struct stat st;
+	check(fstat(segment->fd, &st) == 0, "Failed to stat %s", close(segment->fd); goto catch, path_str(path));
+	segment->size = (uint64_t) st.st_size;
+	bdestroy(path);
+	return segment;
+catch:
+	free(segment);
+	bdestroy(path);
+	return NULL;
+}
+
+static void close_segment(const KVStore *const store, KVSegment *const segment, const bool unlink_files) {
+	close(segment->fd);
+	if (unlink_files) {
+		bstring data_path = segment_path(store, segment->id, DATA_SUFFIX);
+		bstring hint_path = segment_path(store, segment->id, HINT_SUFFIX);
+		if (data_path) {
+			unlink(path_str(data_path));
+		}
+		if (hint_path) {
+			unlink(path_str(hint_path));
+		}
+		bdestroy(data_path);
+		bdestroy(hint_path);
+	}
+	free(segment);
+}
+
+/** Make room for n segments, so that adding them can't fail */
+static bool reserve_segments(KVStore *const store, const size_t n) {
+	if (n <= store->segment_capacity) {
+		return true;
+	}
+	size_t capacity = store->segment_capacity ? store->segment_capacity : 8;
+	while (capacity < n) {
+		capacity *= 2;
+	}
+	KVSegment **segments = realloc(store->segments, capacity * sizeof(KVSegment *));
+	check_mem_return(segments, false);
+	store->segments = segments;
+	store->segment_capacity = capacity;
+	return true;
+}
+
+/** Insert segment into the segments, which stay sorted by id */
+static bool add_segment(KVStore *const store, KVSegment *const segment) {
+	if (!reserve_segments(store, store->segment_count + 1)) {
+		return false;
+	}
+	size_t i = store->segment_count;
+	while (i > 0 && store->segments[i - 1]->id > segment->id) {
+		store->segments[i] = store->segments[i - 1];
+		i--;
+	}
+	store->segments[i] = segment;
+	store->segment_count++;
+	return true;
+}
+
+static uint32_t take_id(KVStore *const store) {
+	pthread_rwlock_wrlock(&store->lock);
+	const uint32_t id = store->next_id++;
+	pthread_rwlock_unlock(&store->lock);
+	return id;
+}
+
+/** Start a new active segment, with the write lock held or while opening */
+static bool roll_segment(KVStore *const store) {
+	KVSegment *segment = open_segment(store, store->next_id, true);
+	check_return(segment, "Failed to create segment %u", false, store->next_id);
+	if (!add_segment(store, segment)) {
+		close_segment(store, segment, true);
+		return false;
+	}
+	store->next_id++;
+	store->active = segment;
+	return true;
+}
+
+/** Ids of the data files in the directory, sorted. Leftovers of an interrupted hint write are removed. */
+static bool list_segments(KVStore *const store, uint32_t **const ids, size_t *const count) {
+	DIR *dir = opendir(path_str(store->dir));
+	check_return(dir, "Failed to open %s", false, path_str(store->dir));
+	size_t capacity = 0;
+	struct dirent *dirent;
+	while ((dirent = readdir(dir))) {
+		const char *name = dirent->d_name;
+		size_t digits = 0;
+		while (name[digits] >= '0' && name[digits] <= '9') {
+			digits++;
+		}
+		if (digits != ID_DIGITS) {
+			continue;
+		}
+		if (strcmp(name + digits, HINT_SUFFIX TMP_SUFFIX) == 0) {
+			bstring path = bformat("%s/%s", path_str(store->dir), name);
+			if (path) {
+				unlink(path_str(path));
+			}
+			bdestroy(path);
+			continue;
+		}
+		const unsigned long id = strtoul(name, NULL, 10);
+		if (strcmp(name + digits, DATA_SUFFIX) != 0 || id >= UINT32_MAX) {
+			continue;
+		}
+		if (*count == capacity) {
+			capacity = capacity ? capacity * 2 : 16;
+			uint32_t *grown = realloc(*ids, capacity * sizeof(uint32_t));
+			check_mem(grown, closedir(dir); return false);
+			*ids = grown;
+		}
+		(*ids)[(*count)++] = (uint32_t) id;
+	}
+	closedir(dir);
+	if (*count > 0) {
+		qsort(*ids, *count, sizeof(uint32_t), compare_ids);
+	}
+	return true;
+}
+
+static bool load_segment(KVStore *const store, KVSegment *const segment) {
+	if (load_hints(store, segment)) {
+		return true;
+	}
+	return scan_segment(store, segment, load_record, store);
+}
+
+/**
+ * Load a segment from its hint file: the hint records followed by the CRC-32C of all of them
+ * @return false if there is no usable hint file, the data file is scanned instead
+ */
+static bool load_hints(KVStore *const store, KVSegment *const segment) {
+	bstring path = segment_path(store, segment->id, HINT_SUFFIX);
+	check_mem_return(path, false);
+	FILE *file = fopen(path_str(path), "rb");
+	bdestroy(path);
+	if (!file) {
+		// Segments that were not written by a merge have none
+		errno = 0;
+		return false;
+	}
+	bstring hints = bread((bNread) fread, file);
+	fclose(file);
+	bool ok = hints && hints->slen >= (int) sizeof(uint32_t);
+	if (ok) {
+		const size_t length = (size_t) hints->slen - sizeof(uint32_t);
+		uint32_t crc;
+		memcpy(&crc, hints->data + length, sizeof(crc));
+		ok = crc == Commons_crc32c(0, hints->data, length);
+		for (size_t pos = 0; ok && pos < length;) {
+			uint64_t seq, offset;
+			uint32_t key_len, value_len;
+			ok = length - pos >= KVSTORE_HINT_HEADER_SIZE;
+			if (!ok) {
+				break;
+			}
+			memcpy(&seq, hints->data + pos, sizeof(seq));
+			memcpy(&offset, hints->data + pos + 8, sizeof(offset));
+			memcpy(&key_len, hints->data + pos + 16, sizeof(key_len));
+			memcpy(&value_len, hints->data + pos + 20, sizeof(value_len));
+			pos += KVSTORE_HINT_HEADER_SIZE;
+			ok = key_len <= length - pos && offset <= segment->size && body_length(key_len, value_len) <= MAX_BODY_LENGTH &&
+				 KVSTORE_HEADER_SIZE + body_length(key_len, value_len) <= segment->size - offset;
+			if (ok) {
+				ok = apply_record(store, segment, offset, seq, hints->data + pos, key_len, value_len);
+				pos += key_len;
+			}
+		}
+	}
+	if (!ok) {
+		// Records already applied point at the same places the scan will find, loading them twice is harmless
+		log_warn("Ignoring damaged hint file of segment %u", segment->id);
+	}
+	bdestroy(hints);
+	return ok;
+}
+
+static bool load_record(void *ctx, KVSegment *segment, const uint64_t offset, const RecordHeader *header,
+						const unsigned char *body) {
+	return apply_record(ctx, segment, offset, header->seq, body, header->key_len, header->value_len);
+}
+
+/** Point the keydir at a record found while opening, unless a newer record of the key was found before */
+static bool apply_record(KVStore *const store, KVSegment *const segment, const uint64_t offset, const uint64_t seq,
+						 const void *const key, const uint32_t key_len, const uint32_t value_len) {
+	const size_t hash = key_hash(store, key, key_len);
+	KVEntry *entry = find_entry(store, key, key_len, hash);
+	if (!entry) {
+		entry = new_entry(key, key_len, hash);
+		check_mem_return(entry, false);
+		if (!HashMap_attach_hashed(store->keydir, &entry->entry)) {
+			free(entry);
+			return false;
+		}
+	} else if (entry->seq >= seq) {
+		// Equal when a merge was interrupted after copying the record and both copies are still around
+		return true;
+	}
+	entry->segment = segment;
+	entry->offset = offset;
+	entry->seq = seq;
+	entry->value_len = value_len;
+	if (seq >= store->seq) {
+		store->seq = seq + 1;
+	}
+	return true;
+}
+
+/** Drop the keys whose newest record is a tombstone, once every segment is loaded */
+static bool purge_tombstones(KVStore *const store) {
+	KVEntry **removed = NULL;
+	size_t count = 0;
+	size_t capacity = 0;
+	HashMapIterator it;
+	HashMap_iter_init(store->keydir, &it);
+	for (MapEntry *entry = HashMap_iter_next(&it); entry; entry = HashMap_iter_next(&it)) {
+		KVEntry *kv_entry = entry->value;
+		if (!is_tombstone(kv_entry->value_len)) {
+			continue;
+		}
+		if (count == capacity) {
+			capacity = capacity ? capacity * 2 : 64;
+			KVEntry **grown = realloc(removed, capacity * sizeof(KVEntry *));
+			check_mem(grown, free(removed); return false);
+			removed = grown;
+		}
+		removed[count++] = kv_entry;
+	}
+	for (size_t i = 0; i < count; i++) {
+		HashMap_remove_hashed(store->keydir, &removed[i]->key, removed[i]->entry.hash);
+	}
+	free(removed);
+	return true;
+}
+
+/**
+ * Read the records of a data file in order through a bStream, checking their CRCs. The first torn or
+ * damaged record ends the scan with a warning, the segment size is cut back to the records before it.
+ * @return false on read errors or if fn returned false
+ */
+static bool scan_segment(const KVStore *const store, KVSegment *const segment, const record_fn fn, void *const ctx) {
+	bstring path = segment_path(store, segment->id, DATA_SUFFIX);
+	check_mem_return(path, false);
+	FILE *file = fopen(path_str(path), "rb");
+	bstring header_bytes = bfromcstralloc(KVSTORE_HEADER_SIZE + 1, "");
+	bstring body = bfromcstralloc(256, "");
+	struct bStream *stream = file ? bsopen((bNread) fread, file) : NULL;
+	bool ok = stream && header_bytes && body;
+	check(ok, "Failed to read %s", goto done, path_str(path));
+
+	uint64_t offset = 0;
+	while (offset < segment->size) {
+		RecordHeader header;
+		if (bsread(header_bytes, stream, KVSTORE_HEADER_SIZE) != BSTR_OK ||
+			header_bytes->slen != KVSTORE_HEADER_SIZE) {
+			break;
+		}
+		decode_header(header_bytes->data, &header);
+		const uint64_t body_len = body_length(header.key_len, header.value_len);
+		if (body_len > segment->size - offset - KVSTORE_HEADER_SIZE || body_len > MAX_BODY_LENGTH) {
+			break;
+		}
+		body->slen = 0;
+		if (body_len > 0 && (bsread(body, stream, (int) body_len) != BSTR_OK || (uint64_t) body->slen != body_len)) {
+			break;
+		}
+		const uint32_t crc = Commons_crc32c(Commons_crc32c(0, header_bytes->data + sizeof(uint32_t),
+														   KVSTORE_HEADER_SIZE - sizeof(uint32_t)), body->data, body_len);
+		if (crc != header.crc) {
+			break;
+		}
+		ok = fn(ctx, segment, offset, &header, body->data);
+		if (!ok) {
+			goto done;
+		}
+		offset += KVSTORE_HEADER_SIZE + body_len;
+	}
+	if (offset < segment->size) {
+		log_warn("Ignoring %llu bytes after the last intact record of %s",
+				 (unsigned long long) (segment->size - offset), path_str(path));
+		segment->size = offset;
+	}
+done:
+	if (stream) {
+		bsclose(stream);
+	}
+	if (file) {
+		fclose(file);
+	}
+	bdestroy(header_bytes);
+	bdestroy(body);
+	bdestroy(path);
+	return ok;
+}
+
+static void decode_header(const unsigned char *const bytes, RecordHeader *const header) {
+	memcpy(&header->crc, bytes, sizeof(uint32_t));
+	memcpy(&header->key_len, bytes + 4, sizeof(uint32_t));
+	memcpy(&header->value_len, bytes + 8, sizeof(uint32_t));
+	memcpy(&header->seq, bytes + 12, sizeof(uint64_t));
+}
+
+static void encode_header(unsigned char *const bytes, const RecordHeader *const header) {
+	memcpy(bytes, &header->crc, sizeof(uint32_t));
+	memcpy(bytes + 4, &header->key_len, sizeof(uint32_t));
+	memcpy(bytes + 8, &header->value_len, sizeof(uint32_t));
+	memcpy(bytes + 12, &header->seq, sizeof(uint64_t));
+}
+
+/** CRC-32C of a whole record in memory, everything after the crc field */
+static uint32_t record_crc(const unsigned char *const record, const uint64_t body_len) {
+	return Commons_crc32c(0, record + sizeof(uint32_t), KVSTORE_HEADER_SIZE - sizeof(uint32_t) + body_len);
+}
+
+static KVEntry *find_entry(const KVStore *const store, const void *const key, const size_t key_len,
+						   const size_t hash) {
+	struct tagbstring probe = {.mlen = -1, .slen = (int) key_len, .data = (unsigned char *) key};
+	MapEntry *entry = HashMap_find_hashed(store->keydir, &probe, hash);
+	return entry ? entry->value : NULL;
+}
+
+static size_t key_hash(const KVStore *const store, const void *const key, const size_t key_len) {
+	struct tagbstring probe = {.mlen = -1, .slen = (int) key_len, .data = (unsigned char *) key};
+	return HashMap_hash(store->keydir, &probe);
+}
+
+static KVEntry *new_entry(const void *const key, const uint32_t key_len, const size_t hash) {
+	KVEntry *entry = malloc(sizeof(KVEntry) + key_len + 1);
+	check_mem_return(entry, NULL);
+	memcpy(entry->key_data, key, key_len);
+	entry->key_data[key_len] = '\0';
+	entry->key = (struct tagbstring) {.mlen = -1, .slen = (int) key_len, .data = entry->key_data};
+	entry->entry = (MapEntry) {.key = &entry->key, .value = entry, .hash = hash};
+	return entry;
+}
+
+/** Append a put, or a tombstone if value_len is KVSTORE_TOMBSTONE, and point the keydir at it */
+static bool write_record(KVStore *const store, const void *const key, const size_t key_len,
+						 const void *const value, const uint32_t value_len) {
+	const size_t body_len = body_length(key_len, value_len);
+	const size_t size = KVSTORE_HEADER_SIZE + body_len;
+	unsigned char stack_record[STACK_RECORD_SIZE];
+	unsigned char *record = size <= STACK_RECORD_SIZE ? stack_record : malloc(size);
+	check_mem_return(record, false);
+	memcpy(record + KVSTORE_HEADER_SIZE, key, key_len);
+	if (body_len > key_len) {
+		memcpy(record + KVSTORE_HEADER_SIZE + key_len, value, value_len);
+	}
+	const size_t hash = key_hash(store, key, key_len);
+
+	pthread_rwlock_wrlock(&store->lock);
+	KVEntry *entry = find_entry(store, key, key_len, hash);
+	bool ok = entry || !is_tombstone(value_len);
+	bool added = false;
+	if (ok && !entry) {
+		// In the keydir before the record is written, so a failed insert leaves nothing behind on disk
+		entry = new_entry(key, (uint32_t) key_len, hash);
+		ok = entry && HashMap_attach_hashed(store->keydir, &entry->entry);
+		check(ok, "Failed to add key", free(entry); goto done);
+		added = true;
+	}
+	if (ok) {
+		RecordHeader header = {.key_len = (uint32_t) key_len, .value_len = value_len, .seq = store->seq};
+		encode_header(record, &header);
+		header.crc = record_crc(record, body_len);
+		encode_header(record, &header);
+		uint64_t offset;
+		ok = append_record(store, record, size, &offset);
+		if (!ok) {
+			if (added) {
+				HashMap_detach_hashed(store->keydir, &entry->key, hash);
+				free(entry);
+			}
+		} else if (is_tombstone(value_len)) {
+			store->seq++;
+			HashMap_remove_hashed(store->keydir, &entry->key, hash);
+		} else {
+			store->seq++;
+			entry->segment = store->active;
+			entry->offset = offset;
+			entry->seq = header.seq;
+			entry->value_len = value_len;
+		}
+	}
+done:
+	pthread_rwlock_unlock(&store->lock);
+	if (record != stack_record) {
+		free(record);
+	}
+	return ok;
+}
+
+/** Write a record to the end of the active segment with one write, rolling it over first if it is full */
+static bool append_record(KVStore *const store, const unsigned char *const record, const size_t size,
+						  uint64_t *const offset) {
+	if (store->active->size > 0 && store->active->size + size > store->max_segment_size) {
+		check_return(roll_segment(store), "Failed to roll over the active segment", false);
+	}
+	KVSegment *active = store->active;
+	if (!write_all(active->fd, record, size)) {
+		log_err("Failed to write to segment %u", active->id);
+		// Cut off whatever part made it, the next record must start where this one did
+		if (ftruncate(active->fd, (off_t) active->size) != 0) {
+			log_err("Failed to truncate segment %u", active->id);
+		}
+		return false;
+	}
+	*offset = active->size;
+	active->size += size;
+	return true;
+}
+
+static bool write_all(const int fd, const void *const data, size_t size) {
+	const unsigned char *p = data;
+	while (size > 0) {
+		const ssize_t written = write(fd, p, size);
+		if (written < 0 && errno == EINTR) {
+			continue;
+		}
+		if (written <= 0) {
+			return false;
+		}
+		p += written;
+		size -= (size_t) written;
+	}
+	return true;
+}
+
+/** fsync the directory so files created and renamed in it survive a crash */
+static bool sync_dir(const KVStore *const store) {
+	const int fd = open(path_str(store->dir), O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	const bool synced = fsync(fd) == 0;
+	close(fd);
+	return synced;
+}
+
+/** Copy a record to the merge output if the keydir still points at it, tombstones are dropped */
+static bool merge_record(void *ctx, KVSegment *segment, const uint64_t offset, const RecordHeader *header,
+						 const unsigned char *body) {
+	MergeState *state = ctx;
+	KVStore *store = state->store;
+	if (header->seq > state->input->max_seq) {
+		state->input->max_seq = header->seq;
+	}
+	if (is_tombstone(header->value_len)) {
+		// Every older record of the key is in this merge too and is dropped with it, see remove_inputs
+		state->input->tombstones = true;
+		return true;
+	}
+	const size_t hash = key_hash(store, body, header->key_len);
+	pthread_rwlock_rdlock(&store->lock);
+	const KVEntry *entry = find_entry(store, body, header->key_len, hash);
+	const bool live = entry && entry->segment == segment && entry->offset == offset;
+	pthread_rwlock_unlock(&store->lock);
+	if (!live) {
+		return true;
+	}
+
+	const uint64_t size = KVSTORE_HEADER_SIZE + (uint64_t) header->key_len + header->value_len;
+	KVSegment *output = state->output_count ? state->outputs[state->output_count - 1] : NULL;
+	if (output && output->size > 0 && output->size + size > store->max_segment_size) {
+		check_return(finish_output(state), "Failed to finish merge output", false);
+		output = NULL;
+	}
+	if (!output) {
+		check_return(start_output(state), "Failed to start merge output", false);
+		output = state->outputs[state->output_count - 1];
+	}
+
+	if (state->move_count == state->move_capacity) {
+		const size_t capacity = state->move_capacity ? state->move_capacity * 2 : 1024;
+		MergeMove *moves = realloc(state->moves, capacity * sizeof(MergeMove));
+		check_mem_return(moves, false);
+		state->moves = moves;
+		state->move_capacity = capacity;
+	}
+	unsigned char *key = Arena_alloc(state->keys, header->key_len ? header->key_len : 1);
+	check_mem_return(key, false);
+	memcpy(key, body, header->key_len);
+	state->moves[state->move_count++] = (MergeMove) {
+		.key = key, .key_len = header->key_len, .from = segment, .from_offset = offset, .to = output,
+		.to_offset = output->size
+	};
+
+	// Same header, same CRC, the sequence number is kept so the copy is exactly as old as the original
+	unsigned char header_bytes[KVSTORE_HEADER_SIZE];
+	encode_header(header_bytes, header);
+	unsigned char hint[KVSTORE_HINT_HEADER_SIZE];
+	memcpy(hint, &header->seq, sizeof(uint64_t));
+	memcpy(hint + 8, &output->size, sizeof(uint64_t));
+	memcpy(hint + 16, &header->key_len, sizeof(uint32_t));
+	memcpy(hint + 20, &header->value_len, sizeof(uint32_t));
+	check_mem_return(bcatblk(state->buffer, header_bytes, KVSTORE_HEADER_SIZE) == BSTR_OK &&
+					 bcatblk(state->buffer, body, (int) (size - KVSTORE_HEADER_SIZE)) == BSTR_OK &&
+					 bcatblk(state->hints, hint, KVSTORE_HINT_HEADER_SIZE) == BSTR_OK &&
+					 bcatblk(state->hints, body, (int) header->key_len) == BSTR_OK, false);
+	output->size += size;
+	if (state->buffer->slen >= MERGE_BUFFER_SIZE) {
+		check_return(write_all(output->fd, state->buffer->data, (size_t) state->buffer->slen),
+					 "Failed to write segment %u", false, output->id);
+		state->buffer->slen = 0;
+	}
+	return true;
+}
+
+/**
+ * Delete the input segments of a merge, which dropped their tombstones. A tombstone must not disappear
+ * before the older records of its key do, or a crash in between brings the key back. Ids don't tell which
+ * segment is older, merge outputs get ids above the segment that was active at the time, but sequence
+ * numbers do: every record older than a tombstone is in a segment whose newest record is older than the
+ * newest one of the tombstone's segment. So inputs go in the order of their newest records, and the
+ * directory is synced before each one with tombstones goes, making the deletes before it stick.
+ */
+static void remove_inputs(KVStore *const store, MergeInput *const inputs, const size_t count) {
+	qsort(inputs, count, sizeof(MergeInput), compare_max_seqs);
+	size_t i = 0;
+	for (; i < count; i++) {
+		if (inputs[i].tombstones && !sync_dir(store)) {
+			log_err("Failed to sync %s, keeping the merged segments from %u on", path_str(store->dir),
+					inputs[i].segment->id);
+			break;
+		}
+		close_segment(store, inputs[i].segment, true);
+	}
+	// Left on disk their records load again on the next open, as copies or behind newer records
+	for (; i < count; i++) {
+		close_segment(store, inputs[i].segment, false);
+	}
+}
+
+static bool start_output(MergeState *const state) {
+	KVSegment **outputs = realloc(state->outputs, (state->output_count + 1) * sizeof(KVSegment *));
+	check_mem_return(outputs, false);
+	state->outputs = outputs;
+	KVSegment *output = open_segment(state->store, take_id(state->store), true);
+	check_return(output, "Failed to create merge output", false);
+	state->outputs[state->output_count++] = output;
+	return true;
+}
+
+/** Flush and sync the last output, then write its hint file next to it */
+static bool finish_output(MergeState *const state) {
+	const KVSegment *output = state->outputs[state->output_count - 1];
+	check_return(write_all(output->fd, state->buffer->data, (size_t) state->buffer->slen),
+				 "Failed to write segment %u", false, output->id);
+	state->buffer->slen = 0;
+	check_return(fsync(output->fd) == 0, "Failed to sync segment %u", false, output->id);
+
+	const uint32_t crc = Commons_crc32c(0, state->hints->data, (size_t) state->hints->slen);
+	check_mem_return(bcatblk(state->hints, &crc, sizeof(crc)) == BSTR_OK, false);
+	bstring path = segment_path(state->store, output->id, HINT_SUFFIX);
+	bstring tmp_path = segment_path(state->store, output->id, HINT_SUFFIX TMP_SUFFIX);
+	bool ok = path && tmp_path;
+	check_mem(ok, goto done);
+	// Written aside and renamed, a hint file is either complete or not there
+	const int fd = open(path_str(tmp_path), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	ok = fd >= 0;
+	check(ok, "Failed to create %s", goto done, path_str(tmp_path));
+	ok = write_all(fd, state->hints->data, (size_t) state->hints->slen) && fsync(fd) == 0;
+	close(fd);
+	ok = ok && rename(path_str(tmp_path), path_str(path)) == 0;
+	if (!ok) {
+		log_err("Failed to write %s", path_str(path));
+		unlink(path_str(tmp_path));
+	}
+done:
+	state->hints->slen = 0;
+	bdestroy(path);
+	bdestroy(tmp_path);
+	return ok;
+}
+
+static void free_store(KVStore *const store) {
+	for (size_t i = 0; i < store->segment_count; i++) {
+		close_segment(store, store->segments[i], false);
+	}
+	free(store->segments);
+	if (store->keydir) {
+		HashMap_destroy(store->keydir);
+	}
+	bdestroy(store->dir);
+	pthread_rwlock_destroy(&store->lock);
+	pthread_mutex_destroy(&store->merge_lock);
+	free(store);
+}
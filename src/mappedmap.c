@@ -0,0 +1,358 @@
+//
+// Read only HashMap snapshots saved to disk and memory mapped back in
+//
+#include "mappedmap.h"
+
+#include <bstrlib.h>
+#include <dbg.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define RECORD_HEADER_SIZE 8
+#define align8(n) (((n) + 7) & ~(size_t) 7)
+
+// Keys up to this size are encoded on the stack by MappedMap_get_with
+#define STACK_KEY_SIZE 256
+
+static size_t cstr_size(const void *item);
+
+static void cstr_encode(const void *item, void *out);
+
+static size_t bstring_size(const void *item);
+
+static void bstring_encode(const void *item, void *out);
+
+static size_t int_size(const void *item);
+
+static void int_encode(const void *item, void *out);
+
+static size_t int64_size(const void *item);
+
+static void int64_encode(const void *item, void *out);
+
+static bool ensure_buffer(uint8_t **buffer, size_t *capacity, size_t size);
+
+static bool write_records(const HashMap *map, FILE *file, const MapCodec *key_codec, const MapCodec *value_codec);
+
+static bool sync_parent_dir(const char *path);
+
+static bool is_valid_header(const MappedMapHeader *header, size_t length);
+
+const MapCodec MapCodec_cstr = {cstr_size, cstr_encode};
+const MapCodec MapCodec_bstring = {bstring_size, bstring_encode};
+const MapCodec MapCodec_int = {int_size, int_encode};
+const MapCodec MapCodec_int64 = {int64_size, int64_encode};
+
+bool HashMap_save(const HashMap *const map, const char *const path, const MapCodec *const key_codec,
+				  const MapCodec *const value_codec) {
+	check_return(map && path, "Map or path is null", false);
+	check_return(key_codec && value_codec, "Codecs must not be null", false);
+
+	// At most half full, misses in the mapped table end after a probe or two
+	size_t capacity = HASHMAP_MIN_CAPACITY;
+	while (capacity < map->size * 2) {
+		capacity <<= 1;
+	}
+	MappedMapSlot *slots = calloc(capacity, sizeof(MappedMapSlot));
+	check_mem_return(slots, false);
+	uint8_t *buffer = NULL;
+	size_t buffer_capacity = 0;
+	char *tmp_path = NULL;
+	FILE *file = NULL;
+
+	// First pass: hash the encoded keys and lay out the records, so the slots can be written up front
+	const uint64_t slots_offset = align8(sizeof(MappedMapHeader));
+	const uint64_t records_offset = slots_offset + capacity * sizeof(MappedMapSlot);
+	uint64_t offset = records_offset;
+	HashMapIterator it;
+	HashMap_iter_init(map, &it);
+	for (const MapEntry *entry = HashMap_iter_next(&it); entry; entry = HashMap_iter_next(&it)) {
+		const size_t key_len = key_codec->encoded_size(entry->key);
+		const size_t value_len = value_codec->encoded_size(entry->value);
+		check(key_len <= UINT32_MAX && value_len <= UINT32_MAX, "Entry too large to save", goto catch);
+		check_mem(ensure_buffer(&buffer, &buffer_capacity, key_len), goto catch);
+		key_codec->encode(entry->key, buffer);
+
+		const uint64_t hash = Commons_hash_bytes(buffer, key_len, 0);
+		size_t index = hash & (capacity - 1);
+		while (slots[index].offset != 0) {
+			index = (index + 1) & (capacity - 1);
+		}
+		slots[index] = (MappedMapSlot) {.hash = hash, .offset = offset};
+		offset += align8(RECORD_HEADER_SIZE + value_len + key_len);
+	}
+
+	MappedMapHeader header = {
+		.version = MAPPEDMAP_VERSION,
+		.header_size = sizeof(MappedMapHeader),
+		.capacity = capacity,
+		.size = map->size,
+		.slots_offset = slots_offset,
+		.records_offset = records_offset,
+		.file_size = offset
+	};
+	memcpy(header.magic, MAPPEDMAP_MAGIC, sizeof(header.magic));
+
+	const size_t path_len = strlen(path);
+	tmp_path = malloc(path_len + sizeof(".tmp"));
+	check_mem(tmp_path, goto catch);
+	memcpy(tmp_path, path, path_len);
+	memcpy(tmp_path + path_len, ".tmp", sizeof(".tmp"));
+	file = fopen(tmp_path, "wb");
+	check(file, "Failed to open %s", goto catch, tmp_path);
+
+	static const uint8_t padding[8] = {0};
+	check(fwrite(&header, sizeof(header), 1, file) == 1, "Failed to write header", goto catch);
+	check(fwrite(padding, 1, slots_offset - sizeof(header), file) == slots_offset - sizeof(header),
+		  "Failed to write header", goto catch);
+	check(fwrite(slots, sizeof(MappedMapSlot), capacity, file) == capacity, "Failed to write slots", goto catch);
+	// Second pass: the iteration order is the same as long as the map is not modified in between
+	check(write_records(map, file, key_codec, value_codec), "Failed to write records", goto catch);
+
+	// The data must be on disk before the rename is, or a crash could leave path naming a half written file
+	check(fflush(file) == 0 && fsync(fileno(file)) == 0, "Failed to sync %s", goto catch, tmp_path);
+	const int closed = fclose(file);
+	file = NULL;
+	check(closed == 0, "Failed to close %s", goto catch, tmp_path);
+	check(rename(tmp_path, path) == 0, "Failed to rename %s to %s", goto catch, tmp_path, path);
+	if (!sync_parent_dir(path)) {
+		// The new file is complete, only the rename may be lost in a crash and the old file read instead
+		log_warn("Failed to sync the directory of %s", path);
+	}
+	free(tmp_path);
+	free(buffer);
+	free(slots);
+	return true;
+catch:
+	if (file) {
+		fclose(file);
+	}
+	if (tmp_path) {
+		remove(tmp_path);
+	}
+	free(tmp_path);
+	free(buffer);
+	free(slots);
+	return false;
+}
+
+MappedMap *HashMap_open_mapped(const char *const path) {
+	check_return(path, "Path is null", NULL);
+	const int fd = open(path, O_RDONLY);
+	check_return(fd >= 0, "Failed to open %s", NULL, path);
+
+	struct stat st;
+	void *base = MAP_FAILED;
+	MappedMap *map = NULL;
+	check(fstat(fd, &st) == 0, "Failed to stat %s", goto catch, path);
+	check(st.st_size >= (off_t) sizeof(MappedMapHeader), "%s is too small to be a map file", goto catch, path);
+	const size_t length = (size_t) st.st_size;
+	base = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+	check(base != MAP_FAILED, "Failed to map %s", goto catch, path);
+	check(is_valid_header(base, length), "%s is not a valid map file", goto catch, path);
+
+	map = malloc(sizeof(MappedMap));
+	check_mem(map, goto catch);
+	const MappedMapHeader *header = base;
+	map->base = base;
+	map->length = length;
+	map->slots = (const MappedMapSlot *) ((const uint8_t *) base + header->slots_offset);
+	map->capacity = header->capacity;
+	map->size = header->size;
+	// The mapping stays valid after the descriptor is closed
+	close(fd);
+	return map;
+catch:
+	if (base != MAP_FAILED) {
+		munmap(base, (size_t) st.st_size);
+	}
+	close(fd);
+	return NULL;
+}
+
+const void *MappedMap_get(const MappedMap *const map, const void *const key, const size_t key_len,
+						  size_t *const value_len) {
+	check_return(map && key, "Map or key is null", NULL);
+	const uint64_t hash = Commons_hash_bytes(key, key_len, 0);
+	const size_t mask = map->capacity - 1;
+	size_t index = hash & mask;
+	// Bounded so a damaged file can never make a lookup spin
+	for (size_t probes = 0; probes < map->capacity; probes++, index = (index + 1) & mask) {
+		const MappedMapSlot *slot = &map->slots[index];
+		if (slot->offset == 0) {
+			return NULL;
+		}
+		if (slot->hash != hash || slot->offset > map->length - RECORD_HEADER_SIZE) {
+			continue;
+		}
+		const uint8_t *record = map->base + slot->offset;
+		uint32_t lengths[2];
+		memcpy(lengths, record, sizeof(lengths));
+		if (lengths[0] != key_len || (uint64_t) lengths[1] + key_len > map->length - slot->offset - RECORD_HEADER_SIZE) {
+			continue;
+		}
+		const uint8_t *value = record + RECORD_HEADER_SIZE;
+		if (memcmp(value + lengths[1], key, key_len) == 0) {
+			if (value_len) {
+				*value_len = lengths[1];
+			}
+			return value;
+		}
+	}
+	return NULL;
+}
+
+const void *MappedMap_get_with(const MappedMap *const map, const void *const key, const MapCodec *const codec,
+							   size_t *const value_len) {
+	check_return(map && key && codec, "Map, key or codec is null", NULL);
+	const size_t key_len = codec->encoded_size(key);
+	uint8_t stack_buffer[STACK_KEY_SIZE];
+	uint8_t *buffer = key_len <= STACK_KEY_SIZE ? stack_buffer : malloc(key_len);
+	check_mem_return(buffer, NULL);
+	codec->encode(key, buffer);
+	const void *value = MappedMap_get(map, buffer, key_len, value_len);
+	if (buffer != stack_buffer) {
+		free(buffer);
+	}
+	return value;
+}
+
+size_t MappedMap_size(const MappedMap *const map) {
+	check_return(map, "Map is null", 0);
+	return map->size;
+}
+
+bool MappedMap_close(MappedMap *map) {
+	check_return(map, "Map is null", false);
+	const int unmapped = munmap((void *) map->base, map->length);
+	free(map);
+	check_return(unmapped == 0, "Failed to unmap map", false);
+	return true;
+}
+
+
+// Private helper functions
+
+static size_t cstr_size(const void *item) {
+	return strlen(item) + 1;
+}
+
+static void cstr_encode(const void *item, void *out) {
+	memcpy(out, item, strlen(item) + 1);
+}
+
+static size_t bstring_size(const void *item) {
+	const_bstring str = item;
+	return str->slen > 0 ? (size_t) str->slen : 0;
+}
+
+static void bstring_encode(const void *item, void *out) {
+	const_bstring str = item;
+	if (str->slen > 0) {
+		memcpy(out, str->data, (size_t) str->slen);
+	}
+}
+
+static size_t int_size(const void *item) {
+	(void) item;
+	return sizeof(int);
+}
+
+static void int_encode(const void *item, void *out) {
+	memcpy(out, item, sizeof(int));
+}
+
+static size_t int64_size(const void *item) {
+	(void) item;
+	return sizeof(int64_t);
+}
+
+static void int64_encode(const void *item, void *out) {
+	memcpy(out, item, sizeof(int64_t));
+}
+
+static bool ensure_buffer(uint8_t **buffer, size_t *capacity, const size_t size) {
+	if (size <= *capacity && *buffer) {
+		return true;
+	}
+	size_t doubled;
+	if (Commons_will_overflow(*capacity, 2, &doubled)) {
+		doubled = size; // Past half the address space, grow just as much as asked
+	}
+	const size_t new_capacity = size > doubled ? size : doubled;
+	uint8_t *grown = realloc(*buffer, new_capacity > 0 ? new_capacity : 1);
+	if (!grown) {
+		return false;
+	}
+	*buffer = grown;
+	*capacity = new_capacity;
+	return true;
+}
+
+/** fsync the directory holding path so the file renamed into it survives a crash */
+static bool sync_parent_dir(const char *const path) {
+	const char *const slash = strrchr(path, '/');
+	char *dir = slash ? strndup(path, slash == path ? 1 : (size_t) (slash - path)) : strdup(".");
+	if (!dir) {
+		return false;
+	}
+	const int fd = open(dir, O_RDONLY);
+	free(dir);
+	if (fd < 0) {
+		return false;
+	}
+	const bool synced = fsync(fd) == 0;
+	close(fd);
+	return synced;
+}
+
+static bool write_records(const HashMap *const map, FILE *const file, const MapCodec *const key_codec,
+						  const MapCodec *const value_codec) {
+	uint8_t *record = NULL;
+	size_t record_capacity = 0;
+	HashMapIterator it;
+	HashMap_iter_init(map, &it);
+	for (const MapEntry *entry = HashMap_iter_next(&it); entry; entry = HashMap_iter_next(&it)) {
+		const uint32_t lengths[2] = {
+			(uint32_t) key_codec->encoded_size(entry->key), (uint32_t) value_codec->encoded_size(entry->value)
+		};
+		const size_t size = align8(RECORD_HEADER_SIZE + (size_t) lengths[0] + lengths[1]);
+		if (!ensure_buffer(&record, &record_capacity, size)) {
+			free(record);
+			return false;
+		}
+		memset(record + size - 8, 0, 8); // Padding
+		memcpy(record, lengths, sizeof(lengths));
+		value_codec->encode(entry->value, record + RECORD_HEADER_SIZE);
+		key_codec->encode(entry->key, record + RECORD_HEADER_SIZE + lengths[1]);
+		if (fwrite(record, 1, size, file) != size) {
+			free(record);
+			return false;
+		}
+	}
+	free(record);
+	return true;
+}
+
+static bool is_valid_header(const MappedMapHeader *header, const size_t length) {
+	if (memcmp(header->magic, MAPPEDMAP_MAGIC, sizeof(header->magic)) != 0) {
+		return false;
+	}
+	if (header->version != MAPPEDMAP_VERSION || header->header_size != sizeof(MappedMapHeader)) {
+		return false;
+	}
+	if (header->capacity == 0 || (header->capacity & (header->capacity - 1)) != 0 ||
+		header->size >= header->capacity) {
+		return false;
+	}
+	if (header->file_size != length || header->slots_offset < sizeof(MappedMapHeader) ||
+		header->slots_offset > length || header->slots_offset % 8 != 0 || header->capacity > (length - header->slots_offset) / sizeof(MappedMapSlot)) {
+		return false;
+	}
+	return header->records_offset == header->slots_offset + header->capacity * sizeof(MappedMapSlot);
+}
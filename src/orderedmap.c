@@ -0,0 +1,372 @@
+//
+// Insertion ordered hash map, entries in a dense array and a sparse index of offsets into it
+//
+#include "orderedmap.h"
+
+#include <dbg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashmap_internal.h"
+#include "slottable.h"
+
+// Returned by find_slot when the key is not in the map
+#define NOT_FOUND SIZE_MAX
+
+static void default_df(void *map_entry);
+
+static void release_entries(OrderedMap *map);
+
+static size_t generate_hash(const OrderedMap *map, const void *key);
+
+static size_t entries_capacity(size_t capacity);
+
+static uint8_t width_for(size_t capacity);
+
+static size_t index_get(const OrderedMap *map, size_t slot);
+
+static void index_set(OrderedMap *map, size_t slot, size_t value);
+
+static size_t find_slot(const OrderedMap *map, const void *key, size_t hash, size_t *insert_slot);
+
+static void insert_index(OrderedMap *map, size_t hash, size_t entry);
+
+static void erase_slot(OrderedMap *map, size_t slot);
+
+static void compact_entries(OrderedMap *map);
+
+static void rebuild_index(OrderedMap *map);
+
+static bool resize(OrderedMap *map, size_t new_capacity);
+
+static bool make_room(OrderedMap *map);
+
+static void shrink_if_sparse(OrderedMap *map);
+
+OrderedMap *OrderedMap_create(size_t capacity, const hash_fn hash_fn, const equals_fn equals_fn, const destructor_fn df) {
+	check_return(capacity > 0, "Capacity must be > 0", NULL);
+	check_return((capacity & (capacity - 1)) == 0, "Capacity must be a power of 2", NULL);
+	check_return(hash_fn, "Hash function must not be null", NULL);
+	check_return(equals_fn, "Equals function must not be null", NULL);
+
+	if (capacity < HASHMAP_MIN_CAPACITY) {
+		capacity = HASHMAP_MIN_CAPACITY;
+	}
+
+	OrderedMap *map = calloc(1, sizeof(OrderedMap));
+	check_mem_return(map, NULL);
+	map->index_width = width_for(capacity);
+	map->index = calloc(capacity, map->index_width);
+	map->entries = malloc(entries_capacity(capacity) * sizeof(MapEntry));
+	check_mem(map->index && map->entries, goto catch);
+
+	map->used = 0;
+	map->size = 0;
+	map->capacity = capacity;
+	map->min_capacity = capacity;
+	map->hash_fn = hash_fn;
+	map->equals_fn = equals_fn;
+	map->df = df ? df : default_df;
+	map->seed = HashMap_new_seed();
+	return map;
+catch:
+	free(map->index);
+	free(map->entries);
+	free(map);
+	return NULL;
+}
+
+bool OrderedMap_destroy(OrderedMap *map) {
+	check_return(map, "Map is null", false);
+	release_entries(map);
+	free(map->index);
+	free(map->entries);
+	free(map);
+	return true;
+}
+
+bool OrderedMap_clear(OrderedMap *map) {
+	check_return(map, "Map is null", false);
+	release_entries(map);
+	map->used = 0;
+	map->size = 0;
+	// Going back to min_capacity only frees memory, when that fails the grown table is just as good
+	if (map->capacity <= map->min_capacity || !resize(map, map->min_capacity)) {
+		memset(map->index, 0, map->capacity * map->index_width);
+	}
+	return true;
+}
+
+void *OrderedMap_put(OrderedMap *const map, void *const key, void *const value) {
+	check_return(map, "Map is null", NULL);
+	check_return(key, "Key is null", NULL);
+	check_return(value, "Value is null", NULL);
+
+	const size_t hash = generate_hash(map, key);
+	const size_t slot = find_slot(map, key, hash, NULL);
+	if (slot != NOT_FOUND) {
+		// Replace the value in place, the key keeps its position in the order
+		MapEntry *entry = &map->entries[index_get(map, slot) - 1];
+		void *old_value = entry->value;
+		entry->value = value;
+		return old_value;
+	}
+	if (map->used == entries_capacity(map->capacity)) {
+		check_return(make_room(map), "Failed to resize map", NULL);
+	}
+	map->entries[map->used] = (MapEntry) {.key = key, .value = value, .hash = hash};
+	insert_index(map, hash, map->used);
+	map->used++;
+	map->size++;
+	return NULL;
+}
+
+void *OrderedMap_get(const OrderedMap *const map, const void *const key) {
+	check_return(map, "Map is null", NULL);
+	check_return(key, "Key is null", NULL);
+	const size_t slot = find_slot(map, key, generate_hash(map, key), NULL);
+	return slot != NOT_FOUND ? map->entries[index_get(map, slot) - 1].value : NULL;
+}
+
+bool OrderedMap_contains(const OrderedMap *const map, const void *const key) {
+	return OrderedMap_get(map, key) != NULL;
+}
+
+bool OrderedMap_remove(OrderedMap *const map, const void *const key) {
+	check_return(map, "Map is null", false);
+	check_return(key, "Key is null", false);
+	const size_t slot = find_slot(map, key, generate_hash(map, key), NULL);
+	if (slot == NOT_FOUND) {
+		return false;
+	}
+	const size_t i = index_get(map, slot) - 1;
+	erase_slot(map, slot);
+	map->df(&map->entries[i]);
+	map->entries[i].key = NULL;
+	map->entries[i].value = NULL;
+	map->size--;
+	if (i == map->used - 1) {
+		// The last entry needs no hole, the next put can take its place
+		map->used--;
+	}
+	shrink_if_sparse(map);
+	return true;
+}
+
+bool OrderedMap_for_each(const OrderedMap *const map, const map_visit_fn fn, void *const ctx) {
+	check_return(map && fn, "Map or function is null", false);
+	for (size_t i = 0; i < map->used; i++) {
+		const MapEntry *entry = &map->entries[i];
+		if (entry->key && !fn(entry->key, entry->value, ctx)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool OrderedMap_next(const OrderedMap *const map, size_t *const cursor, void **const key, void **const value) {
+	check_return(map && cursor, "Map or cursor is null", false);
+	while (*cursor < map->used) {
+		const MapEntry *entry = &map->entries[(*cursor)++];
+		if (entry->key) {
+			if (key) {
+				*key = entry->key;
+			}
+			if (value) {
+				*value = entry->value;
+			}
+			return true;
+		}
+	}
+	return false;
+}
+
+
+// Private helper functions
+
+static void default_df(void *map_entry) {
+	MapEntry *entry = map_entry;
+	free(entry->key);
+	free(entry->value);
+}
+
+/** Release the live entries, removed ones are left with a NULL key */
+static void release_entries(OrderedMap *const map) {
+	for (size_t i = 0; i < map->used; i++) {
+		if (map->entries[i].key) {
+			map->df(&map->entries[i]);
+		}
+	}
+}
+
+static inline size_t generate_hash(const OrderedMap *map, const void *key) {
+	// Same mix as HashMap, see generate_hash there
+	return (size_t) Commons_hash_u64_seeded(map->hash_fn(key), map->seed);
+}
+
+static inline size_t entries_capacity(const size_t capacity) {
+	return (size_t) (capacity * HASHMAP_LOAD_FACTOR);
+}
+
+/** Bytes per index slot, enough to hold entries_capacity(capacity) + 1 */
+static uint8_t width_for(const size_t capacity) {
+	if (capacity <= UINT8_MAX + 1) {
+		return 1;
+	}
+	if (capacity <= UINT16_MAX + 1) {
+		return 2;
+	}
+	if (capacity <= (size_t) UINT32_MAX + 1) {
+		return 4;
+	}
+	return 8;
+}
+
+static inline size_t index_get(const OrderedMap *const map, const size_t slot) {
+	switch (map->index_width) {
+		case 1:
+			return ((const uint8_t *) map->index)[slot];
+		case 2:
+			return ((const uint16_t *) map->index)[slot];
+		case 4:
+			return ((const uint32_t *) map->index)[slot];
+		default:
+			return ((const uint64_t *) map->index)[slot];
+	}
+}
+
+static inline void index_set(OrderedMap *const map, const size_t slot, const size_t value) {
+	switch (map->index_width) {
+		case 1:
+			((uint8_t *) map->index)[slot] = (uint8_t) value;
+			break;
+		case 2:
+			((uint16_t *) map->index)[slot] = (uint16_t) value;
+			break;
+		case 4:
+			((uint32_t *) map->index)[slot] = (uint32_t) value;
+			break;
+		default:
+			((uint64_t *) map->index)[slot] = value;
+	}
+}
+
+/**
+ * @param insert_slot if not NULL and key is not in the map, set to the empty slot that ended the probe
+ * @return the index slot of key or NOT_FOUND
+ */
+static size_t find_slot(const OrderedMap *const map, const void *const key, const size_t hash,
+						size_t *const insert_slot) {
+	const size_t mask = map->capacity - 1;
+	for (size_t slot = hash & mask;; slot = (slot + 1) & mask) {
+		const size_t offset = index_get(map, slot);
+		if (offset == 0) {
+			if (insert_slot) {
+				*insert_slot = slot;
+			}
+			return NOT_FOUND;
+		}
+		const MapEntry *entry = &map->entries[offset - 1];
+		if (entry->hash == hash && map->equals_fn(entry->key, key)) {
+			return slot;
+		}
+	}
+}
+
+/** Point the first empty slot of hash's probe sequence at entries[entry] */
+static void insert_index(OrderedMap *const map, const size_t hash, const size_t entry) {
+	const size_t mask = map->capacity - 1;
+	size_t slot = hash & mask;
+	while (index_get(map, slot) != 0) {
+		slot = (slot + 1) & mask;
+	}
+	index_set(map, slot, entry + 1);
+}
+
+/** Backward shift deletion, see erase_index in hashmap.c, homes come from the hashes in the array */
+static void erase_slot(OrderedMap *const map, const size_t slot) {
+	const size_t mask = map->capacity - 1;
+	size_t hole = slot;
+	for (size_t next = (hole + 1) & mask;; next = (next + 1) & mask) {
+		const size_t offset = index_get(map, next);
+		if (offset == 0) {
+			break;
+		}
+		const size_t home = map->entries[offset - 1].hash & mask;
+		if (((next - home) & mask) >= ((next - hole) & mask)) {
+			index_set(map, hole, offset);
+			hole = next;
+		}
+	}
+	index_set(map, hole, 0);
+}
+
+/** Squeeze the holes out of the array, keeping the order. The index is stale afterwards. */
+static void compact_entries(OrderedMap *const map) {
+	size_t live = 0;
+	for (size_t i = 0; i < map->used; i++) {
+		if (map->entries[i].key) {
+			map->entries[live++] = map->entries[i];
+		}
+	}
+	map->used = live;
+}
+
+static void rebuild_index(OrderedMap *const map) {
+	memset(map->index, 0, map->capacity * map->index_width);
+	for (size_t i = 0; i < map->used; i++) {
+		insert_index(map, map->entries[i].hash, i);
+	}
+}
+
+/**
+ * Move to an index of new_capacity slots, new_capacity must have room for every entry. Holes are dropped
+ * on the way, also when the resize fails.
+ * @return false if out of memory, the map then keeps its capacity
+ */
+static bool resize(OrderedMap *const map, const size_t new_capacity) {
+	compact_entries(map);
+	const uint8_t width = width_for(new_capacity);
+	void *index = calloc(new_capacity, width);
+	MapEntry *entries = index ? realloc(map->entries, entries_capacity(new_capacity) * sizeof(MapEntry)) : NULL;
+	if (!entries) {
+		free(index);
+		rebuild_index(map);
+		return false;
+	}
+	free(map->index);
+	map->entries = entries;
+	map->index = index;
+	map->index_width = width;
+	map->capacity = new_capacity;
+	rebuild_index(map);
+	return true;
+}
+
+/**
+ * Free at least one entry at the end of a full array. When a quarter or more of it are holes, squeezing
+ * them out at the same capacity is enough and pays for itself over the puts that fill them again.
+ */
+static bool make_room(OrderedMap *const map) {
+	if (map->used - map->size >= map->used / 4) {
+		compact_entries(map);
+		rebuild_index(map);
+		return true;
+	}
+	size_t new_cap;
+	if (!SlotTable_grow_capacity(map->capacity, &new_cap, sizeof(MapEntry))) {
+		log_warn("Max capacity reached for map, further attempts to expand will cause failure");
+		return false;
+	}
+	return resize(map, new_cap);
+}
+
+static void shrink_if_sparse(OrderedMap *const map) {
+	const size_t shrink_threshold = (size_t) (map->capacity * HASHMAP_SHRINK_LOAD_FACTOR);
+	const size_t new_cap = SlotTable_shrink_capacity(map->size, shrink_threshold, map->capacity, map->min_capacity,
+													 sizeof(MapEntry));
+	if (new_cap) {
+		resize(map, new_cap);
+	}
+}
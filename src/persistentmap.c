@@ -0,0 +1,419 @@
+//
+// Persistent hash map, a hash array mapped trie whose versions share their unchanged nodes
+//
+#include "persistentmap.h"
+
+#include <dbg.h>
+#include <stdlib.h>
+
+#include "hashmap_internal.h"
+
+static void default_df(void *map_entry);
+
+static size_t hash_key(const PersistentMap *map, const void *key);
+
+static PersistentNode *retain(PersistentNode *node);
+
+static void release(const PersistentMap *map, PersistentNode *node);
+
+static size_t node_hash(const PersistentNode *node);
+
+static PersistentBranch *new_branch(PersistentNodeKind kind, uint32_t bitmap, size_t count);
+
+static PersistentMap *new_version(const PersistentMap *map, PersistentNode *root, size_t size);
+
+static uint32_t digit(size_t hash, unsigned shift);
+
+static size_t child_index(const PersistentNode *branch, uint32_t bit);
+
+static PersistentNode *merge(const PersistentMap *map, PersistentNode *a, PersistentNode *b, unsigned shift);
+
+static PersistentNode *assoc(const PersistentMap *map, PersistentNode *node, unsigned shift, PersistentLeaf *leaf,
+							 bool *replaced);
+
+static bool dissoc(const PersistentMap *map, PersistentNode *node, unsigned shift, size_t hash, const void *key,
+				   PersistentNode **result);
+
+static const PersistentLeaf *find(const PersistentMap *map, const void *key);
+
+static bool for_each_node(const PersistentNode *node, map_visit_fn fn, void *ctx);
+
+PersistentMap *PersistentMap_create(const hash_fn hash_fn, const equals_fn equals_fn, const destructor_fn df) {
+	check_return(hash_fn, "Hash function must not be null", NULL);
+	check_return(equals_fn, "Equals function must not be null", NULL);
+	PersistentMap *map = malloc(sizeof(PersistentMap));
+	check_mem_return(map, NULL);
+	*map = (PersistentMap) {
+		.refs = 1, .root = NULL, .size = 0, .hash_fn = hash_fn, .equals_fn = equals_fn,
+		.df = df ? df : default_df, .seed = HashMap_new_seed()
+	};
+	return map;
+}
+
+PersistentMap *PersistentMap_retain(PersistentMap *const map) {
+	check_return(map, "Map is null", NULL);
+	__atomic_add_fetch(&map->refs, 1, __ATOMIC_RELAXED);
+	return map;
+}
+
+bool PersistentMap_release(PersistentMap *const map) {
+	check_return(map, "Map is null", false);
+	if (__atomic_sub_fetch(&map->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		release(map, map->root);
+		free(map);
+	}
+	return true;
+}
+
+void *PersistentMap_get(const PersistentMap *const map, const void *const key) {
+	check_return(map, "Map is null", NULL);
+	check_return(key, "Key is null", NULL);
+	const PersistentLeaf *leaf = find(map, key);
+	return leaf ? leaf->entry.value : NULL;
+}
+
+bool PersistentMap_contains(const PersistentMap *const map, const void *const key) {
+	check_return(map, "Map is null", false);
+	check_return(key, "Key is null", false);
+	return find(map, key) != NULL;
+}
+
+PersistentMap *PersistentMap_assoc(PersistentMap *const map, void *const key, void *const value) {
+	check_return(map, "Map is null", NULL);
+	check_return(key, "Key is null", NULL);
+	check_return(value, "Value is null", NULL);
+
+	PersistentLeaf *leaf = malloc(sizeof(PersistentLeaf));
+	check_mem_return(leaf, NULL);
+	leaf->node = (PersistentNode) {.refs = 1, .bitmap = 0, .kind = PERSISTENT_LEAF, .count = 0};
+	leaf->entry = (MapEntry) {.key = key, .value = value, .hash = hash_key(map, key)};
+
+	// The reference taken here keeps the leaf alive whatever happens to the nodes built around it
+	bool replaced = false;
+	PersistentNode *root = assoc(map, map->root, 0, leaf, &replaced);
+	PersistentMap *version = root ? new_version(map, root, map->size + !replaced) : NULL;
+	if (!version) {
+		release(map, root);
+		// Back to the one reference of this call, key and value go back to the caller
+		free(leaf);
+		return NULL;
+	}
+	__atomic_sub_fetch(&leaf->node.refs, 1, __ATOMIC_RELAXED);
+	return version;
+}
+
+PersistentMap *PersistentMap_dissoc(PersistentMap *const map, const void *const key) {
+	check_return(map, "Map is null", NULL);
+	check_return(key, "Key is null", NULL);
+	if (!find(map, key)) {
+		return PersistentMap_retain(map);
+	}
+	PersistentNode *root;
+	check_return(dissoc(map, map->root, 0, hash_key(map, key), key, &root), "Failed to copy path", NULL);
+	PersistentMap *version = new_version(map, root, map->size - 1);
+	if (!version) {
+		release(map, root);
+	}
+	return version;
+}
+
+size_t PersistentMap_size(const PersistentMap *const map) {
+	check_return(map, "Map is null", 0);
+	return map->size;
+}
+
+bool PersistentMap_for_each(const PersistentMap *const map, const map_visit_fn fn, void *const ctx) {
+	check_return(map, "Map is null", false);
+	check_return(fn, "Visit function is null", false);
+	return !map->root || for_each_node(map->root, fn, ctx);
+}
+
+
+// Private helper functions
+
+static void default_df(void *map_entry) {
+	MapEntry *entry = map_entry;
+	free(entry->key);
+	free(entry->value);
+}
+
+static inline size_t hash_key(const PersistentMap *const map, const void *const key) {
+	return Commons_hash_u64_seeded(map->hash_fn(key), map->seed);
+}
+
+static inline PersistentNode *retain(PersistentNode *const node) {
+	__atomic_add_fetch(&node->refs, 1, __ATOMIC_RELAXED);
+	return node;
+}
+
+static void release(const PersistentMap *const map, PersistentNode *const node) {
+	if (!node || __atomic_sub_fetch(&node->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+		return;
+	}
+	if (node->kind == PERSISTENT_LEAF) {
+		map->df(&((PersistentLeaf *) node)->entry);
+	} else {
+		PersistentBranch *branch = (PersistentBranch *) node;
+		for (size_t i = 0; i < node->count; i++) {
+			release(map, branch->children[i]);
+		}
+	}
+	free(node);
+}
+
+/** The hash every key under a leaf or collision node has */
+static inline size_t node_hash(const PersistentNode *const node) {
+	if (node->kind == PERSISTENT_COLLISION) {
+		return ((const PersistentLeaf *) ((const PersistentBranch *) node)->children[0])->entry.hash;
+	}
+	return ((const PersistentLeaf *) node)->entry.hash;
+}
+
+/** @return a branch or collision node with room for count children, not filled in yet */
+static PersistentBranch *new_branch(const PersistentNodeKind kind, const uint32_t bitmap, const size_t count) {
+	PersistentBranch *branch = malloc(sizeof(PersistentBranch) + count * sizeof(PersistentNode *));
+	check_mem_return(branch, NULL);
+	branch->node = (PersistentNode) {.refs = 1, .bitmap = bitmap, .kind = kind, .count = (uint16_t) count};
+	return branch;
+}
+
+/** @return a version of map with root, which it takes over, or NULL if out of memory */
+static PersistentMap *new_version(const PersistentMap *const map, PersistentNode *const root, const size_t size) {
+	PersistentMap *version = malloc(sizeof(PersistentMap));
+	check_mem_return(version, NULL);
+	*version = *map;
+	version->refs = 1;
+	version->root = root;
+	version->size = size;
+	return version;
+}
+
+static inline uint32_t digit(const size_t hash, const unsigned shift) {
+	return (uint32_t) (hash >> shift) % PERSISTENTMAP_FANOUT;
+}
+
+/** Index of the child for bit in a branch */
+static inline size_t child_index(const PersistentNode *const branch, const uint32_t bit) {
+	return (size_t) __builtin_popcount(branch->bitmap & (bit - 1));
+}
+
+/**
+ * Branches holding two leaf or collision nodes with different hashes that got to the same place at shift,
+ * one branch per level their hashes share a digit on
+ * @return the new subtree, which retained a and b, or NULL if out of memory
+ */
+static PersistentNode *merge(const PersistentMap *const map, PersistentNode *const a, PersistentNode *const b,
+							 const unsigned shift) {
+	const uint32_t da = digit(node_hash(a), shift);
+	const uint32_t db = digit(node_hash(b), shift);
+	if (da == db) {
+		PersistentNode *child = merge(map, a, b, shift + PERSISTENTMAP_BITS);
+		if (!child) {
+			return NULL;
+		}
+		PersistentBranch *branch = new_branch(PERSISTENT_BRANCH, UINT32_C(1) << da, 1);
+		if (!branch) {
+			release(map, child);
+			return NULL;
+		}
+		branch->children[0] = child;
+		return &branch->node;
+	}
+	PersistentBranch *branch = new_branch(PERSISTENT_BRANCH, UINT32_C(1) << da | UINT32_C(1) << db, 2);
+	check_mem_return(branch, NULL);
+	branch->children[da < db ? 0 : 1] = retain(a);
+	branch->children[da < db ? 1 : 0] = retain(b);
+	return &branch->node;
+}
+
+/**
+ * Copy of the path from node down to where leaf goes, every node off that path is shared
+ * @param node subtree at shift, NULL if empty
+ * @param replaced set if leaf replaced a leaf with an equal key
+ * @return the new subtree or NULL if out of memory, then nothing holds a reference taken here any more
+ */
+static PersistentNode *assoc(const PersistentMap *const map, PersistentNode *const node, const unsigned shift,
+							 PersistentLeaf *const leaf, bool *const replaced) {
+	const size_t hash = leaf->entry.hash;
+	if (!node) {
+		return retain(&leaf->node);
+	}
+
+	if (node->kind == PERSISTENT_LEAF) {
+		const PersistentLeaf *old = (const PersistentLeaf *) node;
+		if (old->entry.hash != hash) {
+			return merge(map, node, &leaf->node, shift);
+		}
+		if (map->equals_fn(old->entry.key, leaf->entry.key)) {
+			*replaced = true;
+			return retain(&leaf->node);
+		}
+		PersistentBranch *collision = new_branch(PERSISTENT_COLLISION, 0, 2);
+		check_mem_return(collision, NULL);
+		collision->children[0] = retain(node);
+		collision->children[1] = retain(&leaf->node);
+		return &collision->node;
+	}
+
+	if (node->kind == PERSISTENT_COLLISION) {
+		if (node_hash(node) != hash) {
+			return merge(map, node, &leaf->node, shift);
+		}
+		const PersistentBranch *old = (const PersistentBranch *) node;
+		size_t at = node->count;
+		for (size_t i = 0; i < node->count; i++) {
+			if (map->equals_fn(((const PersistentLeaf *) old->children[i])->entry.key, leaf->entry.key)) {
+				at = i;
+				*replaced = true;
+				break;
+			}
+		}
+		check_return(node->count < UINT16_MAX || at < node->count, "Too many colliding keys", NULL);
+		PersistentBranch *collision = new_branch(PERSISTENT_COLLISION, 0, node->count + (at == node->count));
+		check_mem_return(collision, NULL);
+		for (size_t i = 0; i < node->count; i++) {
+			if (i != at) {
+				collision->children[i] = retain(old->children[i]);
+			}
+		}
+		collision->children[at] = retain(&leaf->node);
+		return &collision->node;
+	}
+
+	const PersistentBranch *old = (const PersistentBranch *) node;
+	const uint32_t bit = UINT32_C(1) << digit(hash, shift);
+	const size_t index = child_index(node, bit);
+	const bool present = node->bitmap & bit;
+	PersistentNode *child = present ? assoc(map, old->children[index], shift + PERSISTENTMAP_BITS, leaf, replaced)
+								   : retain(&leaf->node);
+	if (!child) {
+		return NULL;
+	}
+	PersistentBranch *branch = new_branch(PERSISTENT_BRANCH, node->bitmap | bit, node->count + !present);
+	if (!branch) {
+		release(map, child);
+		return NULL;
+	}
+	for (size_t i = 0, j = 0; i < branch->node.count; i++) {
+		if (i == index) {
+			branch->children[i] = child;
+			j += present;
+		} else {
+			branch->children[i] = retain(old->children[j++]);
+		}
+	}
+	return &branch->node;
+}
+
+/**
+ * Copy of the path from node down to key without it. Branches left with a single leaf or collision node
+ * are replaced by that node, so the trie stays as shallow as if key had never been added.
+ * @param node subtree at shift, which must hold key
+ * @param result set to the new subtree, NULL if it is empty
+ * @return false if out of memory
+ */
+static bool dissoc(const PersistentMap *const map, PersistentNode *const node, const unsigned shift,
+				   const size_t hash, const void *const key, PersistentNode **const result) {
+	if (node->kind == PERSISTENT_LEAF) {
+		*result = NULL;
+		return true;
+	}
+
+	const PersistentBranch *old = (const PersistentBranch *) node;
+	if (node->kind == PERSISTENT_COLLISION) {
+		size_t at = 0;
+		while (!map->equals_fn(((const PersistentLeaf *) old->children[at])->entry.key, key)) {
+			at++;
+		}
+		if (node->count == 2) {
+			*result = retain(old->children[1 - at]);
+			return true;
+		}
+		PersistentBranch *collision = new_branch(PERSISTENT_COLLISION, 0, node->count - 1);
+		check_mem_return(collision, false);
+		for (size_t i = 0, j = 0; i < node->count; i++) {
+			if (i != at) {
+				collision->children[j++] = retain(old->children[i]);
+			}
+		}
+		*result = &collision->node;
+		return true;
+	}
+
+	const uint32_t bit = UINT32_C(1) << digit(hash, shift);
+	const size_t index = child_index(node, bit);
+	PersistentNode *child;
+	if (!dissoc(map, old->children[index], shift + PERSISTENTMAP_BITS, hash, key, &child)) {
+		return false;
+	}
+	const bool inline_child = child && child->kind != PERSISTENT_BRANCH;
+	if (node->count == 1 && (!child || inline_child)) {
+		// Nothing else down here, the leaf (or nothing) moves up to the parent
+		*result = child;
+		return true;
+	}
+	if (!child && node->count == 2 && old->children[1 - index]->kind != PERSISTENT_BRANCH) {
+		*result = retain(old->children[1 - index]);
+		return true;
+	}
+
+	PersistentBranch *branch = new_branch(PERSISTENT_BRANCH, child ? node->bitmap : node->bitmap & ~bit,
+										  node->count - !child);
+	if (!branch) {
+		release(map, child);
+		return false;
+	}
+	for (size_t i = 0, j = 0; i < node->count; i++) {
+		if (i != index) {
+			branch->children[j++] = retain(old->children[i]);
+		} else if (child) {
+			branch->children[j++] = child;
+		}
+	}
+	*result = &branch->node;
+	return true;
+}
+
+static const PersistentLeaf *find(const PersistentMap *const map, const void *const key) {
+	const PersistentNode *node = map->root;
+	if (!node) {
+		return NULL;
+	}
+	const size_t hash = hash_key(map, key);
+	for (unsigned shift = 0; node->kind == PERSISTENT_BRANCH; shift += PERSISTENTMAP_BITS) {
+		const uint32_t bit = UINT32_C(1) << digit(hash, shift);
+		if (!(node->bitmap & bit)) {
+			return NULL;
+		}
+		node = ((const PersistentBranch *) node)->children[child_index(node, bit)];
+	}
+	if (node->kind == PERSISTENT_LEAF) {
+		const PersistentLeaf *leaf = (const PersistentLeaf *) node;
+		return leaf->entry.hash == hash && map->equals_fn(leaf->entry.key, key) ? leaf : NULL;
+	}
+	const PersistentBranch *collision = (const PersistentBranch *) node;
+	if (node_hash(node) != hash) {
+		return NULL;
+	}
+	for (size_t i = 0; i < node->count; i++) {
+		const PersistentLeaf *leaf = (const PersistentLeaf *) collision->children[i];
+		if (map->equals_fn(leaf->entry.key, key)) {
+			return leaf;
+		}
+	}
+	return NULL;
+}
+
+static bool for_each_node(const PersistentNode *const node, const map_visit_fn fn, void *const ctx) {
+	if (node->kind == PERSISTENT_LEAF) {
+		const PersistentLeaf *leaf = (const PersistentLeaf *) node;
+		return fn(leaf->entry.key, leaf->entry.value, ctx);
+	}
+	const PersistentBranch *branch = (const PersistentBranch *) node;
+	for (size_t i = 0; i < node->count; i++) {
+		if (!for_each_node(branch->children[i], fn, ctx)) {
+			return false;
+		}
+	}
+	return true;
+}
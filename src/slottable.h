@@ -0,0 +1,182 @@
+//
+// The table behind HashSet, StrMap and CountMap: fixed size slots inline in one array, followed in the same
+// allocation by the control bytes of hashgroup.h. Slots are probed by groups and removed by backward shift,
+// the load factors are HashMap's.
+//
+// The functions take the slot size, and those that need to find a slot's home the offset of its cached hash
+// too, SlotTable_layout gives both for a slot type with a size_t hash field. Called with constants they
+// inline to plain struct copies. Lookups compare keys, which every container does its own way, so finding
+// a key is left to the callers. OrderedMap keeps an index of offsets instead of slots and only shares the
+// capacity policy.
+//
+#ifndef libfaafo_SLOTTABLE_H
+#define libfaafo_SLOTTABLE_H
+
+#include <commons.h>
+#include <hashmap.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashgroup.h"
+
+/** Slot size and hash offset of Slot, the last two arguments of the functions below */
+#define SlotTable_layout(Slot) sizeof(Slot), offsetof(Slot, hash)
+
+/** Set the grow and shrink thresholds of a table with threshold, shrink_threshold and capacity fields */
+#define SlotTable_set_thresholds(table) ((table)->threshold = (size_t) ((table)->capacity * HASHMAP_LOAD_FACTOR), \
+	(table)->shrink_threshold = (size_t) ((table)->capacity * HASHMAP_SHRINK_LOAD_FACTOR))
+
+static inline size_t SlotTable_hash(const void *slots, const size_t index, const size_t stride,
+									const size_t hash_offset) {
+	size_t hash;
+	memcpy(&hash, (const char *) slots + index * stride + hash_offset, sizeof(size_t));
+	return hash;
+}
+
+/**
+ * Allocate an empty table, the control bytes follow the slots so freeing the slots frees both
+ * @return the slots or NULL if out of memory
+ */
+static inline void *SlotTable_allocate(const size_t capacity, uint8_t **const out_ctrl, const size_t stride) {
+	const size_t slot_bytes = capacity * stride;
+	uint8_t *table = calloc(1, slot_bytes + HashGroup_ctrl_bytes(capacity));
+	if (table) {
+		*out_ctrl = table + slot_bytes;
+	}
+	return table;
+}
+
+/** Copy slot into the first empty slot of its hash's probe sequence, the table must have one */
+static inline void SlotTable_insert(void *const slots, uint8_t *const ctrl, const size_t capacity,
+									const void *const slot, const size_t stride, const size_t hash_offset) {
+	const size_t hash = SlotTable_hash(slot, 0, stride, hash_offset);
+	const size_t mask = capacity - 1;
+	for (size_t pos = hash & mask;; pos = (pos + HASHGROUP_WIDTH) & mask) {
+		const GroupMask empty = HashGroup_match_empty(ctrl + pos);
+		if (empty) {
+			const size_t index = (pos + HashGroup_lowest(empty)) & mask;
+			memcpy((char *) slots + index * stride, slot, stride);
+			HashGroup_set_ctrl(ctrl, capacity, index, HashGroup_tag(hash));
+			return;
+		}
+	}
+}
+
+/**
+ * Empty the slot at index with backward shift deletion, see erase_index in hashmap.c. The caller releases
+ * whatever the slot owned and updates its size.
+ */
+static inline void SlotTable_erase(void *const slots, uint8_t *const ctrl, const size_t capacity, const size_t index,
+								   const size_t stride, const size_t hash_offset) {
+	const size_t mask = capacity - 1;
+	size_t hole = index;
+	for (size_t next = (hole + 1) & mask; ctrl[next] != CTRL_EMPTY; next = (next + 1) & mask) {
+		const size_t home = SlotTable_hash(slots, next, stride, hash_offset) & mask;
+		if (((next - home) & mask) >= ((next - hole) & mask)) {
+			memcpy((char *) slots + hole * stride, (const char *) slots + next * stride, stride);
+			HashGroup_set_ctrl(ctrl, capacity, hole, ctrl[next]);
+			hole = next;
+		}
+	}
+	memset((char *) slots + hole * stride, 0, stride);
+	HashGroup_set_ctrl(ctrl, capacity, hole, CTRL_EMPTY);
+}
+
+/**
+ * Move the slots of a table to a new one of new_capacity slots and free the old one. *ctrl and *capacity
+ * follow, the thresholds are up to the caller.
+ * @return the new slots, or NULL if out of memory and the table was left as it was
+ */
+static inline void *SlotTable_resize(void *const slots, uint8_t **const ctrl, size_t *const capacity,
+									 const size_t new_capacity, const size_t stride, const size_t hash_offset) {
+	uint8_t *new_ctrl;
+	void *new_slots = SlotTable_allocate(new_capacity, &new_ctrl, stride);
+	if (!new_slots) {
+		return NULL;
+	}
+	for (size_t i = 0; i < *capacity; i++) {
+		if ((*ctrl)[i] != CTRL_EMPTY) {
+			SlotTable_insert(new_slots, new_ctrl, new_capacity, (const char *) slots + i * stride, stride,
+							 hash_offset);
+		}
+	}
+	free(slots);
+	*ctrl = new_ctrl;
+	*capacity = new_capacity;
+	return new_slots;
+}
+
+/** Call df on the pointer ptr_offset bytes into each of the size full slots, what the slot owns */
+static inline void SlotTable_release(const void *const slots, const uint8_t *const ctrl, const size_t capacity,
+									 size_t size, const size_t stride, const size_t ptr_offset, const destructor_fn df) {
+	for (size_t i = 0; size > 0 && i < capacity; i++) {
+		if (ctrl[i] != CTRL_EMPTY) {
+			void *owned;
+			memcpy(&owned, (const char *) slots + i * stride + ptr_offset, sizeof(void *));
+			df(owned);
+			size--;
+		}
+	}
+}
+
+/**
+ * Empty a table whose slots were released. A table grown past min_capacity is swapped for a fresh one of
+ * min_capacity, so an earlier burst of inserts isn't held on to, otherwise it is zeroed in place. *ctrl and
+ * *capacity follow, the thresholds are up to the caller.
+ * @return the slots to use from now on
+ */
+static inline void *SlotTable_clear(void *const slots, uint8_t **const ctrl, size_t *const capacity,
+									const size_t min_capacity, const size_t size, const size_t stride) {
+	if (*capacity > min_capacity) {
+		uint8_t *new_ctrl;
+		void *new_slots = SlotTable_allocate(min_capacity, &new_ctrl, stride);
+		if (new_slots) {
+			free(slots);
+			*ctrl = new_ctrl;
+			*capacity = min_capacity;
+			return new_slots;
+		}
+	}
+	if (size > 0) {
+		memset(slots, 0, *capacity * stride);
+		memset(*ctrl, CTRL_EMPTY, HashGroup_ctrl_bytes(*capacity));
+	}
+	return slots;
+}
+
+/** @return false if a table twice the size of capacity would not fit in memory, out_capacity is then unset */
+static inline bool SlotTable_grow_capacity(const size_t capacity, size_t *const out_capacity, const size_t stride) {
+	return !Commons_will_overflow(capacity, 2, out_capacity) && *out_capacity <= SIZE_MAX / stride;
+}
+
+/** @return the smallest capacity that holds n slots of stride bytes below the load factor, 0 if there is none */
+static inline size_t SlotTable_capacity_for(const size_t n, const size_t stride) {
+	size_t capacity = HASHMAP_MIN_CAPACITY;
+	while ((size_t) (capacity * HASHMAP_LOAD_FACTOR) < n) {
+		if (Commons_will_overflow(capacity, 2, &capacity) || capacity > SIZE_MAX / stride) {
+			return 0;
+		}
+	}
+	return capacity;
+}
+
+/**
+ * Same policy as HashMap: below the shrink threshold, move to a table twice the size the slots need, never
+ * below min_capacity. A failed shrink costs nothing but memory, so callers may ignore resize failures.
+ * @return the capacity to shrink to, or 0 to keep the table
+ */
+static inline size_t SlotTable_shrink_capacity(const size_t size, const size_t shrink_threshold, const size_t capacity,
+											   const size_t min_capacity, const size_t stride) {
+	if (size >= shrink_threshold || capacity <= min_capacity) {
+		return 0;
+	}
+	size_t new_capacity = SlotTable_capacity_for(size * 2, stride);
+	if (new_capacity < min_capacity) {
+		new_capacity = min_capacity;
+	}
+	return new_capacity < capacity ? new_capacity : 0;
+}
+
+#endif //libfaafo_SLOTTABLE_H
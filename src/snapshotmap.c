@@ -0,0 +1,219 @@
+//
+// Read mostly HashMap with lock free readers
+//
+#include "snapshotmap.h"
+
+#include <dbg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashmap_internal.h"
+
+static void noop_entry_df(void *entry);
+
+static void publish(SnapshotMap *map, HashMap *table, MapEntry *replaced, SnapshotRetired *retired);
+
+static void reclaim(SnapshotMap *map);
+
+static uint64_t oldest_reader_epoch(const SnapshotMap *map);
+
+SnapshotMap *SnapshotMap_create(const size_t capacity, const size_t max_readers, const hash_fn hash_fn,
+								const equals_fn equals_fn, const destructor_fn map_entry_df) {
+	check_return(max_readers > 0, "Max readers must be > 0", NULL);
+	SnapshotMap *map = calloc(1, sizeof(SnapshotMap));
+	check_mem_return(map, NULL);
+
+	void *readers = NULL;
+	check_mem(posix_memalign(&readers, SNAPSHOTMAP_CACHE_LINE, max_readers * sizeof(SnapshotReader)) == 0,
+			  goto catch);
+	memset(readers, 0, max_readers * sizeof(SnapshotReader));
+	map->readers = readers;
+	map->max_readers = max_readers;
+
+	// Tables never destroy entries themselves, entries outlive the versions that share them
+	map->current = HashMap_create(capacity, hash_fn, equals_fn, noop_entry_df);
+	check(map->current, "Failed to create table", goto catch);
+	map->df = map_entry_df ? map_entry_df : Commons_map_entry_destroy;
+
+	map->epoch = 1;
+	check(pthread_mutex_init(&map->write_lock, NULL) == 0, "Failed to init write lock", goto catch);
+	return map;
+catch:
+	if (map->current) {
+		HashMap_destroy(map->current);
+	}
+	free(map->readers);
+	free(map);
+	return NULL;
+}
+
+SnapshotReader *SnapshotMap_register_reader(SnapshotMap *const map) {
+	check_return(map, "Map is null", NULL);
+	for (size_t i = 0; i < map->max_readers; i++) {
+		bool expected = false;
+		if (__atomic_compare_exchange_n(&map->readers[i].in_use, &expected, true, false, __ATOMIC_ACQ_REL,
+										__ATOMIC_RELAXED)) {
+			__atomic_store_n(&map->readers[i].epoch, 0, __ATOMIC_RELEASE);
+			return &map->readers[i];
+		}
+	}
+	log_err("All %zu reader slots are taken", map->max_readers);
+	return NULL;
+}
+
+void SnapshotMap_unregister_reader(SnapshotMap *const map, SnapshotReader *const reader) {
+	check(map && reader, "Map or reader is null", return);
+	__atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&reader->in_use, false, __ATOMIC_RELEASE);
+}
+
+void SnapshotMap_enter(SnapshotMap *const map, SnapshotReader *const reader) {
+	/*
+	 * Announce the epoch before loading the table. Both are sequentially consistent, as is the writer's
+	 * publish and its scan of the readers, so a writer that misses this announcement is guaranteed to have
+	 * published before our load of current and will not free the table we end up reading.
+	 */
+	__atomic_store_n(&reader->epoch, __atomic_load_n(&map->epoch, __ATOMIC_ACQUIRE), __ATOMIC_SEQ_CST);
+}
+
+void SnapshotMap_exit(SnapshotReader *const reader) {
+	__atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+}
+
+void *SnapshotMap_get(const SnapshotMap *const map, const void *const key) {
+	const HashMap *table = __atomic_load_n(&map->current, __ATOMIC_SEQ_CST);
+	const MapEntry *entry = HashMap_find_hashed(table, key, HashMap_hash(table, key));
+	return entry ? entry->value : NULL;
+}
+
+bool SnapshotMap_put(SnapshotMap *const map, void *const key, void *const value) {
+	check_return(map, "Map is null", false);
+	check_return(key, "Key is null", false);
+	check_return(value, "Value is null", false);
+
+	// Allocate everything up front so running out of memory leaves the published version untouched
+	SnapshotRetired *retired = malloc(sizeof(SnapshotRetired));
+	check_mem_return(retired, false);
+	pthread_mutex_lock(&map->write_lock);
+	HashMap *table = HashMap_clone_table(map->current);
+	check_mem(table, goto catch);
+
+	// Entries are shared with the published version, so a replace detaches the old entry instead of mutating it
+	const size_t hash = HashMap_hash(table, key);
+	MapEntry *replaced = HashMap_detach_hashed(table, key, hash);
+	HashMap_put_hashed(table, key, value, hash);
+	if (!HashMap_find_hashed(table, key, hash)) {
+		log_err("Failed to put entry");
+		HashMap_free_table(table);
+		goto catch;
+	}
+	publish(map, table, replaced, retired);
+	pthread_mutex_unlock(&map->write_lock);
+	return true;
+catch:
+	pthread_mutex_unlock(&map->write_lock);
+	free(retired);
+	return false;
+}
+
+bool SnapshotMap_remove(SnapshotMap *const map, const void *const key) {
+	check_return(map, "Map is null", false);
+	check_return(key, "Key is null", false);
+
+	SnapshotRetired *retired = malloc(sizeof(SnapshotRetired));
+	check_mem_return(retired, false);
+	pthread_mutex_lock(&map->write_lock);
+	const HashMap *current = map->current;
+	const size_t hash = HashMap_hash(current, key);
+	HashMap *table = HashMap_find_hashed(current, key, hash) ? HashMap_clone_table(current) : NULL;
+	if (!table) {
+		pthread_mutex_unlock(&map->write_lock);
+		free(retired);
+		return false;
+	}
+	MapEntry *removed = HashMap_detach_hashed(table, key, hash);
+	publish(map, table, removed, retired);
+	pthread_mutex_unlock(&map->write_lock);
+	return true;
+}
+
+size_t SnapshotMap_size(const SnapshotMap *const map) {
+	check_return(map, "Map is null", 0);
+	return __atomic_load_n(&map->current, __ATOMIC_ACQUIRE)->size;
+}
+
+void SnapshotMap_reclaim(SnapshotMap *const map) {
+	check(map, "Map is null", return);
+	pthread_mutex_lock(&map->write_lock);
+	reclaim(map);
+	pthread_mutex_unlock(&map->write_lock);
+}
+
+bool SnapshotMap_destroy(SnapshotMap *map) {
+	check_return(map, "Map is null", false);
+	while (map->retired) {
+		SnapshotRetired *next = map->retired->next;
+		HashMap_free_table(map->retired->table);
+		if (map->retired->entry) {
+			map->df(map->retired->entry);
+		}
+		free(map->retired);
+		map->retired = next;
+	}
+	// The published version is the only one left, let it destroy its entries on the way out
+	map->current->df = map->df;
+	HashMap_destroy(map->current);
+	pthread_mutex_destroy(&map->write_lock);
+	free(map->readers);
+	free(map);
+	return true;
+}
+
+
+// Private helper functions
+
+static void noop_entry_df(void *entry) {
+	(void) entry;
+}
+
+static void publish(SnapshotMap *const map, HashMap *const table, MapEntry *const replaced,
+					SnapshotRetired *const retired) {
+	retired->table = map->current;
+	retired->entry = replaced;
+	__atomic_store_n(&map->current, table, __ATOMIC_SEQ_CST);
+	// Readers that see the new epoch are guaranteed to see the new table as well
+	retired->epoch = __atomic_add_fetch(&map->epoch, 1, __ATOMIC_SEQ_CST);
+	retired->next = map->retired;
+	map->retired = retired;
+	reclaim(map);
+}
+
+static void reclaim(SnapshotMap *const map) {
+	const uint64_t oldest = oldest_reader_epoch(map);
+	SnapshotRetired **link = &map->retired;
+	while (*link) {
+		SnapshotRetired *retired = *link;
+		if (retired->epoch > oldest) {
+			// Some reader entered before this version was replaced and may still be using it
+			link = &retired->next;
+			continue;
+		}
+		*link = retired->next;
+		HashMap_free_table(retired->table);
+		if (retired->entry) {
+			map->df(retired->entry);
+		}
+		free(retired);
+	}
+}
+
+static uint64_t oldest_reader_epoch(const SnapshotMap *const map) {
+	uint64_t oldest = UINT64_MAX;
+	for (size_t i = 0; i < map->max_readers; i++) {
+		const uint64_t epoch = __atomic_load_n(&map->readers[i].epoch, __ATOMIC_SEQ_CST);
+		if (epoch != 0 && epoch < oldest) {
+			oldest = epoch;
+		}
+	}
+	return oldest;
+}
@@ -0,0 +1,311 @@
+//
+// Open addressing hash map for string keys, short keys inline in the slots
+//
+#include "strmap.h"
+
+#include <dbg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashmap_internal.h"
+#include "slottable.h"
+
+#define SLOT_LAYOUT SlotTable_layout(StrMapSlot)
+
+// Returned by find_index when the key is not in the map
+#define NOT_FOUND SIZE_MAX
+
+static void default_value_df(void *value);
+
+static size_t generate_hash(const StrMap *map, const char *key, size_t len);
+
+static void make_probe(StrMapKey *probe, const char *key, size_t len);
+
+static size_t find_index(const StrMap *map, const char *key, size_t len, size_t hash, size_t *insert_index);
+
+static bool copy_key(StrMap *map, StrMapSlot *slot, const char *key);
+
+static void erase_index(StrMap *map, size_t index);
+
+static bool resize(StrMap *map, size_t new_capacity);
+
+static bool compact_keys(StrMap *map);
+
+static void compact_if_dead(StrMap *map);
+
+static void shrink_if_sparse(StrMap *map);
+
+StrMap *StrMap_create(size_t capacity, const destructor_fn value_df) {
+	check_return(capacity > 0, "Capacity must be > 0", NULL);
+	check_return((capacity & (capacity - 1)) == 0, "Capacity must be a power of 2", NULL);
+
+	if (capacity < HASHMAP_MIN_CAPACITY) {
+		capacity = HASHMAP_MIN_CAPACITY;
+	}
+
+	StrMap *map = calloc(1, sizeof(StrMap));
+	check_mem_return(map, NULL);
+	map->slots = SlotTable_allocate(capacity, &map->ctrl, sizeof(StrMapSlot));
+	check_mem(map->slots, goto catch);
+
+	map->size = 0;
+	map->capacity = capacity;
+	map->min_capacity = capacity;
+	map->keys = NULL;
+	map->dead_key_bytes = 0;
+	map->df = value_df ? value_df : default_value_df;
+	map->seed = HashMap_new_seed();
+	SlotTable_set_thresholds(map);
+	return map;
+catch:
+	free(map);
+	return NULL;
+}
+
+bool StrMap_destroy(StrMap *map) {
+	check_return(map, "Map is null", false);
+	SlotTable_release(map->slots, map->ctrl, map->capacity, map->size, sizeof(StrMapSlot), offsetof(StrMapSlot, value),
+					  map->df);
+	if (map->keys) {
+		Arena_destroy(map->keys);
+	}
+	free(map->slots); // ctrl bytes share the allocation
+	free(map);
+	return true;
+}
+
+bool StrMap_clear(StrMap *map) {
+	check_return(map, "Map is null", false);
+	SlotTable_release(map->slots, map->ctrl, map->capacity, map->size, sizeof(StrMapSlot), offsetof(StrMapSlot, value),
+					  map->df);
+	map->slots = SlotTable_clear(map->slots, &map->ctrl, &map->capacity, map->min_capacity, map->size,
+								 sizeof(StrMapSlot));
+	SlotTable_set_thresholds(map);
+	if (map->keys) {
+		Arena_reset(map->keys);
+	}
+	map->dead_key_bytes = 0;
+	map->size = 0;
+	return true;
+}
+
+void *StrMap_put(StrMap *const map, const char *const key, const size_t len, void *const value) {
+	check_return(map, "Map is null", NULL);
+	check_return(key || len == 0, "Key is null", NULL);
+	check_return(len <= UINT32_MAX, "Key is too long", NULL);
+	check_return(value, "Value is null", NULL);
+
+	const size_t hash = generate_hash(map, key, len);
+	size_t insert_index;
+	const size_t index = find_index(map, key, len, hash, &insert_index);
+	if (index != NOT_FOUND) {
+		void *old_value = map->slots[index].value;
+		map->slots[index].value = value;
+		return old_value;
+	}
+	if (map->size >= map->threshold) {
+		size_t new_cap;
+		if (!SlotTable_grow_capacity(map->capacity, &new_cap, sizeof(StrMapSlot))) {
+			log_warn("Max capacity reached for map, further attempts to expand will cause failure");
+			return NULL;
+		}
+		check_return(resize(map, new_cap), "Failed to resize map", NULL);
+		find_index(map, key, len, hash, &insert_index);
+	}
+	StrMapSlot slot = {.hash = hash, .len = (uint32_t) len, .value = value};
+	check_mem_return(copy_key(map, &slot, key), NULL);
+	map->slots[insert_index] = slot;
+	HashGroup_set_ctrl(map->ctrl, map->capacity, insert_index, HashGroup_tag(hash));
+	map->size++;
+	return NULL;
+}
+
+void *StrMap_get(const StrMap *const map, const char *const key, const size_t len) {
+	check_return(map, "Map is null", NULL);
+	check_return(key || len == 0, "Key is null", NULL);
+	const size_t index = find_index(map, key, len, generate_hash(map, key, len), NULL);
+	return index != NOT_FOUND ? map->slots[index].value : NULL;
+}
+
+bool StrMap_contains(const StrMap *const map, const char *const key, const size_t len) {
+	return StrMap_get(map, key, len) != NULL;
+}
+
+bool StrMap_remove(StrMap *const map, const char *const key, const size_t len) {
+	check_return(map, "Map is null", false);
+	check_return(key || len == 0, "Key is null", false);
+	const size_t index = find_index(map, key, len, generate_hash(map, key, len), NULL);
+	if (index == NOT_FOUND) {
+		return false;
+	}
+	void *value = map->slots[index].value;
+	erase_index(map, index);
+	map->df(value);
+	if (len > STRMAP_INLINE_KEY) {
+		map->dead_key_bytes += len;
+		compact_if_dead(map);
+	}
+	shrink_if_sparse(map);
+	return true;
+}
+
+bool StrMap_for_each(const StrMap *const map, const strmap_visit_fn fn, void *const ctx) {
+	check_return(map && fn, "Map or function is null", false);
+	for (size_t i = 0; i < map->capacity; i++) {
+		if (map->ctrl[i] == CTRL_EMPTY) {
+			continue;
+		}
+		const StrMapSlot *slot = &map->slots[i];
+		const char *key = slot->len > STRMAP_INLINE_KEY ? slot->key.data : slot->key.bytes;
+		if (!fn(key, slot->len, slot->value, ctx)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+
+// Private helper functions
+
+static void default_value_df(void *value) {
+	free(value);
+}
+
+static inline size_t generate_hash(const StrMap *map, const char *key, const size_t len) {
+	return (size_t) Commons_hash_bytes(key, len, map->seed);
+}
+
+/** Zero padded copy of a short key, to compare against inline keys as a whole */
+static inline void make_probe(StrMapKey *const probe, const char *const key, const size_t len) {
+	memset(probe, 0, sizeof(StrMapKey));
+	if (len > 0) {
+		memcpy(probe->bytes, key, len);
+	}
+}
+
+/**
+ * @param insert_index if not NULL and key is not in the map, set to the slot a new entry for key goes in
+ * @return the slot of key or NOT_FOUND
+ */
+static size_t find_index(const StrMap *const map, const char *const key, const size_t len, const size_t hash,
+						 size_t *const insert_index) {
+	const bool is_inline = len <= STRMAP_INLINE_KEY;
+	StrMapKey probe;
+	if (is_inline) {
+		make_probe(&probe, key, len);
+	}
+	const size_t mask = map->capacity - 1;
+	const uint8_t tag = HashGroup_tag(hash);
+	for (size_t pos = hash & mask;; pos = (pos + HASHGROUP_WIDTH) & mask) {
+		const uint8_t *group = map->ctrl + pos;
+		for (GroupMask match = HashGroup_match(group, tag); match; match &= match - 1) {
+			const size_t index = (pos + HashGroup_lowest(match)) & mask;
+			const StrMapSlot *slot = &map->slots[index];
+			if (slot->hash != hash || slot->len != len) {
+				continue;
+			}
+			// A fixed size compare the compiler turns into a few word loads, padding included
+			if (is_inline ? memcmp(slot->key.bytes, probe.bytes, STRMAP_INLINE_KEY) == 0
+						  : memcmp(slot->key.data, key, len) == 0) {
+				return index;
+			}
+		}
+		const GroupMask empty = HashGroup_match_empty(group);
+		if (empty) {
+			if (insert_index) {
+				*insert_index = (pos + HashGroup_lowest(empty)) & mask;
+			}
+			return NOT_FOUND;
+		}
+	}
+}
+
+/** Fill in the key of a new slot, slot->len set already */
+static bool copy_key(StrMap *const map, StrMapSlot *const slot, const char *const key) {
+	if (slot->len <= STRMAP_INLINE_KEY) {
+		make_probe(&slot->key, key, slot->len);
+		return true;
+	}
+	if (!map->keys) {
+		map->keys = Arena_create(0);
+		check_mem_return(map->keys, false);
+	}
+	slot->key.data = Arena_alloc(map->keys, slot->len);
+	check_mem_return(slot->key.data, false);
+	memcpy(slot->key.data, key, slot->len);
+	return true;
+}
+
+/** The caller releases the value */
+static inline void erase_index(StrMap *const map, const size_t index) {
+	SlotTable_erase(map->slots, map->ctrl, map->capacity, index, SLOT_LAYOUT);
+	map->size--;
+}
+
+static bool resize(StrMap *const map, const size_t new_capacity) {
+	StrMapSlot *slots = SlotTable_resize(map->slots, &map->ctrl, &map->capacity, new_capacity, SLOT_LAYOUT);
+	check_mem_return(slots, false);
+	map->slots = slots;
+	SlotTable_set_thresholds(map);
+	if (map->keys && map->dead_key_bytes > map->keys->allocated / 2) {
+		// Failing only means the dead keys stay around until the next try
+		compact_keys(map);
+	}
+	return true;
+}
+
+/** Copy the live long keys into a fresh arena and drop the old one with the removed keys in it */
+static bool compact_keys(StrMap *const map) {
+	Arena *keys = Arena_create(map->keys->chunk_size);
+	check_mem_return(keys, false);
+	char **copies = malloc(map->size * sizeof(char *));
+	check_mem(copies, goto catch);
+	size_t n = 0;
+	for (size_t i = 0; i < map->capacity; i++) {
+		const StrMapSlot *slot = &map->slots[i];
+		if (map->ctrl[i] == CTRL_EMPTY || slot->len <= STRMAP_INLINE_KEY) {
+			continue;
+		}
+		copies[n] = Arena_alloc(keys, slot->len);
+		check_mem(copies[n], goto catch);
+		memcpy(copies[n++], slot->key.data, slot->len);
+	}
+	// Only swap the keys once all copies were made, the map stays untouched if any of them fails
+	n = 0;
+	for (size_t i = 0; i < map->capacity; i++) {
+		if (map->ctrl[i] != CTRL_EMPTY && map->slots[i].len > STRMAP_INLINE_KEY) {
+			map->slots[i].key.data = copies[n++];
+		}
+	}
+	free(copies);
+	Arena_destroy(map->keys);
+	map->keys = keys;
+	map->dead_key_bytes = 0;
+	return true;
+catch:
+	free(copies);
+	Arena_destroy(keys);
+	return false;
+}
+
+/**
+ * Compact the long keys once more than half of the arena is dead, a map whose size holds steady never
+ * resizes. The dead keys must also outweigh the slots, which compact_keys walks, so that its cost stays
+ * proportional to the bytes it gives back however few long keys the map holds.
+ */
+static void compact_if_dead(StrMap *const map) {
+	if (map->dead_key_bytes > map->keys->allocated / 2 &&
+		map->dead_key_bytes >= map->capacity * sizeof(StrMapSlot)) {
+		// Failing only means the dead keys stay around until the next try
+		compact_keys(map);
+	}
+}
+
+static void shrink_if_sparse(StrMap *const map) {
+	const size_t new_cap = SlotTable_shrink_capacity(map->size, map->shrink_threshold, map->capacity,
+													 map->min_capacity, sizeof(StrMapSlot));
+	if (new_cap) {
+		resize(map, new_cap);
+	}
+}
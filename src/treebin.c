@@ -0,0 +1,226 @@
+//
+// AVL trees of colliding HashMap entries
+//
+#include "treebin.h"
+
+#include <dbg.h>
+#include <stdlib.h>
+
+#define height(node) ((node) ? (node)->height : 0)
+
+const char TreeBin_marker = 0;
+
+static void update_height(TreeNode *node);
+
+static void set_left(TreeNode *node, TreeNode *child);
+
+static void set_right(TreeNode *node, TreeNode *child);
+
+static TreeNode *rotate_left(TreeNode *node);
+
+static TreeNode *rotate_right(TreeNode *node);
+
+static TreeNode *rebalance(TreeNode *node);
+
+static TreeNode *insert_node(TreeNode *root, TreeNode *node, compare_fn compare_fn);
+
+static TreeNode *remove_min(TreeNode *root, TreeNode **min);
+
+static TreeNode *remove_node(TreeNode *root, const void *key, compare_fn compare_fn, TreeNode **removed);
+
+static void destroy_nodes(TreeNode *node, destructor_fn df);
+
+TreeBin *TreeBin_create(const size_t hash, const compare_fn compare_fn) {
+	TreeBin *bin = malloc(sizeof(TreeBin));
+	check_mem_return(bin, NULL);
+	bin->entry = (MapEntry) {.key = (void *) &TreeBin_marker, .value = NULL, .hash = hash};
+	bin->root = NULL;
+	bin->count = 0;
+	bin->compare_fn = compare_fn;
+	return bin;
+}
+
+void TreeBin_destroy(TreeBin *bin, const destructor_fn df) {
+	destroy_nodes(bin->root, df);
+	free(bin);
+}
+
+MapEntry *TreeBin_find(const TreeBin *const bin, const void *const key) {
+	const TreeNode *node = bin->root;
+	while (node) {
+		const int cmp = bin->compare_fn(key, node->entry->key);
+		if (cmp == 0) {
+			return node->entry;
+		}
+		node = cmp < 0 ? node->left : node->right;
+	}
+	return NULL;
+}
+
+bool TreeBin_insert(TreeBin *const bin, MapEntry *const entry) {
+	TreeNode *node = malloc(sizeof(TreeNode));
+	check_mem_return(node, false);
+	*node = (TreeNode) {.entry = entry, .left = NULL, .right = NULL, .parent = NULL, .height = 1};
+	bin->root = insert_node(bin->root, node, bin->compare_fn);
+	bin->root->parent = NULL;
+	bin->count++;
+	return true;
+}
+
+MapEntry *TreeBin_remove(TreeBin *const bin, const void *const key) {
+	TreeNode *removed = NULL;
+	bin->root = remove_node(bin->root, key, bin->compare_fn, &removed);
+	if (bin->root) {
+		bin->root->parent = NULL;
+	}
+	if (!removed) {
+		return NULL;
+	}
+	MapEntry *entry = removed->entry;
+	free(removed);
+	bin->count--;
+	return entry;
+}
+
+const TreeNode *TreeBin_first(const TreeBin *const bin) {
+	const TreeNode *node = bin->root;
+	while (node && node->left) {
+		node = node->left;
+	}
+	return node;
+}
+
+const TreeNode *TreeBin_next(const TreeNode *node) {
+	if (node->right) {
+		node = node->right;
+		while (node->left) {
+			node = node->left;
+		}
+		return node;
+	}
+	// Climb until coming up from a left subtree, that parent is the next node
+	while (node->parent && node == node->parent->right) {
+		node = node->parent;
+	}
+	return node->parent;
+}
+
+
+// Private helper functions
+
+static inline void update_height(TreeNode *const node) {
+	const int left = height(node->left);
+	const int right = height(node->right);
+	node->height = 1 + (left > right ? left : right);
+}
+
+static inline void set_left(TreeNode *const node, TreeNode *const child) {
+	node->left = child;
+	if (child) {
+		child->parent = node;
+	}
+}
+
+static inline void set_right(TreeNode *const node, TreeNode *const child) {
+	node->right = child;
+	if (child) {
+		child->parent = node;
+	}
+}
+
+static TreeNode *rotate_left(TreeNode *const node) {
+	TreeNode *right = node->right;
+	set_right(node, right->left);
+	set_left(right, node);
+	update_height(node);
+	update_height(right);
+	return right;
+}
+
+static TreeNode *rotate_right(TreeNode *const node) {
+	TreeNode *left = node->left;
+	set_left(node, left->right);
+	set_right(left, node);
+	update_height(node);
+	update_height(left);
+	return left;
+}
+
+/** Restore the AVL balance of node after one of its subtrees changed height by one, returns the new subtree root */
+static TreeNode *rebalance(TreeNode *const node) {
+	update_height(node);
+	const int balance = height(node->left) - height(node->right);
+	if (balance > 1) {
+		if (height(node->left->left) < height(node->left->right)) {
+			set_left(node, rotate_left(node->left));
+		}
+		return rotate_right(node);
+	}
+	if (balance < -1) {
+		if (height(node->right->right) < height(node->right->left)) {
+			set_right(node, rotate_right(node->right));
+		}
+		return rotate_left(node);
+	}
+	return node;
+}
+
+// Recursion depth is bounded by the tree height, which AVL keeps under 1.45 log2(count)
+static TreeNode *insert_node(TreeNode *const root, TreeNode *const node, const compare_fn compare_fn) {
+	if (!root) {
+		return node;
+	}
+	if (compare_fn(node->entry->key, root->entry->key) < 0) {
+		set_left(root, insert_node(root->left, node, compare_fn));
+	} else {
+		set_right(root, insert_node(root->right, node, compare_fn));
+	}
+	return rebalance(root);
+}
+
+static TreeNode *remove_min(TreeNode *const root, TreeNode **const min) {
+	if (!root->left) {
+		*min = root;
+		return root->right;
+	}
+	set_left(root, remove_min(root->left, min));
+	return rebalance(root);
+}
+
+static TreeNode *remove_node(TreeNode *const root, const void *const key, const compare_fn compare_fn,
+							 TreeNode **const removed) {
+	if (!root) {
+		return NULL;
+	}
+	const int cmp = compare_fn(key, root->entry->key);
+	if (cmp < 0) {
+		set_left(root, remove_node(root->left, key, compare_fn, removed));
+	} else if (cmp > 0) {
+		set_right(root, remove_node(root->right, key, compare_fn, removed));
+	} else {
+		*removed = root;
+		if (!root->left || !root->right) {
+			// The caller links the remaining child to its new parent
+			return root->left ? root->left : root->right;
+		}
+		// Two children, the smallest node of the right subtree takes the place of root
+		TreeNode *min;
+		TreeNode *right = remove_min(root->right, &min);
+		set_right(min, right);
+		set_left(min, root->left);
+		return rebalance(min);
+	}
+	return rebalance(root);
+}
+
+static void destroy_nodes(TreeNode *const node, const destructor_fn df) {
+	if (!node) {
+		return;
+	}
+	destroy_nodes(node->left, df);
+	destroy_nodes(node->right, df);
+	if (df) {
+		df(node->entry);
+	}
+	free(node);
+}
@@ -0,0 +1,63 @@
+//
+// Balanced trees for HashMap entries that share one full hash.
+//
+// Open addressing keeps every entry in its own slot, so keys crafted to collide turn a probe into a walk
+// over all of them. Once enough entries share a hash the map moves them into a TreeBin, an AVL tree ordered
+// by the map's comparator, that takes up a single slot and finds a key in O(log n) compares.
+//
+#ifndef libfaafo_TREEBIN_H
+#define libfaafo_TREEBIN_H
+
+#include <hashmap.h>
+
+typedef struct TreeNode {
+    MapEntry *entry;
+    struct TreeNode *left;
+    struct TreeNode *right;
+    struct TreeNode *parent;
+    int height;
+} TreeNode;
+
+/**
+ * The slot entry of a bin is embedded so that the table can point at it like at any other entry. Its key
+ * is a marker that no caller key can be equal to, and its hash is the one all the entries in the bin share.
+ */
+typedef struct TreeBin {
+    MapEntry entry;
+    TreeNode *root;
+    size_t count;
+    compare_fn compare_fn;
+} TreeBin;
+
+/** Key of the slot entry of every bin */
+extern const char TreeBin_marker;
+
+#define TreeBin_is_bin(map_entry) ((map_entry)->key == (void *) &TreeBin_marker)
+#define TreeBin_of(map_entry) ((TreeBin *) (map_entry))
+
+/** @return an empty bin for entries with hash, or NULL if out of memory */
+TreeBin *TreeBin_create(size_t hash, compare_fn compare_fn);
+
+/**
+ * Free the bin and its nodes
+ * @param df called for every entry in the bin, NULL to leave the entries alone
+ */
+void TreeBin_destroy(TreeBin *bin, destructor_fn df);
+
+/** @return the entry for key or NULL */
+MapEntry *TreeBin_find(const TreeBin *bin, const void *key);
+
+/**
+ * Add an entry whose key is not in the bin yet
+ * @return false if out of memory, the bin is left as it was
+ */
+bool TreeBin_insert(TreeBin *bin, MapEntry *entry);
+
+/** @return the entry removed for key, or NULL if key is not in the bin */
+MapEntry *TreeBin_remove(TreeBin *bin, const void *key);
+
+/** In order traversal, NULL when there is nothing (left) to visit */
+const TreeNode *TreeBin_first(const TreeBin *bin);
+const TreeNode *TreeBin_next(const TreeNode *node);
+
+#endif //libfaafo_TREEBIN_H
@@ -0,0 +1,88 @@
+//
+// Tests for the chunked bump allocator
+//
+#include <unity.h>
+#include <arena.h>
+#include <stdint.h>
+#include <string.h>
+
+static Arena *arena;
+
+void setUp(void) {
+    arena = Arena_create(256);
+}
+
+void tearDown(void) {
+    if (arena) {
+        TEST_ASSERT_TRUE(Arena_destroy(arena));
+    }
+}
+
+void test_create(void) {
+    TEST_ASSERT_NOT_NULL(arena);
+    TEST_ASSERT_NULL_MESSAGE(arena->head, "Chunks should be created lazily");
+    TEST_ASSERT_EQUAL_INT(256, arena->chunk_size);
+
+    Arena *default_arena = Arena_create(0);
+    TEST_ASSERT_EQUAL_INT(ARENA_DEFAULT_CHUNK_SIZE, default_arena->chunk_size);
+    Arena_destroy(default_arena);
+}
+
+void test_alloc_is_aligned_and_disjoint(void) {
+    char *prev = NULL;
+    for (int i = 1; i <= 100; i++) {
+        char *ptr = Arena_alloc(arena, (size_t) i);
+        TEST_ASSERT_NOT_NULL(ptr);
+        TEST_ASSERT_EQUAL_INT(0, (uintptr_t) ptr % ARENA_ALIGNMENT);
+        memset(ptr, i, (size_t) i);
+        if (prev) {
+            // Previous allocation must be untouched
+            TEST_ASSERT_EQUAL_INT(i - 1, prev[i - 2]);
+        }
+        prev = ptr;
+    }
+    TEST_ASSERT_EQUAL_INT(5050, arena->allocated);
+}
+
+void test_alloc_larger_than_chunk(void) {
+    char *small = Arena_alloc(arena, 16);
+    char *big = Arena_alloc(arena, 4096);
+    TEST_ASSERT_NOT_NULL(big);
+    memset(big, 0xAB, 4096);
+
+    // The regular chunk keeps serving small requests
+    char *small2 = Arena_alloc(arena, 16);
+    TEST_ASSERT_EQUAL_PTR(small + 16, small2);
+}
+
+void test_calloc(void) {
+    unsigned char *ptr = Arena_calloc(arena, 200);
+    for (int i = 0; i < 200; i++) {
+        TEST_ASSERT_EQUAL_INT(0, ptr[i]);
+    }
+}
+
+void test_reset(void) {
+    for (int i = 0; i < 50; i++) {
+        Arena_alloc(arena, 100);
+    }
+    Arena_alloc(arena, 10000);
+    TEST_ASSERT_TRUE(Arena_reset(arena));
+    TEST_ASSERT_EQUAL_INT(0, arena->allocated);
+    TEST_ASSERT_NOT_NULL_MESSAGE(arena->head, "One regular chunk should be kept");
+    TEST_ASSERT_NULL(arena->head->next);
+    TEST_ASSERT_EQUAL_INT(0, arena->head->used);
+
+    char *ptr = Arena_alloc(arena, 64);
+    TEST_ASSERT_NOT_NULL(ptr);
+}
+
+int main(void) {
+    UNITY_BEGIN();
+    RUN_TEST(test_create);
+    RUN_TEST(test_alloc_is_aligned_and_disjoint);
+    RUN_TEST(test_alloc_larger_than_chunk);
+    RUN_TEST(test_calloc);
+    RUN_TEST(test_reset);
+    return UNITY_END();
+}
@@ -0,0 +1,230 @@
+//
+// Tests for Cache
+//
+#include <unity.h>
+#include <cache.h>
+#include <ptr_deref.h>
+
+#include "testutil.h"
+
+static Cache *cache;
+static int released;
+
+static void counting_df(void *map_entry) {
+    MapEntry *entry = map_entry;
+    if (entry->key) {
+        released++;
+    }
+    free(entry->key);
+    free(entry->value);
+}
+
+/** An entry weighs as much as its value */
+static size_t value_weigh_fn(const void *key, const void *value) {
+    (void) key;
+    return (size_t) deref_int(value);
+}
+
+static Cache *int_cache(const size_t capacity, const CachePolicy policy, const weigh_fn weigh_fn) {
+    return Cache_create(capacity, policy, TestUtil_hash_fn_int, TestUtil_equals_fn_int, weigh_fn, counting_df);
+}
+
+static bool put_int(const int key, const int value) {
+    return Cache_put(cache, TestUtil_allocate_int(key), TestUtil_allocate_int(value));
+}
+
+static bool cached(const int key) {
+    return Cache_peek(cache, &key) != NULL;
+}
+
+void setUp(void) {
+    cache = NULL;
+    released = 0;
+}
+
+void tearDown(void) {
+    if (cache) {
+        TEST_ASSERT_TRUE(Cache_destroy(cache));
+    }
+}
+
+void test_create(void) {
+    TEST_ASSERT_NULL(int_cache(0, CACHE_LRU, NULL));
+    cache = int_cache(1000, CACHE_TINYLFU, NULL);
+    TEST_ASSERT_NOT_NULL(cache);
+    TEST_ASSERT_EQUAL_INT(10, cache->window_capacity);
+    TEST_ASSERT_EQUAL_INT(792, cache->protected_capacity);
+    TEST_ASSERT_EQUAL_INT(0, Cache_size(cache));
+}
+
+void test_lru_order(void) {
+    cache = int_cache(3, CACHE_LRU, NULL);
+    TEST_ASSERT_TRUE(put_int(1, 10));
+    TEST_ASSERT_TRUE(put_int(2, 20));
+    TEST_ASSERT_TRUE(put_int(3, 30));
+    // Using 1 makes 2 the least recently used, peeking at it doesn't count
+    TEST_ASSERT_EQUAL_INT(10, deref_int(Cache_get(cache, &(int) {1})));
+    TEST_ASSERT_EQUAL_INT(20, deref_int(Cache_peek(cache, &(int) {2})));
+    TEST_ASSERT_TRUE(put_int(4, 40));
+    TEST_ASSERT_FALSE(cached(2));
+    TEST_ASSERT_TRUE(cached(1) && cached(3) && cached(4));
+
+    TEST_ASSERT_TRUE(Cache_touch(cache, &(int) {3}));
+    TEST_ASSERT_FALSE(Cache_touch(cache, &(int) {2}));
+    TEST_ASSERT_TRUE(put_int(5, 50));
+    TEST_ASSERT_FALSE(cached(1));
+    TEST_ASSERT_EQUAL_INT(3, Cache_size(cache));
+    TEST_ASSERT_EQUAL_INT(2, cache->stats.evictions);
+    TEST_ASSERT_EQUAL_INT(2, released);
+}
+
+void test_weighted_capacity(void) {
+    cache = int_cache(100, CACHE_LRU, value_weigh_fn);
+    for (int i = 0; i < 4; i++) {
+        TEST_ASSERT_TRUE(put_int(i, 25));
+    }
+    TEST_ASSERT_EQUAL_INT(100, cache->weight);
+
+    // Half the capacity pushes out the two oldest entries
+    TEST_ASSERT_TRUE(put_int(4, 50));
+    TEST_ASSERT_FALSE(cached(0) || cached(1));
+    TEST_ASSERT_EQUAL_INT(100, cache->weight);
+
+    // A replaced value that got heavier evicts too
+    TEST_ASSERT_TRUE(put_int(2, 50));
+    TEST_ASSERT_FALSE(cached(3));
+    TEST_ASSERT_EQUAL_INT(100, cache->weight);
+    TEST_ASSERT_EQUAL_INT(2, Cache_size(cache));
+
+    // Heavier than everything, refused and left with the caller
+    int *key = TestUtil_allocate_int(9);
+    int *value = TestUtil_allocate_int(101);
+    TEST_ASSERT_FALSE(Cache_put(cache, key, value));
+    TEST_ASSERT_EQUAL_INT(2, Cache_size(cache));
+    free(key);
+    free(value);
+}
+
+void test_replace_and_remove(void) {
+    cache = int_cache(10, CACHE_TINYLFU, NULL);
+    int *key = TestUtil_allocate_int(1);
+    TEST_ASSERT_TRUE(Cache_put(cache, key, TestUtil_allocate_int(10)));
+    // Same key pointer: only the old value is released
+    TEST_ASSERT_TRUE(Cache_put(cache, key, TestUtil_allocate_int(11)));
+    TEST_ASSERT_EQUAL_INT(0, released);
+    TEST_ASSERT_EQUAL_INT(11, deref_int(Cache_peek(cache, &(int) {1})));
+    // Equal key: the old key goes with the old value
+    TEST_ASSERT_TRUE(put_int(1, 12));
+    TEST_ASSERT_EQUAL_INT(1, released);
+    TEST_ASSERT_EQUAL_INT(1, Cache_size(cache));
+
+    TEST_ASSERT_TRUE(Cache_remove(cache, &(int) {1}));
+    TEST_ASSERT_FALSE(Cache_remove(cache, &(int) {1}));
+    TEST_ASSERT_EQUAL_INT(2, released);
+    TEST_ASSERT_EQUAL_INT(0, Cache_size(cache));
+    TEST_ASSERT_EQUAL_INT(0, cache->weight);
+
+    for (int i = 0; i < 10; i++) {
+        TEST_ASSERT_TRUE(put_int(i, i));
+    }
+    TEST_ASSERT_TRUE(Cache_clear(cache));
+    TEST_ASSERT_EQUAL_INT(12, released);
+    TEST_ASSERT_EQUAL_INT(0, Cache_size(cache));
+    TEST_ASSERT_EQUAL_INT(0, cache->stats.evictions);
+    TEST_ASSERT_TRUE(put_int(1, 1));
+    TEST_ASSERT_TRUE(cached(1));
+}
+
+void test_stats(void) {
+    cache = int_cache(100, CACHE_LRU, NULL);
+    TEST_ASSERT_TRUE(Cache_hit_rate(cache) == 0);
+    for (int i = 0; i < 50; i++) {
+        TEST_ASSERT_TRUE(put_int(i, i));
+    }
+    for (int i = 0; i < 100; i++) {
+        const int *value = Cache_get(cache, &i);
+        TEST_ASSERT_TRUE(i < 50 ? value && *value == i : value == NULL);
+    }
+    TEST_ASSERT_EQUAL_INT(50, cache->stats.hits);
+    TEST_ASSERT_EQUAL_INT(50, cache->stats.misses);
+    TEST_ASSERT_TRUE(Cache_hit_rate(cache) == 0.5);
+}
+
+/** A scan over cold keys flushes LRU but not W-TinyLFU */
+void test_tinylfu_resists_scan(void) {
+    for (CachePolicy policy = CACHE_LRU; policy <= CACHE_TINYLFU; policy++) {
+        cache = int_cache(100, policy, NULL);
+        for (int round = 0; round < 10; round++) {
+            for (int i = 0; i < 50; i++) {
+                if (!Cache_get(cache, &i)) {
+                    TEST_ASSERT_TRUE(put_int(i, i));
+                }
+            }
+        }
+        for (int i = 1000; i < 3000; i++) {
+            if (!Cache_get(cache, &i)) {
+                TEST_ASSERT_TRUE(put_int(i, i));
+            }
+        }
+        int hot = 0;
+        for (int i = 0; i < 50; i++) {
+            hot += cached(i);
+        }
+        TEST_ASSERT_TRUE(Cache_size(cache) <= 100);
+        if (policy == CACHE_LRU) {
+            TEST_ASSERT_EQUAL_INT(0, hot);
+        } else {
+            // Hot keys that meet in the window and the main cache can push each other out on a tie
+            TEST_ASSERT_TRUE(hot >= 45);
+        }
+        TEST_ASSERT_TRUE(Cache_destroy(cache));
+    }
+    cache = NULL;
+}
+
+/** Sizes and weights stay consistent under a random mix of operations */
+void test_random_operations(void) {
+    srand(42);
+    for (CachePolicy policy = CACHE_LRU; policy <= CACHE_TINYLFU; policy++) {
+        released = 0;
+        cache = int_cache(500, policy, value_weigh_fn);
+        int puts = 0;
+        for (int i = 0; i < 100000; i++) {
+            const int key = rand() % 1000;
+            switch (rand() % 4) {
+                case 0:
+                case 1:
+                    Cache_get(cache, &key);
+                    break;
+                case 2:
+                    TEST_ASSERT_TRUE(put_int(key, 1 + rand() % 20));
+                    puts++;
+                    break;
+                default:
+                    Cache_remove(cache, &key);
+            }
+            TEST_ASSERT_TRUE(cache->weight <= cache->capacity);
+        }
+        size_t weight = 0;
+        for (size_t s = 0; s < 3; s++) {
+            weight += cache->lists[s].weight;
+        }
+        TEST_ASSERT_EQUAL_INT(cache->weight, weight);
+        TEST_ASSERT_EQUAL_INT(cache->map->size, Cache_size(cache));
+        TEST_ASSERT_TRUE(Cache_destroy(cache));
+        TEST_ASSERT_EQUAL_INT(puts, released);
+    }
+    cache = NULL;
+}
+
+int main(void) {
+    UNITY_BEGIN();
+    RUN_TEST(test_create);
+    RUN_TEST(test_lru_order);
+    RUN_TEST(test_weighted_capacity);
+    RUN_TEST(test_replace_and_remove);
+    RUN_TEST(test_stats);
+    RUN_TEST(test_tinylfu_resists_scan);
+    RUN_TEST(test_random_operations);
+    return UNITY_END();
+}
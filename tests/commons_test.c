@@ -0,0 +1,116 @@
+//
+// Tests for the hash functions in commons.h
+//
+#include <unity.h>
+#include <bstrlib.h>
+#include <commons.h>
+#include <string.h>
+
+#include "testutil.h"
+
+void setUp(void) {
+}
+
+void tearDown(void) {
+}
+
+void test_hash_bytes_deterministic(void) {
+    const char *text = "The quick brown fox jumps over the lazy dog";
+    const uint64_t hash = Commons_hash_bytes(text, strlen(text), 0);
+    TEST_ASSERT_EQUAL_UINT64(hash, Commons_hash_bytes(text, strlen(text), 0));
+    TEST_ASSERT_NOT_EQUAL(hash, Commons_hash_bytes(text, strlen(text), 1));
+    TEST_ASSERT_NOT_EQUAL(hash, Commons_hash_bytes(text, strlen(text) - 1, 0));
+    TEST_ASSERT_EQUAL_UINT64(Commons_hash_bytes(NULL, 0, 0), Commons_hash_bytes("", 0, 0));
+}
+
+void test_hash_bytes_every_length(void) {
+    // Every length takes one of the short, medium or long paths, all bytes must take part in each of them
+    uint8_t data[200];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (uint8_t) (i * 7 + 3);
+    }
+    for (size_t len = 1; len <= sizeof(data); len++) {
+        const uint64_t hash = Commons_hash_bytes(data, len, 0);
+        TEST_ASSERT_NOT_EQUAL(hash, Commons_hash_bytes(data, len - 1, 0));
+        for (size_t i = 0; i < len; i++) {
+            data[i] ^= 1;
+            TEST_ASSERT_NOT_EQUAL(hash, Commons_hash_bytes(data, len, 0));
+            data[i] ^= 1;
+        }
+    }
+}
+
+void test_hash_u64_spreads_sequential_keys(void) {
+    // Sequential keys must land in the low bits about as well as random ones
+    const size_t n = 1 << 12;
+    uint8_t *seen = calloc(n, 1);
+    size_t collisions = 0;
+    for (uint64_t i = 0; i < n; i++) {
+        const size_t bucket = Commons_hash_u64(i) & (n - 1);
+        collisions += seen[bucket];
+        seen[bucket] = 1;
+    }
+    free(seen);
+    // A random function puts n keys in n buckets with about n / e collisions
+    TEST_ASSERT_LESS_THAN(n / 2, collisions);
+    TEST_ASSERT_NOT_EQUAL(Commons_hash_u64(1), Commons_hash_u64(2));
+    TEST_ASSERT_NOT_EQUAL(Commons_hash_u64_seeded(1, 0), Commons_hash_u64_seeded(1, 1));
+}
+
+void test_hash_u64_avalanche(void) {
+    // Flipping one input bit flips about half of the output bits
+    uint64_t state = 12345;
+    size_t total = 0;
+    const size_t samples = 200;
+    for (size_t s = 0; s < samples; s++) {
+        state = state * UINT64_C(6364136223846793005) + 1;
+        for (int bit = 0; bit < 64; bit++) {
+            total += (size_t) __builtin_popcountll(Commons_hash_u64(state) ^ Commons_hash_u64(state ^ (UINT64_C(1) << bit)));
+        }
+    }
+    const double mean = (double) total / (double) (samples * 64);
+    TEST_ASSERT_TRUE(mean > 31.0 && mean < 33.0);
+}
+
+void test_hash_fns(void) {
+    int a = 1, b = 1, c = 2;
+    TEST_ASSERT_EQUAL(Commons_hash_fn_int(&a), Commons_hash_fn_int(&b));
+    TEST_ASSERT_NOT_EQUAL(Commons_hash_fn_int(&a), Commons_hash_fn_int(&c));
+
+    int64_t big = INT64_C(1) << 40;
+    TEST_ASSERT_NOT_EQUAL(Commons_hash_fn_int64(&big), (size_t) big);
+
+    bstring str = bfromcstr("hello world");
+    TEST_ASSERT_EQUAL(Commons_hash_fn_cstr("hello world"), Commons_hash_fn_bstring(str));
+    TEST_ASSERT_EQUAL(Commons_hash_bytes("hello world", 11, 0), Commons_hash_fn_bstring(str));
+    bdestroy(str);
+    TEST_ASSERT_EQUAL(0, Commons_hash_fn_bstring(NULL));
+}
+
+void test_random_seed(void) {
+    // Two 64 bit seeds in a row being equal means there is no randomness at all
+    TEST_ASSERT_NOT_EQUAL(Commons_hash_random_seed(), Commons_hash_random_seed());
+}
+
+void test_crc32c(void) {
+    // The check value of CRC-32C
+    TEST_ASSERT_EQUAL_HEX32(0xe3069283, Commons_crc32c(0, "123456789", 9));
+    TEST_ASSERT_EQUAL_HEX32(0, Commons_crc32c(0, NULL, 0));
+    // Checksumming in pieces gives the same result as all at once
+    const char *text = "The quick brown fox jumps over the lazy dog";
+    const uint32_t whole = Commons_crc32c(0, text, strlen(text));
+    TEST_ASSERT_EQUAL_HEX32(whole, Commons_crc32c(Commons_crc32c(0, text, 13), text + 13, strlen(text) - 13));
+    TEST_ASSERT_NOT_EQUAL(whole, Commons_crc32c(0, text, strlen(text) - 1));
+}
+
+int main(void) {
+    UNITY_BEGIN();
+    RUN_TEST(test_hash_bytes_deterministic);
+    RUN_TEST(test_hash_bytes_every_length);
+    RUN_TEST(test_hash_u64_spreads_sequential_keys);
+    RUN_TEST(test_hash_u64_avalanche);
+    RUN_TEST(test_hash_fns);
+    RUN_TEST(test_random_seed);
+    RUN_TEST(test_crc32c);
+    return UNITY_END();
+}
@@ -0,0 +1,119 @@
+//
+// Tests for the sharded concurrent HashMap
+//
+#include <unity.h>
+#include <concurrenthashmap.h>
+#include <ptr_deref.h>
+#include <pthread.h>
+
+#include "testutil.h"
+
+#define N_THREADS 8
+#define KEYS_PER_THREAD 5000
+
+static ConcurrentHashMap *map;
+
+void setUp(void) {
+    map = ConcurrentHashMap_create(16, HASHMAP_DEFAULT_CAPACITY, TestUtil_hash_fn_int, TestUtil_equals_fn_int, NULL);
+}
+
+void tearDown(void) {
+    if (map) {
+        TEST_ASSERT_TRUE(ConcurrentHashMap_destroy(map));
+    }
+}
+
+void test_create(void) {
+    TEST_ASSERT_NOT_NULL(map);
+    TEST_ASSERT_EQUAL_INT(16, map->n_shards);
+    TEST_ASSERT_EQUAL_INT(0, ConcurrentHashMap_size(map));
+    TEST_ASSERT_EQUAL_INT(0, (uintptr_t) map->shards % CONCURRENTHASHMAP_CACHE_LINE);
+    TEST_ASSERT_EQUAL_INT(0, sizeof(ConcurrentShard) % CONCURRENTHASHMAP_CACHE_LINE);
+
+    TEST_ASSERT_NULL(ConcurrentHashMap_create(3, 16, TestUtil_hash_fn_int, TestUtil_equals_fn_int, NULL));
+}
+
+void test_put_get_remove(void) {
+    for (int i = 0; i < 100; i++) {
+        TEST_ASSERT_NULL(ConcurrentHashMap_put(map, TestUtil_allocate_int(i), TestUtil_allocate_int(i * 2)));
+    }
+    TEST_ASSERT_EQUAL_INT(100, ConcurrentHashMap_size(map));
+
+    int key = 10;
+    int *old_value = ConcurrentHashMap_put(map, &key, TestUtil_allocate_int(-1));
+    TEST_ASSERT_EQUAL_INT(20, deref_int(old_value));
+    free(old_value);
+    TEST_ASSERT_EQUAL_INT(-1, deref_int(ConcurrentHashMap_get(map, &key)));
+
+    TEST_ASSERT_TRUE(ConcurrentHashMap_remove(map, &key));
+    TEST_ASSERT_FALSE(ConcurrentHashMap_remove(map, &key));
+    TEST_ASSERT_FALSE(ConcurrentHashMap_contains_key(map, &key));
+    TEST_ASSERT_EQUAL_INT(99, ConcurrentHashMap_size(map));
+
+    TEST_ASSERT_TRUE(ConcurrentHashMap_clear(map));
+    TEST_ASSERT_EQUAL_INT(0, ConcurrentHashMap_size(map));
+}
+
+static bool copy_int(const void *value, void *ctx) {
+    if (!value) {
+        return false;
+    }
+    *(int *) ctx = deref_int(value);
+    return true;
+}
+
+void test_read(void) {
+    ConcurrentHashMap_put(map, TestUtil_allocate_int(1), TestUtil_allocate_int(42));
+    int key = 1;
+    int out = 0;
+    TEST_ASSERT_TRUE(ConcurrentHashMap_read(map, &key, copy_int, &out));
+    TEST_ASSERT_EQUAL_INT(42, out);
+    key = 2;
+    TEST_ASSERT_FALSE(ConcurrentHashMap_read(map, &key, copy_int, &out));
+}
+
+static void *writer(void *arg) {
+    const int base = *(int *) arg * KEYS_PER_THREAD;
+    for (int i = base; i < base + KEYS_PER_THREAD; i++) {
+        ConcurrentHashMap_put(map, TestUtil_allocate_int(i), TestUtil_allocate_int(i + 1));
+        // Read back something another thread may be writing at the same time
+        int other = (i + KEYS_PER_THREAD) % (N_THREADS * KEYS_PER_THREAD);
+        ConcurrentHashMap_contains_key(map, &other);
+    }
+    for (int i = base; i < base + KEYS_PER_THREAD; i += 2) {
+        ConcurrentHashMap_remove(map, &i);
+    }
+    return NULL;
+}
+
+void test_concurrent_writers(void) {
+    pthread_t threads[N_THREADS];
+    int ids[N_THREADS];
+    for (int t = 0; t < N_THREADS; t++) {
+        ids[t] = t;
+        TEST_ASSERT_EQUAL_INT(0, pthread_create(&threads[t], NULL, writer, &ids[t]));
+    }
+    for (int t = 0; t < N_THREADS; t++) {
+        pthread_join(threads[t], NULL);
+    }
+
+    TEST_ASSERT_EQUAL_INT(N_THREADS * KEYS_PER_THREAD / 2, ConcurrentHashMap_size(map));
+    for (int i = 0; i < N_THREADS * KEYS_PER_THREAD; i++) {
+        int *value = ConcurrentHashMap_get(map, &i);
+        if (i % 2 == 0) {
+            TEST_ASSERT_NULL(value);
+        } else {
+            TEST_ASSERT_NOT_NULL(value);
+            TEST_ASSERT_EQUAL_INT(i + 1, deref_int(value));
+        }
+    }
+}
+
+int main(void) {
+    UNITY_BEGIN();
+    RUN_TEST(test_create);
+    RUN_TEST(test_put_get_remove);
+    RUN_TEST(test_read);
+    RUN_TEST(test_concurrent_writers);
+    return UNITY_END();
+}
@@ -0,0 +1,145 @@
+//
+// Tests for CountMap
+//
+#include <unity.h>
+#include <countmap.h>
+#include <ptr_deref.h>
+
+#include "testutil.h"
+
+static CountMap *map;
+
+static void *copy_int(const void *key) {
+    return TestUtil_allocate_int(deref_int(key));
+}
+
+static CountMap *int_counts_with(const copy_fn key_copy, const destructor_fn key_df) {
+    return CountMap_create(COUNTMAP_DEFAULT_CAPACITY, TestUtil_hash_fn_int, TestUtil_equals_fn_int, key_copy, key_df);
+}
+
+static CountMap *int_counts(void) {
+    return int_counts_with(copy_int, NULL);
+}
+
+void setUp(void) {
+    map = int_counts();
+}
+
+void tearDown(void) {
+    if (map) {
+        TEST_ASSERT_TRUE(CountMap_destroy(map));
+    }
+}
+
+void test_increment_get_remove(void) {
+    // Key i is counted i times, straight from a key on the stack
+    for (int i = 0; i < 200; i++) {
+        for (int j = 0; j < i; j++) {
+            TEST_ASSERT_TRUE(CountMap_increment(map, &i, 1));
+        }
+    }
+    TEST_ASSERT_EQUAL_INT(199, map->size);
+    for (int i = 0; i < 200; i++) {
+        TEST_ASSERT_EQUAL_INT(i, CountMap_get(map, &i));
+    }
+    TEST_ASSERT_FALSE(CountMap_contains(map, &(int) {0}));
+    TEST_ASSERT_EQUAL_INT(0, CountMap_get(map, &(int) {0}));
+
+    // Counts can go down and below zero without the key going away
+    TEST_ASSERT_TRUE(CountMap_increment(map, &(int) {5}, -7));
+    TEST_ASSERT_EQUAL_INT(-2, CountMap_get(map, &(int) {5}));
+    TEST_ASSERT_TRUE(CountMap_contains(map, &(int) {5}));
+
+    for (int i = 1; i < 200; i++) {
+        TEST_ASSERT_TRUE(CountMap_remove(map, &i));
+    }
+    TEST_ASSERT_FALSE(CountMap_remove(map, &(int) {1}));
+    TEST_ASSERT_TRUE(CountMap_is_empty(map));
+    TEST_ASSERT_EQUAL_INT(map->min_capacity, map->capacity);
+}
+
+void test_increment_many(void) {
+    enum { N = 10000 };
+    static int values[N];
+    static const void *keys[N];
+    for (int i = 0; i < N; i++) {
+        values[i] = i % 100;
+        keys[i] = &values[i];
+    }
+    TEST_ASSERT_EQUAL_INT(N, CountMap_increment_many(map, keys, N));
+    TEST_ASSERT_EQUAL_INT(100, map->size);
+    for (int i = 0; i < 100; i++) {
+        TEST_ASSERT_EQUAL_INT(N / 100, CountMap_get(map, &i));
+    }
+    size_t cursor = 0;
+    void *key;
+    int64_t count;
+    int64_t total = 0;
+    while (CountMap_next(map, &cursor, &key, &count)) {
+        total += count;
+    }
+    TEST_ASSERT_EQUAL_INT(N, total);
+}
+
+void test_top_k_and_merge(void) {
+    for (int i = 1; i <= 1000; i++) {
+        TEST_ASSERT_TRUE(CountMap_increment(map, &i, (i * 7919) % 1000 + 1));
+    }
+    CountEntry top[10];
+    TEST_ASSERT_EQUAL_INT(10, CountMap_top_k(map, 10, top));
+    // i * 7919 mod 1000 hits every residue exactly once, so the top counts are 1000 down to 991
+    for (int i = 0; i < 10; i++) {
+        TEST_ASSERT_EQUAL_INT(1000 - i, top[i].count);
+        TEST_ASSERT_EQUAL_INT(top[i].count, CountMap_get(map, top[i].key));
+    }
+    CountEntry all[2000];
+    TEST_ASSERT_EQUAL_INT(1000, CountMap_top_k(map, 2000, all));
+    for (int i = 1; i < 1000; i++) {
+        TEST_ASSERT_TRUE(all[i - 1].count >= all[i].count);
+    }
+    TEST_ASSERT_EQUAL_INT(0, CountMap_top_k(map, 0, all));
+
+    // Merging adds counts for shared keys and copies the others in
+    CountMap *other = int_counts();
+    for (int i = 500; i < 1500; i++) {
+        TEST_ASSERT_TRUE(CountMap_increment(other, &i, 1000000));
+    }
+    TEST_ASSERT_TRUE(CountMap_merge(map, other));
+    TEST_ASSERT_TRUE(CountMap_destroy(other));
+    TEST_ASSERT_EQUAL_INT(1499, map->size);
+    TEST_ASSERT_EQUAL_INT((1 * 7919) % 1000 + 1, CountMap_get(map, &(int) {1}));
+    TEST_ASSERT_EQUAL_INT(1000000 + (600 * 7919) % 1000 + 1, CountMap_get(map, &(int) {600}));
+    TEST_ASSERT_EQUAL_INT(1000000, CountMap_get(map, &(int) {1400}));
+    TEST_ASSERT_EQUAL_INT(1, CountMap_top_k(map, 1, top));
+    TEST_ASSERT_TRUE(top[0].count > 1000000);
+}
+
+void test_merge_without_key_copy(void) {
+    // Both maps keep the keys they are given and free them, so merging would free other's keys twice
+    CountMap *owner = int_counts_with(NULL, NULL);
+    CountMap *other = int_counts_with(NULL, NULL);
+    for (int i = 0; i < 10; i++) {
+        TEST_ASSERT_TRUE(CountMap_increment(owner, TestUtil_allocate_int(i), 1));
+        TEST_ASSERT_TRUE(CountMap_increment(other, TestUtil_allocate_int(i + 5), 1));
+    }
+    TEST_ASSERT_FALSE(CountMap_merge(owner, other));
+    TEST_ASSERT_EQUAL_INT(10, owner->size);
+
+    // A map that releases nothing can share the keys
+    CountMap *shared = int_counts_with(NULL, NOOP);
+    TEST_ASSERT_TRUE(CountMap_merge(shared, other));
+    TEST_ASSERT_EQUAL_INT(10, shared->size);
+    TEST_ASSERT_EQUAL_INT(1, CountMap_get(shared, &(int) {14}));
+    TEST_ASSERT_TRUE(CountMap_destroy(shared));
+    TEST_ASSERT_TRUE(CountMap_destroy(owner));
+    TEST_ASSERT_TRUE(CountMap_destroy(other));
+}
+
+int main(void) {
+    UNITY_BEGIN();
+    RUN_TEST(test_increment_get_remove);
+    RUN_TEST(test_increment_many);
+    RUN_TEST(test_top_k_and_merge);
+    RUN_TEST(test_merge_without_key_copy);
+    return UNITY_END();
+}
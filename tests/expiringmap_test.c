@@ -0,0 +1,169 @@
+//
+// Tests for ExpiringMap
+//
+#include <unity.h>
+#include <expiringmap.h>
+#include <ptr_deref.h>
+
+#include "testutil.h"
+
+static ExpiringMap *map;
+static uint64_t ticks;
+static int released;
+
+static uint64_t fake_clock(void) {
+    return ticks;
+}
+
+static void counting_df(void *map_entry) {
+    MapEntry *entry = map_entry;
+    if (entry->key) {
+        released++;
+    }
+    free(entry->key);
+    free(entry->value);
+}
+
+static bool put_int(const int key, const uint64_t ttl) {
+    return ExpiringMap_put(map, TestUtil_allocate_int(key), TestUtil_allocate_int(key), ttl);
+}
+
+/** Move the clock and the wheel to t */
+static size_t advance_to(const uint64_t t) {
+    ticks = t;
+    return ExpiringMap_advance(map, t);
+}
+
+void setUp(void) {
+    ticks = 1000;
+    released = 0;
+    map = ExpiringMap_create(TestUtil_hash_fn_int, TestUtil_equals_fn_int, fake_clock, counting_df);
+}
+
+void tearDown(void) {
+    if (map) {
+        TEST_ASSERT_TRUE(ExpiringMap_destroy(map));
+    }
+}
+
+void test_put_get_expire(void) {
+    TEST_ASSERT_TRUE(put_int(1, 10));
+    TEST_ASSERT_TRUE(put_int(2, 100));
+    TEST_ASSERT_EQUAL_INT(1, deref_int(ExpiringMap_get(map, &(int) {1})));
+    TEST_ASSERT_EQUAL_INT(0, advance_to(1009));
+    TEST_ASSERT_EQUAL_INT(2, ExpiringMap_size(map));
+    TEST_ASSERT_EQUAL_INT(1, advance_to(1010));
+    TEST_ASSERT_NULL(ExpiringMap_get(map, &(int) {1}));
+    TEST_ASSERT_EQUAL_INT(2, deref_int(ExpiringMap_get(map, &(int) {2})));
+    TEST_ASSERT_EQUAL_INT(1, advance_to(5000));
+    TEST_ASSERT_EQUAL_INT(0, ExpiringMap_size(map));
+    TEST_ASSERT_EQUAL_INT(2, released);
+    TEST_ASSERT_EQUAL_INT(2, map->expired);
+}
+
+void test_lazy_expiry(void) {
+    TEST_ASSERT_TRUE(put_int(1, 10));
+    // The clock moved but the wheel didn't, the lookup finds the entry expired and releases it
+    ticks = 1010;
+    TEST_ASSERT_NULL(ExpiringMap_get(map, &(int) {1}));
+    TEST_ASSERT_EQUAL_INT(0, ExpiringMap_size(map));
+    TEST_ASSERT_EQUAL_INT(1, released);
+    TEST_ASSERT_EQUAL_INT(1, map->expired);
+    TEST_ASSERT_EQUAL_INT(0, ExpiringMap_expire(map));
+
+    TEST_ASSERT_TRUE(put_int(2, 10));
+    ticks = 1020;
+    TEST_ASSERT_FALSE(ExpiringMap_touch(map, &(int) {2}, 10));
+    TEST_ASSERT_EQUAL_INT(0, ExpiringMap_size(map));
+}
+
+void test_replace_touch_remove(void) {
+    TEST_ASSERT_TRUE(put_int(1, 10));
+    // Replacing the entry releases the old one and moves the deadline
+    TEST_ASSERT_TRUE(put_int(1, 100));
+    TEST_ASSERT_EQUAL_INT(1, released);
+    TEST_ASSERT_EQUAL_INT(0, advance_to(1050));
+    TEST_ASSERT_TRUE(ExpiringMap_touch(map, &(int) {1}, 100));
+    TEST_ASSERT_EQUAL_INT(0, advance_to(1149));
+    TEST_ASSERT_EQUAL_INT(1, advance_to(1150));
+
+    TEST_ASSERT_TRUE(put_int(2, 10));
+    TEST_ASSERT_TRUE(ExpiringMap_remove(map, &(int) {2}));
+    TEST_ASSERT_FALSE(ExpiringMap_remove(map, &(int) {2}));
+    TEST_ASSERT_EQUAL_INT(3, released);
+    TEST_ASSERT_EQUAL_INT(0, advance_to(2000));
+    TEST_ASSERT_EQUAL_INT(0, map->wheel.occupied[0] | map->wheel.occupied[1]);
+
+    for (int i = 0; i < 100; i++) {
+        TEST_ASSERT_TRUE(put_int(i, (uint64_t) i * 1000));
+    }
+    TEST_ASSERT_TRUE(ExpiringMap_clear(map));
+    TEST_ASSERT_EQUAL_INT(103, released);
+    TEST_ASSERT_EQUAL_INT(0, ExpiringMap_size(map));
+}
+
+/** Deadlines on every level and past the wheel's span come out at the right tick, in order */
+void test_wheel_levels(void) {
+    const uint64_t ttls[] = {
+        0, 1, 63, 64, 65, 4095, 4096, 100000, 262143, 262144, EXPIRINGMAP_WHEEL_SPAN - 1,
+        EXPIRINGMAP_WHEEL_SPAN, EXPIRINGMAP_WHEEL_SPAN * 3 + 12345, UINT64_C(1) << 40
+    };
+    const int n = sizeof(ttls) / sizeof(ttls[0]);
+    for (int i = 0; i < n; i++) {
+        TEST_ASSERT_TRUE(put_int(i, ttls[i]));
+    }
+    for (int i = 0; i < n; i++) {
+        const uint64_t deadline = 1000 + ttls[i];
+        if (deadline > 1000) {
+            TEST_ASSERT_EQUAL_INT(0, advance_to(deadline - 1));
+            TEST_ASSERT_NOT_NULL(ExpiringMap_get(map, &i));
+        }
+        TEST_ASSERT_EQUAL_INT(1, advance_to(deadline));
+        TEST_ASSERT_EQUAL_INT(n - 1 - i, ExpiringMap_size(map));
+    }
+}
+
+/** Random ttls checked against the deadlines kept on the side */
+void test_random_deadlines(void) {
+    enum { KEYS = 2000 };
+    static uint64_t deadlines[KEYS];
+    srand(7);
+    for (int i = 0; i < KEYS; i++) {
+        deadlines[i] = 0;
+    }
+    for (int step = 0; step < 20000; step++) {
+        const int key = rand() % KEYS;
+        if (rand() % 3) {
+            const uint64_t ttl = rand() % 4 == 0 ? (uint64_t) rand() * 1000 : (uint64_t) (rand() % 5000);
+            TEST_ASSERT_TRUE(put_int(key, ttl));
+            deadlines[key] = ticks + ttl;
+        } else {
+            advance_to(ticks + rand() % 300);
+        }
+        if (step % 100 == 0) {
+            for (int i = 0; i < KEYS; i++) {
+                const bool live = deadlines[i] > ticks;
+                TEST_ASSERT_EQUAL(live, ExpiringMap_get(map, &i) != NULL);
+                if (!live) {
+                    deadlines[i] = 0;
+                }
+            }
+        }
+    }
+    size_t live = 0;
+    for (int i = 0; i < KEYS; i++) {
+        live += deadlines[i] > ticks;
+    }
+    advance_to(ticks);
+    TEST_ASSERT_EQUAL_INT(live, ExpiringMap_size(map));
+}
+
+int main(void) {
+    UNITY_BEGIN();
+    RUN_TEST(test_put_get_expire);
+    RUN_TEST(test_lazy_expiry);
+    RUN_TEST(test_replace_touch_remove);
+    RUN_TEST(test_wheel_levels);
+    RUN_TEST(test_random_deadlines);
+    return UNITY_END();
+}
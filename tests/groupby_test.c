@@ -0,0 +1,184 @@
+//
+// Tests for GroupBy
+//
+#include <unity.h>
+#include <arraylist.h>
+#include <groupby.h>
+#include <stdlib.h>
+
+#include "testutil.h"
+
+typedef struct Sale {
+    int store;
+    int64_t amount;
+} Sale;
+
+/** Sum of squares of the amounts, kept as a double to have a custom aggregate with a state of its own */
+typedef struct SquareSum {
+    double sum;
+} SquareSum;
+
+enum { STORES = 1000 };
+
+/** The answer, computed the plain way */
+typedef struct Expected {
+    int64_t count;
+    int64_t sum;
+    int64_t min;
+    int64_t max;
+    double squares;
+} Expected;
+
+static const void *store_key(const void *record) {
+    return &((const Sale *) record)->store;
+}
+
+static const void *odd_store_key(const void *record) {
+    return ((const Sale *) record)->store % 2 ? &((const Sale *) record)->store : NULL;
+}
+
+static int64_t amount(const void *record) {
+    return ((const Sale *) record)->amount;
+}
+
+static void square_init(void *state) {
+    ((SquareSum *) state)->sum = 0;
+}
+
+static void square_update(void *state, const void *record) {
+    const double value = (double) amount(record);
+    ((SquareSum *) state)->sum += value * value;
+}
+
+static void square_merge(void *state, const void *other) {
+    ((SquareSum *) state)->sum += ((const SquareSum *) other)->sum;
+}
+
+static GroupAggregate aggregates[5];
+static GroupBySpec spec;
+
+void setUp(void) {
+    aggregates[0] = GroupAggregate_count();
+    aggregates[1] = GroupAggregate_sum(amount);
+    aggregates[2] = GroupAggregate_custom(sizeof(SquareSum), square_init, square_update, square_merge);
+    aggregates[3] = GroupAggregate_min(amount);
+    aggregates[4] = GroupAggregate_max(amount);
+    spec = (GroupBySpec) {
+        .key_fn = store_key, .hash_fn = TestUtil_hash_fn_int, .equals_fn = TestUtil_equals_fn_int,
+        .aggregates = aggregates, .aggregate_count = 5, .nthreads = 4
+    };
+}
+
+void tearDown(void) {
+}
+
+/** n sales, skewed ones put half of them on store 7 */
+static Sale *make_sales(const size_t n, const bool skewed) {
+    Sale *sales = malloc(n * sizeof(Sale));
+    srand(42);
+    for (size_t i = 0; i < n; i++) {
+        sales[i].store = skewed && i % 2 ? 7 : rand() % STORES;
+        sales[i].amount = rand() % 2001 - 1000;
+    }
+    return sales;
+}
+
+static void check_result(const Sale *sales, const size_t n, const ArrayList *result) {
+    Expected *expected = calloc(STORES, sizeof(Expected));
+    size_t groups = 0;
+    for (size_t i = 0; i < n; i++) {
+        Expected *e = &expected[sales[i].store];
+        if (e->count == 0) {
+            e->min = INT64_MAX;
+            e->max = INT64_MIN;
+            groups++;
+        }
+        e->count++;
+        e->sum += sales[i].amount;
+        e->squares += (double) sales[i].amount * (double) sales[i].amount;
+        e->min = sales[i].amount < e->min ? sales[i].amount : e->min;
+        e->max = sales[i].amount > e->max ? sales[i].amount : e->max;
+    }
+    TEST_ASSERT_NOT_NULL(result);
+    TEST_ASSERT_EQUAL_INT(groups, ArrayList_size(result));
+    for (unsigned int i = 0; i < ArrayList_size(result); i++) {
+        const GroupRow *row = ArrayList_get(result, i);
+        Expected *e = &expected[*(const int *) row->key];
+        TEST_ASSERT_TRUE(e->count > 0);
+        TEST_ASSERT_EQUAL_INT(e->count, GroupRow_value(&spec, row, 0));
+        TEST_ASSERT_EQUAL_INT(e->sum, GroupRow_value(&spec, row, 1));
+        const SquareSum *squares = GroupRow_state(&spec, row, 2);
+        TEST_ASSERT_TRUE(squares->sum == e->squares);
+        TEST_ASSERT_EQUAL_INT(e->min, GroupRow_value(&spec, row, 3));
+        TEST_ASSERT_EQUAL_INT(e->max, GroupRow_value(&spec, row, 4));
+        // Every group comes out once
+        e->count = 0;
+    }
+    free(expected);
+}
+
+void test_group_array(void) {
+    // Small enough to run on the calling thread, then big enough for 4 threads
+    const size_t sizes[] = {0, 1, 5000, 200000};
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        Sale *sales = make_sales(sizes[s], false);
+        ArrayList *result = GroupBy_array(sales, sizes[s], sizeof(Sale), &spec);
+        check_result(sales, sizes[s], result);
+        ArrayList_destroy(result);
+        free(sales);
+    }
+}
+
+void test_group_list_skewed(void) {
+    const size_t n = 100000;
+    Sale *sales = make_sales(n, true);
+    ArrayList *list = ArrayList_create((unsigned int) n, NOOP);
+    for (size_t i = 0; i < n; i++) {
+        ArrayList_add(list, &sales[i]);
+    }
+    for (size_t nthreads = 1; nthreads <= 8; nthreads *= 2) {
+        spec.nthreads = nthreads;
+        ArrayList *result = GroupBy_list(list, &spec);
+        check_result(sales, n, result);
+        ArrayList_destroy(result);
+    }
+    ArrayList_destroy(list);
+    free(sales);
+}
+
+void test_filter_and_invalid(void) {
+    const size_t n = 50000;
+    Sale *sales = make_sales(n, false);
+    // Records without a key are left out
+    spec.key_fn = odd_store_key;
+    spec.aggregate_count = 1;
+    ArrayList *result = GroupBy_array(sales, n, sizeof(Sale), &spec);
+    TEST_ASSERT_NOT_NULL(result);
+    TEST_ASSERT_EQUAL_INT(STORES / 2, ArrayList_size(result));
+    int64_t total = 0;
+    for (unsigned int i = 0; i < ArrayList_size(result); i++) {
+        const GroupRow *row = ArrayList_get(result, i);
+        TEST_ASSERT_EQUAL_INT(1, *(const int *) row->key % 2);
+        total += GroupRow_value(&spec, row, 0);
+    }
+    size_t odd = 0;
+    for (size_t i = 0; i < n; i++) {
+        odd += sales[i].store % 2;
+    }
+    TEST_ASSERT_EQUAL_INT(odd, total);
+    ArrayList_destroy(result);
+
+    // A SUM without a value function
+    aggregates[1].value_fn = NULL;
+    spec.aggregate_count = 2;
+    TEST_ASSERT_NULL(GroupBy_array(sales, n, sizeof(Sale), &spec));
+    free(sales);
+}
+
+int main(void) {
+    UNITY_BEGIN();
+    RUN_TEST(test_group_array);
+    RUN_TEST(test_group_list_skewed);
+    RUN_TEST(test_filter_and_invalid);
+    return UNITY_END();
+}
@@ -55,12 +55,21 @@ void test_create(void) {
     TEST_ASSERT_EQUAL_INT(map->size, 0);
     TEST_ASSERT_EQUAL_PTR(testutil_equals_fn_bstring, map->equals_fn);
     TEST_ASSERT_EQUAL_PTR(TestUtil_hash_fn_bstring, map->hash_fn);
-    TEST_ASSERT_NOT_NULL(map->buckets);
+    // A small map uses the table embedded in it
+    TEST_ASSERT_TRUE(map->slots == map->small_slots);
+    TEST_ASSERT_TRUE(map->ctrl == map->small_ctrl);
     for (int i = 0; i < HASHMAP_DEFAULT_CAPACITY; i++) {
-        TEST_ASSERT_NULL(map->buckets[i]);
+        TEST_ASSERT_NULL(map->slots[i]);
+        TEST_ASSERT_EQUAL_INT(0, map->ctrl[i]);
     }
 }
 
+void test_create_small_capacity_rounded_up(void) {
+    map = HashMap_create(2, TestUtil_hash_fn_int, TestUtil_equals_fn_int, test_destroy_function_int);
+    TEST_ASSERT_NOT_NULL(map);
+    TEST_ASSERT_EQUAL_INT(HASHMAP_MIN_CAPACITY, map->capacity);
+}
+
 void test_put(void) {
     // Set up
     map = HashMap_create(HASHMAP_DEFAULT_CAPACITY, TestUtil_hash_fn_bstring, testutil_equals_fn_bstring,
@@ -149,6 +158,776 @@ void test_remove(void) {
     bdestroy(non_existing_key);
 }
 
+static size_t colliding_hash_fn(const void *key) {
+    // Every key lands in the same home slot, forcing one long probe run
+    (void) key;
+    return 42;
+}
+
+void test_remove_keeps_colliding_entries_reachable(void) {
+    map = HashMap_create(HASHMAP_DEFAULT_CAPACITY, colliding_hash_fn, TestUtil_equals_fn_int, test_destroy_function_int);
+    const int n = 40;
+    for (int i = 0; i < n; i++) {
+        HashMap_put(map, TestUtil_allocate_int(i), TestUtil_allocate_int(i * 2));
+    }
+    TEST_ASSERT_EQUAL_INT(n, map->size);
+
+    // Remove every third key from the middle of the run, the rest must still be found
+    for (int i = 0; i < n; i += 3) {
+        TEST_ASSERT_TRUE(HashMap_remove(map, &i));
+    }
+    for (int i = 0; i < n; i++) {
+        int *value = HashMap_get(map, &i);
+        if (i % 3 == 0) {
+            TEST_ASSERT_NULL(value);
+        } else {
+            TEST_ASSERT_NOT_NULL(value);
+            TEST_ASSERT_EQUAL_INT(i * 2, deref_int(value));
+        }
+    }
+}
+
+void test_put_remove_mixed(void) {
+    map = HashMap_create(HASHMAP_DEFAULT_CAPACITY, TestUtil_hash_fn_int, TestUtil_equals_fn_int, test_destroy_function_int);
+    const int n = 2000;
+    bool present[2000] = {false};
+    size_t expected_size = 0;
+
+    // Deterministic pseudo random mix of puts and removes, checked against a plain presence table
+    unsigned int seed = 12345;
+    for (int round = 0; round < 20000; round++) {
+        seed = seed * 1103515245 + 12345;
+        int key = (int) ((seed >> 8) % n);
+        if (present[key] && (seed & 1)) {
+            TEST_ASSERT_TRUE(HashMap_remove(map, &key));
+            present[key] = false;
+            expected_size--;
+        } else if (!present[key]) {
+            HashMap_put(map, TestUtil_allocate_int(key), TestUtil_allocate_int(key + 1));
+            present[key] = true;
+            expected_size++;
+        }
+    }
+    TEST_ASSERT_EQUAL_INT(expected_size, map->size);
+    for (int key = 0; key < n; key++) {
+        int *value = HashMap_get(map, &key);
+        if (present[key]) {
+            TEST_ASSERT_NOT_NULL(value);
+            TEST_ASSERT_EQUAL_INT(key + 1, deref_int(value));
+        } else {
+            TEST_ASSERT_NULL(value);
+        }
+    }
+}
+
+void test_clear(void) {
+    map = new_bstring_hashmap();
+    for (int i = 0; i < 20; i++) {
+        HashMap_put(map, bformat("key %d", i), bformat("value %d", i));
+    }
+    TEST_ASSERT_TRUE(map->capacity > HASHMAP_DEFAULT_CAPACITY);
+    TEST_ASSERT_TRUE(HashMap_clear(map));
+    TEST_ASSERT_EQUAL_INT(0, map->size);
+    // The table goes back to the capacity the map was created with
+    TEST_ASSERT_EQUAL_INT(HASHMAP_DEFAULT_CAPACITY, map->capacity);
+
+    bstring key = bfromcstr("key 1");
+    TEST_ASSERT_NULL(HashMap_get(map, key));
+    bdestroy(key);
+}
+
+static int *arena_int(HashMap *arena_map, const int i) {
+    int *ptr = HashMap_arena_alloc(arena_map, sizeof(int));
+    *ptr = i;
+    return ptr;
+}
+
+void test_arena_put_get_remove(void) {
+    map = HashMap_create_arena(HASHMAP_DEFAULT_CAPACITY, TestUtil_hash_fn_int, TestUtil_equals_fn_int, 1024);
+    TEST_ASSERT_NOT_NULL(map);
+    TEST_ASSERT_NOT_NULL(map->arena);
+
+    for (int i = 0; i < 100; i++) {
+        TEST_ASSERT_NULL(HashMap_put(map, arena_int(map, i), arena_int(map, i * 3)));
+    }
+    TEST_ASSERT_EQUAL_INT(100, map->size);
+    for (int i = 0; i < 100; i += 2) {
+        TEST_ASSERT_TRUE(HashMap_remove(map, &i));
+    }
+    TEST_ASSERT_NOT_NULL_MESSAGE(map->free_entries, "Removed entries should be kept for reuse");
+
+    // Reinserting must reuse the removed entries rather than growing the arena
+    const size_t allocated = map->arena->allocated;
+    for (int i = 0; i < 100; i += 2) {
+        HashMap_put(map, arena_int(map, i), arena_int(map, -i));
+    }
+    TEST_ASSERT_EQUAL_INT(allocated + 100 * sizeof(int), map->arena->allocated);
+    TEST_ASSERT_NULL(map->free_entries);
+    TEST_ASSERT_EQUAL_INT(100, map->size);
+    int key = 42;
+    TEST_ASSERT_EQUAL_INT(-42, deref_int(HashMap_get(map, &key)));
+}
+
+void test_arena_clear(void) {
+    map = HashMap_create_arena(HASHMAP_DEFAULT_CAPACITY, TestUtil_hash_fn_int, TestUtil_equals_fn_int, 0);
+    for (int round = 0; round < 3; round++) {
+        for (int i = 0; i < 500; i++) {
+            HashMap_put(map, arena_int(map, i), arena_int(map, i + round));
+        }
+        TEST_ASSERT_EQUAL_INT(500, map->size);
+        int key = 250;
+        TEST_ASSERT_EQUAL_INT(250 + round, deref_int(HashMap_get(map, &key)));
+
+        TEST_ASSERT_TRUE(HashMap_clear(map));
+        TEST_ASSERT_EQUAL_INT(0, map->size);
+        TEST_ASSERT_EQUAL_INT(0, map->arena->allocated);
+        TEST_ASSERT_NULL(HashMap_get(map, &key));
+    }
+}
+
+void test_arena_alloc_requires_arena_mode(void) {
+    map = new_bstring_hashmap();
+    TEST_ASSERT_NULL(HashMap_arena_alloc(map, 16));
+}
+
+void test_incremental_resize(void) {
+    map = HashMap_create(HASHMAP_DEFAULT_CAPACITY, TestUtil_hash_fn_int, TestUtil_equals_fn_int, test_destroy_function_int);
+    TEST_ASSERT_TRUE(HashMap_set_incremental_resize(map, 4));
+
+    const int n = 1000;
+    bool saw_migration = false;
+    for (int i = 0; i < n; i++) {
+        HashMap_put(map, TestUtil_allocate_int(i), TestUtil_allocate_int(i + 7));
+        saw_migration |= map->old.slots != NULL;
+        // Everything put so far must be reachable, whichever table it currently sits in
+        int probe_key = i / 2;
+        TEST_ASSERT_EQUAL_INT(probe_key + 7, deref_int(HashMap_get(map, &probe_key)));
+    }
+    TEST_ASSERT_TRUE_MESSAGE(saw_migration, "Growing should have gone through incremental migrations");
+    TEST_ASSERT_EQUAL_INT(n, map->size);
+
+    // Removes and replaces while a migration is running
+    for (int i = 0; i < n; i += 5) {
+        TEST_ASSERT_TRUE(HashMap_remove(map, &i));
+    }
+    for (int i = 1; i < n; i += 5) {
+        // The existing entry keeps its key, so a stack key is fine for a replace
+        int *old_value = HashMap_put(map, &i, TestUtil_allocate_int(-i));
+        TEST_ASSERT_EQUAL_INT(i + 7, deref_int(old_value));
+        free(old_value);
+    }
+    for (int i = 0; i < n; i++) {
+        int *value = HashMap_get(map, &i);
+        if (i % 5 == 0) {
+            TEST_ASSERT_NULL(value);
+        } else {
+            TEST_ASSERT_EQUAL_INT(i % 5 == 1 ? -i : i + 7, deref_int(value));
+        }
+    }
+    TEST_ASSERT_EQUAL_INT(n - n / 5, map->size);
+
+    while (HashMap_rehash_step(map, 1)) {
+    }
+    TEST_ASSERT_NULL(map->old.slots);
+    int key = 999;
+    TEST_ASSERT_EQUAL_INT(999 + 7, deref_int(HashMap_get(map, &key)));
+}
+
+void test_incremental_resize_with_collisions(void) {
+    // One giant run that wraps around the table end exercises the migration cursor logic
+    map = HashMap_create(HASHMAP_DEFAULT_CAPACITY, colliding_hash_fn, TestUtil_equals_fn_int, test_destroy_function_int);
+    HashMap_set_incremental_resize(map, 1);
+    for (int i = 0; i < 100; i++) {
+        HashMap_put(map, TestUtil_allocate_int(i), TestUtil_allocate_int(i));
+        for (int j = 0; j <= i; j += 7) {
+            TEST_ASSERT_EQUAL_INT(j, deref_int(HashMap_get(map, &j)));
+        }
+    }
+    for (int i = 0; i < 100; i += 2) {
+        TEST_ASSERT_TRUE(HashMap_remove(map, &i));
+    }
+    for (int i = 1; i < 100; i += 2) {
+        TEST_ASSERT_EQUAL_INT(i, deref_int(HashMap_get(map, &i)));
+    }
+}
+
+void test_incremental_resize_disable_finishes_migration(void) {
+    map = HashMap_create(HASHMAP_DEFAULT_CAPACITY, TestUtil_hash_fn_int, TestUtil_equals_fn_int, test_destroy_function_int);
+    HashMap_set_incremental_resize(map, 1);
+    for (int i = 0; i < 13; i++) {
+        HashMap_put(map, TestUtil_allocate_int(i), TestUtil_allocate_int(i));
+    }
+    TEST_ASSERT_NOT_NULL(map->old.slots);
+    HashMap_set_incremental_resize(map, 0);
+    TEST_ASSERT_NULL(map->old.slots);
+    TEST_ASSERT_EQUAL_INT(13, map->size);
+}
+
+void test_contains_key(void) {
+    map = HashMap_create(HASHMAP_DEFAULT_CAPACITY, TestUtil_hash_fn_int, TestUtil_equals_fn_int, test_destroy_function_int);
+    HashMap_put(map, TestUtil_allocate_int(3), TestUtil_allocate_int(30));
+    int key = 3;
+    TEST_ASSERT_TRUE(HashMap_contains_key(map, &key));
+    key = 4;
+    TEST_ASSERT_FALSE(HashMap_contains_key(map, &key));
+}
+
+static void assert_iterates_everything(const int n) {
+    // Every key exactly once, whichever table it sits in
+    bool *seen = calloc(n, sizeof(bool));
+    HashMapIterator it;
+    HashMap_iter_init(map, &it);
+    size_t count = 0;
+    for (MapEntry *entry = HashMap_iter_next(&it); entry; entry = HashMap_iter_next(&it)) {
+        const int key = deref_int(entry->key);
+        TEST_ASSERT_FALSE(seen[key]);
+        TEST_ASSERT_EQUAL_INT(key * 3, deref_int(entry->value));
+        seen[key] = true;
+        count++;
+    }
+    TEST_ASSERT_NULL(HashMap_iter_next(&it));
+    TEST_ASSERT_EQUAL_INT(map->size, count);
+    free(seen);
+}
+
+void test_iterator(void) {
+    map = HashMap_create(HASHMAP_DEFAULT_CAPACITY, TestUtil_hash_fn_int, TestUtil_equals_fn_int, test_destroy_function_int);
+    HashMapIterator it;
+    HashMap_iter_init(map, &it);
+    TEST_ASSERT_NULL(HashMap_iter_next(&it));
+
+    const int n = 500;
+    for (int i = 0; i < n; i++) {
+        HashMap_put(map, TestUtil_allocate_int(i), TestUtil_allocate_int(i * 3));
+    }
+    assert_iterates_everything(n);
+}
+
+void test_iterator_during_migration(void) {
+    map = HashMap_create(HASHMAP_DEFAULT_CAPACITY, TestUtil_hash_fn_int, TestUtil_equals_fn_int, test_destroy_function_int);
+    HashMap_set_incremental_resize(map, 1);
+    const int n = 200;
+    for (int i = 0; i < n; i++) {
+        HashMap_put(map, TestUtil_allocate_int(i), TestUtil_allocate_int(i * 3));
+    }
+    TEST_ASSERT_NOT_NULL(map->old.slots);
+    assert_iterates_everything(n);
+}
+
+static bool sum_values(void *key, void *value, void *ctx) {
+    (void) key;
+    *(long *) ctx += deref_int(value);
+    return true;
+}
+
+static bool stop_after_ten(void *key, void *value, void *ctx) {
+    (void) key;
+    (void) value;
+    return ++*(int *) ctx < 10;
+}
+
+void test_for_each(void) {
+    map = HashMap_create(HASHMAP_DEFAULT_CAPACITY, TestUtil_hash_fn_int, TestUtil_equals_fn_int, test_destroy_function_int);
+    HashMap_set_incremental_resize(map, 2);
+    const int n = 300;
+    for (int i = 0; i < n; i++) {
+        HashMap_put(map, TestUtil_allocate_int(i), TestUtil_allocate_int(i));
+    }
+    long sum = 0;
+    TEST_ASSERT_TRUE(HashMap_for_each(map, sum_values, &sum));
+    TEST_ASSERT_EQUAL_INT(n * (n - 1) / 2, sum);
+
+    int visited = 0;
+    TEST_ASSERT_FALSE(HashMap_for_each(map, stop_after_ten, &visited));
+    TEST_ASSERT_EQUAL_INT(10, visited);
+}
+
+void test_keyset_and_values(void) {
+    map = HashMap_create(HASHMAP_DEFAULT_CAPACITY, TestUtil_hash_fn_int, TestUtil_equals_fn_int, test_destroy_function_int);
+    for (int i = 1; i <= 40; i++) {
+        HashMap_put(map, TestUtil_allocate_int(i), TestUtil_allocate_int(-i));
+    }
+    long key_sum = 0, value_sum = 0;
+    HashMapView keys = HashMap_keyset(map);
+    for (int *key = HashMapView_next(&keys); key; key = HashMapView_next(&keys)) {
+        key_sum += *key;
+        TEST_ASSERT_TRUE(HashMap_contains_key(map, key));
+    }
+    HashMapView values = HashMap_values(map);
+    for (int *value = HashMapView_next(&values); value; value = HashMapView_next(&values)) {
+        value_sum += *value;
+    }
+    TEST_ASSERT_EQUAL_INT(820, key_sum);
+    TEST_ASSERT_EQUAL_INT(-820, value_sum);
+}
+
+static int hash_calls;
+
+static size_t counting_hash_fn(const void *key) {
+    hash_calls++;
+    return TestUtil_hash_fn_int(key);
+}
+
+static void *copy_int(const void *key) {
+    return TestUtil_allocate_int(deref_int(key));
+}
+
+static void *zero_counter(const void *key, void *ctx) {
+    (void) key;
+    (void) ctx;
+    return TestUtil_allocate_int(0);
+}
+
+void test_get_or_insert_with(void) {
+    map = HashMap_create(HASHMAP_DEFAULT_CAPACITY, counting_hash_fn, TestUtil_equals_fn_int, test_destroy_function_int);
+    hash_calls = 0;
+    const int words[] = {4, 2, 4, 4, 9, 2};
+    for (int i = 0; i < 6; i++) {
+        // Stack keys, the map only copies the ones it inserts
+        int *count = HashMap_get_or_insert_with(map, &words[i], copy_int, zero_counter, NULL);
+        TEST_ASSERT_NOT_NULL(count);
+        (*count)++;
+    }
+    TEST_ASSERT_EQUAL_INT(6, hash_calls);
+    TEST_ASSERT_EQUAL_INT(3, map->size);
+    int key = 4;
+    TEST_ASSERT_EQUAL_INT(3, deref_int(HashMap_get(map, &key)));
+    key = 2;
+    TEST_ASSERT_EQUAL_INT(2, deref_int(HashMap_get(map, &key)));
+}
+
+static void *increment_or_remove(const void *key, void *value, void *ctx) {
+    (void) key;
+    if (!value) {
+        return TestUtil_allocate_int(*(int *) ctx);
+    }
+    *(int *) value += *(int *) ctx;
+    if (deref_int(value) > 10) {
+        return NULL;
+    }
+    return value;
+}
+
+void test_compute(void) {
+    map = HashMap_create(HASHMAP_DEFAULT_CAPACITY, counting_hash_fn, TestUtil_equals_fn_int, test_destroy_function_int);
+    HashMap_set_incremental_resize(map, 1);
+    for (int i = 0; i < 100; i++) {
+        int step = 1;
+        TEST_ASSERT_EQUAL_INT(1, deref_int(HashMap_compute(map, &i, copy_int, increment_or_remove, &step)));
+    }
+    TEST_ASSERT_EQUAL_INT(100, map->size);
+
+    hash_calls = 0;
+    int key = 42, step = 5;
+    TEST_ASSERT_EQUAL_INT(6, deref_int(HashMap_compute(map, &key, copy_int, increment_or_remove, &step)));
+    TEST_ASSERT_EQUAL_INT(1, hash_calls);
+    // Going over 10 removes the entry
+    TEST_ASSERT_NULL(HashMap_compute(map, &key, copy_int, increment_or_remove, &step));
+    TEST_ASSERT_EQUAL_INT(99, map->size);
+    TEST_ASSERT_FALSE(HashMap_contains_key(map, &key));
+    for (int i = 0; i < 100; i++) {
+        TEST_ASSERT_EQUAL(i != 42, HashMap_contains_key(map, &i));
+    }
+}
+
+static void *sum_or_remove(void *old_value, void *value, void *ctx) {
+    (void) ctx;
+    const int sum = deref_int(old_value) + deref_int(value);
+    free(value);
+    if (sum == 0) {
+        return NULL;
+    }
+    *(int *) old_value = sum;
+    return old_value;
+}
+
+void test_merge(void) {
+    map = HashMap_create(HASHMAP_DEFAULT_CAPACITY, TestUtil_hash_fn_int, TestUtil_equals_fn_int, test_destroy_function_int);
+    int key = 7;
+    TEST_ASSERT_EQUAL_INT(3, deref_int(HashMap_merge(map, &key, copy_int, TestUtil_allocate_int(3), sum_or_remove, NULL)));
+    TEST_ASSERT_EQUAL_INT(5, deref_int(HashMap_merge(map, &key, copy_int, TestUtil_allocate_int(2), sum_or_remove, NULL)));
+    TEST_ASSERT_EQUAL_INT(1, map->size);
+    TEST_ASSERT_NULL(HashMap_merge(map, &key, copy_int, TestUtil_allocate_int(-5), sum_or_remove, NULL));
+    TEST_ASSERT_EQUAL_INT(0, map->size);
+}
+
+void test_put_many_get_many(void) {
+    map = HashMap_create(HASHMAP_DEFAULT_CAPACITY, TestUtil_hash_fn_int, TestUtil_equals_fn_int, test_destroy_function_int);
+    HashMap_set_incremental_resize(map, 3);
+    // Not a multiple of HASHMAP_BATCH, so the last batch is a partial one
+    const int n = 1000;
+    void **keys = malloc(n * sizeof(void *));
+    void **values = malloc(n * sizeof(void *));
+    void **inserted = malloc(n * sizeof(void *));
+    for (int i = 0; i < n; i++) {
+        keys[i] = TestUtil_allocate_int(i);
+        values[i] = TestUtil_allocate_int(i * 10);
+    }
+    TEST_ASSERT_TRUE(HashMap_put_many(map, keys, values, n, inserted));
+    TEST_ASSERT_EQUAL_INT(n, map->size);
+    for (int i = 0; i < n; i++) {
+        TEST_ASSERT_NULL(inserted[i]);
+    }
+    free(inserted);
+
+    int lookup[2 * n];
+    void *lookup_keys[2 * n];
+    void *out[2 * n];
+    for (int i = 0; i < 2 * n; i++) {
+        lookup[i] = i % 2 == 0 ? i / 2 : n + i;
+        lookup_keys[i] = &lookup[i];
+    }
+    TEST_ASSERT_EQUAL_INT(n, HashMap_get_many(map, lookup_keys, 2 * n, out));
+    for (int i = 0; i < 2 * n; i++) {
+        if (i % 2 == 0) {
+            TEST_ASSERT_EQUAL_INT(i / 2 * 10, deref_int(out[i]));
+        } else {
+            TEST_ASSERT_NULL(out[i]);
+        }
+    }
+
+    // Replacing hands the old values back, the new key in the middle is inserted
+    void *replace_keys[3] = {keys[0], TestUtil_allocate_int(n + 1), keys[1]};
+    void *replacements[3] = {TestUtil_allocate_int(-1), TestUtil_allocate_int(-2), TestUtil_allocate_int(-3)};
+    void *old_values[3];
+    TEST_ASSERT_TRUE(HashMap_put_many(map, replace_keys, replacements, 3, old_values));
+    TEST_ASSERT_EQUAL_INT(0, deref_int(old_values[0]));
+    TEST_ASSERT_NULL(old_values[1]);
+    TEST_ASSERT_EQUAL_INT(10, deref_int(old_values[2]));
+    free(old_values[0]);
+    free(old_values[2]);
+    TEST_ASSERT_EQUAL_INT(n + 1, map->size);
+    free(keys);
+    free(values);
+}
+
+void test_seed_differs_per_map(void) {
+    map = HashMap_create(HASHMAP_DEFAULT_CAPACITY, TestUtil_hash_fn_int, TestUtil_equals_fn_int, test_destroy_function_int);
+    HashMap *other = HashMap_create(HASHMAP_DEFAULT_CAPACITY, TestUtil_hash_fn_int, TestUtil_equals_fn_int, test_destroy_function_int);
+    TEST_ASSERT_TRUE(map->seed != other->seed);
+    HashMap_destroy(other);
+}
+
+static int compare_int(const void *a, const void *b) {
+    const int x = deref_int(a);
+    const int y = deref_int(b);
+    return (x > y) - (x < y);
+}
+
+static size_t half_colliding_hash_fn(const void *key) {
+    // Odd keys all collide, even keys hash normally around them and never to the same value
+    const int i = deref_int(key);
+    return i % 2 ? 1 : (size_t) i;
+}
+
+void test_tree_bins(void) {
+    map = HashMap_create(HASHMAP_DEFAULT_CAPACITY, half_colliding_hash_fn, TestUtil_equals_fn_int, test_destroy_function_int);
+    TEST_ASSERT_TRUE(HashMap_set_compare(map, compare_int));
+    const int n = 400;
+    for (int i = 0; i < n; i++) {
+        HashMap_put(map, TestUtil_allocate_int(i), TestUtil_allocate_int(i * 3));
+    }
+    TEST_ASSERT_EQUAL_INT(n, map->size);
+    TEST_ASSERT_EQUAL_INT(1, map->tree_bins);
+    TEST_ASSERT_FALSE(HashMap_set_compare(map, NULL));
+    for (int i = 0; i < n; i++) {
+        TEST_ASSERT_EQUAL_INT(i * 3, deref_int(HashMap_get(map, &i)));
+    }
+    int missing = n + 1;
+    TEST_ASSERT_FALSE(HashMap_contains_key(map, &missing));
+    assert_iterates_everything(n);
+    long sum = 0;
+    TEST_ASSERT_TRUE(HashMap_for_each(map, sum_values, &sum));
+    TEST_ASSERT_EQUAL_INT(3 * n * (n - 1) / 2, sum);
+
+    // Replacing a value inside a bin hands the old one back like anywhere else
+    int key = 7;
+    int *old_value = HashMap_put(map, &key, TestUtil_allocate_int(21));
+    TEST_ASSERT_EQUAL_INT(21, deref_int(old_value));
+    free(old_value);
+
+    // Drain the bin until it turns back into plain slots
+    const int keep = HASHMAP_UNTREEIFY_THRESHOLD - 1;
+    int odd_left = n / 2;
+    for (int i = 1; odd_left > keep; i += 2) {
+        TEST_ASSERT_TRUE(HashMap_remove(map, &i));
+        odd_left--;
+        TEST_ASSERT_EQUAL_INT(odd_left > keep ? 1 : 0, map->tree_bins);
+    }
+    for (int i = n - 1; i > n - 1 - 2 * keep; i -= 2) {
+        TEST_ASSERT_EQUAL_INT(i * 3, deref_int(HashMap_get(map, &i)));
+    }
+    TEST_ASSERT_EQUAL_INT(n / 2 + keep, map->size);
+}
+
+void test_tree_bins_incremental_resize(void) {
+    map = HashMap_create(HASHMAP_DEFAULT_CAPACITY, colliding_hash_fn, TestUtil_equals_fn_int, test_destroy_function_int);
+    HashMap_set_compare(map, compare_int);
+    HashMap_set_incremental_resize(map, 1);
+    for (int i = 0; i < 100; i++) {
+        HashMap_put(map, TestUtil_allocate_int(i), TestUtil_allocate_int(i));
+        for (int j = 0; j <= i; j += 7) {
+            TEST_ASSERT_EQUAL_INT(j, deref_int(HashMap_get(map, &j)));
+        }
+    }
+    TEST_ASSERT_EQUAL_INT(1, map->tree_bins);
+    for (int i = 0; i < 100; i += 2) {
+        TEST_ASSERT_TRUE(HashMap_remove(map, &i));
+    }
+    for (int i = 1; i < 100; i += 2) {
+        TEST_ASSERT_EQUAL_INT(i, deref_int(HashMap_get(map, &i)));
+    }
+    HashMap_clear(map);
+    TEST_ASSERT_EQUAL_INT(0, map->tree_bins);
+}
+
+void test_tree_bins_arena_clear(void) {
+    map = HashMap_create_arena(HASHMAP_DEFAULT_CAPACITY, colliding_hash_fn, TestUtil_equals_fn_int, 0);
+    HashMap_set_compare(map, compare_int);
+    for (int round = 0; round < 2; round++) {
+        for (int i = 0; i < 50; i++) {
+            HashMap_put(map, arena_int(map, i), arena_int(map, i));
+        }
+        TEST_ASSERT_EQUAL_INT(1, map->tree_bins);
+        HashMap_clear(map);
+    }
+}
+
+static void put_ints(const int from, const int to) {
+    for (int i = from; i < to; i++) {
+        HashMap_put(map, TestUtil_allocate_int(i), TestUtil_allocate_int(i * 3));
+    }
+}
+
+static void assert_ints(const int from, const int to) {
+    for (int i = from; i < to; i++) {
+        TEST_ASSERT_EQUAL_INT(i * 3, deref_int(HashMap_get(map, &i)));
+    }
+}
+
+void test_shrink_on_remove(void) {
+    map = HashMap_create(HASHMAP_DEFAULT_CAPACITY, TestUtil_hash_fn_int, TestUtil_equals_fn_int, test_destroy_function_int);
+    const int n = 10000;
+    put_ints(0, n);
+    const size_t peak = map->capacity;
+    for (int i = 0; i < n - 2; i++) {
+        TEST_ASSERT_TRUE(HashMap_remove(map, &i));
+        TEST_ASSERT_TRUE(map->size >= map->shrink_threshold || map->capacity == map->min_capacity);
+    }
+    TEST_ASSERT_TRUE(map->capacity < peak);
+    TEST_ASSERT_EQUAL_INT(HASHMAP_DEFAULT_CAPACITY, map->capacity);
+    TEST_ASSERT_TRUE(map->slots == map->small_slots);
+    assert_ints(n - 2, n);
+}
+
+/** Growing out of the embedded table and back into it, all at once and incrementally */
+void test_small_table(void) {
+    for (size_t step = 0; step < 3; step++) {
+        map = HashMap_create(HASHMAP_DEFAULT_CAPACITY, TestUtil_hash_fn_int, TestUtil_equals_fn_int, test_destroy_function_int);
+        HashMap_set_incremental_resize(map, step);
+        for (int round = 0; round < 3; round++) {
+            put_ints(0, 12);
+            TEST_ASSERT_TRUE(map->slots == map->small_slots);
+            put_ints(12, 100);
+            TEST_ASSERT_TRUE(map->slots != map->small_slots);
+            assert_ints(0, 100);
+            for (int i = 0; i < 98; i++) {
+                TEST_ASSERT_TRUE(HashMap_remove(map, &i));
+            }
+            HashMap_set_incremental_resize(map, 0);
+            TEST_ASSERT_TRUE(map->slots == map->small_slots);
+            assert_ints(98, 100);
+            HashMap_set_incremental_resize(map, step);
+            TEST_ASSERT_TRUE(HashMap_clear(map));
+        }
+        TEST_ASSERT_TRUE(HashMap_destroy(map));
+    }
+    map = NULL;
+}
+
+static int small_entries_in_use(void) {
+    return __builtin_popcount(map->small_entries_used);
+}
+
+/** A map with the default destructor keeps its first entries in itself, through removes, tree bins and clears */
+void test_small_entries(void) {
+    map = HashMap_create(HASHMAP_DEFAULT_CAPACITY, TestUtil_hash_fn_int, TestUtil_equals_fn_int, NULL);
+    for (int round = 0; round < 2; round++) {
+        put_ints(0, HASHMAP_SMALL_ENTRIES);
+        TEST_ASSERT_EQUAL_INT(HASHMAP_SMALL_ENTRIES, small_entries_in_use());
+        TEST_ASSERT_TRUE(map->slots == map->small_slots);
+        put_ints(HASHMAP_SMALL_ENTRIES, 100);
+        assert_ints(0, 100);
+        // Removed entries go back to the map, the next puts take them again
+        for (int i = 0; i < 4; i++) {
+            TEST_ASSERT_TRUE(HashMap_remove(map, &i));
+        }
+        TEST_ASSERT_EQUAL_INT(HASHMAP_SMALL_ENTRIES - 4, small_entries_in_use());
+        put_ints(100, 104);
+        TEST_ASSERT_EQUAL_INT(HASHMAP_SMALL_ENTRIES, small_entries_in_use());
+        assert_ints(4, 104);
+        TEST_ASSERT_TRUE(HashMap_clear(map));
+        TEST_ASSERT_EQUAL_INT(0, small_entries_in_use());
+    }
+    TEST_ASSERT_TRUE(HashMap_destroy(map));
+
+    map = HashMap_create(HASHMAP_DEFAULT_CAPACITY, colliding_hash_fn, TestUtil_equals_fn_int, NULL);
+    HashMap_set_compare(map, compare_int);
+    put_ints(0, 50);
+    TEST_ASSERT_EQUAL_INT(1, map->tree_bins);
+    TEST_ASSERT_EQUAL_INT(HASHMAP_SMALL_ENTRIES, small_entries_in_use());
+    for (int i = 0; i < 50; i += 2) {
+        TEST_ASSERT_TRUE(HashMap_remove(map, &i));
+    }
+    for (int i = 1; i < 50; i += 2) {
+        TEST_ASSERT_EQUAL_INT(i * 3, deref_int(HashMap_get(map, &i)));
+    }
+    TEST_ASSERT_TRUE(HashMap_destroy(map));
+
+    // A destructor of its own may free the entries, so they all come from malloc
+    map = HashMap_create(HASHMAP_DEFAULT_CAPACITY, TestUtil_hash_fn_int, TestUtil_equals_fn_int, test_destroy_function_int);
+    put_ints(0, 4);
+    TEST_ASSERT_EQUAL_INT(0, small_entries_in_use());
+}
+
+void test_shrink_on_remove_incremental(void) {
+    map = HashMap_create(HASHMAP_DEFAULT_CAPACITY, TestUtil_hash_fn_int, TestUtil_equals_fn_int, test_destroy_function_int);
+    HashMap_set_incremental_resize(map, 2);
+    const int n = 2000;
+    put_ints(0, n);
+    for (int i = 0; i < n; i += 2) {
+        TEST_ASSERT_TRUE(HashMap_remove(map, &i));
+    }
+    for (int i = 1; i < n - 100; i += 2) {
+        TEST_ASSERT_TRUE(HashMap_remove(map, &i));
+        TEST_ASSERT_EQUAL_INT(i * 3 + 6, deref_int(HashMap_get(map, &(int) {i + 2})));
+    }
+    HashMap_set_incremental_resize(map, 0);
+    TEST_ASSERT_EQUAL_INT(50, map->size);
+    TEST_ASSERT_EQUAL_INT(256, map->capacity);
+    for (int i = n - 99; i < n; i += 2) {
+        TEST_ASSERT_EQUAL_INT(i * 3, deref_int(HashMap_get(map, &i)));
+    }
+}
+
+static size_t first_keys_colliding_hash_fn(const void *key) {
+    const int i = deref_int(key);
+    return i < 200 ? 1 : (size_t) i;
+}
+
+void test_build_parallel(void) {
+    // Every key shows up twice or three times, the last value must win like with HashMap_put_many
+    const size_t sizes[] = {1000, 200000};
+    for (size_t s = 0; s < 2; s++) {
+        const size_t n = sizes[s];
+        void **keys = malloc(n * sizeof(void *));
+        void **values = malloc(n * sizeof(void *));
+        void **old_values = malloc(n * sizeof(void *));
+        const int distinct = (int) n / 2;
+        for (size_t i = 0; i < n; i++) {
+            keys[i] = TestUtil_allocate_int((int) (i * 7919 % distinct));
+            values[i] = TestUtil_allocate_int((int) i);
+        }
+        map = HashMap_create(HASHMAP_DEFAULT_CAPACITY, TestUtil_hash_fn_int, TestUtil_equals_fn_int, test_destroy_function_int);
+        TEST_ASSERT_TRUE(HashMap_build_parallel(map, keys, values, n, 4, old_values));
+        TEST_ASSERT_EQUAL_INT(distinct, map->size);
+        TEST_ASSERT_EQUAL_INT(HASHMAP_DEFAULT_CAPACITY, map->min_capacity);
+        int *last = malloc(distinct * sizeof(int));
+        for (size_t i = 0; i < n; i++) {
+            last[deref_int(keys[i])] = (int) i;
+        }
+        for (int k = 0; k < distinct; k++) {
+            TEST_ASSERT_EQUAL_INT(last[k], deref_int(HashMap_get(map, &k)));
+        }
+        free(last);
+        // A key that was a duplicate handed back the value it replaced and was not stored, so it is the caller's
+        int freed = 0;
+        for (size_t i = 0; i < n; i++) {
+            if (old_values[i]) {
+                TEST_ASSERT_TRUE(HashMap_get(map, keys[i]) != old_values[i]);
+                free(old_values[i]);
+                free(keys[i]);
+                freed++;
+            }
+        }
+        TEST_ASSERT_EQUAL_INT(n - distinct, freed);
+
+        // Only into an empty map
+        TEST_ASSERT_FALSE(HashMap_build_parallel(map, keys, values, n, 4, old_values));
+        TEST_ASSERT_TRUE(HashMap_destroy(map));
+        free(keys);
+        free(values);
+        free(old_values);
+    }
+
+    // Keys that collide go to a tree bin like they do with HashMap_put_many
+    const size_t n = 40000;
+    void **keys = malloc(n * sizeof(void *));
+    void **values = malloc(n * sizeof(void *));
+    void **old_values = malloc(n * sizeof(void *));
+    for (size_t i = 0; i < n; i++) {
+        keys[i] = TestUtil_allocate_int((int) i);
+        values[i] = TestUtil_allocate_int((int) i);
+    }
+    map = HashMap_create(HASHMAP_DEFAULT_CAPACITY, first_keys_colliding_hash_fn, TestUtil_equals_fn_int,
+                         test_destroy_function_int);
+    HashMap_set_compare(map, compare_int);
+    TEST_ASSERT_TRUE(HashMap_build_parallel(map, keys, values, n, 4, old_values));
+    TEST_ASSERT_EQUAL_INT(n, map->size);
+    TEST_ASSERT_EQUAL_INT(1, map->tree_bins);
+    for (int i = 0; i < (int) n; i += 7) {
+        TEST_ASSERT_EQUAL_INT(i, deref_int(HashMap_get(map, &i)));
+    }
+    TEST_ASSERT_TRUE(HashMap_destroy(map));
+    free(keys);
+    free(values);
+    free(old_values);
+    map = NULL;
+}
+
+void test_reserve(void) {
+    map = HashMap_create(HASHMAP_DEFAULT_CAPACITY, TestUtil_hash_fn_int, TestUtil_equals_fn_int, test_destroy_function_int);
+    TEST_ASSERT_TRUE(HashMap_reserve(map, 1000));
+    const size_t capacity = map->capacity;
+    TEST_ASSERT_EQUAL_INT(2048, capacity);
+    put_ints(0, 1000);
+    TEST_ASSERT_EQUAL_INT(capacity, map->capacity);
+    assert_ints(0, 1000);
+
+    // Reserved capacity is kept through removals and clear
+    for (int i = 0; i < 990; i++) {
+        HashMap_remove(map, &i);
+    }
+    TEST_ASSERT_EQUAL_INT(capacity, map->capacity);
+    HashMap_clear(map);
+    TEST_ASSERT_EQUAL_INT(capacity, map->capacity);
+
+    // Reserving less than there is room for changes nothing
+    TEST_ASSERT_TRUE(HashMap_reserve(map, 10));
+    TEST_ASSERT_EQUAL_INT(capacity, map->capacity);
+    TEST_ASSERT_FALSE(HashMap_reserve(map, SIZE_MAX));
+}
+
+void test_compact(void) {
+    map = HashMap_create(1024, TestUtil_hash_fn_int, TestUtil_equals_fn_int, test_destroy_function_int);
+    HashMap_set_incremental_resize(map, 1);
+    put_ints(0, 2000);
+    for (int i = 0; i < 1900; i++) {
+        HashMap_remove(map, &i);
+    }
+    // Automatic shrinking stops at the capacity the map was created with, compact does not
+    TEST_ASSERT_EQUAL_INT(1024, map->capacity);
+    TEST_ASSERT_TRUE(HashMap_compact(map));
+    TEST_ASSERT_NULL(map->old.slots);
+    TEST_ASSERT_EQUAL_INT(256, map->capacity);
+    TEST_ASSERT_EQUAL_INT(256, map->min_capacity);
+    assert_ints(1900, 2000);
+
+    HashMap_clear(map);
+    TEST_ASSERT_TRUE(HashMap_compact(map));
+    TEST_ASSERT_EQUAL_INT(HASHMAP_MIN_CAPACITY, map->capacity);
+}
+
 int main(void) {
     UNITY_BEGIN();
     RUN_TEST(test_create);
@@ -156,5 +935,35 @@ int main(void) {
     RUN_TEST(test_get_no_resize_required);
     RUN_TEST(test_get_resize_required);
     RUN_TEST(test_remove);
+    RUN_TEST(test_create_small_capacity_rounded_up);
+    RUN_TEST(test_remove_keeps_colliding_entries_reachable);
+    RUN_TEST(test_put_remove_mixed);
+    RUN_TEST(test_clear);
+    RUN_TEST(test_arena_put_get_remove);
+    RUN_TEST(test_arena_clear);
+    RUN_TEST(test_arena_alloc_requires_arena_mode);
+    RUN_TEST(test_incremental_resize);
+    RUN_TEST(test_incremental_resize_with_collisions);
+    RUN_TEST(test_incremental_resize_disable_finishes_migration);
+    RUN_TEST(test_contains_key);
+    RUN_TEST(test_iterator);
+    RUN_TEST(test_iterator_during_migration);
+    RUN_TEST(test_for_each);
+    RUN_TEST(test_keyset_and_values);
+    RUN_TEST(test_get_or_insert_with);
+    RUN_TEST(test_compute);
+    RUN_TEST(test_merge);
+    RUN_TEST(test_put_many_get_many);
+    RUN_TEST(test_seed_differs_per_map);
+    RUN_TEST(test_tree_bins);
+    RUN_TEST(test_tree_bins_incremental_resize);
+    RUN_TEST(test_tree_bins_arena_clear);
+    RUN_TEST(test_shrink_on_remove);
+    RUN_TEST(test_shrink_on_remove_incremental);
+    RUN_TEST(test_small_table);
+    RUN_TEST(test_small_entries);
+    RUN_TEST(test_build_parallel);
+    RUN_TEST(test_reserve);
+    RUN_TEST(test_compact);
     return UNITY_END();
 }
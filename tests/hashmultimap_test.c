@@ -0,0 +1,153 @@
+//
+// Tests for HashMultiMap
+//
+#include <unity.h>
+#include <hashmultimap.h>
+#include <ptr_deref.h>
+
+#include "testutil.h"
+
+static HashMultiMap *multimap;
+
+static void *copy_int(const void *key) {
+    return TestUtil_allocate_int(deref_int(key));
+}
+
+static void put_int(const int key, const int value) {
+    TEST_ASSERT_TRUE(HashMultiMap_put(multimap, &key, copy_int, TestUtil_allocate_int(value)));
+}
+
+/** The values of key are exactly from, from + step, ... below to, in that order */
+static void assert_values(const int key, const int from, const int to, const int step) {
+    size_t count;
+    void *const *values = HashMultiMap_get_all(multimap, &key, &count);
+    size_t expected = 0;
+    for (int v = from; v < to; v += step) {
+        TEST_ASSERT_TRUE(expected < count);
+        TEST_ASSERT_EQUAL_INT(v, deref_int(values[expected]));
+        expected++;
+    }
+    TEST_ASSERT_EQUAL_INT(expected, count);
+    TEST_ASSERT_EQUAL_INT(expected, HashMultiMap_count(multimap, &key));
+}
+
+static bool sum_counts(void *key, void *const *values, size_t count, void *ctx) {
+    (void) key;
+    (void) values;
+    *(size_t *) ctx += count;
+    return true;
+}
+
+void setUp(void) {
+    multimap = HashMultiMap_create(TestUtil_hash_fn_int, TestUtil_equals_fn_int, TestUtil_equals_fn_int, NULL, NULL);
+}
+
+void tearDown(void) {
+    if (multimap) {
+        TEST_ASSERT_TRUE(HashMultiMap_destroy(multimap));
+    }
+}
+
+void test_put_get_all(void) {
+    // Key k gets k values, most keys have one or two like the postings of rare words
+    for (int v = 0; v < 1000; v++) {
+        for (int k = 1; k <= 100; k++) {
+            if (v < k) {
+                put_int(k, v);
+            }
+        }
+    }
+    TEST_ASSERT_EQUAL_INT(100, HashMultiMap_key_count(multimap));
+    TEST_ASSERT_EQUAL_INT(5050, multimap->size);
+    for (int k = 1; k <= 100; k++) {
+        assert_values(k, 0, k, 1);
+    }
+    size_t count = 7;
+    TEST_ASSERT_NULL(HashMultiMap_get_all(multimap, &(int) {0}, &count));
+    TEST_ASSERT_EQUAL_INT(0, count);
+
+    // A single value sits in the node, no block is used for it
+    size_t single;
+    void *const *values = HashMultiMap_get_all(multimap, &(int) {1}, &single);
+    TEST_ASSERT_EQUAL_INT(1, single);
+    TEST_ASSERT_TRUE(values == &((MultiMapNode *) HashMap_get(multimap->map, &(int) {1}))->first);
+
+    size_t total = 0;
+    TEST_ASSERT_TRUE(HashMultiMap_for_each(multimap, sum_counts, &total));
+    TEST_ASSERT_EQUAL_INT(5050, total);
+}
+
+void test_remove_value_and_key(void) {
+    for (int v = 0; v < 10; v++) {
+        put_int(1, v);
+        put_int(2, v);
+    }
+    // Matched by value, the first match goes and the order of the others is kept
+    TEST_ASSERT_TRUE(HashMultiMap_remove_value(multimap, &(int) {1}, &(int) {0}));
+    TEST_ASSERT_FALSE(HashMultiMap_remove_value(multimap, &(int) {1}, &(int) {0}));
+    TEST_ASSERT_FALSE(HashMultiMap_remove_value(multimap, &(int) {3}, &(int) {0}));
+    assert_values(1, 1, 10, 1);
+    for (int v = 1; v < 9; v++) {
+        TEST_ASSERT_TRUE(HashMultiMap_remove_value(multimap, &(int) {1}, &v));
+    }
+    assert_values(1, 9, 10, 1);
+    TEST_ASSERT_TRUE(HashMultiMap_remove_value(multimap, &(int) {1}, &(int) {9}));
+    TEST_ASSERT_EQUAL_INT(0, HashMultiMap_count(multimap, &(int) {1}));
+    TEST_ASSERT_EQUAL_INT(1, HashMultiMap_key_count(multimap));
+
+    TEST_ASSERT_EQUAL_INT(10, HashMultiMap_remove(multimap, &(int) {2}));
+    TEST_ASSERT_EQUAL_INT(0, HashMultiMap_remove(multimap, &(int) {2}));
+    TEST_ASSERT_EQUAL_INT(0, multimap->size);
+
+    // Freed nodes and blocks are handed out again
+    const size_t allocated = multimap->arena->allocated;
+    for (int v = 0; v < 10; v++) {
+        put_int(3, v);
+    }
+    TEST_ASSERT_EQUAL_INT(allocated, multimap->arena->allocated);
+    assert_values(3, 0, 10, 1);
+
+    TEST_ASSERT_TRUE(HashMultiMap_clear(multimap));
+    TEST_ASSERT_EQUAL_INT(0, HashMultiMap_key_count(multimap));
+    put_int(4, 4);
+    assert_values(4, 4, 5, 1);
+}
+
+static int keys_released;
+
+static void counting_key_df(void *key) {
+    keys_released++;
+    free(key);
+}
+
+/** Keys 3 and 13 land in the same slot, and a copy of 13 is a 3 */
+static size_t last_digit_hash_fn(const void *key) {
+    return (size_t) (deref_int(key) % 10);
+}
+
+static void *copy_last_digit(const void *key) {
+    return TestUtil_allocate_int(deref_int(key) % 10);
+}
+
+void test_put_attach_failure(void) {
+    HashMultiMap_destroy(multimap);
+    multimap = HashMultiMap_create(last_digit_hash_fn, TestUtil_equals_fn_int, TestUtil_equals_fn_int, counting_key_df,
+                                   NULL);
+    keys_released = 0;
+    TEST_ASSERT_TRUE(HashMultiMap_put(multimap, &(int) {3}, copy_last_digit, TestUtil_allocate_int(1)));
+    // 13 is not in the map but its copy is, the copy can't be attached and goes to key_df
+    int *value = TestUtil_allocate_int(2);
+    TEST_ASSERT_FALSE(HashMultiMap_put(multimap, &(int) {13}, copy_last_digit, value));
+    TEST_ASSERT_EQUAL_INT(1, keys_released);
+    free(value);
+    TEST_ASSERT_EQUAL_INT(1, HashMultiMap_key_count(multimap));
+    assert_values(3, 1, 2, 1);
+}
+
+int main(void) {
+    UNITY_BEGIN();
+    RUN_TEST(test_put_get_all);
+    RUN_TEST(test_remove_value_and_key);
+    RUN_TEST(test_put_attach_failure);
+    return UNITY_END();
+}
@@ -0,0 +1,139 @@
+//
+// Tests for HashSet
+//
+#include <unity.h>
+#include <hashset.h>
+#include <ptr_deref.h>
+
+#include "testutil.h"
+
+static HashSet *set;
+
+static HashSet *int_set(const int from, const int to) {
+    HashSet *ints = HashSet_create(HASHSET_DEFAULT_CAPACITY, TestUtil_hash_fn_int, TestUtil_equals_fn_int, NULL);
+    for (int i = from; i < to; i++) {
+        TEST_ASSERT_TRUE(HashSet_add(ints, TestUtil_allocate_int(i)));
+    }
+    return ints;
+}
+
+static void *copy_int(const void *key) {
+    return TestUtil_allocate_int(deref_int(key));
+}
+
+void setUp(void) {
+    set = NULL;
+}
+
+void tearDown(void) {
+    if (set) {
+        TEST_ASSERT_TRUE(HashSet_destroy(set));
+    }
+}
+
+void test_add_contains_remove(void) {
+    set = int_set(0, 1000);
+    TEST_ASSERT_EQUAL_INT(1000, set->size);
+    for (int i = 0; i < 1000; i++) {
+        TEST_ASSERT_TRUE(HashSet_contains(set, &i));
+    }
+    int missing = 1000;
+    TEST_ASSERT_FALSE(HashSet_contains(set, &missing));
+
+    // A duplicate is not added and stays with the caller
+    int *duplicate = TestUtil_allocate_int(7);
+    TEST_ASSERT_FALSE(HashSet_add(set, duplicate));
+    TEST_ASSERT_TRUE(HashSet_get(set, duplicate) != duplicate);
+    TEST_ASSERT_EQUAL_INT(7, deref_int(HashSet_get(set, duplicate)));
+    free(duplicate);
+
+    for (int i = 0; i < 1000; i += 2) {
+        TEST_ASSERT_TRUE(HashSet_remove(set, &i));
+    }
+    TEST_ASSERT_FALSE(HashSet_remove(set, &missing));
+    TEST_ASSERT_EQUAL_INT(500, set->size);
+    for (int i = 0; i < 1000; i++) {
+        TEST_ASSERT_EQUAL(i % 2 == 1, HashSet_contains(set, &i));
+    }
+}
+
+void test_shrinks_and_clears(void) {
+    set = int_set(0, 5000);
+    const size_t peak = set->capacity;
+    for (int i = 0; i < 4990; i++) {
+        HashSet_remove(set, &i);
+    }
+    TEST_ASSERT_TRUE(set->capacity < peak);
+    for (int i = 4990; i < 5000; i++) {
+        TEST_ASSERT_TRUE(HashSet_contains(set, &i));
+    }
+    TEST_ASSERT_TRUE(HashSet_clear(set));
+    TEST_ASSERT_EQUAL_INT(0, set->size);
+    TEST_ASSERT_EQUAL_INT(HASHSET_DEFAULT_CAPACITY, set->capacity);
+}
+
+void test_iterator(void) {
+    set = int_set(0, 300);
+    bool seen[300] = {false};
+    HashSetIterator it;
+    HashSet_iter_init(set, &it);
+    size_t count = 0;
+    for (int *key = HashSet_iter_next(&it); key; key = HashSet_iter_next(&it)) {
+        TEST_ASSERT_FALSE(seen[*key]);
+        seen[*key] = true;
+        count++;
+    }
+    TEST_ASSERT_EQUAL_INT(300, count);
+}
+
+void test_add_all(void) {
+    set = int_set(0, 100);
+    HashSet *other = int_set(50, 200);
+    TEST_ASSERT_TRUE(HashSet_add_all(set, other, copy_int));
+    TEST_ASSERT_EQUAL_INT(200, set->size);
+    for (int i = 0; i < 200; i++) {
+        TEST_ASSERT_TRUE(HashSet_contains(set, &i));
+    }
+    // Keys were copied, other still owns its own
+    int key = 150;
+    TEST_ASSERT_TRUE(HashSet_get(set, &key) != HashSet_get(other, &key));
+    HashSet_destroy(other);
+}
+
+void test_retain_all(void) {
+    set = int_set(0, 1000);
+    HashSet *other = int_set(900, 1100);
+    TEST_ASSERT_EQUAL_INT(900, HashSet_retain_all(set, other));
+    TEST_ASSERT_EQUAL_INT(100, set->size);
+    for (int i = 0; i < 1100; i++) {
+        TEST_ASSERT_EQUAL(i >= 900 && i < 1000, HashSet_contains(set, &i));
+    }
+    HashSet_destroy(other);
+}
+
+void test_remove_all(void) {
+    // Both ways round, walking the other set and walking this one
+    set = int_set(0, 1000);
+    HashSet *small = int_set(990, 1010);
+    TEST_ASSERT_EQUAL_INT(10, HashSet_remove_all(set, small));
+    TEST_ASSERT_EQUAL_INT(990, set->size);
+
+    HashSet *large = int_set(0, 2000);
+    HashSet_remove(large, &(int) {5});
+    TEST_ASSERT_EQUAL_INT(989, HashSet_remove_all(set, large));
+    TEST_ASSERT_EQUAL_INT(1, set->size);
+    TEST_ASSERT_TRUE(HashSet_contains(set, &(int) {5}));
+    HashSet_destroy(small);
+    HashSet_destroy(large);
+}
+
+int main(void) {
+    UNITY_BEGIN();
+    RUN_TEST(test_add_contains_remove);
+    RUN_TEST(test_shrinks_and_clears);
+    RUN_TEST(test_iterator);
+    RUN_TEST(test_add_all);
+    RUN_TEST(test_retain_all);
+    RUN_TEST(test_remove_all);
+    return UNITY_END();
+}
@@ -0,0 +1,267 @@
+//
+// Tests for KVStore
+//
+#include <unity.h>
+#include <bstrlib.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <kvstore.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "testutil.h"
+
+static KVStore *store;
+static char dir[] = "/tmp/kvstore_testXXXXXX";
+
+void setUp(void) {
+    strcpy(dir, "/tmp/kvstore_testXXXXXX");
+    TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+    store = KVStore_open(dir, 4096);
+    TEST_ASSERT_NOT_NULL(store);
+}
+
+void tearDown(void) {
+    if (store) {
+        TEST_ASSERT_TRUE(KVStore_close(store));
+    }
+    DIR *d = opendir(dir);
+    struct dirent *dirent;
+    char path[sizeof(dir) + NAME_MAX + 2];
+    while (d && (dirent = readdir(d))) {
+        if (dirent->d_name[0] != '.') {
+            snprintf(path, sizeof(path), "%s/%s", dir, dirent->d_name);
+            unlink(path);
+        }
+    }
+    if (d) {
+        closedir(d);
+    }
+    rmdir(dir);
+}
+
+static void reopen(void) {
+    TEST_ASSERT_TRUE(KVStore_close(store));
+    store = KVStore_open(dir, 4096);
+    TEST_ASSERT_NOT_NULL(store);
+}
+
+static size_t count_files(const char *suffix) {
+    DIR *d = opendir(dir);
+    struct dirent *dirent;
+    size_t count = 0;
+    while ((dirent = readdir(d))) {
+        const size_t len = strlen(dirent->d_name);
+        count += len > strlen(suffix) && strcmp(dirent->d_name + len - strlen(suffix), suffix) == 0;
+    }
+    closedir(d);
+    return count;
+}
+
+static void put_int(const int key, const int value) {
+    char k[32], v[32];
+    snprintf(k, sizeof(k), "key-%d", key);
+    snprintf(v, sizeof(v), "value-%d", value);
+    TEST_ASSERT_TRUE(KVStore_put(store, k, strlen(k), v, strlen(v)));
+}
+
+/** Check the value of key, -1 for a key that must not be in the store */
+static void assert_int(const int key, const int value) {
+    char k[32], v[32];
+    snprintf(k, sizeof(k), "key-%d", key);
+    bstring stored = KVStore_get(store, k, strlen(k));
+    if (value < 0) {
+        TEST_ASSERT_NULL(stored);
+        TEST_ASSERT_FALSE(KVStore_contains(store, k, strlen(k)));
+        return;
+    }
+    snprintf(v, sizeof(v), "value-%d", value);
+    TEST_ASSERT_NOT_NULL(stored);
+    TEST_ASSERT_EQUAL_STRING(v, bdata(stored));
+    TEST_ASSERT_TRUE(KVStore_contains(store, k, strlen(k)));
+    bdestroy(stored);
+}
+
+static bool remove_int(const int key) {
+    char k[32];
+    snprintf(k, sizeof(k), "key-%d", key);
+    return KVStore_remove(store, k, strlen(k));
+}
+
+void test_put_get_remove(void) {
+    for (int i = 0; i < 1000; i++) {
+        put_int(i, i);
+    }
+    TEST_ASSERT_EQUAL_INT(1000, KVStore_size(store));
+    // Enough data for the 4 KiB segments to roll over
+    TEST_ASSERT_TRUE(store->segment_count > 5);
+    for (int i = 0; i < 1000; i += 2) {
+        put_int(i, i * 10);
+    }
+    for (int i = 0; i < 1000; i += 3) {
+        TEST_ASSERT_TRUE(remove_int(i));
+    }
+    TEST_ASSERT_FALSE(remove_int(0));
+    TEST_ASSERT_FALSE(remove_int(5000));
+    for (int i = 0; i < 1000; i++) {
+        assert_int(i, i % 3 == 0 ? -1 : i % 2 == 0 ? i * 10 : i);
+    }
+    TEST_ASSERT_EQUAL_INT(1000 - 334, KVStore_size(store));
+
+    // Empty values and binary keys
+    bstring key = bfromcstr("binary");
+    key->data[3] = '\0';
+    bstring empty = bfromcstr("");
+    TEST_ASSERT_TRUE(KVStore_put_bstring(store, key, empty));
+    bstring stored = KVStore_get_bstring(store, key);
+    TEST_ASSERT_NOT_NULL(stored);
+    TEST_ASSERT_EQUAL_INT(0, stored->slen);
+    bdestroy(stored);
+    TEST_ASSERT_TRUE(KVStore_remove_bstring(store, key));
+    TEST_ASSERT_NULL(KVStore_get_bstring(store, key));
+    bdestroy(key);
+    bdestroy(empty);
+}
+
+void test_reopen(void) {
+    for (int i = 0; i < 500; i++) {
+        put_int(i, i);
+    }
+    for (int i = 0; i < 500; i += 2) {
+        put_int(i, i + 1);
+    }
+    for (int i = 0; i < 500; i += 5) {
+        TEST_ASSERT_TRUE(remove_int(i));
+    }
+    TEST_ASSERT_TRUE(KVStore_sync(store));
+    const size_t files = count_files(".data");
+    reopen();
+    TEST_ASSERT_EQUAL_INT(400, KVStore_size(store));
+    for (int i = 0; i < 500; i++) {
+        assert_int(i, i % 5 == 0 ? -1 : i % 2 == 0 ? i + 1 : i);
+    }
+    // A removed key can come back, and newer writes win over everything loaded
+    put_int(0, 7);
+    put_int(1, 7);
+    reopen();
+    assert_int(0, 7);
+    assert_int(1, 7);
+    TEST_ASSERT_EQUAL_INT(401, KVStore_size(store));
+    // Reopening without writing leaves no empty segments behind, only the active one of the open store
+    reopen();
+    reopen();
+    TEST_ASSERT_EQUAL_INT(files + 2, count_files(".data"));
+}
+
+void test_torn_tail(void) {
+    for (int i = 0; i < 20; i++) {
+        put_int(i, i);
+    }
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%010u.data", dir, store->active->id);
+    const off_t size = (off_t) store->active->size;
+    TEST_ASSERT_TRUE(KVStore_close(store));
+    store = NULL;
+
+    // A write cut short by a crash
+    TEST_ASSERT_EQUAL_INT(0, truncate(path, size - 3));
+    store = KVStore_open(dir, 4096);
+    TEST_ASSERT_NOT_NULL(store);
+    TEST_ASSERT_EQUAL_INT(19, KVStore_size(store));
+    assert_int(18, 18);
+    assert_int(19, -1);
+    TEST_ASSERT_TRUE(KVStore_close(store));
+    store = NULL;
+
+    // A flipped bit fails the CRC, the record and everything after it in the file is ignored
+    const int fd = open(path, O_RDWR);
+    TEST_ASSERT_TRUE(fd >= 0);
+    char byte;
+    const off_t middle = size / 2;
+    TEST_ASSERT_EQUAL_INT(1, pread(fd, &byte, 1, middle));
+    byte ^= 0x10;
+    TEST_ASSERT_EQUAL_INT(1, pwrite(fd, &byte, 1, middle));
+    close(fd);
+    store = KVStore_open(dir, 4096);
+    TEST_ASSERT_NOT_NULL(store);
+    TEST_ASSERT_TRUE(KVStore_size(store) <= 10);
+    assert_int(0, 0);
+    assert_int(18, -1);
+}
+
+void test_merge_removed_after_merge(void) {
+    for (int i = 0; i < 200; i++) {
+        put_int(i, i);
+    }
+    TEST_ASSERT_TRUE(KVStore_merge(store));
+    // The merge output got an id above the active segment, which now takes the tombstone
+    uint32_t max_id = 0;
+    for (size_t i = 0; i < store->segment_count; i++) {
+        max_id = store->segments[i]->id > max_id ? store->segments[i]->id : max_id;
+    }
+    TEST_ASSERT_TRUE(store->active->id < max_id);
+    TEST_ASSERT_TRUE(remove_int(5));
+    // Roll the segment with the tombstone over, the next merge drops the tombstone and the copy of the key
+    for (int i = 200; i < 400; i++) {
+        put_int(i, i);
+    }
+    TEST_ASSERT_TRUE(KVStore_merge(store));
+    reopen();
+    TEST_ASSERT_EQUAL_INT(399, KVStore_size(store));
+    for (int i = 0; i < 400; i++) {
+        assert_int(i, i == 5 ? -1 : i);
+    }
+}
+
+void test_merge(void) {
+    // Every key written many times over, so most records are garbage
+    for (int round = 0; round < 10; round++) {
+        for (int i = 0; i < 200; i++) {
+            put_int(i, round * 1000 + i);
+        }
+    }
+    for (int i = 0; i < 200; i += 4) {
+        TEST_ASSERT_TRUE(remove_int(i));
+    }
+    const size_t before = store->segment_count;
+    TEST_ASSERT_TRUE(KVStore_merge(store));
+    TEST_ASSERT_TRUE(store->segment_count < before / 3);
+    TEST_ASSERT_EQUAL_INT(store->segment_count - 1, count_files(".hint"));
+    TEST_ASSERT_EQUAL_INT(150, KVStore_size(store));
+    for (int i = 0; i < 200; i++) {
+        assert_int(i, i % 4 == 0 ? -1 : 9000 + i);
+    }
+
+    // The merged segments load from their hint files, the removed keys stay removed
+    put_int(1, 1);
+    reopen();
+    TEST_ASSERT_EQUAL_INT(150, KVStore_size(store));
+    for (int i = 0; i < 200; i++) {
+        assert_int(i, i % 4 == 0 ? -1 : i == 1 ? 1 : 9000 + i);
+    }
+
+    // Merging merged segments again keeps everything
+    for (int i = 0; i < 200; i += 4) {
+        put_int(i, i);
+    }
+    TEST_ASSERT_TRUE(KVStore_merge(store));
+    reopen();
+    TEST_ASSERT_TRUE(KVStore_merge(store));
+    TEST_ASSERT_EQUAL_INT(200, KVStore_size(store));
+    for (int i = 0; i < 200; i++) {
+        assert_int(i, i % 4 == 0 ? i : i == 1 ? 1 : 9000 + i);
+    }
+}
+
+int main(void) {
+    UNITY_BEGIN();
+    RUN_TEST(test_put_get_remove);
+    RUN_TEST(test_reopen);
+    RUN_TEST(test_torn_tail);
+    RUN_TEST(test_merge);
+    RUN_TEST(test_merge_removed_after_merge);
+    return UNITY_END();
+}
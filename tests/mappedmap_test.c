@@ -0,0 +1,112 @@
+//
+// Tests for saving HashMaps and mapping them back in
+//
+#include <unity.h>
+#include <bstrlib.h>
+#include <mappedmap.h>
+#include <ptr_deref.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "testutil.h"
+
+static HashMap *map;
+static char path[] = "/tmp/mappedmap_testXXXXXX";
+
+static size_t hash_cstr(const void *key) {
+    return Commons_hash_fn_cstr(key);
+}
+
+void setUp(void) {
+    map = HashMap_create(HASHMAP_DEFAULT_CAPACITY, hash_cstr, TestUtil_equals_fn_string, NULL);
+    strcpy(path, "/tmp/mappedmap_testXXXXXX");
+    const int fd = mkstemp(path);
+    TEST_ASSERT_TRUE(fd >= 0);
+    close(fd);
+}
+
+void tearDown(void) {
+    HashMap_destroy(map);
+    unlink(path);
+}
+
+static void put_words(const int n) {
+    char word[32];
+    for (int i = 0; i < n; i++) {
+        snprintf(word, sizeof(word), "word-%d", i);
+        HashMap_put(map, TestUtil_allocate_string(word), TestUtil_allocate_int(i * 3));
+    }
+}
+
+void test_save_and_open(void) {
+    const int n = 5000;
+    put_words(n);
+    TEST_ASSERT_TRUE(HashMap_save(map, path, &MapCodec_cstr, &MapCodec_int));
+
+    MappedMap *mapped = HashMap_open_mapped(path);
+    TEST_ASSERT_NOT_NULL(mapped);
+    TEST_ASSERT_EQUAL_INT(n, MappedMap_size(mapped));
+
+    char word[32];
+    for (int i = 0; i < n; i++) {
+        snprintf(word, sizeof(word), "word-%d", i);
+        size_t value_len = 0;
+        const int *value = MappedMap_get_with(mapped, word, &MapCodec_cstr, &value_len);
+        TEST_ASSERT_NOT_NULL(value);
+        TEST_ASSERT_EQUAL_INT(sizeof(int), value_len);
+        TEST_ASSERT_EQUAL_INT(i * 3, *value);
+        TEST_ASSERT_EQUAL_INT(0, (uintptr_t) value % 8);
+    }
+    // Raw lookups take the encoded key, the codec stores the terminator
+    TEST_ASSERT_EQUAL_INT(21, deref_int(MappedMap_get(mapped, "word-7", 7, NULL)));
+    TEST_ASSERT_NULL(MappedMap_get(mapped, "word-7", 6, NULL));
+    TEST_ASSERT_NULL(MappedMap_get_with(mapped, "missing", &MapCodec_cstr, NULL));
+    TEST_ASSERT_TRUE(MappedMap_close(mapped));
+}
+
+void test_empty_map(void) {
+    TEST_ASSERT_TRUE(HashMap_save(map, path, &MapCodec_cstr, &MapCodec_int));
+    MappedMap *mapped = HashMap_open_mapped(path);
+    TEST_ASSERT_NOT_NULL(mapped);
+    TEST_ASSERT_EQUAL_INT(0, MappedMap_size(mapped));
+    TEST_ASSERT_NULL(MappedMap_get_with(mapped, "anything", &MapCodec_cstr, NULL));
+    MappedMap_close(mapped);
+}
+
+void test_bstring_values(void) {
+    HashMap_put(map, TestUtil_allocate_string("greeting"), bfromcstr("hello"));
+    TEST_ASSERT_TRUE(HashMap_save(map, path, &MapCodec_cstr, &MapCodec_bstring));
+    // The bstring has to go before the map's default destructor frees it as plain memory
+    bstring value = HashMap_put(map, "greeting", TestUtil_allocate_int(0));
+    bdestroy(value);
+
+    MappedMap *mapped = HashMap_open_mapped(path);
+    size_t len = 0;
+    const char *mapped_value = MappedMap_get_with(mapped, "greeting", &MapCodec_cstr, &len);
+    TEST_ASSERT_EQUAL_INT(5, len);
+    TEST_ASSERT_EQUAL_MEMORY("hello", mapped_value, 5);
+    MappedMap_close(mapped);
+}
+
+void test_rejects_invalid_files(void) {
+    FILE *file = fopen(path, "wb");
+    fputs("definitely not a map file, but long enough to hold a header of sixty four bytes", file);
+    fclose(file);
+    TEST_ASSERT_NULL(HashMap_open_mapped(path));
+
+    put_words(10);
+    TEST_ASSERT_TRUE(HashMap_save(map, path, &MapCodec_cstr, &MapCodec_int));
+    // Truncated files no longer match the size in the header
+    TEST_ASSERT_EQUAL_INT(0, truncate(path, 200));
+    TEST_ASSERT_NULL(HashMap_open_mapped(path));
+    TEST_ASSERT_NULL(HashMap_open_mapped("/tmp/this/path/does/not/exist"));
+}
+
+int main(void) {
+    UNITY_BEGIN();
+    RUN_TEST(test_save_and_open);
+    RUN_TEST(test_empty_map);
+    RUN_TEST(test_bstring_values);
+    RUN_TEST(test_rejects_invalid_files);
+    return UNITY_END();
+}
@@ -0,0 +1,143 @@
+//
+// Tests for OrderedMap
+//
+#include <unity.h>
+#include <orderedmap.h>
+#include <ptr_deref.h>
+
+#include "testutil.h"
+
+static OrderedMap *map;
+static int released;
+
+static void counting_df(void *map_entry) {
+    MapEntry *entry = map_entry;
+    released++;
+    free(entry->key);
+    free(entry->value);
+}
+
+static void put_ints(const int from, const int to) {
+    for (int i = from; i < to; i++) {
+        TEST_ASSERT_NULL(OrderedMap_put(map, TestUtil_allocate_int(i), TestUtil_allocate_int(i)));
+    }
+}
+
+/** Keys in iteration order, n of them are expected */
+static void assert_order(const int *expected, const int n) {
+    size_t cursor = 0;
+    void *key;
+    void *value;
+    int i = 0;
+    while (OrderedMap_next(map, &cursor, &key, &value)) {
+        TEST_ASSERT_TRUE(i < n);
+        TEST_ASSERT_EQUAL_INT(expected[i], deref_int(key));
+        i++;
+    }
+    TEST_ASSERT_EQUAL_INT(n, i);
+    TEST_ASSERT_EQUAL_INT(n, map->size);
+}
+
+static bool stop_at_three(void *key, void *value, void *ctx) {
+    (void) value;
+    (*(int *) ctx)++;
+    return deref_int(key) != 3;
+}
+
+void setUp(void) {
+    released = 0;
+    map = OrderedMap_create(ORDEREDMAP_DEFAULT_CAPACITY, TestUtil_hash_fn_int, TestUtil_equals_fn_int, counting_df);
+}
+
+void tearDown(void) {
+    if (map) {
+        TEST_ASSERT_TRUE(OrderedMap_destroy(map));
+    }
+}
+
+void test_put_get_remove(void) {
+    put_ints(0, 100000);
+    TEST_ASSERT_EQUAL_INT(100000, map->size);
+    // Past 2^16 entries the index is 4 bytes wide
+    TEST_ASSERT_EQUAL_INT(4, map->index_width);
+    for (int i = 0; i < 100000; i++) {
+        TEST_ASSERT_EQUAL_INT(i, deref_int(OrderedMap_get(map, &i)));
+    }
+    TEST_ASSERT_NULL(OrderedMap_get(map, &(int) {100000}));
+    for (int i = 0; i < 100000; i += 2) {
+        TEST_ASSERT_TRUE(OrderedMap_remove(map, &i));
+    }
+    TEST_ASSERT_FALSE(OrderedMap_remove(map, &(int) {0}));
+    TEST_ASSERT_EQUAL_INT(50000, map->size);
+    TEST_ASSERT_EQUAL_INT(50000, released);
+    for (int i = 0; i < 100000; i++) {
+        TEST_ASSERT_EQUAL(i % 2 == 1, OrderedMap_contains(map, &i));
+    }
+    // Shrinking back down narrows the index again
+    for (int i = 1; i < 100000; i += 2) {
+        if (i > 99) {
+            TEST_ASSERT_TRUE(OrderedMap_remove(map, &i));
+        }
+    }
+    TEST_ASSERT_EQUAL_INT(1, map->index_width);
+    int expected[50];
+    for (int i = 0; i < 50; i++) {
+        expected[i] = 2 * i + 1;
+    }
+    assert_order(expected, 50);
+}
+
+void test_insertion_order(void) {
+    put_ints(0, 5);
+    assert_order((int[]) {0, 1, 2, 3, 4}, 5);
+
+    // Replacing a value keeps the position, removing and putting again moves the key to the end
+    int *key = TestUtil_allocate_int(1);
+    int *old = OrderedMap_put(map, key, TestUtil_allocate_int(10));
+    TEST_ASSERT_EQUAL_INT(1, deref_int(old));
+    // Like with HashMap_put the map keeps the key it has, the one passed in stays with the caller
+    free(key);
+    free(old);
+    TEST_ASSERT_EQUAL_INT(0, released);
+    TEST_ASSERT_TRUE(OrderedMap_remove(map, &(int) {2}));
+    put_ints(2, 3);
+    assert_order((int[]) {0, 1, 3, 4, 2}, 5);
+    TEST_ASSERT_EQUAL_INT(10, deref_int(OrderedMap_get(map, &(int) {1})));
+
+    int visited = 0;
+    TEST_ASSERT_FALSE(OrderedMap_for_each(map, stop_at_three, &visited));
+    TEST_ASSERT_EQUAL_INT(3, visited);
+
+    TEST_ASSERT_TRUE(OrderedMap_clear(map));
+    TEST_ASSERT_TRUE(OrderedMap_is_empty(map));
+    put_ints(7, 9);
+    assert_order((int[]) {7, 8}, 2);
+}
+
+/** A map that keeps the same size while keys come and go reuses its holes instead of growing */
+void test_churn_keeps_order_and_capacity(void) {
+    put_ints(0, 10);
+    const size_t capacity = map->capacity;
+    for (int i = 10; i < 10000; i++) {
+        const int gone = i - 10;
+        TEST_ASSERT_TRUE(OrderedMap_remove(map, &gone));
+        put_ints(i, i + 1);
+    }
+    TEST_ASSERT_EQUAL_INT(capacity, map->capacity);
+    int expected[10];
+    for (int i = 0; i < 10; i++) {
+        expected[i] = 9990 + i;
+    }
+    assert_order(expected, 10);
+    for (int i = 9990; i < 10000; i++) {
+        TEST_ASSERT_EQUAL_INT(i, deref_int(OrderedMap_get(map, &i)));
+    }
+}
+
+int main(void) {
+    UNITY_BEGIN();
+    RUN_TEST(test_put_get_remove);
+    RUN_TEST(test_insertion_order);
+    RUN_TEST(test_churn_keeps_order_and_capacity);
+    return UNITY_END();
+}
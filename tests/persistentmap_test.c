@@ -0,0 +1,159 @@
+//
+// Tests for PersistentMap
+//
+#include <unity.h>
+#include <persistentmap.h>
+#include <ptr_deref.h>
+
+#include "testutil.h"
+
+static PersistentMap *empty;
+static int released;
+
+static void counting_df(void *map_entry) {
+    MapEntry *entry = map_entry;
+    released++;
+    free(entry->key);
+    free(entry->value);
+}
+
+/** Puts every odd key and every key in steps of 16 in the same bucket */
+static size_t colliding_hash_fn(const void *key) {
+    const int i = deref_int(key);
+    return i % 2 ? 1 : (size_t) (i / 16);
+}
+
+/** map with key set to value, map itself is released */
+static PersistentMap *assoc_int(PersistentMap *map, const int key, const int value) {
+    PersistentMap *next = PersistentMap_assoc(map, TestUtil_allocate_int(key), TestUtil_allocate_int(value));
+    TEST_ASSERT_NOT_NULL(next);
+    PersistentMap_release(map);
+    return next;
+}
+
+static PersistentMap *dissoc_int(PersistentMap *map, const int key) {
+    PersistentMap *next = PersistentMap_dissoc(map, &key);
+    TEST_ASSERT_NOT_NULL(next);
+    PersistentMap_release(map);
+    return next;
+}
+
+static bool sum_values(void *key, void *value, void *ctx) {
+    (void) key;
+    *(long *) ctx += deref_int(value);
+    return true;
+}
+
+void setUp(void) {
+    released = 0;
+    empty = PersistentMap_create(TestUtil_hash_fn_int, TestUtil_equals_fn_int, counting_df);
+}
+
+void tearDown(void) {
+}
+
+void test_assoc_get_dissoc(void) {
+    PersistentMap *map = PersistentMap_retain(empty);
+    for (int i = 0; i < 10000; i++) {
+        map = assoc_int(map, i, i * 2);
+    }
+    TEST_ASSERT_EQUAL_INT(10000, PersistentMap_size(map));
+    TEST_ASSERT_EQUAL_INT(0, PersistentMap_size(empty));
+    for (int i = 0; i < 10000; i++) {
+        TEST_ASSERT_EQUAL_INT(i * 2, deref_int(PersistentMap_get(map, &i)));
+    }
+    TEST_ASSERT_NULL(PersistentMap_get(map, &(int) {10000}));
+    TEST_ASSERT_FALSE(PersistentMap_contains(empty, &(int) {1}));
+
+    long sum = 0;
+    TEST_ASSERT_TRUE(PersistentMap_for_each(map, sum_values, &sum));
+    TEST_ASSERT_EQUAL_INT(9999L * 10000, sum);
+
+    for (int i = 0; i < 10000; i += 2) {
+        map = dissoc_int(map, i);
+    }
+    // Missing keys give back the same version
+    PersistentMap *same = PersistentMap_dissoc(map, &(int) {0});
+    TEST_ASSERT_TRUE(same == map);
+    PersistentMap_release(same);
+    TEST_ASSERT_EQUAL_INT(5000, PersistentMap_size(map));
+    for (int i = 0; i < 10000; i++) {
+        TEST_ASSERT_EQUAL(i % 2 == 1, PersistentMap_contains(map, &i));
+    }
+    TEST_ASSERT_EQUAL_INT(5000, released);
+
+    for (int i = 1; i < 10000; i += 2) {
+        map = dissoc_int(map, i);
+    }
+    TEST_ASSERT_EQUAL_INT(0, PersistentMap_size(map));
+    TEST_ASSERT_NULL(map->root);
+    TEST_ASSERT_EQUAL_INT(10000, released);
+    PersistentMap_release(map);
+    PersistentMap_release(empty);
+}
+
+void test_versions_are_independent(void) {
+    PersistentMap *v1 = PersistentMap_retain(empty);
+    for (int i = 0; i < 100; i++) {
+        v1 = assoc_int(v1, i, i);
+    }
+    PersistentMap *snapshot = PersistentMap_retain(v1);
+    PersistentMap *v2 = PersistentMap_retain(v1);
+    v2 = assoc_int(v2, 5, 500);
+    v2 = assoc_int(v2, 1000, 1000);
+    v2 = dissoc_int(v2, 7);
+
+    TEST_ASSERT_EQUAL_INT(100, PersistentMap_size(v1));
+    TEST_ASSERT_EQUAL_INT(5, deref_int(PersistentMap_get(v1, &(int) {5})));
+    TEST_ASSERT_TRUE(PersistentMap_contains(v1, &(int) {7}));
+    TEST_ASSERT_FALSE(PersistentMap_contains(v1, &(int) {1000}));
+    TEST_ASSERT_EQUAL_INT(100, PersistentMap_size(v2));
+    TEST_ASSERT_EQUAL_INT(500, deref_int(PersistentMap_get(v2, &(int) {5})));
+    TEST_ASSERT_FALSE(PersistentMap_contains(v2, &(int) {7}));
+    TEST_ASSERT_EQUAL_INT(0, released);
+
+    // Both old leaves still belong to v1
+    PersistentMap_release(v2);
+    TEST_ASSERT_EQUAL_INT(2, released);
+    PersistentMap_release(v1);
+    TEST_ASSERT_EQUAL_INT(2, released);
+    TEST_ASSERT_EQUAL_INT(7, deref_int(PersistentMap_get(snapshot, &(int) {7})));
+    PersistentMap_release(snapshot);
+    TEST_ASSERT_EQUAL_INT(102, released);
+    PersistentMap_release(empty);
+}
+
+void test_collisions(void) {
+    PersistentMap_release(empty);
+    empty = PersistentMap_create(colliding_hash_fn, TestUtil_equals_fn_int, counting_df);
+    PersistentMap *map = PersistentMap_retain(empty);
+    for (int i = 0; i < 500; i++) {
+        map = assoc_int(map, i, i);
+    }
+    map = assoc_int(map, 3, 33);
+    TEST_ASSERT_EQUAL_INT(500, PersistentMap_size(map));
+    for (int i = 0; i < 500; i++) {
+        TEST_ASSERT_EQUAL_INT(i == 3 ? 33 : i, deref_int(PersistentMap_get(map, &i)));
+    }
+    for (int i = 0; i < 500; i += 3) {
+        map = dissoc_int(map, i);
+    }
+    for (int i = 0; i < 500; i++) {
+        TEST_ASSERT_EQUAL(i % 3 != 0, PersistentMap_contains(map, &i));
+    }
+    for (int i = 0; i < 500; i++) {
+        map = dissoc_int(map, i);
+    }
+    TEST_ASSERT_NULL(map->root);
+    TEST_ASSERT_EQUAL_INT(501, released);
+    PersistentMap_release(map);
+    PersistentMap_release(empty);
+}
+
+int main(void) {
+    UNITY_BEGIN();
+    RUN_TEST(test_assoc_get_dissoc);
+    RUN_TEST(test_versions_are_independent);
+    RUN_TEST(test_collisions);
+    return UNITY_END();
+}
@@ -0,0 +1,157 @@
+//
+// Tests for the read mostly SnapshotMap
+//
+#include <unity.h>
+#include <snapshotmap.h>
+#include <ptr_deref.h>
+#include <pthread.h>
+
+#include "testutil.h"
+
+#define N_READERS 4
+#define N_KEYS 512
+#define N_WRITES 2000
+
+static SnapshotMap *map;
+static int destroyed;
+
+static void counting_df(void *entry) {
+    __atomic_add_fetch(&destroyed, 1, __ATOMIC_RELAXED);
+    Commons_map_entry_destroy(entry);
+}
+
+void setUp(void) {
+    destroyed = 0;
+    map = SnapshotMap_create(HASHMAP_DEFAULT_CAPACITY, N_READERS + 1, TestUtil_hash_fn_int, TestUtil_equals_fn_int,
+                             counting_df);
+}
+
+void tearDown(void) {
+    if (map) {
+        TEST_ASSERT_TRUE(SnapshotMap_destroy(map));
+    }
+}
+
+void test_create(void) {
+    TEST_ASSERT_NOT_NULL(map);
+    TEST_ASSERT_EQUAL_INT(0, SnapshotMap_size(map));
+    TEST_ASSERT_EQUAL_INT(0, (uintptr_t) map->readers % SNAPSHOTMAP_CACHE_LINE);
+    TEST_ASSERT_EQUAL_INT(0, sizeof(SnapshotReader) % SNAPSHOTMAP_CACHE_LINE);
+
+    SnapshotReader *readers[N_READERS + 1];
+    for (int i = 0; i < N_READERS + 1; i++) {
+        readers[i] = SnapshotMap_register_reader(map);
+        TEST_ASSERT_NOT_NULL(readers[i]);
+    }
+    TEST_ASSERT_NULL(SnapshotMap_register_reader(map));
+    SnapshotMap_unregister_reader(map, readers[2]);
+    TEST_ASSERT_EQUAL_PTR(readers[2], SnapshotMap_register_reader(map));
+}
+
+void test_put_get_remove(void) {
+    SnapshotReader *reader = SnapshotMap_register_reader(map);
+    for (int i = 0; i < 100; i++) {
+        TEST_ASSERT_TRUE(SnapshotMap_put(map, TestUtil_allocate_int(i), TestUtil_allocate_int(i * 2)));
+    }
+    TEST_ASSERT_EQUAL_INT(100, SnapshotMap_size(map));
+
+    SnapshotMap_enter(map, reader);
+    for (int i = 0; i < 100; i++) {
+        TEST_ASSERT_EQUAL_INT(i * 2, deref_int(SnapshotMap_get(map, &i)));
+    }
+    SnapshotMap_exit(reader);
+
+    int key = 10;
+    TEST_ASSERT_TRUE(SnapshotMap_put(map, TestUtil_allocate_int(key), TestUtil_allocate_int(-1)));
+    TEST_ASSERT_EQUAL_INT(100, SnapshotMap_size(map));
+    TEST_ASSERT_EQUAL_INT(1, destroyed);
+
+    SnapshotMap_enter(map, reader);
+    TEST_ASSERT_EQUAL_INT(-1, deref_int(SnapshotMap_get(map, &key)));
+    SnapshotMap_exit(reader);
+
+    TEST_ASSERT_TRUE(SnapshotMap_remove(map, &key));
+    TEST_ASSERT_FALSE(SnapshotMap_remove(map, &key));
+    TEST_ASSERT_EQUAL_INT(99, SnapshotMap_size(map));
+    TEST_ASSERT_EQUAL_INT(2, destroyed);
+    TEST_ASSERT_NULL(SnapshotMap_get(map, &key));
+}
+
+void test_reclaim_waits_for_readers(void) {
+    SnapshotReader *reader = SnapshotMap_register_reader(map);
+    int key = 1;
+    SnapshotMap_put(map, TestUtil_allocate_int(key), TestUtil_allocate_int(1));
+
+    SnapshotMap_enter(map, reader);
+    int *seen = SnapshotMap_get(map, &key);
+    SnapshotMap_put(map, TestUtil_allocate_int(key), TestUtil_allocate_int(2));
+    SnapshotMap_remove(map, &key);
+
+    // The reader still holds the first value, nothing it could see may be freed yet
+    TEST_ASSERT_EQUAL_INT(0, destroyed);
+    TEST_ASSERT_EQUAL_INT(1, deref_int(seen));
+    TEST_ASSERT_NULL(SnapshotMap_get(map, &key));
+    SnapshotMap_exit(reader);
+
+    SnapshotMap_reclaim(map);
+    TEST_ASSERT_EQUAL_INT(2, destroyed);
+    TEST_ASSERT_NULL(map->retired);
+}
+
+static bool stop;
+
+static void *reader_thread(void *arg) {
+    (void) arg;
+    SnapshotReader *reader = SnapshotMap_register_reader(map);
+    long checked = 0;
+    while (!__atomic_load_n(&stop, __ATOMIC_ACQUIRE)) {
+        SnapshotMap_enter(map, reader);
+        for (int i = 0; i < N_KEYS; i++) {
+            const int *value = SnapshotMap_get(map, &i);
+            // Values are always key + a multiple of N_KEYS, a torn or freed value breaks that
+            if (value && (*value - i) % N_KEYS != 0) {
+                SnapshotMap_exit(reader);
+                SnapshotMap_unregister_reader(map, reader);
+                return (void *) -1;
+            }
+            checked++;
+        }
+        SnapshotMap_exit(reader);
+    }
+    SnapshotMap_unregister_reader(map, reader);
+    return (void *) checked;
+}
+
+void test_concurrent_readers(void) {
+    stop = false;
+    pthread_t threads[N_READERS];
+    for (int t = 0; t < N_READERS; t++) {
+        TEST_ASSERT_EQUAL_INT(0, pthread_create(&threads[t], NULL, reader_thread, NULL));
+    }
+    for (int w = 0; w < N_WRITES; w++) {
+        const int key = w % N_KEYS;
+        if (w % 7 == 0) {
+            SnapshotMap_remove(map, &key);
+        } else {
+            SnapshotMap_put(map, TestUtil_allocate_int(key), TestUtil_allocate_int(key + w / N_KEYS * N_KEYS));
+        }
+    }
+    __atomic_store_n(&stop, true, __ATOMIC_RELEASE);
+    for (int t = 0; t < N_READERS; t++) {
+        void *result;
+        pthread_join(threads[t], &result);
+        TEST_ASSERT_NOT_EQUAL((intptr_t) -1, (intptr_t) result);
+    }
+
+    SnapshotMap_reclaim(map);
+    TEST_ASSERT_NULL(map->retired);
+}
+
+int main(void) {
+    UNITY_BEGIN();
+    RUN_TEST(test_create);
+    RUN_TEST(test_put_get_remove);
+    RUN_TEST(test_reclaim_waits_for_readers);
+    RUN_TEST(test_concurrent_readers);
+    return UNITY_END();
+}
@@ -0,0 +1,164 @@
+//
+// Tests for StrMap
+//
+#include <unity.h>
+#include <strmap.h>
+#include <ptr_deref.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "testutil.h"
+
+static StrMap *map;
+
+/** Key i, padded to at least min_len bytes so the same numbers can be tried inline and in the arena */
+static size_t make_key(char *buf, const int i, const size_t min_len) {
+    size_t len = (size_t) snprintf(buf, 64, "key-%d", i);
+    while (len < min_len) {
+        buf[len] = (char) ('a' + len % 26);
+        len++;
+    }
+    return len;
+}
+
+static void put_keys(const int from, const int to, const size_t min_len) {
+    char buf[64];
+    for (int i = from; i < to; i++) {
+        const size_t len = make_key(buf, i, min_len);
+        TEST_ASSERT_NULL(StrMap_put(map, buf, len, TestUtil_allocate_int(i)));
+    }
+}
+
+static bool sum_values(const char *key, size_t len, void *value, void *ctx) {
+    (void) key;
+    (void) len;
+    *(long *) ctx += deref_int(value);
+    return true;
+}
+
+void setUp(void) {
+    map = StrMap_create(STRMAP_DEFAULT_CAPACITY, NULL);
+}
+
+void tearDown(void) {
+    if (map) {
+        TEST_ASSERT_TRUE(StrMap_destroy(map));
+    }
+}
+
+void test_put_get_remove(void) {
+    // Short keys stay in the slots, long ones go to the arena
+    const size_t lengths[] = {0, STRMAP_INLINE_KEY, 40};
+    for (size_t l = 0; l < 3; l++) {
+        put_keys(0, 1000, lengths[l]);
+        TEST_ASSERT_EQUAL_INT(1000, map->size);
+        TEST_ASSERT_EQUAL(lengths[l] > STRMAP_INLINE_KEY, map->keys != NULL && map->keys->allocated > 0);
+        char buf[64];
+        for (int i = 0; i < 1000; i++) {
+            const size_t len = make_key(buf, i, lengths[l]);
+            TEST_ASSERT_EQUAL_INT(i, deref_int(StrMap_get(map, buf, len)));
+            // A prefix or an extension of a key is a different key, unpadded "key-1" is a prefix of "key-10"
+            if (lengths[l] > 0) {
+                TEST_ASSERT_FALSE(StrMap_contains(map, buf, len - 1));
+            }
+            buf[len] = 'x';
+            TEST_ASSERT_FALSE(StrMap_contains(map, buf, len + 1));
+        }
+        for (int i = 0; i < 1000; i += 2) {
+            const size_t len = make_key(buf, i, lengths[l]);
+            TEST_ASSERT_TRUE(StrMap_remove(map, buf, len));
+            TEST_ASSERT_FALSE(StrMap_remove(map, buf, len));
+        }
+        TEST_ASSERT_EQUAL_INT(500, map->size);
+        for (int i = 0; i < 1000; i++) {
+            const size_t len = make_key(buf, i, lengths[l]);
+            TEST_ASSERT_EQUAL(i % 2 == 1, StrMap_contains(map, buf, len));
+        }
+        TEST_ASSERT_TRUE(StrMap_clear(map));
+        TEST_ASSERT_EQUAL_INT(0, map->size);
+    }
+}
+
+void test_replace_and_empty_key(void) {
+    TEST_ASSERT_NULL(StrMap_put(map, "", 0, TestUtil_allocate_int(1)));
+    int *old = StrMap_put(map, NULL, 0, TestUtil_allocate_int(2));
+    TEST_ASSERT_EQUAL_INT(1, deref_int(old));
+    free(old);
+    TEST_ASSERT_EQUAL_INT(1, map->size);
+    TEST_ASSERT_EQUAL_INT(2, deref_int(StrMap_get(map, "", 0)));
+
+    // The key is copied, the caller's buffer can go away
+    char key[] = "a key that is much longer than the inline limit";
+    TEST_ASSERT_NULL(StrMap_put(map, key, strlen(key), TestUtil_allocate_int(3)));
+    old = StrMap_put(map, key, strlen(key), TestUtil_allocate_int(4));
+    TEST_ASSERT_EQUAL_INT(3, deref_int(old));
+    free(old);
+    memset(key, 'z', strlen(key));
+    TEST_ASSERT_NULL(StrMap_get(map, key, strlen(key)));
+    TEST_ASSERT_EQUAL_INT(4, deref_int(StrMap_get(map, "a key that is much longer than the inline limit", 47)));
+
+    // Embedded zero bytes are part of the key
+    TEST_ASSERT_NULL(StrMap_put(map, "a\0b", 3, TestUtil_allocate_int(5)));
+    TEST_ASSERT_NULL(StrMap_get(map, "a\0c", 3));
+    TEST_ASSERT_NULL(StrMap_get(map, "a", 1));
+    TEST_ASSERT_EQUAL_INT(5, deref_int(StrMap_get(map, "a\0b", 3)));
+
+    long sum = 0;
+    TEST_ASSERT_TRUE(StrMap_for_each(map, sum_values, &sum));
+    TEST_ASSERT_EQUAL_INT(11, sum);
+}
+
+void test_bstring_keys(void) {
+    bstring key = bfromcstr("bstring key");
+    TEST_ASSERT_NULL(StrMap_put_bstring(map, key, TestUtil_allocate_int(7)));
+    TEST_ASSERT_EQUAL_INT(7, deref_int(StrMap_get(map, "bstring key", 11)));
+    TEST_ASSERT_TRUE(StrMap_contains_bstring(map, key));
+    TEST_ASSERT_EQUAL_INT(7, deref_int(StrMap_get_bstring(map, key)));
+    TEST_ASSERT_TRUE(StrMap_remove_bstring(map, key));
+    TEST_ASSERT_TRUE(StrMap_is_empty(map));
+    bdestroy(key);
+}
+
+void test_dead_long_keys_are_reclaimed(void) {
+    // Churn through far more long keys than are ever live at once, the arena must not keep all of them
+    char buf[64];
+    for (int round = 0; round < 50; round++) {
+        put_keys(round * 1000, round * 1000 + 1000, 40);
+        for (int i = round * 1000; i < round * 1000 + 1000; i++) {
+            TEST_ASSERT_TRUE(StrMap_remove(map, buf, make_key(buf, i, 40)));
+        }
+    }
+    TEST_ASSERT_EQUAL_INT(0, map->size);
+    TEST_ASSERT_TRUE(map->keys->allocated < 50 * 1000 * 48 / 4);
+
+    put_keys(0, 2000, 40);
+    for (int i = 0; i < 2000; i++) {
+        TEST_ASSERT_EQUAL_INT(i, deref_int(StrMap_get(map, buf, make_key(buf, i, 40))));
+    }
+}
+
+void test_steady_churn_keeps_arena_bounded(void) {
+    // The size never changes, so the table never resizes, the removes alone must keep the arena small
+    char buf[64];
+    put_keys(0, 100, 40);
+    for (int i = 100; i < 200000; i++) {
+        const size_t len = make_key(buf, i, 40);
+        TEST_ASSERT_NULL(StrMap_put(map, buf, len, TestUtil_allocate_int(i)));
+        TEST_ASSERT_TRUE(StrMap_remove(map, buf, make_key(buf, i - 100, 40)));
+        TEST_ASSERT_TRUE(map->keys->allocated < 32 * 1024);
+    }
+    TEST_ASSERT_EQUAL_INT(100, map->size);
+    for (int i = 199900; i < 200000; i++) {
+        TEST_ASSERT_EQUAL_INT(i, deref_int(StrMap_get(map, buf, make_key(buf, i, 40))));
+    }
+}
+
+int main(void) {
+    UNITY_BEGIN();
+    RUN_TEST(test_put_get_remove);
+    RUN_TEST(test_replace_and_empty_key);
+    RUN_TEST(test_bstring_keys);
+    RUN_TEST(test_dead_long_keys_are_reclaimed);
+    RUN_TEST(test_steady_churn_keeps_arena_bounded);
+    return UNITY_END();
+}
@@ -0,0 +1,157 @@
+//
+// Tests for the macro generated typed maps
+//
+#include <unity.h>
+#include <commons.h>
+#include <typedmap.h>
+
+#include "testutil.h"
+
+static inline size_t hash_u64(const uint64_t key) {
+    return (size_t) Commons_hash_u64(key);
+}
+
+static inline bool eq_u64(const uint64_t a, const uint64_t b) {
+    return a == b;
+}
+
+// Every key on the same home slot and tag, the worst case for probing and backward shifts
+static inline size_t hash_colliding(const uint64_t key) {
+    (void) key;
+    return 7;
+}
+
+typedef struct Point {
+    int x;
+    int y;
+} Point;
+
+static inline size_t hash_point(const Point p) {
+    return (size_t) Commons_hash_u64((uint64_t) (uint32_t) p.x << 32 | (uint32_t) p.y);
+}
+
+static inline bool eq_point(const Point a, const Point b) {
+    return a.x == b.x && a.y == b.y;
+}
+
+HASHMAP_DECLARE(IntMap, uint64_t, uint32_t, hash_u64, eq_u64)
+HASHMAP_DECLARE(CollidingMap, uint64_t, uint64_t, hash_colliding, eq_u64)
+HASHMAP_DECLARE(PointMap, Point, int, hash_point, eq_point)
+
+void setUp(void) {
+}
+
+void tearDown(void) {
+}
+
+void test_create(void) {
+    IntMap *map = IntMap_create(0);
+    TEST_ASSERT_NOT_NULL(map);
+    TEST_ASSERT_EQUAL_INT(TYPEDMAP_MIN_CAPACITY, map->capacity);
+    TEST_ASSERT_EQUAL_INT(0, IntMap_size(map));
+    IntMap_destroy(map);
+
+    map = IntMap_create(100);
+    TEST_ASSERT_EQUAL_INT(128, map->capacity);
+    IntMap_destroy(map);
+
+    // Capacities that can't be rounded up or allocated fail instead of looping
+    TEST_ASSERT_NULL(IntMap_create(SIZE_MAX));
+    TEST_ASSERT_NULL(IntMap_create(SIZE_MAX / 4));
+}
+
+void test_put_get_remove(void) {
+    IntMap *map = IntMap_create(0);
+    const uint32_t n = 10000;
+    for (uint32_t i = 0; i < n; i++) {
+        TEST_ASSERT_TRUE(IntMap_put(map, i, i * 2));
+    }
+    TEST_ASSERT_EQUAL_INT(n, IntMap_size(map));
+    for (uint32_t i = 0; i < n; i++) {
+        TEST_ASSERT_EQUAL_UINT32(i * 2, *IntMap_get(map, i));
+    }
+    TEST_ASSERT_NULL(IntMap_get(map, n));
+
+    // Replace keeps the size
+    TEST_ASSERT_TRUE(IntMap_put(map, 5, 55));
+    TEST_ASSERT_EQUAL_UINT32(55, *IntMap_get(map, 5));
+    TEST_ASSERT_EQUAL_INT(n, IntMap_size(map));
+
+    uint32_t removed;
+    for (uint32_t i = 0; i < n; i += 2) {
+        TEST_ASSERT_TRUE(IntMap_remove(map, i, &removed));
+        TEST_ASSERT_EQUAL_UINT32(i * 2, removed);
+    }
+    TEST_ASSERT_FALSE(IntMap_remove(map, 0, NULL));
+    for (uint32_t i = 0; i < n; i++) {
+        TEST_ASSERT_EQUAL(i % 2 == 1, IntMap_contains(map, i));
+    }
+    TEST_ASSERT_EQUAL_INT(n / 2, IntMap_size(map));
+
+    IntMap_clear(map);
+    TEST_ASSERT_EQUAL_INT(0, IntMap_size(map));
+    TEST_ASSERT_NULL(IntMap_get(map, 1));
+    IntMap_destroy(map);
+}
+
+void test_entry(void) {
+    IntMap *map = IntMap_create(0);
+    const uint64_t words[] = {3, 1, 3, 3, 2, 1};
+    for (size_t i = 0; i < sizeof(words) / sizeof(words[0]); i++) {
+        bool inserted;
+        uint32_t *count = IntMap_entry(map, words[i], &inserted);
+        TEST_ASSERT_EQUAL(inserted, *count == 0);
+        (*count)++;
+    }
+    TEST_ASSERT_EQUAL_UINT32(2, *IntMap_get(map, 1));
+    TEST_ASSERT_EQUAL_UINT32(1, *IntMap_get(map, 2));
+    TEST_ASSERT_EQUAL_UINT32(3, *IntMap_get(map, 3));
+    IntMap_destroy(map);
+}
+
+void test_colliding_remove(void) {
+    CollidingMap *map = CollidingMap_create(0);
+    for (uint64_t i = 0; i < 12; i++) {
+        CollidingMap_put(map, i, i + 100);
+    }
+    // Remove from the middle of the one long run, everything behind it must still be found
+    for (uint64_t i = 0; i < 12; i += 3) {
+        TEST_ASSERT_TRUE(CollidingMap_remove(map, i, NULL));
+        for (uint64_t j = 0; j < 12; j++) {
+            const bool removed = j % 3 == 0 && j <= i;
+            TEST_ASSERT_EQUAL(!removed, CollidingMap_contains(map, j));
+        }
+    }
+    CollidingMap_destroy(map);
+}
+
+void test_struct_keys_and_iteration(void) {
+    PointMap *map = PointMap_create(0);
+    for (int x = 0; x < 20; x++) {
+        for (int y = 0; y < 20; y++) {
+            PointMap_put(map, (Point) {x, y}, x * 100 + y);
+        }
+    }
+    TEST_ASSERT_EQUAL_INT(400, PointMap_size(map));
+    TEST_ASSERT_EQUAL_INT(1203, *PointMap_get(map, (Point) {12, 3}));
+
+    size_t cursor = 0, count = 0;
+    Point key;
+    int value;
+    while (PointMap_next(map, &cursor, &key, &value)) {
+        TEST_ASSERT_EQUAL_INT(key.x * 100 + key.y, value);
+        count++;
+    }
+    TEST_ASSERT_EQUAL_INT(400, count);
+    PointMap_destroy(map);
+}
+
+int main(void) {
+    UNITY_BEGIN();
+    RUN_TEST(test_create);
+    RUN_TEST(test_put_get_remove);
+    RUN_TEST(test_entry);
+    RUN_TEST(test_colliding_remove);
+    RUN_TEST(test_struct_keys_and_iteration);
+    return UNITY_END();
+}